@@ -0,0 +1,427 @@
+/* aot.c - ahead-of-time compiler from compiled functions to C */
+
+// This turns the functions the bytecode compiler produces for a program into
+// a C translation unit. Every constant the program uses, functions included,
+// is rebuilt at startup by plain runtime calls, so the resulting executable
+// never runs the reader or the compiler. Each function's bytecode becomes
+// straight-line C with gotos for jumps. The code follows the native code
+// protocol in vm.c, so calls between Scheme functions still go through
+// Interpret(). Calls to well-known primitives are made directly when the
+// global still holds the primitive.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lilscheme.h"
+
+typedef struct aotstate {
+    FILE *out;
+    int *indexOf;       // handle -> position in `program`, or -1
+    Handle *objects;    // in the order they're built
+    int nObjects;
+    int usesPrimitive[16];
+} AOTSTATE;
+
+static struct FastPrimitive {
+    const char *name;
+    int arity;
+    const char *expression;
+} fastPrimitives[] = {
+    {"car", 1, "Car(a0)"},
+    {"cdr", 1, "Cdr(a0)"},
+    {"cons", 2, "CreateCons(a0, a1)"},
+    {"eq?", 2, "LISP_BOOLEAN(a0 == a1)"},
+    {"=", 2, "LISP_BOOLEAN(CompareNumbers(a0, a1) == 0)"},
+    {"+", 2, "CreateInteger(UnboxInteger(a0) + UnboxInteger(a1))"},
+    {"-", 2, "CreateInteger(UnboxInteger(a0) - UnboxInteger(a1))"},
+    {"*", 2, "CreateInteger(UnboxInteger(a0) * UnboxInteger(a1))"},
+    {NULL, 0, NULL}
+};
+
+/* Constants */
+
+// number every object reachable from `hnd`, children first
+static void CollectObject(AOTSTATE *as, Handle hnd) {
+    if (hnd == nil || as->indexOf[hnd] != -1) return;
+    switch (TYPEOF(hnd)) {
+    case TYPE_INT: case TYPE_FLOAT: case TYPE_SYMBOL: case TYPE_BYTEVECTOR:
+	break;
+    case TYPE_CONS:
+	CollectObject(as, Car(hnd));
+	CollectObject(as, Cdr(hnd));
+	break;
+    case TYPE_VECTOR:
+	FOR_IN_VECTOR(i, hnd) {
+	    CollectObject(as, VectorRef(hnd, i));
+	}
+	break;
+    case TYPE_FUNCTION:
+	CollectObject(as, DATA_AREA(FUNCTION, hnd)->bytecode);
+	CollectObject(as, DATA_AREA(FUNCTION, hnd)->literals);
+	break;
+    default:
+	panic("can't compile a constant of that type to C");
+    }
+    as->indexOf[hnd] = as->nObjects;
+    as->objects[as->nObjects++] = hnd;
+}
+
+static void EmitReference(AOTSTATE *as, Handle hnd) {
+    if (hnd == nil) fputs("nil", as->out);
+    else fprintf(as->out, "OBJ(%d)", as->indexOf[hnd]);
+}
+
+static void EmitConstant(AOTSTATE *as, int idx) {
+    FILE *out = as->out;
+    Handle hnd = as->objects[idx];
+    switch (TYPEOF(hnd)) {
+    case TYPE_INT:
+	fprintf(out, "    VectorSet(program, %d, CreateInteger(%d));\n",
+		idx, UnboxInteger(hnd));
+	break;
+    case TYPE_FLOAT:
+	fprintf(out, "    VectorSet(program, %d, CreateFloat(%a));\n",
+		idx, UnboxFloat(hnd));
+	break;
+    case TYPE_SYMBOL:
+	fprintf(out, "    VectorSet(program, %d, CreateSymbol(\"", idx);
+	for (char *c = NameOfSymbol(hnd); *c != '\0'; c++) {
+	    if (*c == '"' || *c == '\\') fputc('\\', out);
+	    fputc(*c, out);
+	}
+	fputs("\"));\n", out);
+	break;
+    case TYPE_CONS:
+	fprintf(out, "    VectorSet(program, %d, CreateCons(", idx);
+	EmitReference(as, Car(hnd));
+	fputs(", ", out);
+	EmitReference(as, Cdr(hnd));
+	fputs("));\n", out);
+	break;
+    case TYPE_VECTOR:
+	fprintf(out, "    {\n\tHandle v = CreateVector(%d);\n", VectorLength(hnd));
+	fprintf(out, "\tVectorSet(program, %d, v);\n", idx);
+	FOR_IN_VECTOR(i, hnd) {
+	    fprintf(out, "\tVectorSet(v, %d, ", i);
+	    EmitReference(as, VectorRef(hnd, i));
+	    fputs(");\n", out);
+	}
+	fputs("    }\n", out);
+	break;
+    case TYPE_BYTEVECTOR:
+	{
+	    int len = BytevectorLength(hnd);
+	    fprintf(out, "    {\n\tstatic const uint8_t bytes[] = {");
+	    for (int i = 0; i < len; i++) {
+		fprintf(out, "%s%d", i ? "," : "", BytevectorRef(hnd, i));
+	    }
+	    fprintf(out, "%s};\n", len ? "" : "0");
+	    fprintf(out, "\tHandle bv = CreateBytevector(%d);\n", len);
+	    fprintf(out, "\tmemcpy(BVEC_CONTENTS(bv), bytes, %d);\n", len);
+	    fprintf(out, "\tVectorSet(program, %d, bv);\n    }\n", idx);
+	}
+	break;
+    case TYPE_FUNCTION:
+	{
+	    FUNCTION *f = DATA_AREA(FUNCTION, hnd);
+	    fprintf(out, "    {\n\tHandle fn = CreateFunctionFrom(%d, %d, %d, ",
+		    f->stacksize, f->nLocals, f->arguments);
+	    EmitReference(as, f->bytecode);
+	    fputs(", ", out);
+	    EmitReference(as, f->literals);
+	    fputs(");\n", out);
+	    fprintf(out, "\tDATA_AREA(FUNCTION, fn)->native = &native%d;\n", idx);
+	    fprintf(out, "\tVectorSet(program, %d, fn);\n    }\n", idx);
+	}
+	break;
+    default:
+	panic("can't compile a constant of that type to C");
+    }
+}
+
+/* Code */
+
+static int FastPrimitiveNamed(Handle sym) {
+    if (TYPEOF(sym) != TYPE_SYMBOL) return -1;
+    for (int i = 0; fastPrimitives[i].name != NULL; i++) {
+	if (strcmp(fastPrimitives[i].name, NameOfSymbol(sym)) == 0) return i;
+    }
+    return -1;
+}
+
+static void EmitFunction(AOTSTATE *as, int idx) {
+    FILE *out = as->out;
+    Handle fn = as->objects[idx];
+    Handle bytecode = DATA_AREA(FUNCTION, fn)->bytecode;
+    Handle literals = DATA_AREA(FUNCTION, fn)->literals;
+    int length = BytevectorLength(bytecode);
+
+    // only jump targets need labels
+    char *isTarget = calloc(length + 1, 1);
+    if (isTarget == NULL) panic("out of memory in AOT compiler");
+    for (int pc = 0; pc < length;) {
+	uint8_t op; int arg;
+	pc = DecodeInstruction(bytecode, pc, &op, &arg);
+	if (op == OP_JUMP || op == OP_JUMP_FALSE || op == OP_JUMP_TRUE) {
+	    isTarget[pc + arg] = 1;
+	}
+	else if (op == OP_JUMP_BACK) {
+	    isTarget[pc - arg] = 1;
+	}
+    }
+
+    fprintf(out, "static int run%d(NATIVECODE *nc, JITFRAME *f, int ip) {\n", idx);
+    fputs("    switch (ip) {\n    case 0:\n", out);
+    int fast = -1;   // fast primitive named by the last OP_GLOBAL
+    for (int pc = 0; pc < length;) {
+	uint8_t op; int arg;
+	int next = DecodeInstruction(bytecode, pc, &op, &arg);
+	if (isTarget[pc]) fprintf(out, "    L%d:\n", pc);
+	int lastFast = fast;
+	fast = -1;
+	switch (op) {
+	case OP_END:
+	    fputs("\tpanic(\"end of code; did not return\");\n", out);
+	    break;
+	case OP_NOP:
+	    break;
+	case OP_DROP:
+	    fputs("\tf->sp--;\n", out);
+	    break;
+	case OP_DUP:
+	    fputs("\t{ Handle t = TOS(); PUSH(t); }\n", out);
+	    break;
+	case OP_NIL:
+	    fputs("\tPUSH(nil);\n", out);
+	    break;
+	case OP_RETURN:
+	    fputs("\tf->result = POP();\n\treturn JIT_RETURN;\n", out);
+	    break;
+	case OP_LITERAL:
+	    fprintf(out, "\tPUSH(VectorRef(f->literals, %d));\n", arg);
+	    break;
+	case OP_GLOBAL:
+	    fprintf(out, "\t{ Handle t = LookupGlobal(VectorRef(f->literals, %d));"
+		    " PUSH(t); }\n", arg);
+	    fast = FastPrimitiveNamed(VectorRef(literals, arg));
+	    break;
+	case OP_SET_GLOBAL:
+	    fprintf(out, "\t{ Handle t = POP();"
+		    " SetGlobal(VectorRef(f->literals, %d), t); }\n",
+		    arg);
+	    break;
+	case OP_LOCAL:
+	    fprintf(out, "\tPUSH(VectorRef(f->locals, %d));\n", arg);
+	    break;
+	case OP_SET_LOCAL:
+	    fprintf(out, "\t{ Handle t = POP(); VectorSet(f->locals, %d, t); }\n", arg);
+	    break;
+	case OP_LOCAL_BOX:
+	    fprintf(out, "\tPUSH(Unbox(VectorRef(f->locals, %d)));\n", arg);
+	    break;
+	case OP_SET_LOCAL_BOX:
+	    fprintf(out, "\t{ Handle t = POP(); SetBox(VectorRef(f->locals, %d), t); }\n",
+		    arg);
+	    break;
+	case OP_BOX_LOCAL:
+	    fprintf(out, "\t{ Handle t = CreateBox(VectorRef(f->locals, %d));"
+		    " VectorSet(f->locals, %d, t); }\n", arg, arg);
+	    break;
+	case OP_CLOSURE:
+	    fprintf(out, "\tPUSH(VectorRef(f->closure, %d));\n", arg);
+	    break;
+	case OP_CLOSURE_BOX:
+	    fprintf(out, "\tPUSH(Unbox(VectorRef(f->closure, %d)));\n", arg);
+	    break;
+	case OP_SET_CLOSURE_BOX:
+	    fprintf(out, "\t{ Handle t = POP(); SetBox(VectorRef(f->closure, %d), t); }\n",
+		    arg);
+	    break;
+	case OP_MAKE_CLOSURE:
+	    fprintf(out, "\tMakeClosure(f, %d);\n", arg);
+	    break;
+	case OP_APPLY:
+	    if (lastFast != -1 && fastPrimitives[lastFast].arity == arg) {
+		as->usesPrimitive[lastFast] = 1;
+		fputs("\t{\n\t    Handle proc = POP();\n", out);
+		fprintf(out, "\t    if (proc == primitive%d) {\n", lastFast);
+		fputs("\t\tHandle a0 = POP();\n", out);
+		if (arg == 2) fputs("\t\tHandle a1 = POP();\n", out);
+		fprintf(out, "\t\tHandle r = %s;\n\t\tPUSH(r);\n",
+			fastPrimitives[lastFast].expression);
+		fprintf(out, "\t    }\n\t    else if (Apply(f, proc, %d, %d))"
+			" return JIT_CALL;\n\t}\n", arg, next);
+	    }
+	    else {
+		fprintf(out, "\tif (Apply(f, POP(), %d, %d)) return JIT_CALL;\n",
+			arg, next);
+	    }
+	    // calls return here
+	    fprintf(out, "    case %d:\n", next);
+	    break;
+	case OP_UNCHECKED:
+	    {
+		const UNCHECKED *u = &uncheckedPrimitives[arg];
+		fputs("\t{\n\t    Handle proc = POP();\n", out);
+		fputs("\t    if (!primitivesReplaced) {\n\t\tHandle a0 = POP();\n", out);
+		fprintf(out, "\t\tHandle a1 = %s;\n", u->arity == 2 ? "POP()" : "nil");
+		fprintf(out, "\t\tPUSH(uncheckedPrimitives[%d].call(a0, a1));\n", arg);
+		fprintf(out, "\t    }\n\t    else if (Apply(f, proc, %d, %d))"
+			" return JIT_CALL;\n\t}\n", u->arity, next);
+		fprintf(out, "    case %d:\n", next);
+	    }
+	    break;
+	case OP_CALL_KNOWN: case OP_CALL_SELF:
+	    fprintf(out, "\treturn Call(f, %s, %d, %d);\n",
+		    op == OP_CALL_SELF ? "f->function" : "POP()", arg, next);
+	    fprintf(out, "    case %d:\n", next);
+	    break;
+	case OP_JUMP_FALSE:
+	    fprintf(out, "\tif (POP() == nil) goto L%d;\n", next + arg);
+	    break;
+	case OP_JUMP_TRUE:
+	    fprintf(out, "\tif (POP() != nil) goto L%d;\n", next + arg);
+	    break;
+	case OP_JUMP:
+	    fprintf(out, "\tgoto L%d;\n", next + arg);
+	    break;
+	case OP_JUMP_BACK:
+	    fprintf(out, "\tgoto L%d;\n", next - arg);
+	    break;
+	case OP_CASE:
+	    {
+		// the jumps after OP_CASE become the cases of a switch
+		int jumps = CaseClauses(VectorRef(literals, arg)) + 1;
+		fprintf(out, "\tswitch (CaseIndex(VectorRef(f->literals, %d), POP())) {\n", arg);
+		for (int i = 0; i < jumps; i++) {
+		    next = DecodeInstruction(bytecode, next, &op, &arg);
+		    fprintf(out, "\tcase %d: goto L%d;\n", i,
+			    op == OP_JUMP_BACK ? next - arg : next + arg);
+		}
+		fputs("\t}\n", out);
+	    }
+	    break;
+	default:
+	    fprintf(stderr, "opcode %d\n", op);
+	    panic("the C backend can't compile that opcode");
+	}
+	pc = next;
+    }
+    fputs("    default:\n\tpanic(\"bad entry point\");\n    }\n", out);
+    fputs("    return 0;\n}\n", out);
+    fprintf(out, "static NATIVECODE native%d = { run%d };\n\n", idx, idx);
+    free(isTarget);
+}
+
+static const char *preamble =
+    "#include <string.h>\n"
+    "#include \"lilscheme.h\"\n"
+    "\n"
+    "#define POP() (VectorRef(f->stack, --f->sp))\n"
+    "#define PUSH(_H) (VectorSet(f->stack, f->sp, (_H)), f->sp++)\n"
+    "#define TOS() (VectorRef(f->stack, f->sp-1))\n"
+    "#define OBJ(N) (VectorRef(program, (N)))\n"
+    "\n"
+    "static Handle program; // every constant, in the order they're built\n"
+    "\n"
+    "// Primitives are called here. For functions, this returns nonzero so\n"
+    "// the code can exit to the interpreter, which makes the call.\n"
+    "static inline int Apply(JITFRAME *f, Handle proc, int n, int next) {\n"
+    "    if (TYPEOF(proc) == TYPE_FUNCTION) {\n"
+    "\tf->callee = proc;\n"
+    "\tf->nargs = n;\n"
+    "\tf->ip = next;\n"
+    "\treturn 1;\n"
+    "    }\n"
+    "    Typecheck(proc, TYPE_PRIMITIVE);\n"
+    "    Handle argv = CreateVector(n);\n"
+    "    Retain(argv);\n"
+    "    for (int i = 0; i < n; i++) VectorSet(argv, i, POP());\n"
+    "    Handle result = CallPrimitive(proc, argv);\n"
+    "    Unretain(argv);\n"
+    "    PUSH(result);\n"
+    "    return 0;\n"
+    "}\n"
+    "\n"
+    "// calls the compiler knows are to functions\n"
+    "static inline int Call(JITFRAME *f, Handle proc, int n, int next) {\n"
+    "    f->callee = proc;\n"
+    "    f->nargs = n;\n"
+    "    f->ip = next;\n"
+    "    return JIT_CALL;\n"
+    "}\n"
+    "\n"
+    "static inline void MakeClosure(JITFRAME *f, int n) {\n"
+    "    Handle template = POP();\n"
+    "    Handle values = CreateVector(n);\n"
+    "    Retain(values);\n"
+    "    for (int i = n - 1; i >= 0; i--) VectorSet(values, i, POP());\n"
+    "    Handle closure = CreateClosure(template, values);\n"
+    "    Unretain(values);\n"
+    "    PUSH(closure);\n"
+    "}\n"
+    "\n";
+
+// `program` is a vector of the compiled top-level forms of a program, which
+// are run in order by the generated main()
+void CompileProgramToC(Handle program, FILE *out) {
+    AOTSTATE as;
+    as.out = out;
+    as.indexOf = malloc(MAX_HANDLES * sizeof(int));
+    as.objects = malloc(MAX_HANDLES * sizeof(Handle));
+    if (as.indexOf == NULL || as.objects == NULL) {
+	panic("out of memory in AOT compiler");
+    }
+    for (int i = 0; i < MAX_HANDLES; i++) as.indexOf[i] = -1;
+    as.nObjects = 0;
+    for (int i = 0; fastPrimitives[i].name != NULL; i++) as.usesPrimitive[i] = 0;
+
+    FOR_IN_VECTOR(i, program) {
+	CollectObject(&as, VectorRef(program, i));
+    }
+
+    fputs("/* generated by schemec; do not edit */\n\n", out);
+    fputs(preamble, out);
+
+    // the primitive declarations have to come first, but we only know which
+    // ones are used once the functions are done, so write those to a buffer
+    FILE *body = tmpfile();
+    if (body == NULL) panic("can't create a temporary file");
+    as.out = body;
+    for (int i = 0; i < as.nObjects; i++) {
+	if (TYPEOF(as.objects[i]) == TYPE_FUNCTION) EmitFunction(&as, i);
+    }
+    as.out = out;
+    for (int i = 0; fastPrimitives[i].name != NULL; i++) {
+	if (as.usesPrimitive[i]) fprintf(out, "static Handle primitive%d;\n", i);
+    }
+    fputc('\n', out);
+    rewind(body);
+    int c;
+    while ((c = fgetc(body)) != EOF) fputc(c, out);
+    fclose(body);
+
+    fputs("static void BuildProgram(void) {\n", out);
+    for (int i = 0; fastPrimitives[i].name != NULL; i++) {
+	if (as.usesPrimitive[i]) {
+	    fprintf(out, "    primitive%d = LookupGlobal(CreateSymbol(\"%s\"));\n",
+		    i, fastPrimitives[i].name);
+	    fprintf(out, "    Retain(primitive%d);\n", i);
+	}
+    }
+    fprintf(out, "    program = CreateVector(%d);\n    Retain(program);\n",
+	    as.nObjects);
+    for (int i = 0; i < as.nObjects; i++) EmitConstant(&as, i);
+    fputs("}\n\n", out);
+
+    fputs("int main(int argc, char **argv) {\n", out);
+    fputs("    InitMem();\n    ConstructPrimitives();\n    BuildProgram();\n", out);
+    FOR_IN_VECTOR(i, program) {
+	fprintf(out, "    StartInterpreter(OBJ(%d), nil);\n",
+		as.indexOf[VectorRef(program, i)]);
+    }
+    fputs("    return 0;\n}\n", out);
+
+    free(as.indexOf);
+    free(as.objects);
+}
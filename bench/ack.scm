@@ -0,0 +1,11 @@
+;; expect: 509
+;; Ackermann's function: very deep recursion
+
+(define (ack m n)
+  (if (= m 0)
+      (+ n 1)
+      (if (= n 0)
+          (ack (- m 1) 1)
+          (ack (- m 1) (ack m (- n 1))))))
+
+(display (ack 3 6))
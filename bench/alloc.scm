@@ -0,0 +1,25 @@
+;; expect: 40000
+;; allocation churn: short-lived lists built and reversed
+
+(define (iota n acc)
+  (if (= n 0)
+      acc
+      (iota (- n 1) (cons n acc))))
+
+(define (reverse-onto l acc)
+  (if (null? l)
+      acc
+      (reverse-onto (cdr l) (cons (car l) acc))))
+
+(define (length l)
+  (if (null? l)
+      0
+      (+ 1 (length (cdr l)))))
+
+(define (churn k)
+  (if (= k 0)
+      0
+      (+ (length (reverse-onto (iota 200 '()) '()))
+         (churn (- k 1)))))
+
+(display (churn 200))
@@ -0,0 +1,34 @@
+;; expect: 52000
+;; closure creation and calls through captured, assigned variables
+
+(define (make-counter)
+  (define n 0)
+  (lambda ()
+    (set! n (+ n 1))
+    n))
+
+(define (compose f g)
+  (lambda (x) (f (g x))))
+
+(define (add1 x) (+ x 1))
+
+(define (adder-chain n f)
+  (if (= n 0)
+      f
+      (adder-chain (- n 1) (compose add1 f))))
+
+(define (tick c n)
+  (if (= n 0)
+      (c)
+      (begin
+        (c)
+        (tick c (- n 1)))))
+
+(define (run k)
+  (if (= k 0)
+      0
+      (+ ((adder-chain 20 add1) 0)
+         (tick (make-counter) 30)
+         (run (- k 1)))))
+
+(display (run 1000))
@@ -0,0 +1,109 @@
+/* compilebench.c - compiler throughput */
+
+// usage: compilebench [--functions=N] [--size=N] [--runs=N] [--lazy]
+//
+// This generates a large Scheme source file and times reading and
+// compiling it with CompileFile, without running anything. The file has N
+// top-level procedures (200 unless given). Each one has `size` internal
+// defines (100 unless given), each using earlier ones and its own
+// constants. Each also has a few lets, a named let loop and a closure, so a
+// procedure has hundreds of locals, literals and instructions. The best of
+// the runs is reported, with the garbage collector running only when the
+// heap or the handles run out. With --lazy, procedures are left as stubs
+// until they're called, which is never here, so this times what loading a
+// library that's mostly unused costs.
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lilscheme.h"
+
+static double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Generate(FILE *out, int functions, int size) {
+    for (int f = 0; f < functions; f++) {
+	fprintf(out, "(define (proc%d a b)\n", f);
+	for (int i = 0; i < size; i++) {
+	    // refer to an argument or an earlier local, and a new constant
+	    if (i == 0) fprintf(out, "  (define v0 (+ a %d))\n", f);
+	    else fprintf(out, "  (define v%d (+ v%d %d))\n", i, i / 2, f * size + i);
+	}
+	fprintf(out, "  (let ((x (* v0 2)) (y (- b 1)))\n");
+	fprintf(out, "    (let* ((z (+ x y)) (w (* z z)))\n");
+	fprintf(out, "      (define k (lambda (n) (+ n w v%d)))\n", size - 1);
+	fprintf(out, "      (let loop ((i 0) (acc '()))\n");
+	fprintf(out, "        (if (= i 3) (k (car acc)) (loop (+ i 1) (cons v%d acc)))))))\n",
+		size / 3);
+    }
+    fprintf(out, "(display (proc0 1 2))\n");
+}
+
+// bytes of bytecode in `fn` and the functions it makes
+static long CodeSize(Handle fn) {
+    long size = BytevectorLength(DATA_AREA(FUNCTION, fn)->bytecode);
+    Handle literals = DATA_AREA(FUNCTION, fn)->literals;
+    FOR_IN_VECTOR(i, literals) {
+	Handle lit = VectorRef(literals, i);
+	if (TYPEOF(lit) == TYPE_FUNCTION) size += CodeSize(lit);
+    }
+    return size;
+}
+
+int main(int argc, char **argv) {
+    int functions = 200, size = 100, runs = 5;
+    for (int i = 1; i < argc; i++) {
+	if (strncmp(argv[i], "--functions=", 12) == 0) functions = atoi(argv[i] + 12);
+	else if (strncmp(argv[i], "--size=", 7) == 0) size = atoi(argv[i] + 7);
+	else if (strncmp(argv[i], "--runs=", 7) == 0) runs = atoi(argv[i] + 7);
+	else if (strcmp(argv[i], "--lazy") == 0) lazyCompile = 1;
+	else functions = 0;
+	if (functions < 1 || size < 1 || runs < 1) {
+	    fprintf(stderr, "usage: %s [--functions=N] [--size=N] "
+		    "[--runs=N] [--lazy]\n", argv[0]);
+	    return 1;
+	}
+    }
+    FILE *source = tmpfile();
+    if (source == NULL) {
+	perror("tmpfile");
+	return 1;
+    }
+    Generate(source, functions, size);
+    long bytes = ftell(source);
+
+    InitMem();
+    SetGCFrequency(0);
+    ConstructPrimitives();
+    double best = 0;
+    long code = 0;
+    unsigned long allocated = 0;
+    for (int run = 0; run < runs; run++) {
+	rewind(source);
+	unsigned long before = memStats.bytesAllocated;
+	double start = Seconds();
+	Handle program = CompileFile(source);
+	double elapsed = Seconds() - start;
+	if (run == 0 || elapsed < best) best = elapsed;
+	if (run == 0) {
+	    allocated = memStats.bytesAllocated - before;
+	    Retain(program);
+	    FOR_IN_VECTOR(i, program) code += CodeSize(VectorRef(program, i));
+	    Unretain(program);
+	}
+	GarbageCollect();
+    }
+    fclose(source);
+
+    printf("{\"functions\": %d, \"size\": %d, \"lazy\": %s, \"source bytes\": %ld, "
+	   "\"bytecode bytes\": %ld, \"bytes allocated\": %lu, \"seconds\": %.6f, "
+	   "\"source KB/s\": %.0f}\n",
+	   functions, size, lazyCompile ? "true" : "false", bytes, code, allocated, best,
+	   bytes / 1024.0 / best);
+    return 0;
+}
@@ -0,0 +1,37 @@
+;; expect: 0
+;; symbolic differentiation: list construction and symbol comparison
+
+(define (map f l)
+  (if (null? l)
+      '()
+      (cons (f (car l)) (map f (cdr l)))))
+
+(define (list2 a b) (cons a (cons b '())))
+(define (list3 a b c) (cons a (list2 b c)))
+(define (list4 a b c d) (cons a (list3 b c d)))
+
+(define (deriv a)
+  (if (not (pair? a))
+      (if (eq? a 'x) 1 0)
+      (if (eq? (car a) '+)
+          (cons '+ (map deriv (cdr a)))
+          (if (eq? (car a) '-)
+              (cons '- (map deriv (cdr a)))
+              (if (eq? (car a) '*)
+                  (list3 '* a (cons '+ (map (lambda (a) (list3 '/ (deriv a) a))
+                                            (cdr a))))
+                  (list3 '-
+                         (list3 '/ (deriv (car (cdr a))) (car (cdr (cdr a))))
+                         (list3 '/ (car (cdr a))
+                                (list4 '* (car (cdr (cdr a)))
+                                       (car (cdr (cdr a)))
+                                       (deriv (car (cdr (cdr a))))))))))))
+
+(define (run n)
+  (if (= n 0)
+      0
+      (begin
+        (deriv '(+ (* 3 x x) (* a x x) (* b x) 5))
+        (run (- n 1)))))
+
+(display (run 3000))
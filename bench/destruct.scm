@@ -0,0 +1,53 @@
+;; expect: 10
+;; destructive list operations: set-car! and set-cdr! on a list of lists
+
+(define (make-list n x)
+  (if (= n 0)
+      '()
+      (cons x (make-list (- n 1) x))))
+
+(define (length l)
+  (if (null? l)
+      0
+      (+ 1 (length (cdr l)))))
+
+;; give every sublist a fresh list of n cells
+(define (fill! l n)
+  (if (null? l)
+      l
+      (begin
+        (set-car! l (make-list n 'x))
+        (fill! (cdr l) n))))
+
+;; drop the second cell of every sublist
+(define (shrink! x)
+  (if (null? x)
+      x
+      (if (null? (cdr x))
+          '()
+          (begin
+            (set-cdr! x (cdr (cdr x)))
+            x))))
+
+(define (chop! l)
+  (if (null? l)
+      l
+      (begin
+        (set-car! l (shrink! (car l)))
+        (chop! (cdr l)))))
+
+(define (destruct n l)
+  (if (= n 0)
+      l
+      (begin
+        (if (null? (car l))
+            (fill! l 16)
+            (chop! l))
+        (destruct (- n 1) l))))
+
+(define (total l)
+  (if (null? l)
+      0
+      (+ (length (car l)) (total (cdr l)))))
+
+(display (total (destruct 6000 (make-list 10 '()))))
@@ -0,0 +1,36 @@
+;; expect: 30000
+;; an accumulator machine: multi-way dispatch on symbols and small integers
+
+(define (step op acc)
+  (case op
+    ((inc) (+ acc 1))
+    ((dec) (- acc 1))
+    ((add3) (+ acc 3))
+    ((sub2) (- acc 2))
+    ((double) (* acc 2))
+    ((neg) (- 0 acc))
+    ((zero) 0)
+    ((nop skip) acc)
+    (else 'bad-op)))
+
+(define (weight d)
+  (case d
+    ((0 2 4 6 8) 2)
+    ((1 3 5 7 9) 1)
+    (else 0)))
+
+(define program
+  '(zero inc add3 double dec sub2 nop neg neg inc double skip dec add3 sub2 inc))
+
+(define (run-program p acc)
+  (if (null? p)
+      acc
+      (run-program (cdr p) (step (car p) acc))))
+
+(define (run n)
+  (let loop ((i 0) (total 0))
+    (if (= i n)
+        total
+        (loop (+ i 1) (+ total (run-program program 0) (weight (- (run-program program 0) 7)))))))
+
+(display (run 2000))
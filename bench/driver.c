@@ -0,0 +1,245 @@
+/* driver.c - run the benchmark programs */
+
+// usage: driver [--runs=N] [--baseline=FILE] [--save=FILE] [--threshold=PCT]
+//               [--sealed] PROGRAM.scm...
+//
+// Each run of each program happens in a fresh process, so one program's
+// heap can't affect the next. The garbage collector runs only when the heap
+// or the handles run out. The program is compiled before the clock starts.
+// What's timed is running it. A program's first line may say what it
+// should print, as ";; expect: OUTPUT"; a program that prints anything else
+// has failed.
+//
+// Results go to stdout as JSON, one benchmark per line. The best of the runs
+// is reported. With --baseline, a benchmark that's slower than the baseline
+// by more than the threshold (10% unless given) is flagged as a regression.
+// --sealed compiles the programs as sealed programs.
+// The exit status is 1 if anything failed or regressed. --save writes the
+// results to FILE as well, to be the next baseline.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "lilscheme.h"
+
+#define MAX_BENCHMARKS 64
+#define MAX_OUTPUT 256
+
+typedef struct result {
+    char name[64];
+    int ok;
+    double seconds;
+    MEMSTATS stats;
+    double baseline;        // seconds, or 0 if there's none
+} RESULT;
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// in the child: compile and run the program, then report through `fd`
+static void RunChild(const char *path, int fd) {
+    FILE *source = fopen(path, "r");
+    if (source == NULL) {
+	perror(path);
+	exit(1);
+    }
+    InitMem();
+    SetGCFrequency(0);
+    ConstructPrimitives();
+    Handle program = CompileFile(source);
+    Retain(program);
+    fclose(source);
+
+    RESULT r;
+    memset(&r, 0, sizeof(r));
+    memset(&memStats, 0, sizeof(memStats));
+    double start = Now();
+    FOR_IN_VECTOR(i, program) {
+	StartInterpreter(VectorRef(program, i), nil);
+    }
+    r.seconds = Now() - start;
+    r.stats = memStats;
+    r.ok = 1;
+    fflush(stdout);
+    if (write(fd, &r, sizeof(r)) != sizeof(r)) exit(1);
+    exit(0);
+}
+
+// the expected output, from the program's first line
+static int ReadExpectation(const char *path, char *expected) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    char line[MAX_OUTPUT];
+    int found = fgets(line, sizeof(line), f) != NULL &&
+	sscanf(line, ";; expect: %255[^\n]", expected) == 1;
+    fclose(f);
+    return found;
+}
+
+static void Trim(char *s) {
+    size_t len = strlen(s);
+    while (len > 0 && (s[len-1] == '\n' || s[len-1] == ' ')) s[--len] = '\0';
+}
+
+// one run in a child process; returns 0 if it crashed or printed the wrong thing
+static int RunOnce(const char *path, RESULT *r) {
+    int results[2], output[2];
+    if (pipe(results) != 0 || pipe(output) != 0) {
+	perror("pipe");
+	exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0) {
+	close(results[0]);
+	close(output[0]);
+	dup2(output[1], STDOUT_FILENO);
+	RunChild(path, results[1]);
+    }
+    close(results[1]);
+    close(output[1]);
+
+    char printed[MAX_OUTPUT] = "";
+    size_t got = 0;
+    ssize_t n;
+    while ((n = read(output[0], printed + got, sizeof(printed) - 1 - got)) > 0) {
+	got += n;
+    }
+    printed[got] = '\0';
+    Trim(printed);
+    int ok = read(results[0], r, sizeof(*r)) == sizeof(*r);
+    close(results[0]);
+    close(output[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    char expected[MAX_OUTPUT];
+    if (ok && ReadExpectation(path, expected) && strcmp(expected, printed) != 0) {
+	fprintf(stderr, "%s: printed \"%s\", expected \"%s\"\n",
+		path, printed, expected);
+	ok = 0;
+    }
+    return ok;
+}
+
+static void NameOf(const char *path, char *name) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    snprintf(name, 64, "%s", base);
+    char *dot = strrchr(name, '.');
+    if (dot != NULL) *dot = '\0';
+}
+
+static void LoadBaseline(const char *path, RESULT *results, int n) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+	fprintf(stderr, "no baseline in %s\n", path);
+	return;
+    }
+    char line[512], name[64];
+    double seconds;
+    while (fgets(line, sizeof(line), f) != NULL) {
+	if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ok\": %*[a-z], \"seconds\": %lf",
+		   name, &seconds) != 2) continue;
+	for (int i = 0; i < n; i++) {
+	    if (strcmp(results[i].name, name) == 0) results[i].baseline = seconds;
+	}
+    }
+    fclose(f);
+}
+
+static void WriteResults(FILE *out, RESULT *results, int n, double threshold) {
+    fprintf(out, "{\"benchmarks\": [\n");
+    for (int i = 0; i < n; i++) {
+	RESULT *r = &results[i];
+	fprintf(out, "  {\"name\": \"%s\", \"ok\": %s, \"seconds\": %.6f, "
+		"\"allocations\": %lu, \"bytes\": %lu, \"collections\": %lu, "
+		"\"bytes copied\": %lu",
+		r->name, r->ok ? "true" : "false", r->seconds,
+		r->stats.allocations, r->stats.bytesAllocated,
+		r->stats.collections, r->stats.bytesCopied);
+	if (r->baseline > 0) {
+	    fprintf(out, ", \"baseline\": %.6f, \"change\": %.4f, \"regression\": %s",
+		    r->baseline, r->seconds / r->baseline - 1,
+		    r->seconds > r->baseline * (1 + threshold) ? "true" : "false");
+	}
+	fprintf(out, "}%s\n", i < n - 1 ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+int main(int argc, char **argv) {
+    int runs = 3;
+    double threshold = 0.10;
+    const char *baselineFile = NULL, *saveFile = NULL;
+    RESULT results[MAX_BENCHMARKS];
+    int n = 0;
+
+    for (int i = 1; i < argc; i++) {
+	if (strncmp(argv[i], "--runs=", 7) == 0) runs = atoi(argv[i] + 7);
+	else if (strncmp(argv[i], "--baseline=", 11) == 0) baselineFile = argv[i] + 11;
+	else if (strncmp(argv[i], "--save=", 7) == 0) saveFile = argv[i] + 7;
+	else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+	    threshold = atof(argv[i] + 12) / 100;
+	}
+	else if (strcmp(argv[i], "--sealed") == 0) sealPrograms = 1;
+	else if (argv[i][0] == '-' || n == MAX_BENCHMARKS || runs < 1) {
+	    fprintf(stderr, "usage: %s [--runs=N] [--baseline=FILE] [--save=FILE] "
+		    "[--threshold=PCT] [--sealed] PROGRAM.scm...\n", argv[0]);
+	    return 1;
+	}
+	else {
+	    RESULT *r = &results[n++];
+	    RESULT best;
+	    memset(&best, 0, sizeof(best));
+	    best.ok = 1;
+	    for (int run = 0; run < runs && best.ok; run++) {
+		RESULT this;
+		if (!RunOnce(argv[i], &this)) best.ok = 0;
+		else if (run == 0 || this.seconds < best.seconds) best = this;
+	    }
+	    if (!best.ok) memset(&best, 0, sizeof(best));
+	    *r = best;
+	    NameOf(argv[i], r->name);
+	    r->baseline = 0;
+	    fprintf(stderr, "%-12s %s %.3fs\n", r->name,
+		    r->ok ? "ok    " : "FAILED", r->seconds);
+	}
+    }
+
+    if (baselineFile != NULL) LoadBaseline(baselineFile, results, n);
+    WriteResults(stdout, results, n, threshold);
+    if (saveFile != NULL) {
+	FILE *f = fopen(saveFile, "w");
+	if (f == NULL) {
+	    perror(saveFile);
+	    return 1;
+	}
+	WriteResults(f, results, n, threshold);
+	fclose(f);
+    }
+
+    int status = 0;
+    for (int i = 0; i < n; i++) {
+	RESULT *r = &results[i];
+	if (!r->ok) status = 1;
+	if (r->baseline > 0 && r->seconds > r->baseline * (1 + threshold)) {
+	    fprintf(stderr, "regression: %s took %.3fs, baseline %.3fs (%+.1f%%)\n",
+		    r->name, r->seconds, r->baseline,
+		    100 * (r->seconds / r->baseline - 1));
+	    status = 1;
+	}
+    }
+    return status;
+}
@@ -0,0 +1,9 @@
+;; expect: 46368
+;; doubly recursive Fibonacci: calls and integer arithmetic
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(display (fib 24))
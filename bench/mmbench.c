@@ -0,0 +1,267 @@
+/* mmbench.c - memory manager microbenchmarks */
+
+// usage: mmbench [--samples=N]
+//
+// This times the memory manager on its own, with no reader, compiler or VM:
+// allocation for each type, collection as the live set grows in three
+// shapes (a long list, a wide vector, a binary tree), walking lists after a
+// collection in each copy order, growing a vector with ExtendObject, and
+// Retain/Unretain with a crowded retain table.
+//
+// Allocations are too quick to time one at a time, so they're timed in
+// batches and reported per allocation; a batch that has to collect shows
+// up in the upper percentiles. The collector only runs when the heap or the
+// handles run out, except where a test calls it.
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lilscheme.h"
+
+#define BATCH 1000
+
+static int samples = 200;
+static double *times;
+
+static double Nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double Percentile(double *sorted, int n, double p) {
+    return sorted[(int)(p / 100 * (n - 1) + 0.5)];
+}
+
+// print percentiles of the first `n` entries of `times`, in nanoseconds
+static void Report(const char *name, int n) {
+    qsort(times, n, sizeof(double), CompareDoubles);
+    printf("%-28s %7d %10.0f %10.0f %10.0f %10.0f\n", name, n,
+	   Percentile(times, n, 50), Percentile(times, n, 90),
+	   Percentile(times, n, 99), times[n-1]);
+}
+
+/* allocation */
+
+typedef Handle (*ALLOCATOR)(int);
+
+static Handle AllocInteger(int i) {return CreateInteger(i);}
+static Handle AllocFloat(int i) {return CreateFloat(i);}
+static Handle AllocCons(int i) {return CreateCons(nil, nil);}
+static Handle AllocBox(int i) {return CreateBox(nil);}
+static Handle AllocVector(int i) {return CreateVector(8);}
+static Handle AllocBytevector(int i) {return CreateBytevector(64);}
+
+static void BenchAllocation(const char *name, ALLOCATOR alloc) {
+    for (int s = 0; s < samples; s++) {
+	double start = Nanoseconds();
+	for (int i = 0; i < BATCH; i++) alloc(i);
+	times[s] = (Nanoseconds() - start) / BATCH;
+    }
+    Report(name, samples);
+}
+
+/* collection */
+
+// The builders return their structure retained.
+
+static Handle LongList(int n) {
+    Handle list = CreateCons(nil, nil);
+    Retain(list);
+    for (int i = 1; i < n; i++) {
+	Handle next = CreateCons(nil, list);
+	Unretain(list);
+	Retain(next);
+	list = next;
+    }
+    return list;
+}
+
+static Handle WideVector(int n) {
+    Handle v = CreateVector(n);
+    Retain(v);
+    for (int i = 0; i < n; i++) VectorSet(v, i, CreateInteger(i));
+    return v;
+}
+
+static Handle Tree(int depth) {
+    if (depth == 1) {
+	Handle leaf = CreateCons(nil, nil);
+	Retain(leaf);
+	return leaf;
+    }
+    Handle left = Tree(depth - 1);
+    Handle right = Tree(depth - 1);
+    Handle node = CreateCons(left, right);
+    Retain(node);
+    Unretain(right);
+    Unretain(left);
+    return node;
+}
+
+// time collections with `live` as the only thing retained, then let it go
+static void BenchCollection(const char *shape, int objects, Handle live) {
+    char name[64];
+    unsigned long copied = memStats.bytesCopied;
+    int n = samples / 4;
+    for (int s = 0; s < n; s++) {
+	double start = Nanoseconds();
+	GarbageCollect();
+	times[s] = Nanoseconds() - start;
+    }
+    snprintf(name, sizeof(name), "gc %s %d (%luK)", shape, objects,
+	     (memStats.bytesCopied - copied) / n / 1024);
+    Report(name, n);
+    Unretain(live);
+    GarbageCollect();
+}
+
+/* locality */
+
+// A vector of `lists` lists of `length` integers, built a cell of each
+// list at a time, so no list starts out in one piece. Returned retained.
+static Handle ListsOfIntegers(int lists, int length) {
+    Handle v = CreateVector(lists);
+    Retain(v);
+    for (int i = 0; i < length; i++) {
+	for (int l = 0; l < lists; l++) {
+	    Handle n = CreateInteger(i);
+	    Retain(n);
+	    VectorSet(v, l, CreateCons(n, VectorRef(v, l)));
+	    Unretain(n);
+	}
+    }
+    return v;
+}
+
+// Time walking every list in `v` after a collection that copies in the
+// order given, and count how many cells are within a cache line of the
+// cell before them.
+static void BenchWalk(const char *name, Handle v, int depthFirst) {
+    depthFirstCollection = depthFirst;
+    GarbageCollect();
+    depthFirstCollection = 1;
+    int cells = 0, near = 0;
+    FOR_IN_VECTOR(l, v) {
+	for (Handle c = VectorRef(v, l); Cdr(c) != nil; c = Cdr(c)) {
+	    long distance = (char *)DEREF(Cdr(c)) - (char *)DEREF(c);
+	    if (distance > -64 && distance < 64) near++;
+	    cells++;
+	}
+    }
+    long sum = 0;
+    for (int s = 0; s < samples; s++) {
+	double start = Nanoseconds();
+	FOR_IN_VECTOR(l, v) {
+	    for (Handle c = VectorRef(v, l); c != nil; c = Cdr(c)) {
+		sum += UnboxInteger(Car(c));
+	    }
+	}
+	times[s] = Nanoseconds() - start;
+    }
+    if (sum < 0) puts("");    // keep the walk from being optimized away
+    Report(name, samples);
+    printf("%-28s %6.1f%%\n", "  next cell nearby", 100.0 * near / cells);
+}
+
+/* growth */
+
+// Append to a vector one element at a time. If `interleave`, allocate
+// something between appends, so the vector is never at the bottom of the
+// heap and each growth has to move it.
+static void BenchGrowth(const char *name, int length, int interleave) {
+    Handle v = CreateVector(0);
+    Retain(v);
+    for (int i = 0; i < length; i++) {
+	if (interleave) CreateCons(nil, nil);
+	double start = Nanoseconds();
+	VectorAppend(v, nil);
+	times[i] = Nanoseconds() - start;
+    }
+    Report(name, length);
+    Unretain(v);
+    GarbageCollect();
+}
+
+/* the retain table */
+
+// Retain and unretain an object while `crowd` others are retained. Both
+// scan the table, so this is what a deep native call chain costs.
+static void BenchRetain(const char *name, int crowd) {
+    Handle others = CreateVector(crowd);
+    Retain(others);
+    for (int i = 0; i < crowd; i++) {
+	VectorSet(others, i, CreateCons(nil, nil));
+	Retain(VectorRef(others, i));
+    }
+    Handle x = CreateCons(nil, nil);
+    for (int s = 0; s < samples; s++) {
+	double start = Nanoseconds();
+	for (int i = 0; i < BATCH; i++) {
+	    Retain(x);
+	    Unretain(x);
+	}
+	times[s] = (Nanoseconds() - start) / BATCH;
+    }
+    Report(name, samples);
+    for (int i = crowd - 1; i >= 0; i--) Unretain(VectorRef(others, i));
+    Unretain(others);
+    GarbageCollect();
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+	if (strncmp(argv[i], "--samples=", 10) == 0 && atoi(argv[i] + 10) >= 4) {
+	    samples = atoi(argv[i] + 10);
+	}
+	else {
+	    fprintf(stderr, "usage: %s [--samples=N]\n", argv[0]);
+	    return 1;
+	}
+    }
+    InitMem();
+    SetGCFrequency(0);
+    int sizes[] = {1000, 4000, 16000, 32000};
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    int longest = 4000;
+    times = malloc((samples > longest ? samples : longest) * sizeof(double));
+    if (times == NULL) panic("out of memory for timings");
+
+    printf("%-28s %7s %10s %10s %10s %10s\n", "nanoseconds", "samples",
+	   "p50", "p90", "p99", "max");
+    BenchAllocation("alloc integer", AllocInteger);
+    BenchAllocation("alloc float", AllocFloat);
+    BenchAllocation("alloc cons", AllocCons);
+    BenchAllocation("alloc box", AllocBox);
+    BenchAllocation("alloc vector 8", AllocVector);
+    BenchAllocation("alloc bytevector 64", AllocBytevector);
+
+    for (int i = 0; i < nsizes; i++) {
+	BenchCollection("list", sizes[i], LongList(sizes[i]));
+	BenchCollection("vector", sizes[i], WideVector(sizes[i]));
+	int depth = 1;
+	while ((1 << depth) - 1 < sizes[i]) depth++;
+	BenchCollection("tree", (1 << depth) - 1, Tree(depth));
+    }
+
+    Handle lists = ListsOfIntegers(120, 150);
+    BenchWalk("walk lists, breadth first", lists, 0);
+    BenchWalk("walk lists, depth first", lists, 1);
+    Unretain(lists);
+    GarbageCollect();
+
+    BenchGrowth("extend vector at bottom", longest, 0);
+    BenchGrowth("extend vector, moving", longest, 1);
+
+    BenchRetain("retain/unretain, 0 others", 0);
+    BenchRetain("retain/unretain, 100 others", 100);
+    BenchRetain("retain/unretain, 1000 others", 1000);
+    return 0;
+}
@@ -0,0 +1,31 @@
+;; expect: 92
+;; count the solutions to the 7 queens problem
+
+(define (iota1 n)
+  (if (= n 0)
+      '()
+      (cons n (iota1 (- n 1)))))
+
+(define (append a b)
+  (if (null? a)
+      b
+      (cons (car a) (append (cdr a) b))))
+
+(define (ok? row dist placed)
+  (if (null? placed)
+      't
+      (if (= (car placed) (+ row dist))
+          '()
+          (if (= (car placed) (- row dist))
+              '()
+              (ok? row (+ dist 1) (cdr placed))))))
+
+(define (try x y z)
+  (if (null? x)
+      (if (null? y) 1 0)
+      (+ (if (ok? (car x) 1 z)
+             (try (append (cdr x) y) '() (cons (car x) z))
+             0)
+         (try (cdr x) (cons (car x) y) z))))
+
+(display (try (iota1 8) '() '()))
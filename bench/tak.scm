@@ -0,0 +1,11 @@
+;; expect: 8
+;; Takeuchi's function: deep, non-tail recursion on small integers
+
+(define (tak x y z)
+  (if (not (< y x))
+      z
+      (tak (tak (- x 1) y z)
+           (tak (- y 1) z x)
+           (tak (- z 1) x y))))
+
+(display (tak 20 14 7))
@@ -0,0 +1,28 @@
+;; expect: 7
+;; TAK with lists standing in for the integers
+
+(define (listn n)
+  (if (= n 0)
+      '()
+      (cons n (listn (- n 1)))))
+
+(define (length l)
+  (if (null? l)
+      0
+      (+ 1 (length (cdr l)))))
+
+(define (shorterp x y)
+  (if (null? y)
+      '()
+      (if (null? x)
+          't
+          (shorterp (cdr x) (cdr y)))))
+
+(define (mas x y z)
+  (if (not (shorterp y x))
+      z
+      (mas (mas (cdr x) y z)
+           (mas (cdr y) z x)
+           (mas (cdr z) x y))))
+
+(display (length (mas (listn 18) (listn 12) (listn 6))))
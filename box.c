@@ -0,0 +1,25 @@
+#include "lilscheme.h"
+
+// Boxes
+// These are the cells that hold variables which are both captured by a
+// closure and assigned to. Scheme code never sees them directly.
+
+Handle CreateBox(Handle value) {
+    Handle hnd = CreateObject(TYPE_BOX, 0);
+    DATA_AREA(BOX,hnd)->value = value;
+    return hnd;
+}
+
+Handle Unbox(Handle box) {
+    if (DEREF(box)->type != TYPE_BOX) {
+	panic("can't Unbox that type");
+    }
+    return DATA_AREA(BOX,box)->value;
+}
+
+void SetBox(Handle box, Handle value) {
+    if (DEREF(box)->type != TYPE_BOX) {
+	panic("can't SetBox that type");
+    }
+    DATA_AREA(BOX,box)->value = value;
+}
@@ -0,0 +1,370 @@
+/* cache.c - on-disk cache of compiled programs */
+
+// A cache file holds the compiled top-level forms of one source file. It
+// starts with a header naming the format version and a hash of the source,
+// so a stale cache is simply not loaded. Then come a symbol table and a
+// pool of objects. Objects refer to one another and to symbols by position,
+// never by handle, so the pool can be rebuilt anywhere in a fresh heap.
+// Every object comes after the objects it refers to. Numbers are written
+// little-endian.
+//
+//   header    "LSBC" version:u16 hash:u32 nSymbols:u32 nObjects:u32 nForms:u32
+//   symbols   nSymbols * (length:u16 name)
+//   objects   nObjects * (type:u8 payload)
+//   forms     nForms * ref:u32
+//   checksum  u32, the FNV-1a hash of everything before it
+//
+// A ref is 0 for nil and otherwise one more than a position in the pool.
+// The payloads are:
+//
+//   TYPE_INT          value:i32
+//   TYPE_FLOAT        the 8 bytes of the double
+//   TYPE_SYMBOL       symbol:u32
+//   TYPE_CONS         car:ref cdr:ref
+//   TYPE_VECTOR       length:u32 length*ref
+//   TYPE_BYTEVECTOR   length:u32 bytes
+//   TYPE_FUNCTION     stacksize:u16 nLocals:u16 arguments:u16 bytecode:ref literals:ref
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lilscheme.h"
+
+#define CACHE_MAGIC "LSBC"
+#define CACHE_VERSION 10    // bump whenever the compiler's output changes
+
+#define FNV_BASIS 2166136261u
+#define FNV_STEP(HASH, BYTE) (((HASH) ^ (uint8_t)(BYTE)) * 16777619u)
+
+uint32_t HashSource(FILE *source) {
+    uint32_t hash = FNV_BASIS;
+    int c;
+    while ((c = fgetc(source)) != EOF) {
+	hash = FNV_STEP(hash, c);
+    }
+    // unoptimized, sealed or unchecked code is different code
+    hash = FNV_STEP(hash, optimizeBytecode);
+    hash = FNV_STEP(hash, sealPrograms);
+    hash = FNV_STEP(hash, compilerSafety);
+    return hash ^ CACHE_VERSION;
+}
+
+
+/* Writing */
+
+typedef struct cachewriter {
+    FILE *out;
+    int *indexOf;       // handle -> position in the pool or symbol table
+    Handle *objects;
+    int nObjects;
+    Handle *symbols;
+    int nSymbols;
+    uint32_t checksum;
+} CACHEWRITER;
+
+static void PutByte(CACHEWRITER *cw, int b) {
+    fputc(b & 0xff, cw->out);
+    cw->checksum = FNV_STEP(cw->checksum, b);
+}
+
+static void PutBytes(CACHEWRITER *cw, const void *bytes, int n) {
+    for (int i = 0; i < n; i++) PutByte(cw, ((const uint8_t*)bytes)[i]);
+}
+
+static void PutU16(CACHEWRITER *cw, uint32_t n) {
+    PutByte(cw, n);
+    PutByte(cw, n >> 8);
+}
+
+static void PutU32(CACHEWRITER *cw, uint32_t n) {
+    PutU16(cw, n);
+    PutU16(cw, n >> 16);
+}
+
+static void PutRef(CACHEWRITER *cw, Handle hnd) {
+    PutU32(cw, hnd == nil ? 0 : cw->indexOf[hnd] + 1);
+}
+
+static void NumberObject(CACHEWRITER *cw, Handle hnd) {
+    if (hnd == nil || cw->indexOf[hnd] != -1) return;
+    switch (TYPEOF(hnd)) {
+    case TYPE_SYMBOL:
+	// the pool entry for a symbol just points into the symbol table
+	cw->symbols[cw->nSymbols++] = hnd;
+	break;
+    case TYPE_INT: case TYPE_FLOAT: case TYPE_BYTEVECTOR:
+	break;
+    case TYPE_CONS:
+	NumberObject(cw, Car(hnd));
+	NumberObject(cw, Cdr(hnd));
+	break;
+    case TYPE_VECTOR:
+	FOR_IN_VECTOR(i, hnd) {
+	    NumberObject(cw, VectorRef(hnd, i));
+	}
+	break;
+    case TYPE_FUNCTION:
+	NumberObject(cw, DATA_AREA(FUNCTION, hnd)->bytecode);
+	NumberObject(cw, DATA_AREA(FUNCTION, hnd)->literals);
+	break;
+    default:
+	panic("can't cache an object of that type");
+    }
+    cw->indexOf[hnd] = cw->nObjects;
+    cw->objects[cw->nObjects++] = hnd;
+}
+
+static void WriteObject(CACHEWRITER *cw, Handle hnd) {
+    OBJTYPE type = TYPEOF(hnd);
+    PutByte(cw, type);
+    switch (type) {
+    case TYPE_INT:
+	PutU32(cw, (uint32_t)UnboxInteger(hnd));
+	break;
+    case TYPE_FLOAT:
+	{
+	    double d = UnboxFloat(hnd);
+	    PutBytes(cw, &d, sizeof(d));
+	}
+	break;
+    case TYPE_SYMBOL:
+	for (int i = 0; i < cw->nSymbols; i++) {
+	    if (cw->symbols[i] == hnd) {
+		PutU32(cw, i);
+		break;
+	    }
+	}
+	break;
+    case TYPE_CONS:
+	PutRef(cw, Car(hnd));
+	PutRef(cw, Cdr(hnd));
+	break;
+    case TYPE_VECTOR:
+	PutU32(cw, VectorLength(hnd));
+	FOR_IN_VECTOR(i, hnd) {
+	    PutRef(cw, VectorRef(hnd, i));
+	}
+	break;
+    case TYPE_BYTEVECTOR:
+	PutU32(cw, BytevectorLength(hnd));
+	PutBytes(cw, BVEC_CONTENTS(hnd), BytevectorLength(hnd));
+	break;
+    case TYPE_FUNCTION:
+	{
+	    FUNCTION *f = DATA_AREA(FUNCTION, hnd);
+	    PutU16(cw, f->stacksize);
+	    PutU16(cw, f->nLocals);
+	    PutU16(cw, f->arguments);
+	    PutRef(cw, f->bytecode);
+	    PutRef(cw, f->literals);
+	}
+	break;
+    default:
+	panic("can't cache an object of that type");
+    }
+}
+
+// `program` is a vector of compiled top-level forms; this allocates nothing
+void WriteCodeCache(Handle program, uint32_t hash, FILE *out) {
+    CACHEWRITER cw;
+    cw.out = out;
+    cw.indexOf = malloc(MAX_HANDLES * sizeof(int));
+    cw.objects = malloc(MAX_HANDLES * sizeof(Handle));
+    cw.symbols = malloc(MAX_HANDLES * sizeof(Handle));
+    if (cw.indexOf == NULL || cw.objects == NULL || cw.symbols == NULL) {
+	panic("out of memory writing code cache");
+    }
+    for (int i = 0; i < MAX_HANDLES; i++) cw.indexOf[i] = -1;
+    cw.nObjects = cw.nSymbols = 0;
+    cw.checksum = FNV_BASIS;
+    FOR_IN_VECTOR(i, program) {
+	NumberObject(&cw, VectorRef(program, i));
+    }
+
+    PutBytes(&cw, CACHE_MAGIC, 4);
+    PutU16(&cw, CACHE_VERSION);
+    PutU32(&cw, hash);
+    PutU32(&cw, cw.nSymbols);
+    PutU32(&cw, cw.nObjects);
+    PutU32(&cw, VectorLength(program));
+    for (int i = 0; i < cw.nSymbols; i++) {
+	char *name = NameOfSymbol(cw.symbols[i]);
+	PutU16(&cw, strlen(name));
+	PutBytes(&cw, name, strlen(name));
+    }
+    for (int i = 0; i < cw.nObjects; i++) {
+	WriteObject(&cw, cw.objects[i]);
+    }
+    FOR_IN_VECTOR(i, program) {
+	PutRef(&cw, VectorRef(program, i));
+    }
+    PutU32(&cw, cw.checksum);
+
+    free(cw.indexOf);
+    free(cw.objects);
+    free(cw.symbols);
+}
+
+
+/* Reading */
+
+// Anything wrong with the file makes the loader give up and return nil, so
+// the caller can fall back to compiling the source.
+
+typedef struct cachereader {
+    FILE *in;
+    int bad;
+    Handle pool;
+    int loaded;         // objects in the pool so far
+    uint32_t checksum;
+} CACHEREADER;
+
+static uint32_t GetByte(CACHEREADER *cr) {
+    int c = fgetc(cr->in);
+    if (c == EOF) {
+	cr->bad = 1;
+	return 0;
+    }
+    cr->checksum = FNV_STEP(cr->checksum, c);
+    return c;
+}
+
+static void GetBytes(CACHEREADER *cr, void *bytes, int n) {
+    for (int i = 0; i < n && !cr->bad; i++) ((uint8_t*)bytes)[i] = GetByte(cr);
+}
+
+static uint32_t GetU16(CACHEREADER *cr) {
+    uint32_t lo = GetByte(cr);
+    return lo | GetByte(cr) << 8;
+}
+
+static uint32_t GetU32(CACHEREADER *cr) {
+    uint32_t lo = GetU16(cr);
+    return lo | GetU16(cr) << 16;
+}
+
+// objects may only refer to objects before them
+static Handle GetRef(CACHEREADER *cr) {
+    uint32_t ref = GetU32(cr);
+    if (ref == 0) return nil;
+    if (ref > (uint32_t)cr->loaded) {
+	cr->bad = 1;
+	return nil;
+    }
+    return VectorRef(cr->pool, ref - 1);
+}
+
+static Handle ReadCachedObject(CACHEREADER *cr, Handle symbols) {
+    switch (GetByte(cr)) {
+    case TYPE_INT:
+	return CreateInteger((int)GetU32(cr));
+    case TYPE_FLOAT:
+	{
+	    double d;
+	    GetBytes(cr, &d, sizeof(d));
+	    if (cr->bad) break;
+	    return CreateFloat(d);
+	}
+    case TYPE_SYMBOL:
+	{
+	    uint32_t idx = GetU32(cr);
+	    if (cr->bad || idx >= (uint32_t)VectorLength(symbols)) break;
+	    return VectorRef(symbols, idx);
+	}
+    case TYPE_CONS:
+	{
+	    Handle car = GetRef(cr);
+	    Handle cdr = GetRef(cr);
+	    return CreateCons(car, cdr);
+	}
+    case TYPE_VECTOR:
+	{
+	    uint32_t len = GetU32(cr);
+	    if (cr->bad || len > MAX_HANDLES) break;
+	    Handle v = CreateVector(len);
+	    Retain(v);
+	    for (uint32_t i = 0; i < len && !cr->bad; i++) {
+		VectorSet(v, i, GetRef(cr));
+	    }
+	    Unretain(v);
+	    return v;
+	}
+    case TYPE_BYTEVECTOR:
+	{
+	    uint32_t len = GetU32(cr);
+	    if (cr->bad || len > 0xffff) break;
+	    Handle bv = CreateBytevector(len);
+	    GetBytes(cr, BVEC_CONTENTS(bv), len);
+	    if (cr->bad) break;
+	    return bv;
+	}
+    case TYPE_FUNCTION:
+	{
+	    int stacksize = GetU16(cr);
+	    int nLocals = GetU16(cr);
+	    int arguments = GetU16(cr);
+	    Handle bytecode = GetRef(cr);
+	    Handle literals = GetRef(cr);
+	    if (cr->bad || nLocals < arguments ||
+		bytecode == nil || TYPEOF(bytecode) != TYPE_BYTEVECTOR ||
+		literals == nil || TYPEOF(literals) != TYPE_VECTOR) break;
+	    return CreateFunctionFrom(stacksize, nLocals, arguments,
+				      bytecode, literals);
+	}
+    }
+    cr->bad = 1;
+    return nil;
+}
+
+// Load a cache written by WriteCodeCache. Returns the vector of top-level
+// forms, or nil if the file is damaged or wasn't made from a source with
+// this hash.
+Handle ReadCodeCache(FILE *in, uint32_t hash) {
+    CACHEREADER cr = { in, 0, nil, 0, FNV_BASIS };
+    char magic[4];
+    GetBytes(&cr, magic, 4);
+    if (cr.bad || memcmp(magic, CACHE_MAGIC, 4) != 0) return nil;
+    if (GetU16(&cr) != CACHE_VERSION || GetU32(&cr) != hash) return nil;
+    uint32_t nSymbols = GetU32(&cr);
+    uint32_t nObjects = GetU32(&cr);
+    uint32_t nForms = GetU32(&cr);
+    if (cr.bad || nSymbols > MAX_HANDLES || nObjects > MAX_HANDLES ||
+	nForms > MAX_HANDLES) {
+	return nil;
+    }
+
+    Handle symbols = CreateVector(nSymbols);
+    Retain(symbols);
+    char name[0x10000];
+    for (uint32_t i = 0; i < nSymbols && !cr.bad; i++) {
+	uint32_t len = GetU16(&cr);
+	GetBytes(&cr, name, len);
+	name[len] = '\0';
+	if (!cr.bad) VectorSet(symbols, i, CreateSymbol(name));
+    }
+
+    cr.pool = CreateVector(nObjects);
+    Retain(cr.pool);
+    while (cr.loaded < (int)nObjects && !cr.bad) {
+	Handle obj = ReadCachedObject(&cr, symbols);
+	VectorSet(cr.pool, cr.loaded++, obj);
+    }
+
+    Handle program = nil;
+    if (!cr.bad) {
+	program = CreateVector(nForms);
+	Retain(program);
+	for (uint32_t i = 0; i < nForms && !cr.bad; i++) {
+	    Handle fn = GetRef(&cr);
+	    if (fn == nil || TYPEOF(fn) != TYPE_FUNCTION) cr.bad = 1;
+	    else VectorSet(program, i, fn);
+	}
+	uint32_t expected = cr.checksum;
+	if (GetU32(&cr) != expected) cr.bad = 1;
+	Unretain(program);
+	if (cr.bad) program = nil;
+    }
+    Unretain(cr.pool);
+    Unretain(symbols);
+    return program;
+}
@@ -1,21 +1,148 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "lilscheme.h"
 
 /* MAJOR TODO: implement syntax checking for most of these special forms */
 
+/* Compiler buffers */
+
+// While a function is being compiled, its code goes in a native buffer and
+// its scopes and literals are looked up in hash maps, so compiling a big
+// function takes time in proportion to its size. CreateFunction makes the
+// heap objects once, at the end.
+
+// maps handles to non-negative ints, with open addressing
+typedef struct handlemap {
+    Handle *keys;      // nil where a slot is empty
+    int *values;
+    int capacity;      // a power of two, or 0 before the first MapPut
+    int count;
+} HANDLEMAP;
+
+int MapGet(HANDLEMAP *map, Handle key) {
+    if (map->capacity == 0) return -1;
+    unsigned mask = map->capacity - 1;
+    for (unsigned i = (key * 40503u) & mask; map->keys[i] != nil; i = (i + 1) & mask) {
+	if (map->keys[i] == key) return map->values[i];
+    }
+    return -1;
+}
+
+void MapFree(HANDLEMAP *map) {
+    free(map->keys);
+    free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+    map->capacity = map->count = 0;
+}
+
+void MapPut(HANDLEMAP*, Handle, int);
+
+void MapGrow(HANDLEMAP *map) {
+    HANDLEMAP old = *map;
+    map->capacity = old.capacity == 0 ? 16 : 2 * old.capacity;
+    map->count = 0;
+    map->keys = calloc(map->capacity, sizeof(Handle));
+    map->values = malloc(map->capacity * sizeof(int));
+    if (map->keys == NULL || map->values == NULL) panic("out of memory in the compiler");
+    for (int i = 0; i < old.capacity; i++) {
+	if (old.keys[i] != nil) MapPut(map, old.keys[i], old.values[i]);
+    }
+    MapFree(&old);
+}
+
+void MapPut(HANDLEMAP *map, Handle key, int value) {
+    assert(key != nil);
+    if (2 * (map->count + 1) > map->capacity) MapGrow(map);
+    unsigned mask = map->capacity - 1;
+    unsigned i = (key * 40503u) & mask;
+    while (map->keys[i] != nil && map->keys[i] != key) i = (i + 1) & mask;
+    if (map->keys[i] == nil) map->count++;
+    map->keys[i] = key;
+    map->values[i] = value;
+}
+
+// A growable array of handles. They're kept in a retained vector, which
+// doubles when it fills up, so the collector can see them.
+typedef struct pool {
+    Handle vector;     // nil until the first PoolAdd
+    int count;
+} POOL;
+
+int PoolAdd(POOL *pool, Handle x) {
+    int capacity = pool->vector == nil ? 0 : VectorLength(pool->vector);
+    if (pool->count == capacity) {
+	Handle bigger = CreateVector(capacity == 0 ? 16 : 2 * capacity);
+	for (int i = 0; i < pool->count; i++) {
+	    VectorSet(bigger, i, VectorRef(pool->vector, i));
+	}
+	Retain(bigger);
+	if (pool->vector != nil) Unretain(pool->vector);
+	pool->vector = bigger;
+    }
+    VectorSet(pool->vector, pool->count, x);
+    return pool->count++;
+}
+
+Handle PoolRef(POOL *pool, int i) {
+    assert(i < pool->count);
+    return VectorRef(pool->vector, i);
+}
+
+// a new vector of what's in the pool
+Handle PoolToVector(POOL *pool) {
+    Handle v = CreateVector(pool->count);
+    for (int i = 0; i < pool->count; i++) VectorSet(v, i, VectorRef(pool->vector, i));
+    return v;
+}
+
+void PoolFree(POOL *pool) {
+    if (pool->vector != nil) Unretain(pool->vector);
+    pool->vector = nil;
+    pool->count = 0;
+}
+
 // compiler state
 typedef struct state {
     int currentStack;
     int maxStack;
     int nLocals;
     int nArgs;
-    Handle locals;
-    Handle bytecode;
-    Handle literals;
+    POOL locals;       // arguments, then internal defines, by slot
+    HANDLEMAP localSlots;
+    Handle closure;    // free variables, in closure slot order
+    HANDLEMAP closureSlots;
+    Handle boxed;      // locals and closure variables that live in boxes
+    Handle early;      // boxed locals a closure can capture before they're defined
+    HANDLEMAP boxing;  // BOXED, or BOXED | EARLY, for each variable in `boxed`
+    Handle known;      // alist of known procedures to the forms defining them
+    Handle self;       // the name this function calls itself by, or nil
+    Handle assigned;   // locals that set! changes, which types aren't kept for
+    int *types;        // what each local could hold here, as TYPE_BIT()s
+    int typesLength;
+    uint8_t *code;
+    int codeLength;
+    int codeCapacity;
+    POOL literals;
+    HANDLEMAP literalSlots;
+    struct loop *loops; // the loops being compiled, innermost first
+    int safety;        // 0 where a declaration says not to check arguments
     struct state *prior;
 } STATE;
 
+enum {BOXED = 1, EARLY = 2};
+
+// a loop that a named let or do became
+typedef struct loop {
+    Handle name;
+    Handle vars;
+    int top;           // where the body starts
+    int depth;         // the stack depth there
+    struct loop *outer;
+} LOOP;
+
 void CompileForm(STATE*, Handle, COMPILER_MODE);
 void CompileLiteral(STATE*, Handle, COMPILER_MODE);
 void CompileVariable(STATE*, Handle, COMPILER_MODE); // incomplete
@@ -28,7 +155,16 @@ void CompileApply(STATE*, Handle, COMPILER_MODE);
 void CompileIf(STATE*, Handle, COMPILER_MODE);
 void CompileLambda(STATE*, Handle, COMPILER_MODE);
 void CompileDefine(STATE*, Handle, COMPILER_MODE);
-// void CompileSet
+void CompileSet(STATE*, Handle, COMPILER_MODE);
+void CompileLoop(STATE*, Handle, COMPILER_MODE);
+void CompileCase(STATE*, Handle, COMPILER_MODE);
+
+Handle Expand(Handle, int);
+int IsLoop(Handle);
+int IsCase(Handle);
+int IsDeclaration(Handle);
+int DeclaredSafety(Handle);
+int IsForm(Handle, const char*);
 
 
 
@@ -36,18 +172,47 @@ void CompileDefine(STATE*, Handle, COMPILER_MODE);
 
 
 
-Handle CreateFunction(STATE *state) {    
+Handle CreateFunctionFrom(int stacksize, int nLocals, int arguments,
+			  Handle bytecode, Handle literals) {
     Handle fn = CreateObject(TYPE_FUNCTION, 0);
     FUNCTION *data = DATA_AREA(FUNCTION,fn);
-    data->stacksize = state->maxStack;
-    data->nLocals = state->nLocals;
-    data->arguments = state->nArgs;
-    data->bytecode = state->bytecode;
-    data->literals = state->literals;
+    data->stacksize = stacksize;
+    data->nLocals = nLocals;
+    data->arguments = arguments;
+    data->bytecode = bytecode;
+    data->literals = literals;
     data->closure = nil;
+    data->regcode = nil;
+    data->calls = 0;
+    data->native = NULL;
+    data->profile = NULL;
+    data->name = nil;
     assert(data->nLocals >= data->arguments);
     assert(TYPEOF(data->literals) == TYPE_VECTOR);
     assert(TYPEOF(data->bytecode) == TYPE_BYTEVECTOR);
+    data->verified = VerifyFunction(fn);
+    return fn;
+}
+
+// The code and literals become heap objects here. The optimizer runs
+// between code generation and creating the function; without it, the
+// jumps are still shortened.
+Handle CreateFunction(STATE *state) {
+    Handle bytecode = CreateBytevector(state->codeLength);
+    memcpy(BVEC_CONTENTS(bytecode), state->code, state->codeLength);
+    Retain(bytecode);
+    Handle literals = PoolToVector(&state->literals);
+    Retain(literals);
+    if (optimizeBytecode) {
+	state->maxStack = OptimizeBytecode(bytecode, literals);
+    }
+    else {
+	RelaxBytecode(bytecode, literals);
+    }
+    Handle fn = CreateFunctionFrom(state->maxStack, state->nLocals, state->nArgs,
+				   bytecode, literals);
+    Unretain(literals);
+    Unretain(bytecode);
     return fn;
 }
 
@@ -62,55 +227,97 @@ void StackEffect(STATE *state, int delta) {
 }
 
 
+int CurrentBytecodePosition(STATE *state) {
+    return state->codeLength;
+}
+
 void AppendBytecode(STATE *state, uint8_t op) {
-    BytevectorAppend(state->bytecode, op);
+    if (state->codeLength == state->codeCapacity) {
+	state->codeCapacity = state->codeCapacity == 0 ? 64 : 2 * state->codeCapacity;
+	state->code = realloc(state->code, state->codeCapacity);
+	if (state->code == NULL) panic("out of memory for bytecode");
+    }
+    state->code[state->codeLength++] = op;
 }
 void AppendBytecodeWithArg(STATE *state, uint8_t op, int arg) {
-    if (arg > 0xff) {
-	panic("argument too large; implement `big-arg`");
+    assert(op > OPCODE_ARGUMENTS && arg >= 0);
+    if (arg <= MAX_SHORT_ARG) {
+	AppendBytecode(state, op);
+	AppendBytecode(state, (uint8_t)arg);
+	return;
     }
-    BytevectorAppend(state->bytecode, op);
-    BytevectorAppend(state->bytecode, (uint8_t)arg); // the damage happens here
+    if (arg > MAX_ARG) {
+	panic("argument too large for an instruction");
+    }
+    AppendBytecode(state, OPCODE_BIG_ARG);
+    AppendBytecode(state, op);
+    AppendBytecode(state, (uint8_t)(arg & 0xff));
+    AppendBytecode(state, (uint8_t)(arg >> 8));
 }
 
-int CurrentBytecodePosition(STATE *state) {
-    return BytevectorLength(state->bytecode);
+// A forward jump doesn't know how far it goes until its fixup, so it's
+// written with a big argument. RelaxBytecode shortens it afterwards if the
+// distance fits in a byte. Returns the jump's position for ApplyFixup.
+int AppendJump(STATE *state, uint8_t op) {
+    int pos = CurrentBytecodePosition(state);
+    AppendBytecode(state, OPCODE_BIG_ARG);
+    AppendBytecode(state, op);
+    AppendBytecode(state, 0);
+    AppendBytecode(state, 0);
+    return pos;
 }
 
+// the literal's slot, added if it isn't there already
+int AddLiteral(STATE *state, Handle x) {
+    // TODO: use equivalence not identity
+    assert(x != nil);
+    int idx = MapGet(&state->literalSlots, x);
+    if (idx == -1) {
+	idx = PoolAdd(&state->literals, x);
+	MapPut(&state->literalSlots, x, idx);
+    }
+    return idx;
+}
+
+
 void ApplyFixup(STATE *state, int opPos, int targetPos) {
-    // this will need to be modified for big-arg
-    uint8_t *bytecode = BVEC_CONTENTS(state->bytecode);
-    uint8_t op = bytecode[opPos];
-    if (op != OP_JUMP_TRUE && op != OP_JUMP_FALSE && op != OP_JUMP) {
-	// TODO: handle jump-back properly?
+    uint8_t *bytecode = state->code;
+    uint8_t op = bytecode[opPos + 1];
+    if (bytecode[opPos] != OPCODE_BIG_ARG ||
+	(op != OP_JUMP_TRUE && op != OP_JUMP_FALSE && op != OP_JUMP)) {
 	panic("wrong instruction for fixups");
     }
-    int argPos = opPos+1;
-    int srcPos = opPos+2;
+    int srcPos = opPos + 4;
     int distance = targetPos - srcPos;
     if (distance < 0) {
 	panic("fixup would go backwards");
     }
-    if (distance > 0xff) {
-	panic("jump distance too big; implement `big-arg`");
+    if (distance > MAX_ARG) {
+	panic("jump distance too big");
     }
-    bytecode[argPos] = (uint8_t)distance;
+    bytecode[opPos + 2] = (uint8_t)(distance & 0xff);
+    bytecode[opPos + 3] = (uint8_t)(distance >> 8);
 }
 
 void InitializeState(STATE *state) {
-    state->currentStack = state->maxStack = 0;
-    state->nLocals = 0;
-    state->nArgs = 0;
-    state->locals = nil;
-    state->bytecode = CreateBytevector(0);
-    Retain(state->bytecode);
-    state->literals = CreateVector(0);
-    Retain(state->literals);
+    // nil is 0, so this empties every list, pool and map
+    memset(state, 0, sizeof(*state));
+    state->code = NULL;
+    state->loops = NULL;
     state->prior = NULL;
+    state->safety = compilerSafety;
 }
 
-// sole entry point to the compiler
-Handle Compile(Handle code, COMPILER_MODE mode) {
+// free the code and literals once they're in a function
+void ReleaseCode(STATE *state) {
+    free(state->code);
+    state->code = NULL;
+    PoolFree(&state->literals);
+    MapFree(&state->literalSlots);
+}
+
+// compile a form whose derived forms are already expanded
+Handle CompileExpanded(Handle code, COMPILER_MODE mode) {
     STATE state;
     InitializeState(&state);
 
@@ -121,33 +328,110 @@ Handle Compile(Handle code, COMPILER_MODE mode) {
     AppendBytecode(&state, OP_END);
     StackEffect(&state, -1);
     Handle fn = CreateFunction(&state);
-    Unretain(state.bytecode);
-    Unretain(state.literals);
-    // unretain `bytecode` and `literals`
+    ReleaseCode(&state);
+    free(state.types);
     return fn;
 }
 
-void CompileForm(STATE *state, Handle code, COMPILER_MODE mode) {
-    switch(TYPEOF(code)) {
-    case TYPE_INT: case TYPE_FLOAT:
-    case TYPE_VECTOR: case TYPE_BYTEVECTOR:
-	CompileLiteral(state, code, mode);
-	break;
-    case TYPE_SYMBOL:
-	CompileVariable(state, code, mode);
-	break;
-    case TYPE_CONS:
-	CompileCompound(state, code, mode);
-	break;
-    default:
-	panic("can't compile that type");
+// The primitives that the code being compiled defines or set!s anywhere.
+// None of it runs until it's all compiled, so the optimizer can't take a
+// primitive's current value as the one these calls will get.
+Handle replacedPrimitives;     // nil except while compiling
+
+// add the primitives that `form` assigns to `replacedPrimitives`; the
+// caller keeps the collector off
+void NoteReplacedPrimitives(Handle form) {
+    while (TYPEOF(form) == TYPE_CONS) {
+	if (IsForm(form, "quote")) return;
+	if ((IsForm(form, "define") || IsForm(form, "set!")) &&
+	    TYPEOF(Cdr(form)) == TYPE_CONS) {
+	    Handle name = Cadr(form);
+	    if (TYPEOF(name) == TYPE_CONS) name = Car(name);
+	    Handle cell = TYPEOF(name) == TYPE_SYMBOL ? AlistGet(globals, name) : nil;
+	    if (cell != nil && TYPEOF(Cdr(cell)) == TYPE_PRIMITIVE) {
+		replacedPrimitives = ListAdjoin(replacedPrimitives, name);
+	    }
+	}
+	NoteReplacedPrimitives(Car(form));
+	form = Cdr(form);
+    }
+}
+
+// sole entry point to the compiler
+Handle Compile(Handle code, COMPILER_MODE mode) {
+    TRACE(TRACE_COMPILE, 'B', "compile", 0);
+    // the list only changes handle when it starts, so it's retained then
+    Handle replaced = replacedPrimitives;
+    MakeRoom();
+    DisableGC();
+    NoteReplacedPrimitives(code);
+    EnableGC();
+    if (replacedPrimitives != replaced) Retain(replacedPrimitives);
+    // the caller keeps `code` reachable, and may have retained it itself
+    Handle expanded = Expand(code, 0);
+    if (expanded != code) Retain(expanded);
+    if (IsDeclaration(expanded)) compilerSafety = DeclaredSafety(expanded);
+    Handle fn = CompileExpanded(expanded, mode);
+    if (expanded != code) Unretain(expanded);
+    if (replacedPrimitives != replaced) {
+	Unretain(replacedPrimitives);
+	replacedPrimitives = replaced;
+    }
+    TRACE(TRACE_COMPILE, 'E', "compile", 0);
+    return fn;
+}
+
+// Read and compile every form in a file, giving a vector of functions to be
+// run in order
+Handle CompileFile(FILE *source) {
+    if (sealPrograms) return CompileSealedFile(source);
+    // a file's declarations end with it
+    int safety = compilerSafety;
+    // every form is read before any is compiled, to see which primitives
+    // the file replaces
+    Handle forms = CreateVector(0);
+    Retain(forms);
+    while (!(feof(source) || ferror(source))) {
+	Handle code = ReadObject(source);
+	if (code != nil) {
+	    Retain(code);
+	    VectorAppend(forms, code);
+	    Unretain(code);
+	}
+    }
+    MakeRoom();
+    DisableGC();
+    FOR_IN_VECTOR(i, forms) NoteReplacedPrimitives(VectorRef(forms, i));
+    EnableGC();
+    if (replacedPrimitives != nil) Retain(replacedPrimitives);
+
+    Handle program = CreateVector(0);
+    Retain(program);
+    FOR_IN_VECTOR(i, forms) {
+	Handle fn = Compile(VectorRef(forms, i), COMPILER_MODE_REPL);
+	Retain(fn);
+	VectorAppend(program, fn);
+	Unretain(fn);
     }
+    if (replacedPrimitives != nil) Unretain(replacedPrimitives);
+    replacedPrimitives = nil;
+    compilerSafety = safety;
+    Unretain(program);
+    Unretain(forms);
+    return program;
+}
+
+void CompileForm(STATE *state, Handle code, COMPILER_MODE mode) {
+    OBJTYPE type = TYPEOF(code);
+    if (type == TYPE_SYMBOL) CompileVariable(state, code, mode);
+    else if (type == TYPE_CONS) CompileCompound(state, code, mode);
+    else if (typeInfo[type].flags & SELF_EVALUATING) CompileLiteral(state, code, mode);
+    else panic("can't compile that type");
 }
 
 void CompileLiteral(STATE *state, Handle code, COMPILER_MODE mode) {
     if (code != nil) {
-	int litpos = AddToVector(state->literals, code);
-	assert (litpos < 256); // todo: see if extended args are really needed
+	int litpos = AddLiteral(state, code);
 	AppendBytecodeWithArg(state, OP_LITERAL, litpos);
     }
     else {
@@ -159,65 +443,41 @@ void CompileLiteral(STATE *state, Handle code, COMPILER_MODE mode) {
 /* Variable references */
 
 void CompileGlobalVariable(STATE *state, Handle code, COMPILER_MODE mode) {
-    int varpos = AddToVector(state->literals, code);
-    assert (varpos < 0xff);
+    Handle sealed = AlistGet(sealedGlobals, code);
+    if (sealed != nil) {
+	CompileLiteral(state, Cdr(sealed), mode);
+	return;
+    }
+    int varpos = AddLiteral(state, code);
     AppendBytecodeWithArg(state, OP_GLOBAL, varpos);
     StackEffect(state, 1);
 }
 
 int SearchForLocal(STATE *state, Handle var) {
-    Handle locals = state->locals;
-    int idx = 0;
-    while (locals != nil) {
-	if (Car(locals) == var) return idx;
-	else {
-	    locals = Cdr(locals);
-	    idx++;
-	}
-    }
-    // search failed
-    return -1;
+    return MapGet(&state->localSlots, var);
 }
 
-// TODO: abstract into list.c
 int AddLocal(STATE *state, Handle var) {
-    Handle locals = state->locals;
-    if (locals == nil) {
-	state->locals = CreateCons(var, nil);
-	state->nLocals++;
-	return 0;
-    }
-    else {
-	Handle prev = locals;
-	int idx = 0;
-	while (locals != nil) {
-	    if (Car(locals) == var) return idx; // already present
-	    prev = locals;
-	    locals = Cdr(locals);
-	    idx++;
-	}
-	SetCdr(prev, CreateCons(var, nil));
-	state->nLocals++;
-	return idx+1;
-    }
+    // Locals are normally all known from AnalyzeScope; this is a fallback.
+    int idx = SearchForLocal(state, var);
+    if (idx != -1) return idx;
+    idx = PoolAdd(&state->locals, var);
+    MapPut(&state->localSlots, var, idx);
+    assert(idx == state->nLocals);
+    return state->nLocals++;
 }
 
 // for closure variables
 int SearchForClosure(STATE *state, Handle var) {
-    STATE *parentState = state->prior;
-    int idx = 0;
-    while (parentState != NULL) {
-	Handle locals = parentState->locals;
-	while (locals != nil) {
-	    if (Car(locals) == var) return idx;
-	    else {
-		locals = Cdr(locals);
-		idx++;
-	    }
-	}
-	parentState = parentState->prior;
-    }
-    return -1;
+    return MapGet(&state->closureSlots, var);
+}
+
+int IsBoxed(STATE *state, Handle var) {
+    return MapGet(&state->boxing, var) != -1;
+}
+
+int IsEarly(STATE *state, Handle var) {
+    return MapGet(&state->boxing, var) == (BOXED | EARLY);
 }
 
 void CompileVariable(STATE *state, Handle code, COMPILER_MODE mode) {
@@ -226,17 +486,18 @@ void CompileVariable(STATE *state, Handle code, COMPILER_MODE mode) {
     }
     else {
 	// see if the variable is in scope
+	int boxed = IsBoxed(state, code);
 	int localIdx = SearchForLocal(state, code);
 	if (localIdx != -1) {
-	    assert(localIdx < 0xff);
-	    AppendBytecodeWithArg(state, OP_LOCAL, localIdx);
+	    AppendBytecodeWithArg(state, boxed ? OP_LOCAL_BOX : OP_LOCAL,
+				  localIdx);
 	    StackEffect(state, 1);
 	}
 	else {
 	    int closureIdx = SearchForClosure(state, code);
 	    if (closureIdx != -1) {
-		assert(closureIdx < 0xff);
-		AppendBytecodeWithArg(state, OP_CLOSURE, closureIdx);
+		AppendBytecodeWithArg(state, boxed ? OP_CLOSURE_BOX : OP_CLOSURE,
+				      closureIdx);
 		StackEffect(state, 1);
 	    }
 	    else {
@@ -246,179 +507,1688 @@ void CompileVariable(STATE *state, Handle code, COMPILER_MODE mode) {
     }
 }
 
-/* Compound expressions */
+/* Scope analysis */
+
+// Closures are flat: a closure copies the values of its free variables when
+// it is created, rather than pointing at the frames that enclose it. To make
+// that work, each lambda body is examined before any of its code is
+// generated. The only variables that need boxes are the ones a closure
+// captures that can change after the capture.
+
+int IsForm(Handle form, const char *keyword) {
+    if (TYPEOF(form) != TYPE_CONS) return 0;
+    // compare names first; finding the keyword costs more, and looking it
+    // up rather than interning it means this never allocates
+    Handle head = Car(form);
+    return TYPEOF(head) == TYPE_SYMBOL && strcmp(NameOfSymbol(head), keyword) == 0 &&
+	head == FindSymbolNamed(keyword);
+}
 
-void CompileCompound(STATE *state, Handle code, COMPILER_MODE mode) {
-    Handle determinant = Car(code);
-    if (determinant == CreateSymbol("quote")) {
-	CompileQuote(state, code, mode);
+Handle DefinedName(Handle form) {
+    Handle target = Cadr(form);
+    return TYPEOF(target) == TYPE_CONS ? Car(target) : target;
+}
+
+// internal defines in `form` that become locals of the enclosing lambda
+Handle CollectDefines(Handle form, Handle acc) {
+    if (TYPEOF(form) != TYPE_CONS) return acc;
+    if (IsForm(form, "quote") || IsForm(form, "lambda")) return acc;
+    if (IsForm(form, "define")) {
+	acc = ListAdjoin(acc, DefinedName(form));
+	if (TYPEOF(Cadr(form)) == TYPE_CONS) return acc; // body is a lambda
+	form = Cdr(Cdr(form));
     }
-    else if (determinant == CreateSymbol("if")) {
-	CompileIf(state, code, mode);
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	acc = CollectDefines(Car(form), acc);
     }
-    else if (determinant == CreateSymbol("begin")) {
-	CompileBegin(state, code, mode);
+    return acc;
+}
+
+Handle FreeVariables(Handle, Handle);
+
+// Adds the variables referenced in `form` that aren't in `bound` to `acc`.
+// If `nestedOnly` is set, only count references made from nested lambdas;
+// those are the variables the form captures.
+Handle ScanReferences(Handle form, Handle bound, Handle acc, int nestedOnly) {
+    switch (TYPEOF(form)) {
+    case TYPE_SYMBOL:
+	if (!nestedOnly && ListIndex(bound, form) == -1) {
+	    acc = ListAdjoin(acc, form);
+	}
+	return acc;
+    case TYPE_CONS:
+	break;
+    default:
+	return acc;
     }
-    else if (determinant == CreateSymbol("lambda")) {
-	CompileLambda(state, code, mode);
+
+    Handle inner = nil;
+    if (IsForm(form, "quote")) {
+	return acc;
     }
-    else if (determinant == CreateSymbol("define")) {
-	CompileDefine(state, code, mode);
+    else if (IsForm(form, "lambda")) {
+	inner = FreeVariables(Cadr(form), Cdr(Cdr(form)));
+    }
+    else if (IsForm(form, "define") && TYPEOF(Cadr(form)) == TYPE_CONS) {
+	inner = FreeVariables(Cdr(Cadr(form)), Cdr(Cdr(form)));
     }
     else {
-	CompileApply(state, code, mode);
+	if (IsForm(form, "define") || IsForm(form, "set!")) {
+	    // the target counts as a reference
+	    acc = ScanReferences(Cadr(form), bound, acc, nestedOnly);
+	    form = Cdr(form);
+	}
+	if (IsForm(form, "if") || IsForm(form, "begin") || IsCase(form)) {
+	    form = Cdr(form);
+	}
+	for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	    acc = ScanReferences(Car(form), bound, acc, nestedOnly);
+	}
+	return acc;
     }
-}
-
-void CompileBody(STATE *state, Handle code, COMPILER_MODE mode) {
-    while (code != nil) {
-	CompileForm(state, Car(code), mode);
-	Handle next = Cdr(code);
-	if (next != nil) {
-	    // drop return values of non-ultimate forms
-	    AppendBytecode(state, OP_DROP);
-	    StackEffect(state, -1);
+    for (; inner != nil; inner = Cdr(inner)) {
+	if (ListIndex(bound, Car(inner)) == -1) {
+	    acc = ListAdjoin(acc, Car(inner));
 	}
-	code = next;
     }
+    return acc;
 }
 
-/* (begin expr1 [expr2 ...]) */
-
-void CompileBegin(STATE *state, Handle code, COMPILER_MODE mode) {
-    CompileBody(state, Cdr(code), mode);
+// Every variable the lambda refers to or assigns that it doesn't bind
+// itself. Globals are included; the caller filters them out.
+Handle FreeVariables(Handle args, Handle body) {
+    Handle bound = nil;
+    for (Handle a = args; a != nil; a = Cdr(a)) {
+	bound = ListAdjoin(bound, Car(a));
+    }
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	bound = CollectDefines(Car(f), bound);
+    }
+    Handle free = nil;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	free = ScanReferences(Car(f), bound, free, 0);
+    }
+    return free;
 }
 
-/* function appllication */
+// set! targets anywhere in `form`, nested lambdas included, and if `loops`
+// is set, the variables of loops too
+Handle CollectAssignments(Handle form, Handle acc, int loops) {
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote")) return acc;
+    if (IsForm(form, "set!")) {
+	acc = ListAdjoin(acc, Cadr(form));
+    }
+    else if (loops && IsLoop(form)) {
+	// each time around, a loop assigns its variables
+	for (Handle v = Car(Cdr(Cdr(form))); v != nil; v = Cdr(v)) {
+	    acc = ListAdjoin(acc, Car(v));
+	}
+    }
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	acc = CollectAssignments(Car(form), acc, loops);
+    }
+    return acc;
+}
 
-void CompileArguments(STATE *state, Handle code, COMPILER_MODE mode) {
-    if (code == nil) return;
-    CompileArguments(state, Cdr(code), mode);
-    CompileForm(state, Car(code), mode);
+int IsDefineOf(Handle form, Handle var) {
+    return IsForm(form, "define") && DefinedName(form) == var;
 }
-void CompileApply(STATE *state, Handle code, COMPILER_MODE mode) {
-    Handle fn, arglist;
-    int len;
-    fn = Car(code);
-    arglist = Cdr(code);
-    len = ListLength(arglist);
-    CompileArguments(state, arglist, mode);
-    CompileForm(state, fn, mode);
-    AppendBytecodeWithArg(state, OP_APPLY, len);
-    StackEffect(state, -len);
-    //printf("%d %d\n", len, currentStack);
+
+int CountDefines(Handle, Handle);
+int Mentions(Handle, Handle);
+int CapturedAfterDefineBackwards(Handle, Handle, int*);
+
+// Walks `form` in the order it runs, with `*defined` saying whether `var`
+// has been defined yet. Returns 0 if a lambda in it might capture `var`
+// before it's defined.
+int CapturedAfterDefine(Handle form, Handle var, int *defined) {
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote")) return 1;
+    if (IsForm(form, "lambda") ||
+	(IsForm(form, "define") && TYPEOF(Cadr(form)) == TYPE_CONS)) {
+	if (!*defined && Mentions(form, var)) return 0;
+	if (IsDefineOf(form, var)) *defined = 1;
+	return 1;
+    }
+    if (IsForm(form, "define") || IsForm(form, "set!")) {
+	Handle value = Cdr(Cdr(form));
+	if (value != nil && !CapturedAfterDefine(Car(value), var, defined)) return 0;
+	if (IsDefineOf(form, var)) *defined = 1;
+	return 1;
+    }
+    if (IsForm(form, "if")) {
+	Handle branches = Cdr(Cdr(form));
+	if (!CapturedAfterDefine(Cadr(form), var, defined)) return 0;
+	// afterwards, it's defined only if every branch defined it
+	int after = Cdr(branches) == nil ? *defined : 1;
+	for (; branches != nil; branches = Cdr(branches)) {
+	    int branchDefined = *defined;
+	    if (!CapturedAfterDefine(Car(branches), var, &branchDefined)) return 0;
+	    after &= branchDefined;
+	}
+	*defined = after;
+	return 1;
+    }
+    if (IsCase(form)) {
+	// like an if, with a branch for each clause and the default
+	if (!CapturedAfterDefine(Cadr(form), var, defined)) return 0;
+	int after = 1;
+	for (Handle c = Cdr(Cdr(Cdr(form))); c != nil; c = Cdr(c)) {
+	    int clauseDefined = *defined;
+	    if (!CapturedAfterDefine(Car(c), var, &clauseDefined)) return 0;
+	    after &= clauseDefined;
+	}
+	*defined = after;
+	return 1;
+    }
+    if (IsForm(form, "begin") || IsLoop(form)) {
+	form = IsLoop(form) ? Cdr(Cdr(Cdr(form))) : Cdr(form);
+	for (; form != nil; form = Cdr(form)) {
+	    if (!CapturedAfterDefine(Car(form), var, defined)) return 0;
+	}
+	return 1;
+    }
+    // a call runs its arguments last first, then the procedure
+    return CapturedAfterDefineBackwards(form, var, defined);
 }
 
-/* 'foo or (quote foo) */
+int CapturedAfterDefineBackwards(Handle forms, Handle var, int *defined) {
+    if (forms == nil) return 1;
+    return CapturedAfterDefineBackwards(Cdr(forms), var, defined) &&
+	CapturedAfterDefine(Car(forms), var, defined);
+}
 
-void CompileQuote(STATE *state, Handle code, COMPILER_MODE mode) {
-    Handle quoted = Car(Cdr(code));
-    CompileLiteral(state, quoted, mode);
+// An internal define can be captured by value if it happens once, and
+// nothing can close over it before then. Self-recursive procedures don't
+// qualify because they capture themselves.
+int DefinedBeforeCapture(Handle body, Handle var) {
+    int count = 0;
+    for (Handle f = body; f != nil; f = Cdr(f)) count += CountDefines(Car(f), var);
+    if (count != 1) return 0;
+    int defined = 0;
+    for (; body != nil; body = Cdr(body)) {
+	if (!CapturedAfterDefine(Car(body), var, &defined)) return 0;
+    }
+    return 1;
 }
 
-/* (if condition consequent [alternate]) */
+int IsLexical(STATE *state, Handle var) {
+    return state != NULL && (SearchForLocal(state, var) != -1 ||
+			     SearchForClosure(state, var) != -1);
+}
 
-void CompileIfThen(STATE *state, Handle code, COMPILER_MODE mode) {
-    Handle condition, consequent;
+/* Known procedures */
 
-    // skip 'if
-    code = Cdr(code);
-    condition = Car(code);
-    consequent = Car(Cdr(code));
+// An internal define of a procedure that's only ever called, and only
+// after it's defined, is a known procedure. Calls to it can skip the check
+// that the callee is a function, and since nothing else can see it, its own
+// recursive calls don't need it to capture itself: they call the running
+// function. Small ones are copied into the places they're called from
+// instead, as are lambdas that are applied where they're written.
 
-    // compile condition
-    CompileForm(state, condition, mode);
+#define INLINE_LIMIT 16   // atoms in the biggest procedure body worth copying
 
-    // remember where we put the jump so we can fix it up later
-    int addrOfJump = CurrentBytecodePosition(state);
-    AppendBytecodeWithArg(state, OP_JUMP_FALSE, 0);
-    StackEffect(state, -1);
+int IsParameterList(Handle params) {
+    for (; params != nil; params = Cdr(params)) {
+	if (TYPEOF(params) != TYPE_CONS || TYPEOF(Car(params)) != TYPE_SYMBOL) {
+	    return 0;
+	}
+    }
+    return 1;
+}
 
-    // compile consequent
-    CompileForm(state, consequent, mode);
+// the parameters and body of a definition; returns 0 if `form` doesn't
+// define a procedure
+int DefinedLambda(Handle form, Handle *params, Handle *body) {
+    Handle target = Cadr(form);
+    if (TYPEOF(target) == TYPE_CONS) {
+	*params = Cdr(target);
+	*body = Cdr(Cdr(form));
+	return 1;
+    }
+    Handle value = Cdr(Cdr(form));
+    if (value == nil || !IsForm(Car(value), "lambda")) return 0;
+    *params = Cadr(Car(value));
+    *body = Cdr(Cdr(Car(value)));
+    return 1;
+}
 
-    // apply fixup to the jump we compiled earlier
-    int jumpDest = CurrentBytecodePosition(state);
-    ApplyFixup(state, addrOfJump, jumpDest);
+// how many times `form` defines `var`, as CollectDefines sees it
+int CountDefines(Handle form, Handle var) {
+    if (TYPEOF(form) != TYPE_CONS) return 0;
+    if (IsForm(form, "quote") || IsForm(form, "lambda")) return 0;
+    int count = 0;
+    if (IsForm(form, "define")) {
+	count += DefinedName(form) == var;
+	if (TYPEOF(Cadr(form)) == TYPE_CONS) return count;
+	form = Cdr(Cdr(form));
+    }
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	count += CountDefines(Car(form), var);
+    }
+    return count;
 }
 
-void CompileIfThenElse(STATE *state, Handle code, COMPILER_MODE mode) {
-    Handle condition, consequent, alternative;
+int Mentions(Handle form, Handle var) {
+    return ListIndex(ScanReferences(form, nil, nil, 0), var) != -1;
+}
 
-    // skip 'if
-    code = Cdr(code);
-    condition = Car(code); code = Cdr(code);
-    consequent = Car(code); code = Cdr(code);
-    alternative = Car(code);
+// every reference to `var` in `form` calls it with `argc` arguments, and
+// no nested procedure refers to it
+int OnlyCalled(Handle form, Handle var, int argc) {
+    if (form == var) return 0;
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote")) return 1;
+    if (IsForm(form, "lambda") ||
+	(IsForm(form, "define") && TYPEOF(Cadr(form)) == TYPE_CONS)) {
+	return !Mentions(form, var);
+    }
+    if (Car(form) == var) {
+	if (ListLength(Cdr(form)) != argc) return 0;
+	form = Cdr(form);
+    }
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	if (!OnlyCalled(Car(form), var, argc)) return 0;
+    }
+    return 1;
+}
 
-    // compile condition
-    CompileForm(state, condition, mode);
+// The form in `body` that defines `var` as a known procedure, or nil. This
+// allocates, so the caller has to keep the collector away.
+Handle KnownDefinition(Handle body, Handle var) {
+    // most definitions aren't procedures, so find that out first
+    Handle definition = nil;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	if (IsDefineOf(Car(f), var)) definition = Car(f);
+    }
+    Handle params, lambdaBody;
+    if (definition == nil || !DefinedLambda(definition, &params, &lambdaBody) ||
+	!IsParameterList(params) || ListIndex(params, var) != -1) {
+	return nil;
+    }
+    int count = 0;
+    for (Handle f = body; f != nil; f = Cdr(f)) count += CountDefines(Car(f), var);
+    if (count != 1) return nil;
+    int argc = ListLength(params);
+    Handle inner = nil;
+    for (Handle g = lambdaBody; g != nil; g = Cdr(g)) {
+	inner = CollectDefines(Car(g), inner);
+	if (!OnlyCalled(Car(g), var, argc)) return nil;
+    }
+    if (ListIndex(inner, var) != -1) return nil;
 
-    // remember the jump to the alternative
-    int jumpToAlternative = CurrentBytecodePosition(state);
-    AppendBytecodeWithArg(state, OP_JUMP_FALSE, 0);
-    StackEffect(state, -1);
+    int defined = 0;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	Handle form = Car(f);
+	if (form == definition) defined = 1;
+	else if (defined ? !OnlyCalled(form, var, argc) : Mentions(form, var)) return nil;
+    }
+    return definition;
+}
 
-    // compile consequent; remember jump to end
-    CompileForm(state, consequent, mode);
-    int jumpToEnd = CurrentBytecodePosition(state);
-    AppendBytecodeWithArg(state, OP_JUMP, 0);
+// the form defining `var` if it's a known procedure in this function
+Handle KnownProcedure(STATE *state, Handle var) {
+    Handle cell = AlistGet(state->known, var);
+    return cell == nil ? nil : Cdr(cell);
+}
 
-    // compile alternative
-    int altPos = CurrentBytecodePosition(state);
-    CompileForm(state, alternative, mode);
+int MentionsSymbol(Handle form, Handle var) {
+    if (form == var) return 1;
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote")) return 0;
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	if (MentionsSymbol(Car(form), var)) return 1;
+    }
+    return 0;
+}
 
-    // apply fixups
-    int endPos = CurrentBytecodePosition(state);
-    ApplyFixup(state, jumpToAlternative, altPos);
-    ApplyFixup(state, jumpToEnd, endPos);
+// atoms in `form`, or more than the limit if it has a form that would need
+// a scope of its own
+int InlineSize(Handle form) {
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote")) return 1;
+    if (IsForm(form, "lambda") || IsForm(form, "define") || IsForm(form, "set!")) {
+	return INLINE_LIMIT + 1;
+    }
+    int size = 0;
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	size += InlineSize(Car(form));
+    }
+    return size;
+}
 
-    // if you don't do this, then the stack effect will be one too high
-    // that's because it counts both the consequent and the alternative
-    StackEffect(state, -1);
+// small, and not recursive
+int IsInlinable(Handle var, Handle body) {
+    int size = 0;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	if (MentionsSymbol(Car(f), var)) return 0;
+	size += InlineSize(Car(f));
+    }
+    return body != nil && size <= INLINE_LIMIT;
 }
 
-void CompileIf(STATE *state, Handle code, COMPILER_MODE mode) {
-    int len = ListLength(code);
-    if (len < 3) {
-	panic("too few arguments to if");
+// whether `((lambda params body...) args...)` can be compiled in place
+int CanInlineLambda(STATE *state, Handle fn, int argc) {
+    if (!IsForm(fn, "lambda") || TYPEOF(Cdr(fn)) != TYPE_CONS) return 0;
+    Handle params = Cadr(fn), body = Cdr(Cdr(fn));
+    if (body == nil || !IsParameterList(params) || ListLength(params) != argc ||
+	state->nLocals + argc >= MAX_ARG) {
+	return 0;
     }
-    else if (len == 3) {
-	CompileIfThen(state, code, mode);
+    DisableGC();
+    Handle defines = nil, assigned = nil;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	defines = CollectDefines(Car(f), defines);
+	assigned = CollectAssignments(Car(f), assigned, 1);
     }
-    else {
-	CompileIfThenElse(state, code, mode);
+    EnableGC();
+    if (defines != nil) return 0;
+    for (Handle p = params; p != nil; p = Cdr(p)) {
+	if (ListIndex(assigned, Car(p)) != -1) return 0;
     }
+    return 1;
 }
 
-/* (lambda ([arg1 ...]) expr1 [expr2 ...]) */
+/* Renaming */
 
-void CompileFunction(STATE *state, Handle args, Handle body,
-		     COMPILER_MODE mode) {
-    STATE newState;
-    InitializeState(&newState);
-    newState.nLocals = newState.nArgs = ListLength(args);
-    newState.locals = args;
-    newState.prior = state;
-    
-    CompileBody(&newState, body, COMPILER_MODE_LAMBDA);
-    assert(newState.currentStack == 1);
-    AppendBytecode(&newState, OP_RETURN);
-    AppendBytecode(&newState, OP_END);
+// Renaming and expansion run with the collector on. The caller keeps their
+// arguments reachable, and they keep what they've built so far on the root
+// stack; what they give back isn't held by anything yet. A form that comes
+// out the same as it went in is given back as it is, not copied.
 
-    Handle fn = CreateFunction(&newState);
-    Retain(fn);
-    Unretain(newState.bytecode);
-    Unretain(newState.literals);
-    CompileLiteral(state, fn, mode);
-    if (mode == COMPILER_MODE_LAMBDA) {
-	AppendBytecode(state, OP_BIND_CLOSURE);
+Handle Rename(Handle, Handle);
+
+Handle RenameList(Handle list, Handle renames) {
+    if (TYPEOF(list) != TYPE_CONS) return list;
+    int mark = RootMark();
+    Handle first = PushRoot(Rename(Car(list), renames));
+    Handle rest = PushRoot(RenameList(Cdr(list), renames));
+    if (first != Car(list) || rest != Cdr(list)) list = CreateCons(first, rest);
+    PopRoots(mark);
+    return list;
+}
+
+// the renames that still apply inside a lambda with these parameters and
+// body; the lists are short, so they're built with the collector off
+Handle Unshadow(Handle renames, Handle params, Handle body) {
+    MakeRoom();
+    DisableGC();
+    Handle bound = nil;
+    for (; TYPEOF(params) == TYPE_CONS; params = Cdr(params)) {
+	bound = ListAdjoin(bound, Car(params));
     }
-    Unretain(fn);
+    if (params != nil) bound = ListAdjoin(bound, params);
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	bound = CollectDefines(Car(f), bound);
+    }
+    Handle kept = nil;
+    for (Handle r = renames; r != nil; r = Cdr(r)) {
+	if (ListIndex(bound, Car(Car(r))) == -1) kept = CreateCons(Car(r), kept);
+    }
+    EnableGC();
+    return kept;
 }
 
-void CompileLambda(STATE *state, Handle code, COMPILER_MODE mode) {
-    // TODO: deduplicate from Compile()
+// `form` with the variables in the alist `renames` replaced, except where
+// a nested lambda or internal define binds the same name
+Handle Rename(Handle form, Handle renames) {
+    if (renames == nil) return form;
+    if (TYPEOF(form) == TYPE_SYMBOL) {
+	Handle cell = AlistGet(renames, form);
+	return cell == nil ? form : Cdr(cell);
+    }
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote")) return form;
+    if (!IsForm(form, "lambda") &&
+	!(IsForm(form, "define") && TYPEOF(Cadr(form)) == TYPE_CONS)) {
+	return RenameList(form, renames);
+    }
+    Handle params = IsForm(form, "lambda") ? Cadr(form) : Cdr(Cadr(form));
+    Handle body = Cdr(Cdr(form));
+    int mark = RootMark();
+    Handle inner = PushRoot(Unshadow(renames, params, body));
+    Handle renamed = PushRoot(RenameList(body, inner));
+    Handle head = Cadr(form);
+    if (IsForm(form, "define") && Rename(Car(head), renames) != Car(head)) {
+	// the name belongs to the enclosing scope
+	head = PushRoot(CreateCons(Rename(Car(head), renames), Cdr(head)));
+    }
+    if (head != Cadr(form) || renamed != body) {
+	form = CreateCons(Car(form), PushRoot(CreateCons(head, renamed)));
+    }
+    PopRoots(mark);
+    return form;
+}
+
+/* Derived forms */
+
+// let, let*, letrec, letrec*, named let and do are rewritten into the core
+// forms before anything else looks at the code. Inside a lambda, the
+// variables they bind become locals of the lambda, with fresh names so they
+// can't be confused with anything else in it:
+//
+//   (let ((x 1)) (f x))  =>  (begin (define x' 1) (f x'))
+//
+// and the `begin` is spliced into the body it's in, so a let at the top of
+// a body costs nothing. A named let whose name is only called in tail
+// position from its own body becomes a loop form:
+//
+//   (let lp ((i 0)) body)  =>  (begin (define i' 0) (<loop> lp' (i') body'))
+//
+// which runs the body with a jump back to the top for each call to lp'.
+// Any other named let becomes an internal procedure. A do is a named let
+// with a name nothing else can call. At top level, where there are no
+// locals, these forms are wrapped in a lambda that's called at once.
+//
+// cond becomes nested ifs. case becomes a case form, with the keys of each
+// clause quoted so that nothing takes them for variables, and the default
+// last:
+//
+//   (case k ((1 2) a) ((x) b) (else c))  =>  (<case> k '((1 2) (x)) a b c)
+//
+// The expander keeps to the rules for renaming above.
+
+Handle loopKeyword;    // uninterned, so no program can write a loop form
+
+int IsLoop(Handle form) {
+    return loopKeyword != nil && TYPEOF(form) == TYPE_CONS && Car(form) == loopKeyword;
+}
+
+Handle caseKeyword;    // uninterned, like loopKeyword
+
+int IsCase(Handle form) {
+    return caseKeyword != nil && TYPEOF(form) == TYPE_CONS && Car(form) == caseKeyword;
+}
+
+Handle declareKeyword; // uninterned, like loopKeyword
+
+// A declaration expands to '(<declare> . safety), which every analysis
+// takes for a constant. Compiling it changes the safety of what's compiled
+// after it.
+int IsDeclaration(Handle form) {
+    return declareKeyword != nil && IsForm(form, "quote") &&
+	TYPEOF(Cadr(form)) == TYPE_CONS && Car(Cadr(form)) == declareKeyword;
+}
+
+int DeclaredSafety(Handle form) {
+    return UnboxInteger(Cdr(Cadr(form)));
+}
+
+Handle MakeList2(Handle a, Handle b) {
+    int mark = RootMark();
+    Handle list = CreateCons(a, PushRoot(CreateCons(b, nil)));
+    PopRoots(mark);
+    return list;
+}
+
+Handle MakeList3(Handle a, Handle b, Handle c) {
+    int mark = RootMark();
+    Handle list = CreateCons(a, PushRoot(MakeList2(b, c)));
+    PopRoots(mark);
+    return list;
+}
+
+// a copy of `list` with `tail` on the end
+Handle Splice(Handle list, Handle tail) {
+    if (list == nil) return tail;
+    int mark = RootMark();
+    Handle spliced = CreateCons(Car(list), PushRoot(Splice(Cdr(list), tail)));
+    PopRoots(mark);
+    return spliced;
+}
+
+Handle ExpandList(Handle list, int inLambda) {
+    if (TYPEOF(list) != TYPE_CONS) return list;
+    int mark = RootMark();
+    Handle first = PushRoot(Expand(Car(list), inLambda));
+    Handle rest = PushRoot(ExpandList(Cdr(list), inLambda));
+    if (first != Car(list) || rest != Cdr(list)) list = CreateCons(first, rest);
+    PopRoots(mark);
+    return list;
+}
+
+// the forms of a body, expanded, with each `begin` spliced in
+Handle ExpandBody(Handle body) {
+    if (TYPEOF(body) != TYPE_CONS) return body;
+    int mark = RootMark();
+    Handle rest = PushRoot(ExpandBody(Cdr(body)));
+    Handle form = PushRoot(Expand(Car(body), 1));
+    if (IsForm(form, "begin") && Cdr(form) != nil) body = Splice(Cdr(form), rest);
+    else if (form != Car(body) || rest != Cdr(body)) body = CreateCons(form, rest);
+    PopRoots(mark);
+    return body;
+}
+
+// an uninterned symbol named like `var`; the name is copied out first,
+// since making the symbol can move `var`
+Handle FreshSymbol(Handle var) {
+    const char *name = NameOfSymbol(var);
+    char *copy = malloc(strlen(name) + 1);
+    if (copy == NULL) panic("out of memory in the expander");
+    strcpy(copy, name);
+    Handle fresh = CreateUninternedSymbol(copy);
+    free(copy);
+    return fresh;
+}
+
+// `renames` with (var . fresh) in front of it
+Handle AddRename(Handle var, Handle renames) {
+    int mark = RootMark();
+    Handle fresh = PushRoot(FreshSymbol(var));
+    renames = CreateCons(PushRoot(CreateCons(var, fresh)), renames);
+    PopRoots(mark);
+    return renames;
+}
+
+// an alist giving each of `vars` a fresh name, in front of `renames`
+Handle FreshNames(Handle vars, Handle renames) {
+    int mark = RootMark();
+    for (; vars != nil; vars = Cdr(vars)) {
+	renames = PushRoot(AddRename(Car(vars), renames));
+    }
+    PopRoots(mark);
+    return renames;
+}
+
+Handle BindingVariables(Handle bindings) {
+    if (bindings == nil) return nil;
+    Handle binding = Car(bindings);
+    if (TYPEOF(bindings) != TYPE_CONS || TYPEOF(binding) != TYPE_CONS ||
+	TYPEOF(Car(binding)) != TYPE_SYMBOL || TYPEOF(Cdr(binding)) != TYPE_CONS) {
+	panic("bad binding list");
+    }
+    int mark = RootMark();
+    Handle vars = CreateCons(Car(binding), PushRoot(BindingVariables(Cdr(bindings))));
+    PopRoots(mark);
+    return vars;
+}
+
+Handle BindingValues(Handle bindings) {
+    if (bindings == nil) return nil;
+    int mark = RootMark();
+    Handle value = PushRoot(Expand(Cadr(Car(bindings)), 1));
+    Handle values = CreateCons(value, PushRoot(BindingValues(Cdr(bindings))));
+    PopRoots(mark);
+    return values;
+}
+
+// (define var' value) for each variable, followed by `rest`
+Handle Definitions(Handle vars, Handle values, Handle renames, Handle rest) {
+    if (vars == nil) return rest;
+    int mark = RootMark();
+    Handle define = PushRoot(MakeList3(CreateSymbol("define"),
+				       Cdr(AlistGet(renames, Car(vars))), Car(values)));
+    Handle definitions = CreateCons(define, PushRoot(Definitions(Cdr(vars), Cdr(values),
+								  renames, rest)));
+    PopRoots(mark);
+    return definitions;
+}
+
+Handle ExpandedBody(Handle body, Handle renames) {
+    if (body == nil) panic("no body in binding form");
+    int mark = RootMark();
+    body = PushRoot(ExpandBody(body));
+    // the list of names is short, so it's built with the collector off
+    MakeRoom();
+    DisableGC();
+    Handle defines = nil;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	defines = CollectDefines(Car(f), defines);
+    }
+    EnableGC();
+    PushRoot(defines);
+    body = RenameList(body, PushRoot(FreshNames(defines, renames)));
+    PopRoots(mark);
+    return body;
+}
+// every reference to `name` in `form` calls it with `argc` arguments in
+// tail position; `tail` says whether `form` itself is in tail position
+int OnlyTailCalls(Handle form, Handle name, int argc, int tail) {
+    if (form == name) return 0;
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote")) return 1;
+    if (IsForm(form, "lambda") ||
+	(IsForm(form, "define") && TYPEOF(Cadr(form)) == TYPE_CONS)) {
+	return !MentionsSymbol(form, name);
+    }
+    if (IsCase(form)) {
+	if (!OnlyTailCalls(Cadr(form), name, argc, 0)) return 0;
+	for (form = Cdr(Cdr(Cdr(form))); form != nil; form = Cdr(form)) {
+	    if (!OnlyTailCalls(Car(form), name, argc, tail)) return 0;
+	}
+	return 1;
+    }
+    if (IsForm(form, "begin") || IsLoop(form)) {
+	form = IsLoop(form) ? Cdr(Cdr(Cdr(form))) : Cdr(form);
+	for (; form != nil; form = Cdr(form)) {
+	    if (!OnlyTailCalls(Car(form), name, argc, tail && Cdr(form) == nil)) {
+		return 0;
+	    }
+	}
+	return 1;
+    }
+    if (IsForm(form, "if")) {
+	if (!OnlyTailCalls(Cadr(form), name, argc, 0)) return 0;
+	form = Cdr(Cdr(form));
+    }
+    else if (Car(form) == name) {
+	if (!tail || ListLength(Cdr(form)) != argc) return 0;
+	form = Cdr(form);
+	tail = 0;
+    }
+    else {
+	tail = 0;
+    }
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	if (!OnlyTailCalls(Car(form), name, argc, tail)) return 0;
+    }
+    return 1;
+}
+
+// (let [name] ((var value) ...) body...)
+Handle ExpandLet(Handle form) {
+    Handle rest = Cdr(form);
+    Handle name = nil;
+    if (Car(rest) != nil && TYPEOF(Car(rest)) == TYPE_SYMBOL) {
+	name = Car(rest);
+	rest = Cdr(rest);
+    }
+    int mark = RootMark();
+    Handle vars = PushRoot(BindingVariables(Car(rest)));
+    Handle values = PushRoot(BindingValues(Car(rest)));
+    Handle renames = PushRoot(FreshNames(vars, nil));
+    Handle expanded;
+    if (name == nil) {
+	Handle body = PushRoot(ExpandedBody(Cdr(rest), renames));
+	expanded = CreateCons(CreateSymbol("begin"),
+			      PushRoot(Definitions(vars, values, renames, body)));
+	PopRoots(mark);
+	return expanded;
+    }
+
+    renames = PushRoot(AddRename(name, renames));
+    Handle self = Cdr(AlistGet(renames, name));
+    Handle body = PushRoot(ExpandedBody(Cdr(rest), renames));
+    Handle params = PushRoot(RenameList(vars, renames));
+    int loops = 1;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	loops = loops && OnlyTailCalls(Car(f), self, ListLength(vars), Cdr(f) == nil);
+    }
+    if (loops) {
+	if (loopKeyword == nil) {
+	    loopKeyword = CreateUninternedSymbol("loop");
+	    Retain(loopKeyword);
+	}
+	Handle loop = PushRoot(CreateCons(params, body));
+	loop = PushRoot(CreateCons(self, loop));
+	loop = PushRoot(CreateCons(loopKeyword, loop));
+	expanded = CreateCons(CreateSymbol("begin"),
+			      PushRoot(Definitions(vars, values, renames,
+						   PushRoot(CreateCons(loop, nil)))));
+    }
+    else {
+	Handle lambda = PushRoot(CreateCons(CreateSymbol("lambda"),
+					    PushRoot(CreateCons(params, body))));
+	expanded = MakeList3(CreateSymbol("begin"),
+			     PushRoot(MakeList3(CreateSymbol("define"), self, lambda)),
+			     PushRoot(CreateCons(self, values)));
+    }
+    PopRoots(mark);
+    return expanded;
+}
+
+// (let* ((var value) ...) body...) is a let for each binding, nested, and
+// expands to what those would: a definition for each variable in turn,
+// then the body. Each variable gets its fresh name as it's reached, so
+// every value and the body are renamed once, not once for each binding
+// around them.
+Handle ExpandLetStar(Handle form) {
+    Handle bindings = Cadr(form);
+    int mark = RootMark();
+    Handle vars = PushRoot(BindingVariables(bindings));
+    Handle renames = nil, definitions = nil;
+    for (Handle b = bindings; b != nil; b = Cdr(b), vars = Cdr(vars)) {
+	Handle value = PushRoot(Expand(Cadr(Car(b)), 1));
+	value = PushRoot(Rename(value, renames));
+	renames = PushRoot(AddRename(Car(vars), renames));
+	Handle define = PushRoot(MakeList3(CreateSymbol("define"),
+					   Cdr(Car(renames)), value));
+	definitions = PushRoot(CreateCons(define, definitions));
+    }
+    Handle body = PushRoot(ExpandedBody(Cdr(Cdr(form)), renames));
+    for (; definitions != nil; definitions = Cdr(definitions)) {
+	body = PushRoot(CreateCons(Car(definitions), body));
+    }
+    Handle expanded = CreateCons(CreateSymbol("begin"), body);
+    PopRoots(mark);
+    return expanded;
+}
+
+// (letrec ((var value) ...) body...), and letrec*, which is the same here:
+// the values are worked out in order, where they can see every variable
+Handle ExpandLetrec(Handle form) {
+    Handle bindings = Cadr(form);
+    int mark = RootMark();
+    Handle vars = PushRoot(BindingVariables(bindings));
+    Handle renames = PushRoot(FreshNames(vars, nil));
+    Handle values = PushRoot(RenameList(PushRoot(BindingValues(bindings)), renames));
+    Handle body = PushRoot(ExpandedBody(Cdr(Cdr(form)), renames));
+    Handle expanded = CreateCons(CreateSymbol("begin"),
+				 PushRoot(Definitions(vars, values, renames, body)));
+    PopRoots(mark);
+    return expanded;
+}
+
+Handle DoBindings(Handle specs) {
+    if (specs == nil) return nil;
+    Handle spec = Car(specs);
+    if (TYPEOF(spec) != TYPE_CONS || TYPEOF(Cdr(spec)) != TYPE_CONS) {
+	panic("bad variable in do");
+    }
+    int mark = RootMark();
+    Handle binding = PushRoot(MakeList2(Car(spec), Cadr(spec)));
+    Handle bindings = CreateCons(binding, PushRoot(DoBindings(Cdr(specs))));
+    PopRoots(mark);
+    return bindings;
+}
+
+Handle DoSteps(Handle specs) {
+    if (specs == nil) return nil;
+    Handle spec = Car(specs);
+    Handle step = Cdr(Cdr(spec)) != nil ? Car(Cdr(Cdr(spec))) : Car(spec);
+    int mark = RootMark();
+    Handle steps = CreateCons(step, PushRoot(DoSteps(Cdr(specs))));
+    PopRoots(mark);
+    return steps;
+}
+
+// (do ((var init [step]) ...) (test expr...) command...)  =>
+// (let loop ((var init) ...)
+//   (if test (begin expr...) (begin command... (loop step...))))
+Handle ExpandDo(Handle form) {
+    if (ListLength(form) < 3 || TYPEOF(Car(Cdr(Cdr(form)))) != TYPE_CONS) {
+	panic("bad do");
+    }
+    Handle specs = Cadr(form), exit = Car(Cdr(Cdr(form)));
+    Handle commands = Cdr(Cdr(Cdr(form)));
+    int mark = RootMark();
+    Handle loop = PushRoot(CreateUninternedSymbol("do"));
+    Handle next = PushRoot(CreateCons(loop, PushRoot(DoSteps(specs))));
+    if (commands != nil) {
+	next = PushRoot(Splice(commands, PushRoot(CreateCons(next, nil))));
+	next = PushRoot(CreateCons(CreateSymbol("begin"), next));
+    }
+    Handle result = PushRoot(Cdr(exit) != nil ? CreateCons(CreateSymbol("begin"), Cdr(exit))
+			     : MakeList2(CreateSymbol("quote"), nil));
+    Handle body = PushRoot(CreateCons(CreateSymbol("if"),
+				      PushRoot(MakeList3(Car(exit), result, next))));
+    Handle let = PushRoot(MakeList3(loop, PushRoot(DoBindings(specs)), body));
+    let = PushRoot(CreateCons(CreateSymbol("let"), let));
+    Handle expanded = ExpandLet(let);
+    PopRoots(mark);
+    return expanded;
+}
+
+// (cond (test expr...) ... [(else expr...)])  =>
+// (if test (begin expr...) (cond ...))
+// A clause that's only a test gives the test's value, and (test => f)
+// calls f on it; for those, the value is bound with a let.
+Handle ExpandCond(Handle form) {
+    Handle clauses = Cdr(form);
+    if (clauses == nil) return MakeList2(CreateSymbol("quote"), nil);
+    Handle clause = Car(clauses);
+    if (TYPEOF(clause) != TYPE_CONS) panic("bad cond clause");
+    Handle test = Car(clause), body = Cdr(clause);
+    if (test == CreateSymbol("else")) {
+	if (Cdr(clauses) != nil) panic("else must be the last cond clause");
+	return CreateCons(CreateSymbol("begin"), body);
+    }
+    int mark = RootMark();
+    Handle otherwise = nil;
+    if (Cdr(clauses) != nil) {
+	Handle rest = PushRoot(CreateCons(Car(form), Cdr(clauses)));
+	otherwise = PushRoot(CreateCons(rest, nil));
+    }
+    Handle expanded;
+    if (body != nil && Car(body) != CreateSymbol("=>")) {
+	Handle then = PushRoot(CreateCons(CreateSymbol("begin"), body));
+	expanded = CreateCons(CreateSymbol("if"),
+			      PushRoot(CreateCons(test, PushRoot(CreateCons(then, otherwise)))));
+	PopRoots(mark);
+	return expanded;
+    }
+    Handle value = PushRoot(CreateUninternedSymbol("cond"));
+    Handle then = value;
+    if (body != nil) {
+	if (ListLength(body) != 2) panic("bad cond clause");
+	then = PushRoot(MakeList2(Cadr(body), value));
+    }
+    Handle choice = PushRoot(CreateCons(then, otherwise));
+    choice = PushRoot(CreateCons(CreateSymbol("if"), PushRoot(CreateCons(value, choice))));
+    Handle binding = PushRoot(CreateCons(PushRoot(MakeList2(value, test)), nil));
+    expanded = MakeList3(CreateSymbol("let"), binding, choice);
+    PopRoots(mark);
+    return expanded;
+}
+
+// (declare (optimize (safety N)) ...), where N is 0, 1 or 2. Other
+// declarations and qualities are ignored, and so is a declaration without
+// a safety, which is just ().
+Handle ExpandDeclare(Handle form) {
+    int safety = -1;
+    for (Handle d = Cdr(form); TYPEOF(d) == TYPE_CONS; d = Cdr(d)) {
+	if (!IsForm(Car(d), "optimize")) continue;
+	for (Handle q = Cdr(Car(d)); TYPEOF(q) == TYPE_CONS; q = Cdr(q)) {
+	    if (!IsForm(Car(q), "safety")) continue;
+	    Handle level = Cdr(Car(q));
+	    if (TYPEOF(level) != TYPE_CONS || TYPEOF(Car(level)) != TYPE_INT ||
+		UnboxInteger(Car(level)) < 0 || UnboxInteger(Car(level)) > 2) {
+		panic("safety must be 0, 1 or 2");
+	    }
+	    safety = UnboxInteger(Car(level));
+	}
+    }
+    if (declareKeyword == nil) {
+	declareKeyword = CreateUninternedSymbol("declare");
+	Retain(declareKeyword);
+    }
+    int mark = RootMark();
+    Handle quoted = nil;
+    if (safety != -1) {
+	quoted = PushRoot(CreateCons(declareKeyword, PushRoot(CreateInteger(safety))));
+    }
+    Handle expanded = MakeList2(CreateSymbol("quote"), quoted);
+    PopRoots(mark);
+    return expanded;
+}
+
+// (case key ((datum ...) expr...) ... [(else expr...)])
+Handle ExpandCase(Handle form, int inLambda) {
+    if (TYPEOF(Cdr(form)) != TYPE_CONS) panic("bad case");
+    int mark = RootMark();
+    Handle datums = nil, bodies = nil;
+    Handle otherwise = PushRoot(MakeList2(CreateSymbol("quote"), nil));
+    for (Handle c = Cdr(Cdr(form)); c != nil; c = Cdr(c)) {
+	Handle clause = Car(c);
+	if (TYPEOF(c) != TYPE_CONS || TYPEOF(clause) != TYPE_CONS || Cdr(clause) == nil) {
+	    panic("bad case clause");
+	}
+	Handle body = PushRoot(CreateCons(CreateSymbol("begin"), Cdr(clause)));
+	body = PushRoot(Expand(body, inLambda));
+	if (Car(clause) == CreateSymbol("else")) {
+	    if (Cdr(c) != nil) panic("else must be the last case clause");
+	    otherwise = body;
+	    continue;
+	}
+	for (Handle k = Car(clause); k != nil; k = Cdr(k)) {
+	    if (TYPEOF(k) != TYPE_CONS) panic("bad case clause");
+	    OBJTYPE type = TYPEOF(Car(k));
+	    if (type != TYPE_INT && type != TYPE_SYMBOL && type != TYPE_NIL) {
+		panic("case keys must be integers, symbols or ()");
+	    }
+	}
+	datums = PushRoot(CreateCons(Car(clause), datums));
+	bodies = PushRoot(CreateCons(body, bodies));
+    }
+    if (caseKeyword == nil) {
+	caseKeyword = CreateUninternedSymbol("case");
+	Retain(caseKeyword);
+    }
+    Handle tail = PushRoot(CreateCons(otherwise, nil));
+    for (; bodies != nil; bodies = Cdr(bodies)) tail = PushRoot(CreateCons(Car(bodies), tail));
+    Handle keys = nil;
+    for (; datums != nil; datums = Cdr(datums)) keys = PushRoot(CreateCons(Car(datums), keys));
+    keys = PushRoot(MakeList2(CreateSymbol("quote"), keys));
+    Handle key = PushRoot(Expand(Cadr(form), inLambda));
+    Handle expanded = CreateCons(caseKeyword,
+				 PushRoot(CreateCons(key, PushRoot(CreateCons(keys, tail)))));
+    PopRoots(mark);
+    return expanded;
+}
+
+Handle Expand(Handle form, int inLambda) {
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote")) return form;
+    if (IsForm(form, "lambda") ||
+	(IsForm(form, "define") && TYPEOF(Cadr(form)) == TYPE_CONS)) {
+	int mark = RootMark();
+	Handle body = PushRoot(ExpandBody(Cdr(Cdr(form))));
+	if (body != Cdr(Cdr(form))) {
+	    form = CreateCons(Car(form), PushRoot(CreateCons(Cadr(form), body)));
+	}
+	PopRoots(mark);
+	return form;
+    }
+    int binds = IsForm(form, "let") || IsForm(form, "let*") || IsForm(form, "letrec") ||
+	IsForm(form, "letrec*") || IsForm(form, "do");
+    if (binds && TYPEOF(Cdr(form)) != TYPE_CONS) panic("bad binding form");
+    if (binds && !inLambda) {
+	int mark = RootMark();
+	Handle thunk = PushRoot(MakeList2(nil, form));
+	thunk = PushRoot(CreateCons(CreateSymbol("lambda"), thunk));
+	Handle call = CreateCons(PushRoot(Expand(thunk, 1)), nil);
+	PopRoots(mark);
+	return call;
+    }
+    if (IsForm(form, "let")) return ExpandLet(form);
+    if (IsForm(form, "let*")) return ExpandLetStar(form);
+    if (IsForm(form, "letrec") || IsForm(form, "letrec*")) return ExpandLetrec(form);
+    if (IsForm(form, "do")) return ExpandDo(form);
+    if (IsForm(form, "cond")) {
+	int mark = RootMark();
+	Handle expanded = Expand(PushRoot(ExpandCond(form)), inLambda);
+	PopRoots(mark);
+	return expanded;
+    }
+    if (IsForm(form, "case")) return ExpandCase(form, inLambda);
+    if (IsForm(form, "declare")) return ExpandDeclare(form);
+    return ExpandList(form, inLambda);
+}
+
+// the variables of enclosing functions that the function `state` is the
+// scope of captures, in closure slot order
+Handle ClosureVariables(STATE *state, Handle args, Handle body) {
+    // a known procedure calls itself without capturing itself
+    Handle closure = nil;
+    for (Handle v = FreeVariables(args, body); v != nil; v = Cdr(v)) {
+	if (Car(v) != state->self && IsLexical(state->prior, Car(v))) {
+	    closure = ListAdjoin(closure, Car(v));
+	}
+    }
+    return closure;
+}
+
+void AnalyzeScope(STATE *state, Handle args, Handle body) {
+    // the lists built here are rooted once they're complete
+    DisableGC();
+
+    Handle defines = nil;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	defines = CollectDefines(Car(f), defines);
+    }
+    Handle locals = nil;
+    for (Handle a = args; a != nil; a = Cdr(a)) {
+	locals = ListAdjoin(locals, Car(a));
+    }
+    for (Handle d = defines; d != nil; d = Cdr(d)) {
+	locals = ListAdjoin(locals, Car(d));
+    }
+
+    Handle closure = ClosureVariables(state, args, body);
+
+    Handle captured = nil, assigned = nil, set = nil;
+    for (Handle f = body; f != nil; f = Cdr(f)) {
+	captured = ScanReferences(Car(f), nil, captured, 1);
+	assigned = CollectAssignments(Car(f), assigned, 1);
+	set = CollectAssignments(Car(f), set, 0);
+    }
+    Handle known = nil;
+    for (Handle d = defines; d != nil; d = Cdr(d)) {
+	Handle var = Car(d);
+	if (ListIndex(args, var) != -1 || ListIndex(assigned, var) != -1) continue;
+	Handle form = KnownDefinition(body, var);
+	if (form != nil) known = CreateCons(CreateCons(var, form), known);
+    }
+    Handle boxed = nil, early = nil;
+    for (Handle l = locals; l != nil; l = Cdr(l)) {
+	Handle var = Car(l);
+	if (ListIndex(captured, var) == -1 || AlistGet(known, var) != nil) continue;
+	int isArg = ListIndex(args, var) != -1;
+	int isDefined = ListIndex(defines, var) != -1;
+	int isEarly = isDefined && (isArg || !DefinedBeforeCapture(body, var));
+	if (ListIndex(assigned, var) != -1 || isEarly) {
+	    boxed = ListAdjoin(boxed, var);
+	}
+	if (isEarly) early = ListAdjoin(early, var);
+    }
+    for (Handle c = closure; c != nil; c = Cdr(c)) {
+	if (IsBoxed(state->prior, Car(c))) {
+	    boxed = ListAdjoin(boxed, Car(c));
+	}
+    }
+
+    EnableGC();
+
+    state->closure = closure;
+    state->boxed = boxed;
+    state->known = known;
+    state->early = early;
+    state->assigned = set;
+    state->nArgs = ListLength(args);
+    if (closure != nil) Retain(closure);
+    if (boxed != nil) Retain(boxed);
+    if (known != nil) Retain(known);
+    if (early != nil) Retain(early);
+    if (set != nil) Retain(set);
+
+    // the lists above keep the variables in the maps alive
+    if (locals != nil) Retain(locals);
+    for (Handle l = locals; l != nil; l = Cdr(l)) AddLocal(state, Car(l));
+    if (locals != nil) Unretain(locals);
+    int idx = 0;
+    for (Handle c = closure; c != nil; c = Cdr(c)) {
+	MapPut(&state->closureSlots, Car(c), idx++);
+    }
+    for (Handle b = boxed; b != nil; b = Cdr(b)) MapPut(&state->boxing, Car(b), BOXED);
+    for (Handle e = early; e != nil; e = Cdr(e)) {
+	MapPut(&state->boxing, Car(e), BOXED | EARLY);
+    }
+}
+
+void ReleaseScope(STATE *state) {
+    PoolFree(&state->locals);
+    MapFree(&state->localSlots);
+    if (state->closure != nil) Unretain(state->closure);
+    MapFree(&state->closureSlots);
+    if (state->boxed != nil) Unretain(state->boxed);
+    if (state->known != nil) Unretain(state->known);
+    if (state->early != nil) Unretain(state->early);
+    MapFree(&state->boxing);
+    if (state->assigned != nil) Unretain(state->assigned);
+    free(state->types);
+    state->types = NULL;
+    state->typesLength = 0;
+}
+
+/* Type inference */
+
+// While a procedure is compiled, the compiler keeps what it knows about the
+// types its locals hold at the code being generated, as a set of TYPE_BIT()s
+// for each slot. A definition sets a local's types to its value's; a test
+// like (pair? x), (null? x) or (eq? (type-of x) 'integer) narrows them on
+// each side of an `if`; and a call to a standard primitive that returns
+// means its arguments passed its checks. Branches join by union, and a
+// loop's variables start as the union of what enters the loop and what
+// every jump back to its top passes in. Locals that set! changes or that
+// live in boxes aren't tracked.
+//
+// A call to a standard primitive whose arguments are proven to be types it
+// accepts compiles to OP_UNCHECKED, which skips the argument vector and the
+// checks that can't fail. The proofs rely on the primitives doing what the
+// standard ones do, so once any primitive's global is replaced, OP_UNCHECKED
+// makes an ordinary call instead.
+//
+// After (declare (optimize (safety 0))), such a call compiles to OP_UNCHECKED
+// whether its arguments are proven or not, and a wrong argument can crash.
+// A declaration lasts for the rest of the procedure it's in, including the
+// procedures inside it. One that's a top-level form by itself lasts until
+// the end of the file, or in the REPL until the next one.
+
+int compilerSafety = 1;
+
+typedef struct facts {
+    int *types;
+    int length;
+} FACTS;
+
+// the slot `var` is tracked in, or -1
+int TrackedSlot(STATE *state, Handle var) {
+    if (TYPEOF(var) != TYPE_SYMBOL || IsBoxed(state, var) ||
+	ListIndex(state->assigned, var) != -1) {
+	return -1;
+    }
+    return SearchForLocal(state, var);
+}
+
+int TypesOf(STATE *state, Handle var) {
+    int idx = TrackedSlot(state, var);
+    return idx != -1 && idx < state->typesLength ? state->types[idx] : TYPES_ANY;
+}
+
+void SetTypes(STATE *state, Handle var, int types) {
+    int idx = TrackedSlot(state, var);
+    if (idx == -1) return;
+    if (idx >= state->typesLength) {
+	int length = state->nLocals > idx ? state->nLocals : idx + 1;
+	state->types = realloc(state->types, length * sizeof(int));
+	if (state->types == NULL) panic("out of memory for the compiler");
+	for (int i = state->typesLength; i < length; i++) state->types[i] = TYPES_ANY;
+	state->typesLength = length;
+    }
+    state->types[idx] = types;
+}
+
+void Narrow(STATE *state, Handle var, int types) {
+    SetTypes(state, var, TypesOf(state, var) & types);
+}
+
+FACTS CopyFacts(FACTS from) {
+    FACTS f;
+    f.length = from.length;
+    f.types = malloc((f.length + 1) * sizeof(int));
+    if (f.types == NULL) panic("out of memory for the compiler");
+    memcpy(f.types, from.types, f.length * sizeof(int));
+    return f;
+}
+
+FACTS SaveFacts(STATE *state) {
+    FACTS now = {state->types, state->typesLength};
+    return CopyFacts(now);
+}
+
+// trade what's known now for `f`
+void SwapFacts(STATE *state, FACTS *f) {
+    FACTS now = {state->types, state->typesLength};
+    state->types = f->types;
+    state->typesLength = f->length;
+    *f = now;
+}
+
+// know only what's true both now and in `f`, which is used up
+void JoinFacts(STATE *state, FACTS *f) {
+    if (f->length < state->typesLength) state->typesLength = f->length;
+    for (int i = 0; i < state->typesLength; i++) state->types[i] |= f->types[i];
+    free(f->types);
+}
+
+int IsPrimitiveGlobal(STATE *state, Handle fn) {
+    if (TYPEOF(fn) != TYPE_SYMBOL || IsLexical(state, fn)) return 0;
+    Handle cell = AlistGet(globals, fn);
+    return cell != nil && TYPEOF(Cdr(cell)) == TYPE_PRIMITIVE;
+}
+
+// the unchecked primitive for a call to `fn` with `argc` arguments, or -1
+int StandardPrimitive(STATE *state, Handle fn, int argc) {
+    if (primitivesReplaced || !IsPrimitiveGlobal(state, fn)) return -1;
+    int prim = UncheckedPrimitiveNamed(NameOfSymbol(fn));
+    return prim != -1 && uncheckedPrimitives[prim].arity == argc ? prim : -1;
+}
+
+// the types of the value of `form`, which has just been compiled
+int InferType(STATE *state, Handle form) {
+    if (TYPEOF(form) == TYPE_SYMBOL) return TypesOf(state, form);
+    if (TYPEOF(form) != TYPE_CONS) return TYPE_BIT(TYPEOF(form));
+    Handle head = Car(form);
+    if (IsDeclaration(form)) return TYPE_BIT(TYPE_NIL);
+    if (head == CreateSymbol("quote")) return TYPE_BIT(TYPEOF(Cadr(form)));
+    if (head == CreateSymbol("lambda")) return TYPE_BIT(TYPE_FUNCTION);
+    if (head == CreateSymbol("define")) return TYPE_BIT(TYPE_SYMBOL);
+    if (head == CreateSymbol("begin") && Cdr(form) != nil) {
+	Handle last = Cdr(form);
+	while (Cdr(last) != nil) last = Cdr(last);
+	return InferType(state, Car(last));
+    }
+    if (head == CreateSymbol("if") && ListLength(form) >= 3) {
+	Handle alternative = Cdr(Cdr(Cdr(form)));
+	// without an alternative, a false condition is the value
+	return InferType(state, Car(Cdr(Cdr(form)))) |
+	    (alternative != nil ? InferType(state, Car(alternative)) : TYPE_BIT(TYPE_NIL));
+    }
+    if (IsCase(form)) {
+	int types = 0;
+	for (Handle c = Cdr(Cdr(Cdr(form))); c != nil; c = Cdr(c)) {
+	    types |= InferType(state, Car(c));
+	}
+	return types;
+    }
+    int prim = StandardPrimitive(state, head, ListLength(Cdr(form)));
+    return prim != -1 ? uncheckedPrimitives[prim].returns : TYPES_ANY;
+}
+
+// the names type-of gives each type
+// narrow what's known, given that (eq? x y) came out `truth`
+void RefineEq(STATE *state, Handle x, Handle y, int truth) {
+    if (!IsForm(y, "quote")) return;
+    Handle datum = Cadr(y);
+    if (TYPEOF(x) == TYPE_SYMBOL) {
+	if (truth) Narrow(state, x, TYPE_BIT(TYPEOF(datum)));
+	// only one thing is nil
+	else if (datum == nil) Narrow(state, x, ~TYPE_BIT(TYPE_NIL));
+    }
+    else if (IsForm(x, "type-of") && ListLength(x) == 2 &&
+	     IsPrimitiveGlobal(state, Car(x)) && TYPEOF(datum) == TYPE_SYMBOL) {
+	for (int t = 0; t < TYPE_COUNT; t++) {
+	    if (strcmp(typeInfo[t].typeOf, NameOfSymbol(datum)) != 0) {
+		continue;
+	    }
+	    Narrow(state, Cadr(x), truth ? TYPE_BIT(t) : ~TYPE_BIT(t));
+	}
+    }
+}
+
+// narrow what's known, given that `test`, which has just been compiled,
+// came out `truth`
+void Refine(STATE *state, Handle test, int truth) {
+    if (TYPEOF(test) == TYPE_SYMBOL) {
+	Narrow(state, test, truth ? ~TYPE_BIT(TYPE_NIL) : TYPE_BIT(TYPE_NIL));
+	return;
+    }
+    if (TYPEOF(test) != TYPE_CONS) return;
+    int argc = ListLength(Cdr(test));
+    int prim = StandardPrimitive(state, Car(test), argc);
+    if (prim == -1) return;
+    const char *name = uncheckedPrimitives[prim].name;
+    Handle a = Cadr(test);
+    if (strcmp(name, "not") == 0) {
+	Refine(state, a, !truth);
+    }
+    else if (strcmp(name, "null?") == 0) {
+	Narrow(state, a, truth ? TYPE_BIT(TYPE_NIL) : ~TYPE_BIT(TYPE_NIL));
+    }
+    else if (strcmp(name, "pair?") == 0) {
+	Narrow(state, a, truth ? TYPE_BIT(TYPE_CONS) : ~TYPE_BIT(TYPE_CONS));
+    }
+    else if (strcmp(name, "eq?") == 0) {
+	Handle b = Car(Cdr(Cdr(test)));
+	RefineEq(state, a, b, truth);
+	RefineEq(state, b, a, truth);
+    }
+}
+
+/* Compound expressions */
+
+void CompileCompound(STATE *state, Handle code, COMPILER_MODE mode) {
+    Handle determinant = Car(code);
+    if (determinant == CreateSymbol("quote")) {
+	CompileQuote(state, code, mode);
+    }
+    else if (determinant == CreateSymbol("if")) {
+	CompileIf(state, code, mode);
+    }
+    else if (determinant == CreateSymbol("begin")) {
+	CompileBegin(state, code, mode);
+    }
+    else if (determinant == CreateSymbol("lambda")) {
+	CompileLambda(state, code, mode);
+    }
+    else if (determinant == CreateSymbol("define")) {
+	CompileDefine(state, code, mode);
+    }
+    else if (determinant == CreateSymbol("set!")) {
+	CompileSet(state, code, mode);
+    }
+    else if (IsLoop(code)) {
+	CompileLoop(state, code, mode);
+    }
+    else if (IsCase(code)) {
+	CompileCase(state, code, mode);
+    }
+    else {
+	CompileApply(state, code, mode);
+    }
+}
+
+void CompileBody(STATE *state, Handle code, COMPILER_MODE mode) {
+    while (code != nil) {
+	CompileForm(state, Car(code), mode);
+	Handle next = Cdr(code);
+	if (next != nil) {
+	    // drop return values of non-ultimate forms
+	    AppendBytecode(state, OP_DROP);
+	    StackEffect(state, -1);
+	}
+	code = next;
+    }
+}
+
+/* (begin expr1 [expr2 ...]) */
+
+void CompileBegin(STATE *state, Handle code, COMPILER_MODE mode) {
+    CompileBody(state, Cdr(code), mode);
+}
+
+/* function appllication */
+
+void CompileArguments(STATE *state, Handle code, COMPILER_MODE mode) {
+    if (code == nil) return;
+    CompileArguments(state, Cdr(code), mode);
+    CompileForm(state, Car(code), mode);
+}
+// evaluated last first, like the arguments to a call
+void CompileInlineArguments(STATE *state, Handle args, Handle params,
+			    Handle renames, COMPILER_MODE mode) {
+    if (args == nil) return;
+    CompileInlineArguments(state, Cdr(args), Cdr(params), renames, mode);
+    CompileForm(state, Car(args), mode);
+    Handle param = Cdr(AlistGet(renames, Car(params)));
+    int idx = AddLocal(state, param);
+    AppendBytecodeWithArg(state, OP_SET_LOCAL, idx);
+    StackEffect(state, -1);
+    SetTypes(state, param, InferType(state, Car(args)));
+}
+
+// Compile a call to a lambda whose body we have by binding its parameters
+// to fresh locals and compiling the body in place. The parameters are
+// renamed so they can't be confused with anything else in this function.
+void CompileInline(STATE *state, Handle params, Handle body, Handle args,
+		   COMPILER_MODE mode) {
+    if (params == nil) {
+	int safety = state->safety;
+	CompileBody(state, body, mode);
+	state->safety = safety;
+	return;
+    }
+    int mark = RootMark();
+    Handle renames = PushRoot(FreshNames(params, nil));
+    Handle renamed = PushRoot(RenameList(body, renames));
+    CompileInlineArguments(state, args, params, renames, mode);
+    // a declaration in the body doesn't reach past it
+    int safety = state->safety;
+    CompileBody(state, renamed, mode);
+    state->safety = safety;
+    PopRoots(mark);
+}
+
+// a call to a loop's name stores the new values in its variables and jumps
+// back to the top
+void CompileLoopBack(STATE *state, LOOP *loop, Handle arglist, COMPILER_MODE mode) {
+    CompileArguments(state, arglist, mode);
+    for (Handle v = loop->vars; v != nil; v = Cdr(v)) {
+	int idx = SearchForLocal(state, Car(v));
+	assert(idx != -1);
+	AppendBytecodeWithArg(state, OP_SET_LOCAL, idx);
+	StackEffect(state, -1);
+	// closures made last time around keep the old box
+	if (IsBoxed(state, Car(v))) AppendBytecodeWithArg(state, OP_BOX_LOCAL, idx);
+    }
+    assert(state->currentStack == loop->depth);
+    // the distance counts from the end of the jump, which is longer if
+    // the distance doesn't fit in a byte
+    int distance = CurrentBytecodePosition(state) + 2 - loop->top;
+    if (distance > MAX_SHORT_ARG) distance += 2;
+    AppendBytecodeWithArg(state, OP_JUMP_BACK, distance);
+    // nothing comes back here, but the call still stands for a value
+    StackEffect(state, 1);
+}
+
+// Compile the arguments to a call to a standard primitive. Returns whether
+// each one is proven to be a type in `accepts`.
+int CompileProvenArguments(STATE *state, Handle code, int accepts, COMPILER_MODE mode) {
+    if (code == nil) return 1;
+    int proven = CompileProvenArguments(state, Cdr(code), accepts, mode);
+    CompileForm(state, Car(code), mode);
+    return proven && (InferType(state, Car(code)) & ~accepts) == 0;
+}
+
+void CompileApply(STATE *state, Handle code, COMPILER_MODE mode) {
+    Handle fn, arglist;
+    int len;
+    fn = Car(code);
+    arglist = Cdr(code);
+    len = ListLength(arglist);
+    if (mode == COMPILER_MODE_LAMBDA) {
+	Handle definition = KnownProcedure(state, fn);
+	Handle params, body;
+	for (LOOP *loop = state->loops; loop != NULL; loop = loop->outer) {
+	    if (loop->name == fn) {
+		CompileLoopBack(state, loop, arglist, mode);
+		return;
+	    }
+	}
+	if (state->self != nil && fn == state->self) {
+	    CompileArguments(state, arglist, mode);
+	    AppendBytecodeWithArg(state, OP_CALL_SELF, len);
+	    StackEffect(state, 1 - len);
+	    return;
+	}
+	if (definition != nil) {
+	    DefinedLambda(definition, &params, &body);
+	    if (IsInlinable(fn, body) && state->nLocals + len < MAX_ARG) {
+		CompileInline(state, params, body, arglist, mode);
+		return;
+	    }
+	    CompileArguments(state, arglist, mode);
+	    CompileForm(state, fn, mode);
+	    AppendBytecodeWithArg(state, OP_CALL_KNOWN, len);
+	    StackEffect(state, -len);
+	    return;
+	}
+	if (CanInlineLambda(state, fn, len)) {
+	    CompileInline(state, Cadr(fn), Cdr(Cdr(fn)), arglist, mode);
+	    return;
+	}
+    }
+    Handle sealed = IsLexical(state, fn) ? nil : AlistGet(sealedGlobals, fn);
+    if (sealed != nil && TYPEOF(Cdr(sealed)) == TYPE_FUNCTION) {
+	CompileArguments(state, arglist, mode);
+	CompileLiteral(state, Cdr(sealed), mode);
+	AppendBytecodeWithArg(state, OP_CALL_KNOWN, len);
+	StackEffect(state, -len);
+	return;
+    }
+    int prim = StandardPrimitive(state, fn, len);
+    if (prim == -1) {
+	CompileArguments(state, arglist, mode);
+	CompileForm(state, fn, mode);
+	AppendBytecodeWithArg(state, OP_APPLY, len);
+	StackEffect(state, -len);
+	return;
+    }
+    const UNCHECKED *u = &uncheckedPrimitives[prim];
+    int proven = CompileProvenArguments(state, arglist, u->accepts, mode);
+    CompileForm(state, fn, mode);
+    if ((proven || state->safety == 0) && optimizeBytecode) {
+	AppendBytecodeWithArg(state, OP_UNCHECKED, prim);
+    }
+    else {
+	AppendBytecodeWithArg(state, OP_APPLY, len);
+    }
+    StackEffect(state, -len);
+    // Past the call, the arguments have passed the primitive's checks. A
+    // definition among the arguments could have changed a variable after
+    // it was pushed, so this only goes by arguments that are variables and
+    // constants.
+    for (Handle a = arglist; a != nil; a = Cdr(a)) {
+	if (TYPEOF(Car(a)) == TYPE_CONS && !IsForm(Car(a), "quote")) return;
+    }
+    for (Handle a = arglist; a != nil; a = Cdr(a)) Narrow(state, Car(a), u->checks);
+}
+
+/* 'foo or (quote foo) */
+
+void CompileQuote(STATE *state, Handle code, COMPILER_MODE mode) {
+    if (IsDeclaration(code)) {
+	state->safety = DeclaredSafety(code);
+	CompileLiteral(state, nil, mode);
+	return;
+    }
+    Handle quoted = Car(Cdr(code));
+    CompileLiteral(state, quoted, mode);
+}
+
+/* (if condition consequent [alternate]) */
+
+void CompileIfThen(STATE *state, Handle code, COMPILER_MODE mode) {
+    Handle condition, consequent;
+
+    // skip 'if
+    code = Cdr(code);
+    condition = Car(code);
+    consequent = Car(Cdr(code));
+
+    // compile condition; if it's false, it's also the value of the `if`
+    CompileForm(state, condition, mode);
+    AppendBytecode(state, OP_DUP);
+    StackEffect(state, 1);
+    FACTS otherwise = SaveFacts(state);
+    Refine(state, condition, 1);
+
+    // remember where we put the jump so we can fix it up later
+    int addrOfJump = AppendJump(state, OP_JUMP_FALSE);
+    StackEffect(state, -1);
+
+    // compile consequent in place of the condition
+    AppendBytecode(state, OP_DROP);
+    StackEffect(state, -1);
+    CompileForm(state, consequent, mode);
+    SwapFacts(state, &otherwise);
+    Refine(state, condition, 0);
+    JoinFacts(state, &otherwise);
+
+    // apply fixup to the jump we compiled earlier
+    int jumpDest = CurrentBytecodePosition(state);
+    ApplyFixup(state, addrOfJump, jumpDest);
+}
+
+void CompileIfThenElse(STATE *state, Handle code, COMPILER_MODE mode) {
+    Handle condition, consequent, alternative;
+
+    // skip 'if
+    code = Cdr(code);
+    condition = Car(code); code = Cdr(code);
+    consequent = Car(code); code = Cdr(code);
+    alternative = Car(code);
+
+    // compile condition
+    CompileForm(state, condition, mode);
+    FACTS otherwise = SaveFacts(state);
+    Refine(state, condition, 1);
+
+    // remember the jump to the alternative
+    int jumpToAlternative = AppendJump(state, OP_JUMP_FALSE);
+    StackEffect(state, -1);
+
+    // compile consequent; remember jump to end
+    CompileForm(state, consequent, mode);
+    int jumpToEnd = AppendJump(state, OP_JUMP);
+    SwapFacts(state, &otherwise);
+    Refine(state, condition, 0);
+
+    // compile alternative; the consequent's value isn't on the stack here,
+    // so don't count it, or a loop in the alternative would see the wrong
+    // depth
+    StackEffect(state, -1);
+    int altPos = CurrentBytecodePosition(state);
+    CompileForm(state, alternative, mode);
+    JoinFacts(state, &otherwise);
+
+    // apply fixups
+    int endPos = CurrentBytecodePosition(state);
+    ApplyFixup(state, jumpToAlternative, altPos);
+    ApplyFixup(state, jumpToEnd, endPos);
+}
+
+void CompileIf(STATE *state, Handle code, COMPILER_MODE mode) {
+    int len = ListLength(code);
+    if (len < 3) {
+	panic("too few arguments to if");
+    }
+    else if (len == 3) {
+	CompileIfThen(state, code, mode);
+    }
+    else {
+	CompileIfThenElse(state, code, mode);
+    }
+}
+
+/* (<case> key '((datum ...) ...) expr... default), from a case */
+
+// The key picks a jump from the table after OP_CASE, which goes to its
+// clause; the last jump is to the default.
+void CompileCase(STATE *state, Handle code, COMPILER_MODE mode) {
+    Handle datums = Cadr(Car(Cdr(Cdr(code))));
+    Handle bodies = Cdr(Cdr(Cdr(code)));
+    int clauses = ListLength(datums);
+    CompileForm(state, Cadr(code), mode);
+    DisableGC();
+    int table = AddLiteral(state, CreateCaseTable(datums));
+    EnableGC();
+    AppendBytecodeWithArg(state, OP_CASE, table);
+    StackEffect(state, -1);
+
+    int *jumps = malloc(2 * (clauses + 1) * sizeof(int));
+    if (jumps == NULL) panic("out of memory for the compiler");
+    int *ends = jumps + clauses + 1;
+    for (int i = 0; i <= clauses; i++) jumps[i] = AppendJump(state, OP_JUMP);
+
+    // each clause starts out knowing what was known after the key, and
+    // what's known after the case is what all of them agree on
+    FACTS entry = SaveFacts(state), joined = {NULL, 0};
+    for (int i = 0; i <= clauses; i++, bodies = Cdr(bodies)) {
+	ApplyFixup(state, jumps[i], CurrentBytecodePosition(state));
+	CompileForm(state, Car(bodies), mode);
+	if (i > 0) JoinFacts(state, &joined);
+	if (i < clauses) {
+	    ends[i] = AppendJump(state, OP_JUMP);
+	    // as with an if, only one clause's value is ever on the stack
+	    StackEffect(state, -1);
+	    joined = CopyFacts(entry);
+	    SwapFacts(state, &joined);
+	}
+    }
+    free(entry.types);
+
+    int endPos = CurrentBytecodePosition(state);
+    for (int i = 0; i < clauses; i++) ApplyFixup(state, ends[i], endPos);
+    free(jumps);
+}
+
+/* (lambda ([arg1 ...]) expr1 [expr2 ...]) */
+
+// push a captured variable's value, or its box, for OP_MAKE_CLOSURE
+void CompileCapture(STATE *state, Handle var) {
+    int idx = SearchForLocal(state, var);
+    if (idx != -1) {
+	AppendBytecodeWithArg(state, OP_LOCAL, idx);
+    }
+    else {
+	idx = SearchForClosure(state, var);
+	assert(idx != -1);
+	AppendBytecodeWithArg(state, OP_CLOSURE, idx);
+    }
+    StackEffect(state, 1);
+}
+
+// compile the body of a function whose scope has been analyzed
+Handle CompileScope(STATE *state, Handle body) {
+    // box the locals that need it before anything can capture them
+    for (Handle b = state->boxed; b != nil; b = Cdr(b)) {
+	int idx = SearchForLocal(state, Car(b));
+	if (idx != -1) AppendBytecodeWithArg(state, OP_BOX_LOCAL, idx);
+    }
+    
+    CompileBody(state, body, COMPILER_MODE_LAMBDA);
+    assert(state->currentStack == 1);
+    AppendBytecode(state, OP_RETURN);
+    AppendBytecode(state, OP_END);
+
+    Handle fn = CreateFunction(state);
+    ReleaseCode(state);
+    return fn;
+}
+
+Handle CreateStub(STATE*, Handle, Handle);
+
+// `self` names a known procedure being defined, or is nil
+void CompileFunction(STATE *state, Handle args, Handle body,
+		     COMPILER_MODE mode, Handle self) {
+    STATE newState;
+    InitializeState(&newState);
+    newState.prior = state;
+    newState.self = self;
+    newState.safety = state->safety;
+    Handle fn;
+    if (lazyCompile && !sealPrograms) {
+	fn = CreateStub(&newState, args, body);
+    }
+    else {
+	AnalyzeScope(&newState, args, body);
+	fn = CompileScope(&newState, body);
+    }
+    Retain(fn);
+
+    // a lambda without free variables is its own closure
+    int nCaptured = 0;
+    for (Handle c = newState.closure; c != nil; c = Cdr(c)) {
+	CompileCapture(state, Car(c));
+	nCaptured++;
+    }
+    CompileLiteral(state, fn, mode);
+    if (nCaptured > 0) {
+	AppendBytecodeWithArg(state, OP_MAKE_CLOSURE, nCaptured);
+	StackEffect(state, -nCaptured);
+    }
+    ReleaseScope(&newState);
+    Unretain(fn);
+}
+
+// Compile a top-level procedure by itself and return its function, which
+// nothing retains. Calls to `self`, if it isn't nil, call the function
+// directly.
+Handle CompileProcedure(Handle self, Handle args, Handle body) {
+    STATE state;
+    InitializeState(&state);
+    CompileFunction(&state, args, body, COMPILER_MODE_REPL, self);
+    Handle fn = PoolRef(&state.literals, 0);
+    ReleaseCode(&state);
+    return fn;
+}
+
+void CompileLambda(STATE *state, Handle code, COMPILER_MODE mode) {
+    // TODO: deduplicate from Compile()
     // TODO: dotted args
     Handle args, body;
     // skip 'lambda
@@ -427,13 +2197,13 @@ void CompileLambda(STATE *state, Handle code, COMPILER_MODE mode) {
     args = Car(code);
     body = Cdr(code);
 
-    CompileFunction(state, args, body, mode);
+    CompileFunction(state, args, body, mode, nil);
 }
 
 /* (define var value) or (define (var [arg1 ...]) body) */
 void CompileVarDefine(STATE*, Handle, COMPILER_MODE);
 void CompileFunctionDefine(STATE*, Handle, COMPILER_MODE);
-void CompileBinding(STATE*, Handle, COMPILER_MODE);
+void CompileBinding(STATE*, Handle, int, COMPILER_MODE);
 
 
 void CompileDefine(STATE *state, Handle code, COMPILER_MODE mode) {
@@ -452,8 +2222,13 @@ void CompileVarDefine(STATE *state, Handle code, COMPILER_MODE mode) {
     code = Cdr(code);
     Handle var = Car(code);
     Handle value = Cadr(code);
-    CompileForm(state, value, mode);
-    CompileBinding(state, var, mode);
+    if (KnownProcedure(state, var) != nil) {
+	CompileFunction(state, Cadr(value), Cdr(Cdr(value)), mode, var);
+    }
+    else {
+	CompileForm(state, value, mode);
+    }
+    CompileBinding(state, var, InferType(state, value), mode);
 }
 
 void CompileFunctionDefine(STATE *state, Handle code, COMPILER_MODE mode) {
@@ -463,34 +2238,881 @@ void CompileFunctionDefine(STATE *state, Handle code, COMPILER_MODE mode) {
     Handle var = Car(formals);
     Handle args = Cdr(formals);
     Handle body = Cdr(code);
-    if (mode == COMPILER_MODE_LAMBDA) {
-	AddLocal(state, var);
-    }
-    CompileFunction(state, args, body, mode);
-    CompileBinding(state, var, mode);
+    CompileFunction(state, args, body, mode,
+		    KnownProcedure(state, var) != nil ? var : nil);
+    CompileBinding(state, var, TYPE_BIT(TYPE_FUNCTION), mode);
 }
 
-// bind the top-of-stack to a variable
+// bind the top-of-stack, which has `types`, to a variable
 // create a local if it's being bound in a function
 // else set a global
-void CompileBinding(STATE *state, Handle var, COMPILER_MODE mode) {
+void CompileBinding(STATE *state, Handle var, int types, COMPILER_MODE mode) {
     int idx;
     if (mode == COMPILER_MODE_LAMBDA) {
 	idx = AddLocal(state, var);
-	AppendBytecodeWithArg(state, OP_SET_LOCAL, idx);
+	if (IsBoxed(state, var) && state->loops != NULL && !IsEarly(state, var)) {
+	    // in a loop, each time around binds a new box
+	    AppendBytecodeWithArg(state, OP_SET_LOCAL, idx);
+	    AppendBytecodeWithArg(state, OP_BOX_LOCAL, idx);
+	}
+	else {
+	    AppendBytecodeWithArg(state,
+				  IsBoxed(state, var) ? OP_SET_LOCAL_BOX : OP_SET_LOCAL,
+				  idx);
+	}
+	SetTypes(state, var, types);
     }
     else {
 	// set global
-	idx = AddToVector(state->literals, var);
+	idx = AddLiteral(state, var);
 	AppendBytecodeWithArg(state, OP_SET_GLOBAL, idx);
     }
     StackEffect(state, -1); // set-*! op consumes top-of-stack
     CompileLiteral(state, var, mode); // return symbol of variable we just set
 }
 
+/* (set! var value) */
+
+void CompileSet(STATE *state, Handle code, COMPILER_MODE mode) {
+    Handle var = Cadr(code);
+    Handle value = Car(Cdr(Cdr(code)));
+    CompileForm(state, value, mode);
+    // leave the new value behind as the result
+    AppendBytecode(state, OP_DUP);
+    StackEffect(state, 1);
+
+    int idx;
+    if (mode == COMPILER_MODE_LAMBDA && (idx = SearchForLocal(state, var)) != -1) {
+	AppendBytecodeWithArg(state,
+			      IsBoxed(state, var) ? OP_SET_LOCAL_BOX : OP_SET_LOCAL,
+			      idx);
+	// a parameter of an inlined procedure is tracked even if it's set
+	SetTypes(state, var, InferType(state, value));
+    }
+    else if (mode == COMPILER_MODE_LAMBDA &&
+	     (idx = SearchForClosure(state, var)) != -1) {
+	// anything that's assigned after being captured is boxed
+	assert(IsBoxed(state, var));
+	AppendBytecodeWithArg(state, OP_SET_CLOSURE_BOX, idx);
+    }
+    else {
+	idx = AddLiteral(state, var);
+	AppendBytecodeWithArg(state, OP_SET_GLOBAL, idx);
+    }
+    StackEffect(state, -1);
+}
+
+/* (<loop> name (var ...) body...), from a named let or do */
+
+// add the types of what each call to `name` in `form` passes back to the
+// top of its loop
+void LoopBackTypes(STATE *state, Handle form, Handle name, int *types) {
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote") || IsForm(form, "lambda")) {
+	return;
+    }
+    if (IsForm(form, "define") && TYPEOF(Cadr(form)) == TYPE_CONS) return;
+    if (Car(form) == name) {
+	int i = 0;
+	for (Handle a = Cdr(form); a != nil; a = Cdr(a)) {
+	    types[i++] |= InferType(state, Car(a));
+	}
+    }
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	LoopBackTypes(state, Car(form), name, types);
+    }
+}
+
+// What's known at the top of a loop has to hold every time around. Nothing
+// is known about what the body defines, and the variables have what they
+// came in with or any type the jumps back pass in, which is found by going
+// around until nothing new turns up.
+void LoopTypes(STATE *state, LOOP *loop, Handle body) {
+    DisableGC();
+    Handle defines = nil;
+    for (Handle f = body; f != nil; f = Cdr(f)) defines = CollectDefines(Car(f), defines);
+    EnableGC();
+    for (Handle d = defines; d != nil; d = Cdr(d)) SetTypes(state, Car(d), TYPES_ANY);
+
+    int n = ListLength(loop->vars);
+    int *types = malloc((n + 1) * sizeof(int));
+    if (types == NULL) panic("out of memory for the compiler");
+    int changed = 1;
+    while (changed) {
+	int i = 0;
+	for (Handle v = loop->vars; v != nil; v = Cdr(v)) types[i++] = TypesOf(state, Car(v));
+	for (Handle f = body; f != nil; f = Cdr(f)) {
+	    LoopBackTypes(state, Car(f), loop->name, types);
+	}
+	changed = 0;
+	i = 0;
+	for (Handle v = loop->vars; v != nil; v = Cdr(v), i++) {
+	    changed |= types[i] != TypesOf(state, Car(v));
+	    SetTypes(state, Car(v), types[i]);
+	}
+    }
+    free(types);
+}
+
+void CompileLoop(STATE *state, Handle code, COMPILER_MODE mode) {
+    assert(mode == COMPILER_MODE_LAMBDA);
+    LOOP loop;
+    loop.name = Cadr(code);
+    loop.vars = Car(Cdr(Cdr(code)));
+    loop.top = CurrentBytecodePosition(state);
+    loop.depth = state->currentStack;
+    loop.outer = state->loops;
+    state->loops = &loop;
+
+    // A boxed variable that the body defines and that can be captured
+    // before its definition needs a new box before each time around.
+    Handle body = Cdr(Cdr(Cdr(code)));
+    for (Handle e = state->early; e != nil; e = Cdr(e)) {
+	int defines = 0;
+	for (Handle f = body; f != nil; f = Cdr(f)) defines += CountDefines(Car(f), Car(e));
+	if (defines > 0) {
+	    AppendBytecodeWithArg(state, OP_BOX_LOCAL, SearchForLocal(state, Car(e)));
+	}
+    }
+
+    LoopTypes(state, &loop, body);
+    CompileBody(state, body, mode);
+    state->loops = loop.outer;
+}
+
+/* Lazy compilation */
+
+// With `lazyCompile` set, a lambda's body isn't compiled along with the code
+// around it. The lambda becomes a stub: a function with no stack, whose
+// literals are the lambda's source and what the body needs to know about
+// the scope around it, which is the variables it captures and which of
+// those are boxed. The first call to the stub, or to a closure made from
+// it, compiles the body as it would have been compiled in place. The stub
+// keeps the result for its other closures. Sealed programs are always
+// compiled whole, since the sealed globals are gone by the time anything
+// runs.
+
+int lazyCompile = 0;
+
+enum {LAZY_ARGS, LAZY_BODY, LAZY_SELF, LAZY_CLOSURE, LAZY_BOXED, LAZY_SAFETY,
+      LAZY_COMPILED, LAZY_SLOTS};
+
+// A stub for the function `state` is the scope of. Of the scope analysis,
+// this only finds the closure, which is what the enclosing code needs.
+Handle CreateStub(STATE *state, Handle args, Handle body) {
+    DisableGC();
+    state->closure = ClosureVariables(state, args, body);
+    EnableGC();
+    if (state->closure != nil) Retain(state->closure);
+    state->nArgs = ListLength(args);
+
+    Handle source = CreateVector(LAZY_SLOTS);
+    Retain(source);
+    VectorSet(source, LAZY_ARGS, args);
+    VectorSet(source, LAZY_BODY, body);
+    VectorSet(source, LAZY_SELF, state->self);
+    VectorSet(source, LAZY_CLOSURE, state->closure);
+    DisableGC();
+    Handle boxed = nil;
+    for (Handle c = state->closure; c != nil; c = Cdr(c)) {
+	if (IsBoxed(state->prior, Car(c))) boxed = CreateCons(Car(c), boxed);
+    }
+    EnableGC();
+    VectorSet(source, LAZY_BOXED, boxed);
+    VectorSet(source, LAZY_SAFETY, CreateInteger(state->safety));
+    Handle bytecode = CreateBytevector(1);
+    BVEC_CONTENTS(bytecode)[0] = OP_END;
+    Retain(bytecode);
+    Handle fn = CreateFunctionFrom(0, state->nArgs, state->nArgs, bytecode, source);
+    Unretain(bytecode);
+    Unretain(source);
+    return fn;
+}
+
+// the function a stub stands for, compiled the first time it's asked for
+Handle CompileLazyFunction(Handle stub) {
+    Handle source = DATA_AREA(FUNCTION, stub)->literals;
+    Handle fn = VectorRef(source, LAZY_COMPILED);
+    if (fn != nil) return fn;
+    TRACE(TRACE_COMPILE, 'B', "lazy compile", 0);
+
+    // what the lambda could see of the scope it was in
+    STATE scope;
+    InitializeState(&scope);
+    for (Handle c = VectorRef(source, LAZY_CLOSURE); c != nil; c = Cdr(c)) {
+	AddLocal(&scope, Car(c));
+    }
+    for (Handle b = VectorRef(source, LAZY_BOXED); b != nil; b = Cdr(b)) {
+	MapPut(&scope.boxing, Car(b), BOXED);
+    }
+
+    STATE state;
+    InitializeState(&state);
+    state.prior = &scope;
+    state.self = VectorRef(source, LAZY_SELF);
+    state.safety = UnboxInteger(VectorRef(source, LAZY_SAFETY));
+    AnalyzeScope(&state, VectorRef(source, LAZY_ARGS), VectorRef(source, LAZY_BODY));
+    fn = CompileScope(&state, VectorRef(source, LAZY_BODY));
+    VectorSet(source, LAZY_COMPILED, fn);
+    ReleaseScope(&state);
+    ReleaseScope(&scope);
+    TRACE(TRACE_COMPILE, 'E', "lazy compile", 0);
+    return fn;
+}
+
+/* Sealed programs */
+
+// A script's top-level definitions rarely change once it's loaded, but
+// each form is compiled by itself, so every reference to one has to look
+// up the global in case it was redefined. A sealed program is compiled as a
+// whole instead. A top-level definition is sealed if it's a form by itself,
+// it's the only definition of its name, nothing assigns the name, it isn't
+// the name of a primitive, and no form before it uses the name except from
+// inside a lambda. Its value is known if it's a constant, a quoted datum, a
+// procedure, or another sealed name whose value is known.
+//
+// While a sealed program is being compiled, `sealedGlobals` maps the sealed
+// names whose values are known to those values. References to them compile
+// to the value itself, so constants reach the code that uses them, where
+// the optimizer can fold them, and calls to sealed procedures call the
+// function directly. As in CompileFile, calls to a primitive the program
+// replaces anywhere aren't folded. A procedure is compiled after the
+// procedures it calls, except where they call each other; then the one
+// compiled first is called through its global. In the end, a definition
+// whose value is known is dropped unless something still refers to its name.
+
+int sealPrograms = 0;
+Handle sealedGlobals;        // nil except in CompileSealedFile
+
+enum sealstatus {
+    NOT_SEALED,
+    SEALED,            // value not worked out yet
+    PENDING,           // value being worked out
+    KNOWN,
+    UNKNOWN
+};
+
+typedef struct sealer {
+    Handle forms;      // the program's top-level forms, in a vector
+    char *status;      // the status of each form's definition
+    char *safety;      // the safety each form is compiled at
+} SEALER;
+
+// whether evaluating `form` could refer to `var`, leaving out the bodies of
+// the lambdas it makes
+int UsesNow(Handle form, Handle var) {
+    if (form == var) return 1;
+    if (TYPEOF(form) != TYPE_CONS || IsForm(form, "quote") || IsForm(form, "lambda")) {
+	return 0;
+    }
+    if (IsForm(form, "define") && TYPEOF(Cadr(form)) == TYPE_CONS) return 0;
+    for (; TYPEOF(form) == TYPE_CONS; form = Cdr(form)) {
+	if (UsesNow(Car(form), var)) return 1;
+    }
+    return 0;
+}
+
+void FindSealed(SEALER *s) {
+    DisableGC();
+    Handle assigned = nil;
+    FOR_IN_VECTOR(i, s->forms) {
+	assigned = CollectAssignments(VectorRef(s->forms, i), assigned, 1);
+    }
+    FOR_IN_VECTOR(i, s->forms) {
+	Handle form = VectorRef(s->forms, i);
+	s->status[i] = NOT_SEALED;
+	if (!IsForm(form, "define") || TYPEOF(Cdr(form)) != TYPE_CONS) continue;
+	Handle name = DefinedName(form);
+	if (TYPEOF(name) != TYPE_SYMBOL || ListIndex(assigned, name) != -1 ||
+	    AlistGet(globals, name) != nil) {
+	    continue;
+	}
+	int count = 0, usedBefore = 0;
+	FOR_IN_VECTOR(j, s->forms) {
+	    count += CountDefines(VectorRef(s->forms, j), name);
+	    if (j < i && UsesNow(VectorRef(s->forms, j), name)) usedBefore = 1;
+	}
+	if (count == 1 && !usedBefore) s->status[i] = SEALED;
+    }
+    EnableGC();
+}
+
+// the position of the sealed definition of `name`, or -1
+int SealedIndex(SEALER *s, Handle name) {
+    FOR_IN_VECTOR(i, s->forms) {
+	if (s->status[i] != NOT_SEALED && IsDefineOf(VectorRef(s->forms, i), name)) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+void AddSealedGlobal(Handle name, Handle value) {
+    Handle old = sealedGlobals;
+    DisableGC();
+    sealedGlobals = CreateCons(CreateCons(name, value), old);
+    EnableGC();
+    Retain(sealedGlobals);
+    if (old != nil) Unretain(old);
+}
+
+// Work out the value of the sealed definition at `i`, first working out the
+// values of the sealed names it refers to
+void ResolveSealed(SEALER *s, int i) {
+    if (i == -1 || s->status[i] != SEALED) return;
+    s->status[i] = PENDING;
+    Handle form = VectorRef(s->forms, i);
+    Handle name = DefinedName(form);
+    Handle params, body, value = nil;
+    int known = 0;
+    if (DefinedLambda(form, &params, &body)) {
+	if (IsParameterList(params)) {
+	    DisableGC();
+	    Handle free = FreeVariables(params, body);
+	    Handle inner = nil;
+	    for (Handle f = body; f != nil; f = Cdr(f)) {
+		inner = CollectDefines(Car(f), inner);
+	    }
+	    EnableGC();
+	    if (free != nil) Retain(free);
+	    for (Handle v = free; v != nil; v = Cdr(v)) {
+		ResolveSealed(s, SealedIndex(s, Car(v)));
+	    }
+	    if (free != nil) Unretain(free);
+	    int callsSelf = ListIndex(params, name) == -1 && ListIndex(inner, name) == -1;
+	    compilerSafety = s->safety[i];
+	    value = CompileProcedure(callsSelf ? name : nil, params, body);
+	    known = 1;
+	}
+    }
+    else if (TYPEOF(Cdr(Cdr(form))) == TYPE_CONS) {
+	Handle expr = Car(Cdr(Cdr(form)));
+	switch (TYPEOF(expr)) {
+	case TYPE_INT: case TYPE_FLOAT:
+	case TYPE_VECTOR: case TYPE_BYTEVECTOR:
+	    value = expr;
+	    known = 1;
+	    break;
+	case TYPE_SYMBOL:
+	    ResolveSealed(s, SealedIndex(s, expr));
+	    Handle cell = AlistGet(sealedGlobals, expr);
+	    if (cell != nil) {
+		value = Cdr(cell);
+		known = 1;
+	    }
+	    break;
+	case TYPE_CONS:
+	    if (IsForm(expr, "quote")) {
+		value = Cadr(expr);
+		known = 1;
+	    }
+	    break;
+	default:
+	    break;
+	}
+    }
+    if (known) AddSealedGlobal(name, value);
+    s->status[i] = known ? KNOWN : UNKNOWN;
+}
+
+// Adds the symbols in the literals of `fn`, and of the functions it refers
+// to, to `acc`. The functions themselves go in as well, to mark them seen.
+Handle CollectNames(Handle fn, Handle acc) {
+    if (ListIndex(acc, fn) != -1) return acc;
+    acc = CreateCons(fn, acc);
+    Handle literals = DATA_AREA(FUNCTION, fn)->literals;
+    FOR_IN_VECTOR(i, literals) {
+	Handle lit = VectorRef(literals, i);
+	if (TYPEOF(lit) == TYPE_SYMBOL) acc = ListAdjoin(acc, lit);
+	else if (TYPEOF(lit) == TYPE_FUNCTION) acc = CollectNames(lit, acc);
+    }
+    return acc;
+}
+
+// Compile a file as a sealed program, giving a vector of functions to be
+// run in order like CompileFile
+Handle CompileSealedFile(FILE *source) {
+    TRACE(TRACE_COMPILE, 'B', "compile sealed", 0);
+    SEALER s;
+    s.forms = CreateVector(0);
+    Retain(s.forms);
+    while (!(feof(source) || ferror(source))) {
+	Handle code = ReadObject(source);
+	if (code != nil) {
+	    Retain(code);
+	    Handle expanded = Expand(code, 0);
+	    if (expanded != code) Retain(expanded);
+	    VectorAppend(s.forms, expanded);
+	    if (expanded != code) Unretain(expanded);
+	    Unretain(code);
+	}
+    }
+    MakeRoom();
+    DisableGC();
+    FOR_IN_VECTOR(i, s.forms) NoteReplacedPrimitives(VectorRef(s.forms, i));
+    EnableGC();
+    if (replacedPrimitives != nil) Retain(replacedPrimitives);
+    int n = VectorLength(s.forms);
+    s.status = malloc(n + 1);
+    s.safety = malloc(n + 1);
+    if (s.status == NULL || s.safety == NULL) panic("out of memory in the sealed compiler");
+    // forms aren't compiled in order, so each one's safety is worked out first
+    int safety = compilerSafety;
+    for (int i = 0; i < n; i++) {
+	if (IsDeclaration(VectorRef(s.forms, i))) {
+	    compilerSafety = DeclaredSafety(VectorRef(s.forms, i));
+	}
+	s.safety[i] = compilerSafety;
+    }
+    FindSealed(&s);
+    for (int i = 0; i < n; i++) ResolveSealed(&s, i);
+
+    // a definition with a known value becomes (define name 'value)
+    Handle compiled = CreateVector(n);
+    Retain(compiled);
+    for (int i = 0; i < n; i++) {
+	Handle form = VectorRef(s.forms, i);
+	if (s.status[i] == KNOWN) {
+	    Handle name = DefinedName(form);
+	    Handle value = Cdr(AlistGet(sealedGlobals, name));
+	    DisableGC();
+	    form = CreateCons(CreateSymbol("define"),
+			      CreateCons(name,
+					 CreateCons(CreateCons(CreateSymbol("quote"),
+							       CreateCons(value, nil)),
+						    nil)));
+	    EnableGC();
+	}
+	Retain(form);
+	MakeRoom();
+	compilerSafety = s.safety[i];
+	VectorSet(compiled, i, CompileExpanded(form, COMPILER_MODE_REPL));
+	Unretain(form);
+    }
+
+    // keep the known definitions that the rest of the program names
+    char *keep = malloc(n + 1);
+    if (keep == NULL) panic("out of memory in the sealed compiler");
+    for (int i = 0; i < n; i++) keep[i] = s.status[i] != KNOWN;
+    DisableGC();
+    Handle names = nil;
+    int changed = 1;
+    while (changed) {
+	changed = 0;
+	for (int i = 0; i < n; i++) {
+	    if (keep[i]) names = CollectNames(VectorRef(compiled, i), names);
+	}
+	for (int i = 0; i < n; i++) {
+	    Handle form = VectorRef(s.forms, i);
+	    if (!keep[i] && ListIndex(names, DefinedName(form)) != -1) {
+		keep[i] = 1;
+		changed = 1;
+	    }
+	}
+    }
+    EnableGC();
+
+    Handle program = CreateVector(0);
+    Retain(program);
+    for (int i = 0; i < n; i++) {
+	if (keep[i]) VectorAppend(program, VectorRef(compiled, i));
+    }
+    free(keep);
+    free(s.status);
+    free(s.safety);
+    compilerSafety = safety;
+    Unretain(compiled);
+    Unretain(s.forms);
+    if (sealedGlobals != nil) Unretain(sealedGlobals);
+    sealedGlobals = nil;
+    if (replacedPrimitives != nil) Unretain(replacedPrimitives);
+    replacedPrimitives = nil;
+    Unretain(program);
+    TRACE(TRACE_COMPILE, 'E', "compile sealed", 0);
+    return program;
+}
+
+/* Register backend */
+
+// The register engine runs the same functions as the stack engine, so its
+// code is derived from each function's stack bytecode, whose stack depth is
+// known at every instruction. Pushes of locals, literals, globals and
+// captured values are deferred and become operands of the instruction that
+// consumes them; anything still deferred is moved into its stack slot's
+// register at jumps, labels, and before it could go stale.
+
+typedef struct regstate {
+    uint16_t *code;
+    int length;
+    int capacity;
+    uint16_t *vstack;    // operands standing in for the stack slots
+    int sp;
+    int nLocals;
+    int lastDest;        // where the last instruction's destination is, or -1
+    int tooBig;          // something didn't fit in an operand or a jump
+} REGSTATE;
+
+void EmitWord(REGSTATE *rs, int word) {
+    if (rs->length == rs->capacity) {
+	rs->capacity = rs->capacity ? rs->capacity * 2 : 64;
+	rs->code = realloc(rs->code, rs->capacity * sizeof(uint16_t));
+	if (rs->code == NULL) panic("out of memory for register code");
+    }
+    rs->code[rs->length++] = (uint16_t)word;
+}
+
+// the operand for register, literal or closure value `idx`, if there's
+// room for the index
+int Operand(REGSTATE *rs, int kind, int idx) {
+    if (idx > MAX_OPERAND_INDEX) {
+	rs->tooBig = 1;
+	idx = 0;
+    }
+    return OPERAND(kind, idx);
+}
+
+int StackRegister(REGSTATE *rs, int slot) {
+    int reg = rs->nLocals + slot;
+    if (reg > MAX_OPERAND_INDEX) {
+	rs->tooBig = 1;
+	reg = 0;
+    }
+    return reg;
+}
+
+void EmitMove(REGSTATE *rs, int dest, int source) {
+    EmitWord(rs, ROP_MOVE);
+    rs->lastDest = rs->length;
+    EmitWord(rs, dest);
+    EmitWord(rs, source);
+}
+
+// move a deferred operand into its own register
+void MaterializeSlot(REGSTATE *rs, int slot) {
+    int reg = StackRegister(rs, slot);
+    if (rs->vstack[slot] != OPERAND(OPERAND_REG, reg)) {
+	EmitMove(rs, reg, rs->vstack[slot]);
+	rs->vstack[slot] = OPERAND(OPERAND_REG, reg);
+    }
+}
+
+void MaterializeAll(REGSTATE *rs) {
+    for (int i = 0; i < rs->sp; i++) MaterializeSlot(rs, i);
+}
+
+// before a local is written, nothing deferred may still read it
+void MaterializeReadersOf(REGSTATE *rs, int reg) {
+    for (int i = 0; i < rs->sp; i++) {
+	if (rs->vstack[i] == OPERAND(OPERAND_REG, reg)) MaterializeSlot(rs, i);
+    }
+}
+
+// before globals could change, read the deferred ones
+void MaterializeGlobals(REGSTATE *rs) {
+    for (int i = 0; i < rs->sp; i++) {
+	if (OPERAND_KIND(rs->vstack[i]) == OPERAND_GLOBAL) MaterializeSlot(rs, i);
+    }
+}
+
+void Push(REGSTATE *rs, int operand) {
+    rs->vstack[rs->sp++] = (uint16_t)operand;
+}
+
+int Pop(REGSTATE *rs) {
+    assert(rs->sp > 0);
+    return rs->vstack[--rs->sp];
+}
+
+// push the result of an instruction written to the next slot's register
+int PushResult(REGSTATE *rs) {
+    int reg = StackRegister(rs, rs->sp);
+    Push(rs, OPERAND(OPERAND_REG, reg));
+    return reg;
+}
+
+void EmitDestination(REGSTATE *rs, int reg) {
+    rs->lastDest = rs->length;
+    EmitWord(rs, reg);
+}
+
+Handle CompileRegisterCode(Handle fn) {
+    Handle bytecode = DATA_AREA(FUNCTION, fn)->bytecode;
+    int stacksize = DATA_AREA(FUNCTION, fn)->stacksize;
+    int codeLength = BytevectorLength(bytecode);
+
+    REGSTATE rs;
+    rs.code = NULL;
+    rs.length = rs.capacity = 0;
+    rs.vstack = malloc((stacksize + 1) * sizeof(uint16_t));
+    rs.sp = 0;
+    rs.nLocals = DATA_AREA(FUNCTION, fn)->nLocals;
+    rs.lastDest = -1;
+    rs.tooBig = 0;
+
+    // The stack depth at each instruction comes from following the jumps,
+    // not from the instruction before it, which may be a jump away or code
+    // that never runs. Instructions nothing reaches aren't translated.
+    int *depthAt = StackDepths(fn);
+    if (depthAt == NULL) panic("register engine can't translate code that doesn't verify");
+    // jump targets, and where instructions end up
+    char *isLabel = calloc(codeLength + 1, 1);
+    int *translated = malloc((codeLength + 1) * sizeof(int));
+    int *fixups = malloc((codeLength + 1) * sizeof(int));
+    int *fixupTargets = malloc((codeLength + 1) * sizeof(int));
+    int nFixups = 0;
+    for (int i = 0; i <= codeLength; i++) translated[i] = -1;
+    if (!rs.vstack || !isLabel || !translated || !fixups || !fixupTargets) {
+	panic("out of memory for register translation");
+    }
+    int pc = 0;
+    while (pc < codeLength) {
+	uint8_t op; int arg;
+	int next = DecodeInstruction(bytecode, pc, &op, &arg);
+	if (op == OP_JUMP || op == OP_JUMP_FALSE || op == OP_JUMP_TRUE) {
+	    isLabel[next + arg] = 1;
+	}
+	else if (op == OP_JUMP_BACK) {
+	    isLabel[next - arg] = 1;
+	}
+	pc = next;
+    }
+
+    int reachable = 1;
+    pc = 0;
+    while (pc < codeLength) {
+	uint8_t op; int arg;
+	int next = DecodeInstruction(bytecode, pc, &op, &arg);
+	if (depthAt[pc] == -1) {
+	    // nothing runs this, so nothing falls through from it either
+	    reachable = 0;
+	    pc = next;
+	    continue;
+	}
+	if (isLabel[pc] || !reachable) {
+	    if (reachable) MaterializeAll(&rs);
+	    else rs.sp = depthAt[pc];
+	    reachable = 1;
+	    rs.lastDest = -1;
+	}
+	assert(rs.sp == depthAt[pc]);
+	translated[pc] = rs.length;
+
+	switch (op) {
+	case OP_END:
+	    EmitWord(&rs, ROP_END);
+	    break;
+	case OP_NOP:
+	    break;
+	case OP_DROP:
+	    Pop(&rs);
+	    break;
+	case OP_DUP:
+	    {
+		int top = Pop(&rs);
+		Push(&rs, top);
+		Push(&rs, top);
+	    }
+	    break;
+	case OP_NIL:
+	    Push(&rs, OPERAND(OPERAND_NIL, 0));
+	    break;
+	case OP_RETURN:
+	    EmitWord(&rs, ROP_RETURN);
+	    EmitWord(&rs, Pop(&rs));
+	    reachable = 0;
+	    break;
+	case OP_LITERAL:
+	    Push(&rs, Operand(&rs, OPERAND_LITERAL, arg));
+	    break;
+	case OP_GLOBAL:
+	    Push(&rs, Operand(&rs, OPERAND_GLOBAL, arg));
+	    break;
+	case OP_SET_GLOBAL:
+	    {
+		int value = Pop(&rs);
+		MaterializeGlobals(&rs);
+		EmitWord(&rs, ROP_SET_GLOBAL);
+		EmitWord(&rs, arg);
+		EmitWord(&rs, value);
+		rs.lastDest = -1;
+	    }
+	    break;
+	case OP_LOCAL:
+	    Push(&rs, Operand(&rs, OPERAND_REG, arg));
+	    break;
+	case OP_SET_LOCAL:
+	    {
+		int value = Pop(&rs);
+		MaterializeReadersOf(&rs, arg);
+		if (value == OPERAND(OPERAND_REG, StackRegister(&rs, rs.sp)) &&
+		    rs.lastDest != -1 && rs.code[rs.lastDest] == value) {
+		    // retarget the instruction that computed the value
+		    rs.code[rs.lastDest] = arg;
+		}
+		else {
+		    EmitMove(&rs, arg, value);
+		}
+		rs.lastDest = -1;
+	    }
+	    break;
+	case OP_LOCAL_BOX:
+	    EmitWord(&rs, ROP_UNBOX);
+	    EmitDestination(&rs, StackRegister(&rs, rs.sp));
+	    EmitWord(&rs, Operand(&rs, OPERAND_REG, arg));
+	    PushResult(&rs);
+	    break;
+	case OP_SET_LOCAL_BOX:
+	    EmitWord(&rs, ROP_SET_BOX);
+	    EmitWord(&rs, Operand(&rs, OPERAND_REG, arg));
+	    EmitWord(&rs, Pop(&rs));
+	    rs.lastDest = -1;
+	    break;
+	case OP_BOX_LOCAL:
+	    MaterializeReadersOf(&rs, arg);
+	    EmitWord(&rs, ROP_BOX);
+	    EmitDestination(&rs, arg);
+	    break;
+	case OP_CLOSURE:
+	    Push(&rs, Operand(&rs, OPERAND_CLOSURE, arg));
+	    break;
+	case OP_CLOSURE_BOX:
+	    EmitWord(&rs, ROP_UNBOX);
+	    EmitDestination(&rs, StackRegister(&rs, rs.sp));
+	    EmitWord(&rs, Operand(&rs, OPERAND_CLOSURE, arg));
+	    PushResult(&rs);
+	    break;
+	case OP_SET_CLOSURE_BOX:
+	    EmitWord(&rs, ROP_SET_BOX);
+	    EmitWord(&rs, Operand(&rs, OPERAND_CLOSURE, arg));
+	    EmitWord(&rs, Pop(&rs));
+	    rs.lastDest = -1;
+	    break;
+	case OP_MAKE_CLOSURE:
+	    {
+		int template = Pop(&rs);
+		rs.sp -= arg;
+		EmitWord(&rs, ROP_MAKE_CLOSURE);
+		EmitDestination(&rs, StackRegister(&rs, rs.sp));
+		EmitWord(&rs, template);
+		EmitWord(&rs, arg);
+		for (int i = 0; i < arg; i++) {
+		    EmitWord(&rs, rs.vstack[rs.sp + i]);
+		}
+		PushResult(&rs);
+	    }
+	    break;
+	case OP_UNCHECKED:
+	    // the primitive's global is underneath, so this is an ordinary call
+	    arg = uncheckedPrimitives[arg].arity;
+	    // fall through
+	case OP_APPLY: case OP_CALL_KNOWN: case OP_CALL_SELF:
+	    {
+		// arguments were pushed last-first, so the first is on top
+		int proc = op == OP_CALL_SELF ? OPERAND(OPERAND_SELF, 0) : Pop(&rs);
+		rs.sp -= arg;
+		MaterializeGlobals(&rs);
+		EmitWord(&rs, ROP_CALL);
+		EmitDestination(&rs, StackRegister(&rs, rs.sp));
+		EmitWord(&rs, proc);
+		EmitWord(&rs, arg);
+		for (int i = arg - 1; i >= 0; i--) {
+		    EmitWord(&rs, rs.vstack[rs.sp + i]);
+		}
+		PushResult(&rs);
+	    }
+	    break;
+	case OP_JUMP_FALSE: case OP_JUMP_TRUE: case OP_JUMP: case OP_JUMP_BACK:
+	    {
+		int target = (op == OP_JUMP_BACK) ? next - arg : next + arg;
+		if (op == OP_JUMP_BACK) op = OP_JUMP;
+		int condition = (op == OP_JUMP) ? 0 : Pop(&rs);
+		MaterializeAll(&rs);
+		if (op == OP_JUMP) {
+		    EmitWord(&rs, ROP_JUMP);
+		    reachable = 0;
+		}
+		else {
+		    EmitWord(&rs, op == OP_JUMP_FALSE ? ROP_JUMP_FALSE : ROP_JUMP_TRUE);
+		    EmitWord(&rs, condition);
+		}
+		fixups[nFixups] = rs.length;
+		fixupTargets[nFixups++] = target;
+		EmitWord(&rs, 0);
+		rs.lastDest = -1;
+	    }
+	    break;
+	case OP_CASE:
+	    {
+		// the jumps after OP_CASE become the instruction's targets
+		int key = Pop(&rs);
+		MaterializeAll(&rs);
+		EmitWord(&rs, ROP_CASE);
+		EmitWord(&rs, key);
+		EmitWord(&rs, arg);
+		int jumps = CaseClauses(VectorRef(DATA_AREA(FUNCTION, fn)->literals, arg)) + 1;
+		for (int i = 0; i < jumps; i++) {
+		    int jumpAt = next;
+		    next = DecodeInstruction(bytecode, jumpAt, &op, &arg);
+		    assert(op == OP_JUMP || op == OP_JUMP_BACK);
+		    translated[jumpAt] = rs.length;
+		    int target = op == OP_JUMP_BACK ? next - arg : next + arg;
+		    fixups[nFixups] = rs.length;
+		    fixupTargets[nFixups++] = target;
+		    EmitWord(&rs, 0);
+		}
+		reachable = 0;
+		rs.lastDest = -1;
+	    }
+	    break;
+	default:
+	    panic("register engine can't translate that opcode");
+	}
+	pc = next;
+    }
+    for (int i = 0; i < nFixups; i++) {
+	int target = translated[fixupTargets[i]];
+	assert(target != -1);
+	if (target > 0xffff) rs.tooBig = 1;
+	rs.code[fixups[i]] = target;
+    }
+    // An operand has room for 13 bits of index, and a jump for 16 bits of
+    // target. A function with more registers, literals or closure values
+    // than that, or too much code to jump across, is left to the stack
+    // interpreter: its register code is empty.
+    if (rs.tooBig) rs.length = 0;
+
+    Handle regcode = CreateBytevector(rs.length * 2);
+    uint8_t *bytes = BVEC_CONTENTS(regcode);
+    for (int i = 0; i < rs.length; i++) {
+	bytes[2*i] = rs.code[i] & 0xff;
+	bytes[2*i+1] = rs.code[i] >> 8;
+    }
+    free(rs.code);
+    free(rs.vstack);
+    free(depthAt);
+    free(isLabel);
+    free(translated);
+    free(fixups);
+    free(fixupTargets);
+    return regcode;
+}
+
 /* Disassembler */
 
-const char* OpcodeName(uint8_t);
+
+// returns the position of the next instruction
+int DecodeInstruction(Handle bytecode, int pos, uint8_t *op, int *arg) {
+    *op = BytevectorRef(bytecode, pos++);
+    *arg = 0;
+    if (*op > OPCODE_ARGUMENTS) {
+	*arg = BytevectorRef(bytecode, pos++);
+    }
+    else if (*op == OPCODE_BIG_ARG) {
+	*op = BytevectorRef(bytecode, pos++);
+	*arg = BytevectorRef(bytecode, pos) | BytevectorRef(bytecode, pos + 1) << 8;
+	pos += 2;
+    }
+    return pos;
+}
 
 void Disassemble(Handle fn) {
     FUNCTION *contents = DATA_AREA(FUNCTION, fn);
@@ -500,27 +3122,10 @@ void Disassemble(Handle fn) {
     printf("\nbytecode:\n");
     
     // bytecode disassembly
-    uint8_t *code = BVEC_CONTENTS(contents->bytecode);
-    FOR_IN_VECTOR(i, contents->bytecode) {
-	uint8_t op = code[i];
-	if (op < OPCODE_ARGUMENTS) {
-	    printf("%02x\t%-14s\n", op, OpcodeName(op));
-	}
-	else {
-	    uint8_t arg = code[++i];
-	    printf("%02x %02x\t%-14s %3d", op, arg, OpcodeName(op), arg);
-
-	    switch(op) {
-	    case OP_LITERAL: case OP_GLOBAL: case OP_SET_GLOBAL: {
-	        printf(" (");
-		Handle lit = VectorRef(contents->literals, arg);
-		DisplayObject(lit, stdout);
-		putchar(')');
-	    }
-	    default: break;
-	    }
-	    putchar('\n');
-	}
+    Handle bytecode = contents->bytecode;
+    for (int i = 0; i < BytevectorLength(bytecode);) {
+	i = DisassembleInstruction(fn, i, stdout);
+	putchar('\n');
     }
 
     // disassemble lambdas
@@ -536,6 +3141,137 @@ void Disassemble(Handle fn) {
     putchar('\n');
 }
 
+// print the instruction at `ip`, without a newline; returns the next ip
+int DisassembleInstruction(Handle fn, int ip, FILE *out) {
+    uint8_t op; int arg;
+    int next = DecodeInstruction(DATA_AREA(FUNCTION, fn)->bytecode, ip, &op, &arg);
+    if (op < OPCODE_ARGUMENTS) {
+	fprintf(out, "%02x\t%-14s", op, OpcodeName(op));
+    }
+    else {
+	if (next - ip > 2) {
+	    fprintf(out, "%02x %02x %02x %02x", OPCODE_BIG_ARG, op, arg & 0xff, arg >> 8);
+	}
+	else {
+	    fprintf(out, "%02x %02x", op, arg);
+	}
+	fprintf(out, "\t%-14s %3d", OpcodeName(op), arg);
+
+	switch(op) {
+	case OP_LITERAL: case OP_GLOBAL: case OP_SET_GLOBAL: case OP_GLOBAL_CELL:
+	case OP_CASE: {
+	    fprintf(out, " (");
+	    Handle lit = VectorRef(DATA_AREA(FUNCTION, fn)->literals, arg);
+	    // a global's cell is shown by the global's name
+	    DisplayObject(op == OP_GLOBAL_CELL ? Car(lit) : lit, out);
+	    fputc(')', out);
+	    break;
+	}
+	case OP_UNCHECKED:
+	    fprintf(out, " (%s)", uncheckedPrimitives[arg].name);
+	    break;
+	default: break;
+	}
+    }
+    return next;
+}
+
+void PrintOperand(int operand) {
+    int idx = OPERAND_INDEX(operand);
+    switch (OPERAND_KIND(operand)) {
+    case OPERAND_REG: printf(" r%d", idx); break;
+    case OPERAND_LITERAL: printf(" k%d", idx); break;
+    case OPERAND_GLOBAL: printf(" g%d", idx); break;
+    case OPERAND_NIL: printf(" nil"); break;
+    case OPERAND_CLOSURE: printf(" c%d", idx); break;
+    case OPERAND_SELF: printf(" self"); break;
+    default: printf(" ???"); break;
+    }
+}
+
+void DisassembleRegisterCode(Handle fn) {
+    EnsureRegisterCode(fn);
+    FUNCTION *contents = DATA_AREA(FUNCTION, fn);
+    printf("%d registers, %d vars\n",
+	   contents->nLocals + contents->stacksize, contents->nLocals);
+    printf("literals: ");
+    DisplayObject(contents->literals, stdout);
+    printf("\nregister code:\n");
+
+    Handle code = contents->regcode;
+    int length = BytevectorLength(code) / 2;
+    if (length == 0) printf("none; it runs on the stack interpreter\n");
+#define WORD(N) (BytevectorRef(code, 2*(N)) | BytevectorRef(code, 2*(N)+1) << 8)
+    for (int pc = 0; pc < length;) {
+	int op = WORD(pc);
+	printf("%4d\t", pc);
+	switch (op) {
+	case ROP_END: printf("end"); pc += 1; break;
+	case ROP_MOVE:
+	    printf("move          r%d", WORD(pc+1)); PrintOperand(WORD(pc+2));
+	    pc += 3; break;
+	case ROP_SET_GLOBAL:
+	    printf("set-global!   g%d", WORD(pc+1)); PrintOperand(WORD(pc+2));
+	    pc += 3; break;
+	case ROP_UNBOX:
+	    printf("unbox         r%d", WORD(pc+1)); PrintOperand(WORD(pc+2));
+	    pc += 3; break;
+	case ROP_SET_BOX:
+	    printf("set-box!     "); PrintOperand(WORD(pc+1)); PrintOperand(WORD(pc+2));
+	    pc += 3; break;
+	case ROP_BOX:
+	    printf("box!          r%d", WORD(pc+1));
+	    pc += 2; break;
+	case ROP_MAKE_CLOSURE: case ROP_CALL: {
+	    int n = WORD(pc+3);
+	    printf("%-13s r%d", op == ROP_CALL ? "call" : "make-closure", WORD(pc+1));
+	    PrintOperand(WORD(pc+2));
+	    printf(" /");
+	    for (int i = 0; i < n; i++) PrintOperand(WORD(pc+4+i));
+	    pc += 4 + n;
+	    break;
+	}
+	case ROP_RETURN:
+	    printf("return       "); PrintOperand(WORD(pc+1));
+	    pc += 2; break;
+	case ROP_JUMP:
+	    printf("jump          @%d", WORD(pc+1));
+	    pc += 2; break;
+	case ROP_JUMP_FALSE: case ROP_JUMP_TRUE:
+	    printf("%-13s", op == ROP_JUMP_FALSE ? "jump-false" : "jump-true");
+	    PrintOperand(WORD(pc+1));
+	    printf(" @%d", WORD(pc+2));
+	    pc += 3; break;
+	case ROP_CASE: {
+	    int n = CaseClauses(VectorRef(contents->literals, WORD(pc+2))) + 1;
+	    printf("case         ");
+	    PrintOperand(WORD(pc+1));
+	    printf(" k%d /", WORD(pc+2));
+	    for (int i = 0; i < n; i++) printf(" @%d", WORD(pc+3+i));
+	    pc += 3 + n;
+	    break;
+	}
+	default:
+	    printf("???"); pc += 1; break;
+	}
+	putchar('\n');
+    }
+#undef WORD
+
+    // translating the nested functions allocates, so `contents` goes stale
+    Handle literals = contents->literals;
+    FOR_IN_VECTOR(i, literals) {
+	Handle obj = VectorRef(literals, i);
+	if (TYPEOF(obj) == TYPE_FUNCTION) {
+	    putchar('\n');
+	    DisplayObject(obj, stdout);
+	    putchar('\n');
+	    DisassembleRegisterCode(obj);
+	}
+    }
+    putchar('\n');
+}
+
 const char* OpcodeName(uint8_t op) {
     switch(op) {
     case OP_END: return "end";
@@ -545,20 +3281,38 @@ const char* OpcodeName(uint8_t op) {
     case OP_DUP: return "dup";
     case OP_RETURN: return "return";
     case OP_NIL: return "nil";
-    case OP_BIND_CLOSURE: return "bind-closure!";
 
     case OP_LITERAL: return "literal";
     case OP_GLOBAL: return "global";
     case OP_SET_GLOBAL: return "set-global!";
     case OP_LOCAL: return "local";
     case OP_SET_LOCAL: return "set-local!";
+    case OP_LOCAL_BOX: return "local-box";
+    case OP_SET_LOCAL_BOX: return "set-local-box!";
+    case OP_BOX_LOCAL: return "box-local!";
     case OP_CLOSURE: return "closure";
-    case OP_SET_CLOSURE: return "set-closure!";
+    case OP_CLOSURE_BOX: return "closure-box";
+    case OP_SET_CLOSURE_BOX: return "set-closure-box!";
+    case OP_MAKE_CLOSURE: return "make-closure";
     case OP_APPLY: return "apply";
     case OP_TAIL_APPLY: return "tail-apply";
     case OP_JUMP_TRUE: return "jump-true";
     case OP_JUMP_FALSE: return "jump-false";
     case OP_JUMP: return "jump";
+    case OP_JUMP_BACK: return "jump-back";
+    case OP_CALL_KNOWN: return "call-known";
+    case OP_CALL_SELF: return "call-self";
+    case OP_UNCHECKED: return "unchecked";
+    case OP_CASE: return "case";
+    case OP_GLOBAL_CELL: return "global-cell";
+    case OP_APPLY_FUNCTION: return "apply-function";
+    case OP_APPLY_PRIMITIVE: return "apply-primitive";
+    case OP_ADD_INT: return "add-int";
+    case OP_SUB_INT: return "sub-int";
+    case OP_MUL_INT: return "mul-int";
+    case OP_EQUAL_INT: return "equal-int";
+    case OP_LESS_INT: return "less-int";
+    case OP_GREATER_INT: return "greater-int";
 	
     default: return "???";
     }
@@ -1,14 +1,403 @@
+#define _POSIX_C_SOURCE 200809L // for fmemopen
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "lilscheme.h"
 
+/* regression checks, run with -c */
+
+static int failures = 0;
+
+static void Check(const char *name, int ok) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    if (!ok) failures++;
+}
+
+// compile `source` as a file, run each form and return the last value
+static Handle Run(const char *source) {
+    FILE *in = fmemopen((void *)source, strlen(source), "r");
+    if (in == NULL) panic("can't read the test program");
+    Handle program = CompileFile(in);
+    fclose(in);
+    Retain(program);
+    Handle result = nil;
+    FOR_IN_VECTOR(i, program) result = StartInterpreter(VectorRef(program, i), nil);
+    Unretain(program);
+    return result;
+}
+
+static void CheckRun(const char *name, const char *source, int expected) {
+    Handle result = Run(source);
+    Check(name, TYPEOF(result) == TYPE_INT && UnboxInteger(result) == expected);
+}
+
+// the value of the global `name`
+static Handle Global(const char *name) {
+    return LookupGlobal(CreateSymbol(name));
+}
+
+// whether the bytecode of the function `fn` has an `op` instruction
+static int Uses(Handle fn, uint8_t op) {
+    Handle bytecode = DATA_AREA(FUNCTION, fn)->bytecode;
+    for (int pc = 0; pc < BytevectorLength(bytecode);) {
+	uint8_t found; int arg;
+	pc = DecodeInstruction(bytecode, pc, &found, &arg);
+	if (found == op) return 1;
+    }
+    return 0;
+}
+
+// a function of no arguments with `code` as its bytecode
+static Handle MakeFunction(const uint8_t *code, int length, int stacksize, int nLocals) {
+    Handle bytecode = CreateBytevector(length);
+    Retain(bytecode);
+    memcpy(BVEC_CONTENTS(bytecode), code, length);
+    Handle literals = CreateVector(0);
+    Retain(literals);
+    Handle fn = CreateFunctionFrom(stacksize, nLocals, 0, bytecode, literals);
+    Unretain(literals);
+    Unretain(bytecode);
+    return fn;
+}
+
+// Runs `fn` in a child process and says whether it aborted with `message`
+// on stderr, as the checked loop does with code that breaks the rules; the
+// trusted loop would read past the end of something instead.
+static int AbortsWith(Handle fn, const char *message) {
+    int fds[2];
+    if (pipe(fds) != 0) panic("can't make a pipe");
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == -1) panic("can't fork");
+    if (child == 0) {
+	dup2(fds[1], 2);
+	StartInterpreter(fn, nil);
+	_exit(0);
+    }
+    close(fds[1]);
+    char output[512];
+    int length = 0, n;
+    while ((n = read(fds[0], output + length, sizeof(output) - 1 - length)) > 0) {
+	length += n;
+    }
+    output[length] = '\0';
+    close(fds[0]);
+    int status;
+    if (waitpid(child, &status, 0) != child) panic("can't wait for the child");
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT &&
+	strstr(output, message) != NULL;
+}
+
+// the verifier has to refuse `code`, and the checked loop has to catch it
+static void CheckRefused(const char *name, const uint8_t *code, int length,
+			 int stacksize, int nLocals, const char *message) {
+    Handle fn = MakeFunction(code, length, stacksize, nLocals);
+    Retain(fn);
+    Check(name, !DATA_AREA(FUNCTION, fn)->verified && AbortsWith(fn, message));
+    Unretain(fn);
+}
+
+static void CheckVerifier() {
+    static const uint8_t badLocal[] = { OP_LOCAL, 5, OP_RETURN, OP_END };
+    CheckRefused("local out of range", badLocal, sizeof(badLocal), 1, 1,
+		 "vector index out of bounds");
+    static const uint8_t badJump[] = { OP_JUMP, 40, OP_NIL, OP_RETURN, OP_END };
+    CheckRefused("jump out of range", badJump, sizeof(badJump), 1, 0,
+		 "jumped out of the bytecode");
+    static const uint8_t underflow[] = { OP_DROP, OP_NIL, OP_RETURN, OP_END };
+    CheckRefused("stack underflow", underflow, sizeof(underflow), 1, 0, "sp >= 0");
+}
+
+static void CheckRegisterEngine() {
+    vmEngine = ENGINE_REGISTER;
+    // the optimizer used to leave this dead loop behind
+    CheckRun("dead named let, register engine",
+	     "(define (f p) (+ 0 (if 4 0 (* (let lp ((i 0)) (if (< i 5) (lp 0) i)) 0))))"
+	     "(f 1)", 0);
+    // a loop that's never entered, whose head only its own jump back
+    // reaches; the translator has to take its depth from the jumps
+    static const uint8_t deadLoop[] = {
+	OP_NIL, OP_RETURN,
+	OP_DROP, OP_NIL, OP_JUMP_BACK, 4,
+	OP_END
+    };
+    Handle fn = MakeFunction(deadLoop, sizeof(deadLoop), 1, 0);
+    Retain(fn);
+    Check("dead code after a return, register engine", StartInterpreter(fn, nil) == nil);
+    Unretain(fn);
+    vmEngine = ENGINE_STACK;
+}
+
+// A closure holds the values of its free variables and no more; one that's
+// assigned is shared in a box.
+static void CheckClosures() {
+    CheckRun("closures share an assigned variable",
+	     "(define (make-counter) (define n 0)"
+	     "  (cons (lambda () (set! n (+ n 1)) n) (lambda () n)))"
+	     "(define counter (make-counter))"
+	     "((car counter)) ((car counter))"
+	     "((cdr counter))", 2);
+    CheckRun("closure of an argument",
+	     "(define (adder a b c) (lambda (x) (+ x b)))"
+	     "(define add5 (adder 1 5 9))"
+	     "(add5 10)", 15);
+    Handle add5 = Global("add5"), counter = Car(Global("counter"));
+    Check("closure holds only its free variable",
+	  VectorLength(DATA_AREA(FUNCTION, add5)->closure) == 1);
+    Check("only an assigned variable is boxed",
+	  Uses(counter, OP_CLOSURE_BOX) && !Uses(add5, OP_CLOSURE_BOX));
+}
+
+// Binding forms use slots of the function they're in, and named let and do
+// loop with a jump back, not a call.
+static void CheckBindingForms() {
+    CheckRun("let binds in parallel",
+	     "(define (swap a b) (let ((a b) (b a)) (- a b))) (swap 1 10)", 9);
+    CheckRun("let* sees each binding before it",
+	     "(let* ((x 1) (x (+ x 1)) (y (* x 10))) (+ x y))", 22);
+    CheckRun("letrec of mutually recursive procedures",
+	     "(letrec ((ev? (lambda (n) (if (= n 0) 1 (od? (- n 1)))))"
+	     "         (od? (lambda (n) (if (= n 0) 0 (ev? (- n 1))))))"
+	     "  (+ (ev? 10) (od? 7)))", 2);
+    CheckRun("named let",
+	     "(define (sum-to n) (let loop ((i 0) (acc 0))"
+	     "  (if (> i n) acc (loop (+ i 1) (+ acc i)))))"
+	     "(sum-to 100)", 5050);
+    CheckRun("do",
+	     "(define (sum-below n) (do ((i 0 (+ i 1)) (s 0 (+ s i))) ((= i n) s)))"
+	     "(sum-below 10)", 45);
+    Handle sumTo = Global("sum-to"), sumBelow = Global("sum-below");
+    Check("named let and do loop without closures",
+	  Uses(sumTo, OP_JUMP_BACK) && !Uses(sumTo, OP_MAKE_CLOSURE) &&
+	  Uses(sumBelow, OP_JUMP_BACK) && !Uses(sumBelow, OP_MAKE_CLOSURE));
+}
+
+// Running code quickens its global loads and calls, and a quickened call
+// goes back to the general case when what it calls changes.
+static void CheckQuickening() {
+    CheckRun("quickened integer arithmetic",
+	     "(define (add a b) (+ a b)) (add 1 2) (add 20 22)", 42);
+    Handle add = Global("add");
+    Check("arithmetic on integers quickens",
+	  Uses(add, OP_ADD_INT) && Uses(add, OP_GLOBAL_CELL));
+    CheckRun("quickened global load sees the global change",
+	     "(define k 1) (define (get-k) k) (get-k) (set! k 5) (get-k)", 5);
+    CheckRun("quickened call to a function",
+	     "(define (g x) (+ x 1)) (define (call-g y) (g y)) (call-g 1)", 2);
+    Check("call to a function quickens", Uses(Global("call-g"), OP_APPLY_FUNCTION));
+    CheckRun("quickened call when a primitive replaces the function",
+	     "(set! g car) (call-g (cons 7 8))", 7);
+    Check("call quickens again for a primitive", Uses(Global("call-g"), OP_APPLY_PRIMITIVE));
+}
+
+// A primitive call whose argument types are proven calls the primitive
+// unchecked; one whose checks could fail keeps them.
+static void CheckTypeInference() {
+    CheckRun("pair? test proves a pair",
+	     "(define (first-of l) (if (pair? l) (car l) 0))"
+	     "(+ (first-of (cons 5 6)) (first-of 3))", 5);
+    CheckRun("loop variable proven an integer",
+	     "(define (count-up n) (let loop ((i 0)) (if (= i n) i (loop (+ i 1)))))"
+	     "(count-up 7)", 7);
+    CheckRun("unproven argument", "(define (any-car p) (car p)) (any-car (cons 4 5))", 4);
+    Check("proven calls are unchecked",
+	  Uses(Global("first-of"), OP_UNCHECKED) && Uses(Global("count-up"), OP_UNCHECKED));
+    Check("unproven call keeps its checks", !Uses(Global("any-car"), OP_UNCHECKED));
+}
+
+// With lazy compilation a lambda is a stub until it's first called, and
+// then it runs as if compiled up front.
+static void CheckLazyCompilation() {
+    lazyCompile = 1;
+    CheckRun("lazily compiled procedure",
+	     "(define (twice y) (* y 2)) (define (unused) (car 1)) (twice 21)", 42);
+    Check("procedure not called stays a stub",
+	  DATA_AREA(FUNCTION, Global("unused"))->stacksize == 0 &&
+	  DATA_AREA(FUNCTION, Global("twice"))->stacksize != 0);
+    CheckRun("lazily compiled closure",
+	     "(define (make-adder a) (let ((b 2)) (lambda (c) (+ a b c))))"
+	     "((make-adder 1) 3)", 6);
+    vmEngine = ENGINE_REGISTER;
+    CheckRun("lazily compiled closure, register engine",
+	     "(define (make-adder a) (let ((b 2)) (lambda (c) (+ a b c))))"
+	     "((make-adder 1) 3)", 6);
+    vmEngine = ENGINE_STACK;
+    lazyCompile = 0;
+}
+
+// cond, and case with dense and sparse keys, which dispatches with a table
+static void CheckCondAndCase() {
+    CheckRun("cond",
+	     "(define (sign n) (cond ((< n 0) 1) ((= n 0) 2) (else 3)))"
+	     "(+ (sign (- 0 5)) (+ (* 10 (sign 0)) (* 100 (sign 5))))", 321);
+    CheckRun("cond clause of only a test", "(cond ((quote ()) 1) (7))", 7);
+    CheckRun("cond clause with =>",
+	     "(define (inc x) (+ x 1)) (cond ((+ 2 3) => inc) (else 0))", 6);
+    static const char dense[] =
+	"(define (classify x) (case x ((1 2 3) 1) ((4) 20) ((a b) 300) (else 4000)))"
+	"(+ (classify 2) (+ (classify 4) (+ (classify (quote b)) (classify 99))))";
+    static const char sparse[] =
+	"(define (sparse x) (case x ((1) 1) ((1000) 20) ((100000) 300) (else 4000)))"
+	"(+ (sparse 1) (+ (sparse 1000) (+ (sparse 100000) (sparse 5))))";
+    CheckRun("case with dense keys", dense, 4321);
+    CheckRun("case with sparse keys", sparse, 4321);
+    Check("case dispatches with a table",
+	  Uses(Global("classify"), OP_CASE) && Uses(Global("sparse"), OP_CASE));
+    vmEngine = ENGINE_REGISTER;
+    CheckRun("case with dense keys, register engine", dense, 4321);
+    CheckRun("case with sparse keys, register engine", sparse, 4321);
+    vmEngine = ENGINE_STACK;
+}
+
+// (let* ((v0 0) (v1 (+ v0 1)) ...) vN), inside a procedure or not
+static void CheckLongLetStar(const char *name, int bindings, int inProcedure) {
+    char *source = malloc(bindings * 32 + 64);
+    if (source == NULL) panic("out of memory for the test program");
+    char *p = source;
+    p += sprintf(p, "%s(let* ((v0 0)", inProcedure ? "(define (f) " : "");
+    for (int i = 1; i < bindings; i++) p += sprintf(p, " (v%d (+ v%d 1))", i, i - 1);
+    sprintf(p, ") v%d)%s", bindings - 1, inProcedure ? ") (f)" : "");
+    CheckRun(name, source, bindings - 1);
+    free(source);
+}
+
+// `head`, then `n` copies of `form` with any %d in it counting up from 0,
+// then `tail`; the caller frees it
+static char *Repeat(const char *head, const char *form, int n, const char *tail) {
+    char *source = malloc(strlen(head) + n * (strlen(form) + 8) + strlen(tail) + 1);
+    if (source == NULL) panic("out of memory for the test program");
+    char *p = source + sprintf(source, "%s", head);
+    for (int i = 0; i < n; i++) p += sprintf(p, form, i);
+    sprintf(p, "%s", tail);
+    return source;
+}
+
+// CheckRun for a program that fills much of the heap. Collecting only when
+// it's full, not every second allocation, keeps it from taking a while.
+static void CheckLargeRun(const char *name, char *source, int expected) {
+    SetGCFrequency(0);
+    CheckRun(name, source, expected);
+    SetGCFrequency(2);
+    free(source);
+}
+
+// (define (f) (set! x (+ x 1)) ... x), `forms` of them
+static void CheckLargeProcedure(const char *name, int forms) {
+    CheckLargeRun(name, Repeat("(define x 0) (define (f)", " (set! x (+ x 1))", forms,
+			       " x) (f)"), forms);
+}
+
+// An operand of the register engine has 13 bits for an index, and a jump
+// 16 bits for its target; a function that needs more runs on the stack
+// interpreter. Both engines have to run these the same.
+static void CheckWideFunctions(ENGINE engine) {
+    const char *suffix = engine == ENGINE_REGISTER ? ", register engine" : "";
+    char name[100];
+    vmEngine = engine;
+    snprintf(name, sizeof(name), "more than 8192 literals%s", suffix);
+    CheckLargeRun(name, Repeat("(define last 0) (define (h x) (set! last x)) (define (f)",
+			       " (h %d)", 8300, " last) (f)"), 8299);
+    // more than 64K of bytecode, then a loop
+    snprintf(name, sizeof(name), "jumps past 64K of bytecode%s", suffix);
+    CheckLargeRun(name, Repeat("(define (h a b c d e f g i) 0) (define (f x)",
+			       " (h x x x x x x x x)", 3400,
+			       " (let loop ((i 0)) (if (< i x) (loop (+ i 1)) i))) (f 5)"), 5);
+    // closure value 8192, which the compiler would need as many variables for
+    static const uint8_t code[] = {
+	OPCODE_BIG_ARG, OP_CLOSURE, 0x00, 0x20, OP_RETURN, OP_END
+    };
+    Handle template = MakeFunction(code, sizeof(code), 1, 0);
+    Retain(template);
+    Handle values = CreateVector(0x2001);
+    Retain(values);
+    VectorSet(values, 0x2000, CreateInteger(7));
+    Handle fn = CreateClosure(template, values);
+    Retain(fn);
+    Handle result = StartInterpreter(fn, nil);
+    snprintf(name, sizeof(name), "closure value 8192%s", suffix);
+    Check(name, TYPEOF(result) == TYPE_INT && UnboxInteger(result) == 7);
+    Unretain(fn);
+    Unretain(values);
+    Unretain(template);
+    vmEngine = ENGINE_STACK;
+}
+
+static int RunChecks() {
+    // a loop that only its own jump back reaches is dead code
+    CheckRun("dead loop after a constant test",
+	     "(define (f p) (if (quote ()) (* (do ((i 0 (+ i 1))) ((= i 1) i)) p) 0))"
+	     "(f 3)", 0);
+    CheckRegisterEngine();
+    CheckVerifier();
+    CheckClosures();
+    CheckBindingForms();
+    CheckQuickening();
+    CheckTypeInference();
+    CheckLazyCompilation();
+    CheckCondAndCase();
+    // each binding used to copy the rest of the expansion again, with the
+    // collector off
+    CheckLongLetStar("let* with hundreds of bindings", 400, 1);
+    CheckLongLetStar("let* with hundreds of bindings at top level", 400, 0);
+    CheckLargeProcedure("procedure of thousands of forms", 6000);
+    CheckWideFunctions(ENGINE_STACK);
+    CheckWideFunctions(ENGINE_REGISTER);
+    // these replace a primitive, so they come last
+    CheckRun("unchecked call when its primitive is replaced",
+	     "(define first car)"
+	     "(define car cdr)"
+	     "(define r (first-of (cons 1 2)))"
+	     "(set! car first)"
+	     "r", 2);
+    CheckRun("primitive replaced later in the file",
+	     "(define plus +)"
+	     "(define + (lambda (a b) (* a b)))"
+	     "(define r (+ 5 6))"
+	     "(set! + plus)"
+	     "r", 30);
+    sealPrograms = 1;
+    CheckRun("primitive replaced later in a sealed program",
+	     "(define plus +)"
+	     "(define + (lambda (a b) (* a b)))"
+	     "(define r (+ 5 6))"
+	     "(set! + plus)"
+	     "r", 30);
+    sealPrograms = 0;
+    return failures > 0;
+}
+
 int main(int argc, char **argv) {
     Handle code, fn;
+    // -r shows the register engine's translation as well
+    int showRegisters = (argc > 1 && strcmp(argv[1], "-r") == 0);
+    // -s compiles all of stdin as a sealed program
+    int sealed = (argc > 1 && strcmp(argv[1], "-s") == 0);
+    // -c runs the regression checks instead of reading anything
+    int checks = (argc > 1 && strcmp(argv[1], "-c") == 0);
     
     puts("compiler test");    
     InitMem();
+    ConstructPrimitives();
     DisplayObject(CreateSymbol("ready"), stdout);
     puts("");
 
+    if (checks) return RunChecks();
+
+    if (sealed) {
+	sealPrograms = 1;
+	Handle program = CompileFile(stdin);
+	Retain(program);
+	FOR_IN_VECTOR(i, program) {
+	    Disassemble(VectorRef(program, i));
+	    putchar('\n');
+	}
+	Unretain(program);
+	return 0;
+    }
+
     while(!(feof(stdin) || ferror(stdin))) {
 	code = ReadObject(stdin);
 	putchar('\n');
@@ -17,7 +406,10 @@ int main(int argc, char **argv) {
 	    DisplayObject(code, stdout);
 	    putchar('\n');
 	    fn = Compile(code, COMPILER_MODE_REPL);
+	    Retain(fn);
 	    Disassemble(fn);
+	    if (showRegisters) DisassembleRegisterCode(fn);
+	    Unretain(fn);
 	    putchar('\n');
 	    Unretain(code);
 	}
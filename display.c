@@ -3,44 +3,24 @@
 #include <stdio.h>
 #include "lilscheme.h"
 
-void DisplayCons(Handle, FILE*);
-void DisplayVector(Handle, FILE*);
-
 void DisplayObject(Handle hnd, FILE *output) {
-    switch(TYPEOF(hnd)) {
-    case TYPE_NIL:
-	fputs("nil", output);
-	break;
-    case TYPE_INT:
-	fprintf(output, "%d", UnboxInteger(hnd));
-	break;
-    case TYPE_FLOAT:
-	fprintf(output, "%f", UnboxFloat(hnd));
-	break;
-    case TYPE_SYMBOL:
-	fprintf(output, "%s", NameOfSymbol(hnd));
-	break;
-    case TYPE_CONS:
-	DisplayCons(hnd, output);
-	break;
-    case TYPE_VECTOR:
-	DisplayVector(hnd, output);
-	break;
-    case TYPE_BYTEVECTOR:
-	fprintf(output, "<bytevector #%hd>", hnd);
-	break;
-    case TYPE_FUNCTION:
-	fprintf(output, "<function #%hd>", hnd);
-	break;
-    case TYPE_CONTEXT:
-	fprintf(output, "<continuation #%hd>", hnd);
-	break;
-    case TYPE_PRIMITIVE:
-	fprintf(output, "<primitive #%hd>", hnd);
-	break;
-    default:
-	panic("can't DisplayObject that type");
-    }
+    typeInfo[TYPEOF(hnd)].display(hnd, output);
+}
+
+void DisplayNil(Handle hnd, FILE *output) {
+    fputs("nil", output);
+}
+
+void DisplayInteger(Handle hnd, FILE *output) {
+    fprintf(output, "%d", UnboxInteger(hnd));
+}
+
+void DisplayFloat(Handle hnd, FILE *output) {
+    fprintf(output, "%f", UnboxFloat(hnd));
+}
+
+void DisplaySymbol(Handle hnd, FILE *output) {
+    fprintf(output, "%s", NameOfSymbol(hnd));
 }
 
 void DisplayCons(Handle hnd, FILE *output) {
@@ -72,39 +52,21 @@ void DisplayVector(Handle hnd, FILE *output) {
     fputc(')', output);
 }
 
+void DisplayOpaque(Handle hnd, FILE *output) {
+    fprintf(output, "<%s #%hd>", typeInfo[TYPEOF(hnd)].label, hnd);
+}
+
+// what an object holds is shown as handles, not followed
 void DumpObject(Handle hnd, FILE *output) {
-    switch(TYPEOF(hnd)) {
-    case TYPE_NIL:
-	fputs("nil", output);
-	break;
-    case TYPE_INT:
-	fprintf(output, "%d", UnboxInteger(hnd));
-	break;
-    case TYPE_FLOAT:
-	fprintf(output, "%f", UnboxFloat(hnd));
-	break;
-    case TYPE_SYMBOL:
-	fprintf(output, "'%s", NameOfSymbol(hnd));
-	break;
-    case TYPE_CONS:
-	fprintf(output, "(#%hd . #%hd)", Car(hnd), Cdr(hnd));
-	break;
-    case TYPE_VECTOR: {
-	fputs("#(", output);
-	FOR_IN_VECTOR(i, hnd) {
-	    if (i > 0) fputc(' ', output);
-	    fprintf(output, "#%hd", VectorRef(hnd, i));
-	}
-	fputc(')', output);
-	break;
-    }
-    case TYPE_BYTEVECTOR:
-	fprintf(output, "{BVEC#%hd}", hnd);
-	break;
-    case TYPE_FUNCTION:
-	fprintf(output, "{FUNC#%hd}", hnd);
-	break;
-    default:
-	panic("can't DumpObject that type");
+    const TYPEINFO *type = &typeInfo[TYPEOF(hnd)];
+    if (type->flags & POINTER_FREE) {
+	if (TYPEOF(hnd) == TYPE_SYMBOL) fputc('\'', output);
+	type->display(hnd, output);
+	return;
     }
+    int count;
+    Handle *references = type->references(DATA_AREA(void, hnd), &count);
+    fprintf(output, "{%s", type->typeOf);
+    for (int i = 0; i < count; i++) fprintf(output, " #%hd", references[i]);
+    fputc('}', output);
 }
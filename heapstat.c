@@ -0,0 +1,370 @@
+/* heapstat.c - analyze a heap snapshot */
+
+// usage: heapstat SNAPSHOT [HANDLE...]
+//
+// Reads a snapshot written by WriteHeapSnapshot() and prints a histogram of
+// objects by type, the largest objects, and the dominator tree weighted by
+// retained size. An object's retained size is what a collection would free
+// if it became garbage. For each HANDLE given, this also prints the shortest
+// path to it from a root.
+//
+// This doesn't link against the runtime; the snapshot says everything but
+// the handle limit, which comes from lilscheme.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lilscheme.h"
+
+#define ROOT MAX_HANDLES        // a node standing for all the roots
+#define NODES (MAX_HANDLES + 1)
+#define NONE -1
+
+#define LARGEST_OBJECTS 10
+#define TREE_DEPTH 8
+#define TREE_CUTOFF 0.01        // leave out subtrees smaller than this share
+
+typedef struct node {
+    int present;
+    char type[32];
+    size_t size;
+    int nEdges;
+    int *edges;
+    char label[64];     // symbol name or integer value
+    char rootKind[16];  // set if this object is a root
+    // analysis
+    int order;          // position in reverse postorder, or NONE
+    int idom;           // immediate dominator
+    size_t retained;
+    int pathParent;     // on a shortest path from the roots
+} NODE;
+
+static NODE nodes[NODES];
+static int rpo[NODES];  // reachable nodes in reverse postorder
+static int nReachable = 0;
+
+static void Fail(const char *message) {
+    fprintf(stderr, "heapstat: %s\n", message);
+    exit(1);
+}
+
+static void AddEdge(int from, int to) {
+    NODE *n = &nodes[from];
+    n->edges = realloc(n->edges, (n->nEdges + 1) * sizeof(int));
+    if (n->edges == NULL) Fail("out of memory");
+    n->edges[n->nEdges++] = to;
+}
+
+static int ValidHandle(int h) {
+    return h >= 0 && h < MAX_HANDLES;
+}
+
+static void ReadSnapshot(FILE *in) {
+    char word[32];
+    int version, h;
+    if (fscanf(in, "%31s %d", word, &version) != 2 ||
+	strcmp(word, "lilscheme-heap") != 0 || version != 1) {
+	Fail("not a heap snapshot");
+    }
+    nodes[ROOT].present = 1;
+    strcpy(nodes[ROOT].type, "(roots)");
+    while (fscanf(in, "%31s", word) == 1) {
+	if (strcmp(word, "root") == 0) {
+	    char kind[16];
+	    if (fscanf(in, "%15s %d", kind, &h) != 2 || !ValidHandle(h)) break;
+	    if (nodes[h].rootKind[0] == '\0') strcpy(nodes[h].rootKind, kind);
+	    AddEdge(ROOT, h);
+	}
+	else if (strcmp(word, "object") == 0) {
+	    int count;
+	    if (fscanf(in, "%d", &h) != 1 || !ValidHandle(h)) break;
+	    NODE *n = &nodes[h];
+	    n->present = 1;
+	    if (fscanf(in, "%31s %zu %d", n->type, &n->size, &count) != 3) break;
+	    for (int i = 0; i < count; i++) {
+		int to;
+		if (fscanf(in, "%d", &to) != 1 || !ValidHandle(to)) Fail("bad edge");
+		AddEdge(h, to);
+	    }
+	}
+	else if (strcmp(word, "name") == 0 || strcmp(word, "value") == 0) {
+	    if (fscanf(in, "%d", &h) != 1 || !ValidHandle(h) ||
+		fscanf(in, "%63s", nodes[h].label) != 1) break;
+	}
+	else break;
+    }
+    if (!feof(in)) Fail("malformed heap snapshot");
+}
+
+static void Describe(int h) {
+    NODE *n = &nodes[h];
+    if (h == ROOT) {
+	printf("(roots)");
+	return;
+    }
+    printf("#%d %s", h, n->type);
+    if (n->label[0] != '\0') printf(" %s", n->label);
+    if (n->rootKind[0] != '\0') printf(" [root: %s]", n->rootKind);
+}
+
+
+/* Histogram and largest objects */
+
+typedef struct typecount {
+    char *type;
+    int count;
+    size_t bytes;
+} TYPECOUNT;
+
+static int CompareTypeCounts(const void *a, const void *b) {
+    size_t x = ((TYPECOUNT*)a)->bytes, y = ((TYPECOUNT*)b)->bytes;
+    return (x < y) - (x > y);
+}
+
+static int CompareSizes(const void *a, const void *b) {
+    size_t x = nodes[*(int*)a].size, y = nodes[*(int*)b].size;
+    return (x < y) - (x > y);
+}
+
+static size_t PrintHistogram() {
+    TYPECOUNT types[32];
+    int nTypes = 0, nObjects = 0;
+    size_t total = 0;
+    for (int h = 0; h < MAX_HANDLES; h++) {
+	if (!nodes[h].present) continue;
+	int t;
+	for (t = 0; t < nTypes; t++) {
+	    if (strcmp(types[t].type, nodes[h].type) == 0) break;
+	}
+	if (t == nTypes) {
+	    if (nTypes == 32) Fail("too many types");
+	    types[nTypes++] = (TYPECOUNT){ nodes[h].type, 0, 0 };
+	}
+	types[t].count++;
+	types[t].bytes += nodes[h].size;
+	nObjects++;
+	total += nodes[h].size;
+    }
+    qsort(types, nTypes, sizeof(TYPECOUNT), CompareTypeCounts);
+    printf("%d objects, %zu bytes\n\n", nObjects, total);
+    printf("%-20s %8s %10s %7s\n", "type", "count", "bytes", "%");
+    for (int t = 0; t < nTypes; t++) {
+	printf("%-20s %8d %10zu %7.2f\n", types[t].type, types[t].count,
+	       types[t].bytes, total ? 100.0 * types[t].bytes / total : 0.0);
+    }
+    return total;
+}
+
+static void PrintLargest() {
+    int *handles = malloc(MAX_HANDLES * sizeof(int));
+    if (handles == NULL) Fail("out of memory");
+    int n = 0;
+    for (int h = 0; h < MAX_HANDLES; h++) {
+	if (nodes[h].present) handles[n++] = h;
+    }
+    qsort(handles, n, sizeof(int), CompareSizes);
+    printf("\nlargest objects\n");
+    for (int i = 0; i < n && i < LARGEST_OBJECTS; i++) {
+	printf("%10zu  ", nodes[handles[i]].size);
+	Describe(handles[i]);
+	putchar('\n');
+    }
+    free(handles);
+}
+
+
+/* Dominators */
+
+// Number the nodes reachable from the roots in reverse postorder
+static void OrderNodes() {
+    static int stack[NODES], next[NODES];
+    static int postorder[NODES];
+    int nPost = 0, depth = 0;
+    for (int h = 0; h < NODES; h++) nodes[h].order = NONE;
+
+    stack[depth] = ROOT;
+    next[depth++] = 0;
+    nodes[ROOT].order = 0;  // marks it visited
+    while (depth > 0) {
+	int h = stack[depth - 1];
+	if (next[depth - 1] < nodes[h].nEdges) {
+	    int to = nodes[h].edges[next[depth - 1]++];
+	    if (nodes[to].present && nodes[to].order == NONE) {
+		nodes[to].order = 0;
+		stack[depth] = to;
+		next[depth++] = 0;
+	    }
+	}
+	else {
+	    postorder[nPost++] = h;
+	    depth--;
+	}
+    }
+    for (int i = 0; i < nPost; i++) {
+	int h = postorder[nPost - 1 - i];
+	rpo[i] = h;
+	nodes[h].order = i;
+    }
+    nReachable = nPost;
+}
+
+static int Intersect(int a, int b) {
+    while (a != b) {
+	while (nodes[a].order > nodes[b].order) a = nodes[a].idom;
+	while (nodes[b].order > nodes[a].order) b = nodes[b].idom;
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm, over predecessor lists
+static void ComputeDominators() {
+    // predecessors, as one array indexed by offsets
+    int *start = calloc(NODES + 1, sizeof(int));
+    if (start == NULL) Fail("out of memory");
+    for (int i = 0; i < nReachable; i++) {
+	NODE *n = &nodes[rpo[i]];
+	for (int e = 0; e < n->nEdges; e++) {
+	    if (nodes[n->edges[e]].present) start[n->edges[e] + 1]++;
+	}
+    }
+    for (int h = 0; h < NODES; h++) start[h + 1] += start[h];
+    int *preds = malloc((start[NODES] + 1) * sizeof(int));
+    int *fill = malloc(NODES * sizeof(int));
+    if (preds == NULL || fill == NULL) Fail("out of memory");
+    memcpy(fill, start, NODES * sizeof(int));
+    for (int i = 0; i < nReachable; i++) {
+	NODE *n = &nodes[rpo[i]];
+	for (int e = 0; e < n->nEdges; e++) {
+	    if (nodes[n->edges[e]].present) preds[fill[n->edges[e]]++] = rpo[i];
+	}
+    }
+
+    for (int h = 0; h < NODES; h++) nodes[h].idom = NONE;
+    nodes[ROOT].idom = ROOT;
+    int changed = 1;
+    while (changed) {
+	changed = 0;
+	for (int i = 1; i < nReachable; i++) {
+	    int h = rpo[i];
+	    int idom = NONE;
+	    for (int p = start[h]; p < start[h + 1]; p++) {
+		int pred = preds[p];
+		if (nodes[pred].idom == NONE) continue;
+		idom = (idom == NONE) ? pred : Intersect(pred, idom);
+	    }
+	    if (nodes[h].idom != idom) {
+		nodes[h].idom = idom;
+		changed = 1;
+	    }
+	}
+    }
+    free(start);
+    free(preds);
+    free(fill);
+
+    // children come after their dominators in reverse postorder
+    for (int i = nReachable - 1; i >= 0; i--) {
+	int h = rpo[i];
+	nodes[h].retained += nodes[h].size;
+	if (h != ROOT) nodes[nodes[h].idom].retained += nodes[h].retained;
+    }
+}
+
+static size_t treeCutoff;
+
+static int CompareRetained(const void *a, const void *b) {
+    size_t x = nodes[*(int*)a].retained, y = nodes[*(int*)b].retained;
+    return (x < y) - (x > y);
+}
+
+static void PrintDominatorTree(int h, int depth) {
+    printf("%*s%10zu  ", depth * 2, "", nodes[h].retained);
+    Describe(h);
+    putchar('\n');
+    if (depth == TREE_DEPTH) return;
+
+    int *children = malloc(nReachable * sizeof(int));
+    if (children == NULL) Fail("out of memory");
+    int n = 0, hidden = 0;
+    for (int i = 0; i < nReachable; i++) {
+	int c = rpo[i];
+	if (c == ROOT || nodes[c].idom != h) continue;
+	if (nodes[c].retained >= treeCutoff) children[n++] = c;
+	else hidden++;
+    }
+    qsort(children, n, sizeof(int), CompareRetained);
+    for (int i = 0; i < n; i++) PrintDominatorTree(children[i], depth + 1);
+    if (hidden > 0) {
+	printf("%*s(%d smaller)\n", (depth + 1) * 2 + 12, "", hidden);
+    }
+    free(children);
+}
+
+
+/* Paths */
+
+static void FindShortestPaths() {
+    static int queue[NODES];
+    int head = 0, tail = 0;
+    for (int h = 0; h < NODES; h++) nodes[h].pathParent = NONE;
+    queue[tail++] = ROOT;
+    nodes[ROOT].pathParent = ROOT;
+    while (head < tail) {
+	int h = queue[head++];
+	for (int e = 0; e < nodes[h].nEdges; e++) {
+	    int to = nodes[h].edges[e];
+	    if (nodes[to].present && nodes[to].pathParent == NONE) {
+		nodes[to].pathParent = h;
+		queue[tail++] = to;
+	    }
+	}
+    }
+}
+
+static void PrintPath(int target) {
+    printf("\npath to #%d\n", target);
+    if (!ValidHandle(target) || !nodes[target].present) {
+	printf("  no such object\n");
+	return;
+    }
+    if (nodes[target].pathParent == NONE) {
+	printf("  unreachable\n");
+	return;
+    }
+    static int path[NODES];
+    int n = 0;
+    for (int h = target; h != ROOT; h = nodes[h].pathParent) path[n++] = h;
+    for (int i = n - 1; i >= 0; i--) {
+	printf("  ");
+	Describe(path[i]);
+	putchar('\n');
+    }
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s SNAPSHOT [HANDLE...]\n", argv[0]);
+	return 1;
+    }
+    FILE *in = fopen(argv[1], "r");
+    if (in == NULL) {
+	perror(argv[1]);
+	return 1;
+    }
+    ReadSnapshot(in);
+    fclose(in);
+
+    size_t total = PrintHistogram();
+    PrintLargest();
+
+    OrderNodes();
+    ComputeDominators();
+    treeCutoff = total * TREE_CUTOFF;
+    printf("\ndominator tree (retained bytes)\n");
+    PrintDominatorTree(ROOT, 0);
+
+    FindShortestPaths();
+    for (int i = 2; i < argc; i++) PrintPath(atoi(argv[i]));
+    return 0;
+}
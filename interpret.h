@@ -0,0 +1,326 @@
+/* interpret.h - the stack engine's main loop */
+
+// This is included by vm.c, more than once. INTERPRET names the function
+// and the PROFILE_ macros are hooks for the profiler, which expand to
+// nothing in the ordinary build of the loop. If TRUSTED is 1, the loop only
+// runs functions that VerifyFunction has passed, so it reads and writes the
+// stack, locals and literals without checking the index, and fetches
+// instructions straight from the bytecode. Closure variables are still
+// checked, since the verifier can't see the closure.
+
+#if TRUSTED
+#define REF UncheckedRef
+#define SET UncheckedSet
+#define FETCH(N) (BVEC_CONTENTS(bytecode)[N])
+#else
+#define REF VectorRef
+#define SET VectorSet
+#define FETCH(N) BytevectorRef(bytecode, N)
+#endif
+
+Handle INTERPRET(Handle context) {
+    Handle function, literals, locals, stack, closure;
+    Handle priorContext;
+    Handle bytecode;
+    Handle proc;
+    int ip, sp;
+    int at;            // where the current instruction starts
+
+    uint8_t op; int arg = 0;
+    Handle returnValue = nil;
+
+    // unpack the context
+ init:
+    currentContext = context;
+    if (context == nil) goto terminate;
+    else
+    {
+	SAMPLE_POINT();
+	CONTEXT *cxt = DATA_AREA(CONTEXT, context);
+	function = cxt->function;
+	FUNCTION *fn = DATA_AREA(FUNCTION, function);
+	literals = fn->literals;
+	closure = fn->closure;
+	locals = cxt->locals;
+	stack = cxt->stack;
+	bytecode = fn->bytecode;
+	ip = cxt->ip;
+	sp = cxt->sp;
+	priorContext = cxt->prior;
+#if TRUSTED
+	// the checked loop takes over from here, for this call and the rest
+	if (!fn->verified) return InterpretChecked(context);
+#endif
+	if (fn->native != NULL) goto native;
+    }
+
+    // fetch the current instruction
+    
+ fetch:
+#if !TRUSTED
+    // a jump the verifier would have refused can land anywhere
+    if (ip < 0 || ip >= BytevectorLength(bytecode)) panic("jumped out of the bytecode");
+#endif
+    PROFILE_FETCH(function, ip);
+    at = ip;
+    op = FETCH(ip);
+    ip++;
+    if (op > OPCODE_ARGUMENTS) {
+	arg = FETCH(ip);
+	ip++;
+    }
+    else if (op == OPCODE_BIG_ARG) {
+	op = FETCH(ip);
+	arg = FETCH(ip + 1) | FETCH(ip + 2) << 8;
+	ip += 3;
+    }
+
+    
+    // now dispatch
+    switch (op) {
+    case OP_END:
+	// we put this here to catch off-by-one errors;
+	panic("end of code; did not return");
+	break;
+    case OP_NOP:
+	// nop
+	break;
+    case OP_DROP:
+	// remove top-of-stack
+	sp--;
+	break;
+    case OP_DUP:
+	PUSH(TOS());
+	break;
+    case OP_NIL:
+	PUSH(nil);
+	break;
+    case OP_RETURN:
+	returnValue = POP();
+	PROFILE_RETURN(function);
+	goto leave;
+
+    case OP_LITERAL:
+	PUSH(REF(literals, arg));
+	break;
+    case OP_GLOBAL:
+	PROFILE_GLOBAL(REF(literals, arg));
+	{
+	    Handle cell = AlistGet(globals, REF(literals, arg));
+	    if (cell == nil) panic("undefined global");
+	    QuickenGlobal(bytecode, at, literals, cell);
+	    PUSH(Cdr(cell));
+	}
+	break;
+    case OP_GLOBAL_CELL:
+	PROFILE_GLOBAL(Car(REF(literals, arg)));
+	PUSH(Cdr(REF(literals, arg)));
+	break;
+    case OP_SET_GLOBAL:
+	SetGlobal(REF(literals, arg), POP());
+	break;
+    case OP_LOCAL:
+	PUSH(REF(locals, arg));
+	break;
+    case OP_SET_LOCAL:
+	SET(locals, arg, POP());
+	break;
+    case OP_LOCAL_BOX:
+	PUSH(Unbox(REF(locals, arg)));
+	break;
+    case OP_SET_LOCAL_BOX:
+	SetBox(REF(locals, arg), POP());
+	break;
+    case OP_BOX_LOCAL:
+	SET(locals, arg, CreateBox(REF(locals, arg)));
+	break;
+    case OP_CLOSURE:
+	PUSH(VectorRef(closure, arg));
+	break;
+    case OP_CLOSURE_BOX:
+	PUSH(Unbox(VectorRef(closure, arg)));
+	break;
+    case OP_SET_CLOSURE_BOX:
+	SetBox(VectorRef(closure, arg), POP());
+	break;
+    case OP_MAKE_CLOSURE:
+	{
+	    // the template and captured values stay reachable through the
+	    // stack vector until they're overwritten
+	    Handle template = POP();
+	    if (jitThreshold > 0) NoteCall(template);
+	    Handle values = CreateVector(arg);
+	    Retain(values);
+	    for (int i = arg - 1; i >= 0; i--) {
+		VectorSet(values, i, POP());
+	    }
+	    PUSH(CreateClosure(template, values));
+	    Unretain(values);
+	}
+	break;
+    case OP_APPLY:
+	proc = POP();
+    apply:
+	// quicken for what's being applied, or quicken again if that changed
+	if (TYPEOF(proc) == TYPE_FUNCTION) {
+	    Quicken(bytecode, at, OP_APPLY_FUNCTION);
+	    goto call;
+	}
+	if (TYPEOF(proc) != TYPE_PRIMITIVE) {
+	    panic("attempted to call a non-procedure");
+	}
+	Quicken(bytecode, at, QuickenedPrimitiveCall(proc, stack, sp, arg));
+    primitive:
+	{
+	    Handle argv = CreateVector(arg);
+	    sp = LoadArgumentsFromStack(stack, sp, argv, arg);
+	    Handle result = CallPrimitive(proc, argv);
+	    PUSH(result);
+	}
+	break;
+    case OP_UNCHECKED:
+	// the primitive's value from its global is on top of the arguments,
+	// for when the primitives can't be trusted any more
+	proc = POP();
+	if (!primitivesReplaced) {
+	    const UNCHECKED *u = &uncheckedPrimitives[arg];
+	    Handle a = POP();
+	    Handle b = u->arity == 2 ? POP() : nil;
+	    PUSH(u->call(a, b));
+	    break;
+	}
+	arg = uncheckedPrimitives[arg].arity;
+	if (TYPEOF(proc) == TYPE_FUNCTION) goto call;
+	if (TYPEOF(proc) == TYPE_PRIMITIVE) goto primitive;
+	panic("attempted to call a non-procedure");
+    case OP_APPLY_FUNCTION:
+	proc = POP();
+	if (TYPEOF(proc) == TYPE_FUNCTION) goto call;
+	goto apply;
+    case OP_APPLY_PRIMITIVE:
+	proc = POP();
+	if (TYPEOF(proc) == TYPE_PRIMITIVE) goto primitive;
+	goto apply;
+    case OP_ADD_INT: case OP_SUB_INT: case OP_MUL_INT:
+    case OP_EQUAL_INT: case OP_LESS_INT: case OP_GREATER_INT:
+	// the same primitive as last time, on two integers; the first
+	// argument is on top
+	proc = POP();
+	{
+	    Handle a = REF(stack, sp - 1), b = REF(stack, sp - 2);
+	    if (TYPEOF(proc) == TYPE_PRIMITIVE &&
+		DATA_AREA(PRIMITIVE, proc)->quickened == op &&
+		TYPEOF(a) == TYPE_INT && TYPEOF(b) == TYPE_INT) {
+		sp -= 2;
+		PUSH(IntegerOperation(op, a, b));
+		break;
+	    }
+	}
+	goto apply;
+    case OP_CALL_KNOWN:
+	// the compiler knows this is a function
+	proc = POP();
+	goto call;
+    case OP_CALL_SELF:
+	proc = function;
+	goto call;
+    case OP_TAIL_APPLY:
+	panic("tail-apply not implented");
+	break;
+    case OP_JUMP_TRUE:
+	if (POP() != nil) ip += arg;
+	break;
+    case OP_JUMP_FALSE:
+	if (POP() == nil) ip += arg;
+	break;
+    case OP_JUMP:
+	ip += arg;
+	break;
+    case OP_JUMP_BACK:
+	ip -= arg;
+	SAMPLE_POINT();
+	break;
+    case OP_CASE:
+	// the jumps after this are all big, so the table's choice is found
+	// without decoding any of them
+	ip += 4 * CaseIndex(REF(literals, arg), POP());
+	break;
+	
+    case OP_INVALID:
+	panic("runaway fall-through in VM dispatch");
+    default:
+	panic("invalid opcode");
+    }
+#if !TRUSTED
+    assert(sp >= 0);
+#endif
+    goto fetch;
+
+ call:
+    // call the function `proc` with `arg` arguments from the stack; this
+    // context resumes at `ip`
+    EnsureCompiled(proc);
+    if (jitThreshold > 0) NoteCall(proc);
+    PROFILE_CALL(proc);
+    TRACE_FUNCTION('B', proc);
+    {
+	Handle newContext = CreateContext(proc, currentContext);
+	CONTEXT *cxt = DATA_AREA(CONTEXT, newContext);
+	sp = LoadArgumentsFromStack(stack, sp, cxt->locals, arg);
+	cxt = DATA_AREA(CONTEXT, currentContext);
+	cxt->sp = sp;
+	cxt->ip = ip;
+	context = newContext;
+	goto init;
+    }
+
+ leave:
+    // return `returnValue` to the prior context
+    // if there is no context, leave the interpreter
+    TRACE_FUNCTION('E', function);
+    context = currentContext = priorContext;
+    if (context == nil) goto terminate;
+    else
+    {
+	CONTEXT *cxt = DATA_AREA(CONTEXT, context);
+	sp = cxt->sp;
+	stack = cxt->stack;
+	PUSH(returnValue);
+	cxt->sp = sp;
+	goto init;
+    }
+
+ native:
+    // run compiled machine code until it returns or makes a call
+    {
+	JITFRAME frame;
+	PROFILE_NATIVE(function);
+	frame.function = function;
+	frame.stack = stack;
+	frame.locals = locals;
+	frame.literals = literals;
+	frame.closure = closure;
+	frame.sp = sp;
+	switch (RunNativeCode(function, &frame, ip)) {
+	case JIT_RETURN:
+	    returnValue = frame.result;
+	    PROFILE_RETURN(function);
+	    goto leave;
+	case JIT_CALL:
+	    sp = frame.sp;
+	    ip = frame.ip;
+	    proc = frame.callee;
+	    arg = frame.nargs;
+	    goto call;
+	default:
+	    panic("native code exited strangely");
+	}
+    }
+    
+ terminate:
+    return returnValue;
+}
+
+#undef REF
+#undef SET
+#undef FETCH
@@ -0,0 +1,453 @@
+/* jit.c - template JIT compiler for x86-64 */
+
+// Once a function has been called `jitThreshold` times, its bytecode is
+// translated into machine code. Each instruction becomes a call to a small
+// helper routine below, so the code does the same work the interpreter does
+// without fetching and dispatching. Jumps become native jumps. Calls to
+// Scheme functions and returns still go through Interpret(), which resumes
+// the machine code at the instruction after the call.
+
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lilscheme.h"
+
+int jitThreshold = 0;
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__NetBSD__))
+#include <sys/mman.h>
+
+#define CODE_AREA_SIZE (4*1024*1024)
+
+typedef int (*NATIVEPTR)(JITFRAME*, void*);
+
+typedef struct JitCode {
+    NATIVECODE header;
+    NATIVEPTR entry;
+    int length;        // of the bytecode
+    int *offsets;      // bytecode position -> machine code position, or -1
+    struct JitCode *next;
+} JITCODE;
+
+// Machine code is never freed, even when its function is collected, so the
+// records describing it are kept here for the life of the process.
+static JITCODE *allCode = NULL;
+
+static uint8_t *codeArea = NULL;
+static size_t codeUsed = 0;
+static int jitBroken = 0;     // set if we couldn't get executable memory
+static FILE *perfMap = NULL;
+
+/* Helpers called from the machine code */
+
+#define POP() (VectorRef(f->stack, --f->sp))
+#define PUSH(_H) (VectorSet(f->stack, f->sp, _H),f->sp++)
+#define TOS() (VectorRef(f->stack, f->sp-1))
+
+static void JitDrop(JITFRAME *f, int arg) { f->sp--; }
+static void JitDup(JITFRAME *f, int arg) { PUSH(TOS()); }
+static void JitNil(JITFRAME *f, int arg) { PUSH(nil); }
+static void JitReturn(JITFRAME *f, int arg) { f->result = POP(); }
+
+static void JitLiteral(JITFRAME *f, int arg) {
+    PUSH(VectorRef(f->literals, arg));
+}
+
+static void JitGlobal(JITFRAME *f, int arg) {
+    PUSH(LookupGlobal(VectorRef(f->literals, arg)));
+}
+
+static void JitGlobalCell(JITFRAME *f, int arg) {
+    PUSH(Cdr(VectorRef(f->literals, arg)));
+}
+
+static void JitSetGlobal(JITFRAME *f, int arg) {
+    SetGlobal(VectorRef(f->literals, arg), POP());
+}
+
+static void JitLocal(JITFRAME *f, int arg) {
+    PUSH(VectorRef(f->locals, arg));
+}
+
+static void JitSetLocal(JITFRAME *f, int arg) {
+    VectorSet(f->locals, arg, POP());
+}
+
+static void JitLocalBox(JITFRAME *f, int arg) {
+    PUSH(Unbox(VectorRef(f->locals, arg)));
+}
+
+static void JitSetLocalBox(JITFRAME *f, int arg) {
+    SetBox(VectorRef(f->locals, arg), POP());
+}
+
+static void JitBoxLocal(JITFRAME *f, int arg) {
+    VectorSet(f->locals, arg, CreateBox(VectorRef(f->locals, arg)));
+}
+
+static void JitClosure(JITFRAME *f, int arg) {
+    PUSH(VectorRef(f->closure, arg));
+}
+
+static void JitClosureBox(JITFRAME *f, int arg) {
+    PUSH(Unbox(VectorRef(f->closure, arg)));
+}
+
+static void JitSetClosureBox(JITFRAME *f, int arg) {
+    SetBox(VectorRef(f->closure, arg), POP());
+}
+
+static void JitMakeClosure(JITFRAME *f, int arg) {
+    Handle template = POP();
+    NoteCall(template);
+    Handle values = CreateVector(arg);
+    Retain(values);
+    for (int i = arg - 1; i >= 0; i--) {
+	VectorSet(values, i, POP());
+    }
+    PUSH(CreateClosure(template, values));
+    Unretain(values);
+}
+
+// returns nonzero if the code should jump
+static int JitTestFalse(JITFRAME *f, int arg) { return POP() == nil; }
+static int JitTestTrue(JITFRAME *f, int arg) { return POP() != nil; }
+
+// returns which of the jumps after OP_CASE to take
+static int JitCase(JITFRAME *f, int arg) {
+    return CaseIndex(VectorRef(f->literals, arg), POP());
+}
+
+// Primitives are called right here. For functions, returns nonzero so the
+// code exits to the interpreter, which makes the call.
+static int JitApply(JITFRAME *f, int arg, int next) {
+    Handle proc = POP();
+    switch (TYPEOF(proc)) {
+    case TYPE_FUNCTION:
+	f->callee = proc;
+	f->nargs = arg;
+	f->ip = next;
+	return 1;
+    case TYPE_PRIMITIVE:
+	{
+	    Handle argv = CreateVector(arg);
+	    for (int i = 0; i < arg; i++) {
+		VectorSet(argv, i, POP());
+	    }
+	    Handle result = CallPrimitive(proc, argv);
+	    PUSH(result);
+	}
+	return 0;
+    default:
+	panic("attempted to call a non-procedure");
+	return 0;
+    }
+}
+
+// the primitive's work done here, unless a primitive has been replaced and
+// this has to be an ordinary call
+static int JitUnchecked(JITFRAME *f, int arg, int next) {
+    const UNCHECKED *u = &uncheckedPrimitives[arg];
+    if (primitivesReplaced) return JitApply(f, u->arity, next);
+    f->sp--;
+    Handle a = POP();
+    Handle b = u->arity == 2 ? POP() : nil;
+    PUSH(u->call(a, b));
+    return 0;
+}
+
+// known calls always exit to the interpreter
+static int JitCallKnown(JITFRAME *f, int arg, int next) {
+    f->callee = POP();
+    f->nargs = arg;
+    f->ip = next;
+    return 1;
+}
+
+static int JitCallSelf(JITFRAME *f, int arg, int next) {
+    f->callee = f->function;
+    f->nargs = arg;
+    f->ip = next;
+    return 1;
+}
+
+static void JitEnd(JITFRAME *f, int arg) {
+    panic("end of code; did not return");
+}
+
+static void *HelperFor(uint8_t op) {
+    switch (op) {
+    case OP_END: return JitEnd;
+    case OP_DROP: return JitDrop;
+    case OP_DUP: return JitDup;
+    case OP_NIL: return JitNil;
+    case OP_RETURN: return JitReturn;
+    case OP_LITERAL: return JitLiteral;
+    case OP_GLOBAL: return JitGlobal;
+    case OP_GLOBAL_CELL: return JitGlobalCell;
+    case OP_SET_GLOBAL: return JitSetGlobal;
+    case OP_LOCAL: return JitLocal;
+    case OP_SET_LOCAL: return JitSetLocal;
+    case OP_LOCAL_BOX: return JitLocalBox;
+    case OP_SET_LOCAL_BOX: return JitSetLocalBox;
+    case OP_BOX_LOCAL: return JitBoxLocal;
+    case OP_CLOSURE: return JitClosure;
+    case OP_CLOSURE_BOX: return JitClosureBox;
+    case OP_SET_CLOSURE_BOX: return JitSetClosureBox;
+    case OP_MAKE_CLOSURE: return JitMakeClosure;
+    case OP_APPLY: return JitApply;
+    case OP_CALL_KNOWN: return JitCallKnown;
+    case OP_CALL_SELF: return JitCallSelf;
+    case OP_UNCHECKED: return JitUnchecked;
+    case OP_JUMP_FALSE: return JitTestFalse;
+    case OP_JUMP_TRUE: return JitTestTrue;
+    case OP_CASE: return JitCase;
+    default: return NULL;
+    }
+}
+
+// instructions that are compiled without a helper
+static int IsInline(uint8_t op) {
+    return op == OP_NOP || op == OP_JUMP || op == OP_JUMP_BACK;
+}
+
+/* Machine code emission */
+
+typedef struct emitter {
+    uint8_t *code;
+    size_t pos;
+    size_t limit;
+} EMITTER;
+
+static void Byte(EMITTER *e, uint8_t b) {
+    if (e->pos < e->limit) e->code[e->pos] = b;
+    e->pos++;
+}
+
+static void Dword(EMITTER *e, uint32_t d) {
+    for (int i = 0; i < 4; i++) Byte(e, (d >> (8*i)) & 0xff);
+}
+
+static void Qword(EMITTER *e, uint64_t q) {
+    for (int i = 0; i < 8; i++) Byte(e, (q >> (8*i)) & 0xff);
+}
+
+static void PatchDword(EMITTER *e, size_t at, uint32_t d) {
+    for (int i = 0; i < 4; i++) {
+	if (at + i < e->limit) e->code[at + i] = (d >> (8*i)) & 0xff;
+    }
+}
+
+// call helper(frame, arg, next)
+static void EmitHelperCall(EMITTER *e, void *helper, int arg, int next) {
+    Byte(e, 0x48); Byte(e, 0x89); Byte(e, 0xdf);       // mov rdi, rbx
+    Byte(e, 0xbe); Dword(e, arg);                      // mov esi, arg
+    Byte(e, 0xba); Dword(e, next);                     // mov edx, next
+    Byte(e, 0x48); Byte(e, 0xb8); Qword(e, (uint64_t)helper); // mov rax, helper
+    Byte(e, 0xff); Byte(e, 0xd0);                      // call rax
+}
+
+static void EmitExit(EMITTER *e, int status) {
+    Byte(e, 0xb8); Dword(e, status);                   // mov eax, status
+    Byte(e, 0x5b);                                     // pop rbx
+    Byte(e, 0xc3);                                     // ret
+}
+
+// jump (or jump if eax is nonzero) to a bytecode position; returns where the
+// displacement goes so it can be fixed up
+static size_t EmitJump(EMITTER *e, int conditional) {
+    if (conditional) {
+	Byte(e, 0x85); Byte(e, 0xc0);                  // test eax, eax
+	Byte(e, 0x0f); Byte(e, 0x85);                  // jnz rel32
+    }
+    else {
+	Byte(e, 0xe9);                                 // jmp rel32
+    }
+    size_t at = e->pos;
+    Dword(e, 0);
+    return at;
+}
+
+/* Compilation */
+
+static int JitRun(NATIVECODE *nc, JITFRAME *frame, int ip) {
+    JITCODE *jc = (JITCODE*)nc;
+    assert(ip < jc->length && jc->offsets[ip] != -1);
+    return jc->entry(frame, (uint8_t*)(void*)jc->entry + jc->offsets[ip]);
+}
+
+// The code area is never writable and executable at once. The pages from
+// the first free byte on are made writable while a function is emitted
+// there, then executable again. No machine code runs in between, since the
+// only thread is busy compiling.
+static int ProtectCodeArea(int prot) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = codeUsed / page * page;
+    return mprotect(codeArea + start, CODE_AREA_SIZE - start, prot) == 0;
+}
+
+static int InitCodeArea() {
+    if (codeArea != NULL) return 1;
+    if (jitBroken) return 0;
+    void *area = mmap(NULL, CODE_AREA_SIZE, PROT_READ|PROT_WRITE,
+		      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (area != MAP_FAILED && mprotect(area, CODE_AREA_SIZE, PROT_READ|PROT_EXEC) != 0) {
+	munmap(area, CODE_AREA_SIZE);
+	area = MAP_FAILED;
+    }
+    if (area == MAP_FAILED) {
+	fputs("jit: no executable memory; interpreting everything\n", stderr);
+	jitBroken = 1;
+	return 0;
+    }
+    codeArea = area;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+    perfMap = fopen(name, "w");
+    return 1;
+}
+
+static void WritePerfMap(Handle fn, void *start, size_t size) {
+    if (perfMap == NULL) return;
+    Handle name = GlobalNameOf(fn);
+    if (name != nil) {
+	fprintf(perfMap, "%lx %zx scheme:%s\n",
+		(unsigned long)start, size, NameOfSymbol(name));
+    }
+    else {
+	fprintf(perfMap, "%lx %zx scheme:lambda#%hd\n",
+		(unsigned long)start, size, fn);
+    }
+    fflush(perfMap);
+}
+
+// returns 0 if the function uses an instruction we can't compile
+static int Compilable(Handle bytecode) {
+    int length = BytevectorLength(bytecode);
+    for (int pc = 0; pc < length;) {
+	uint8_t op; int arg;
+	pc = DecodeInstruction(bytecode, pc, &op, &arg);
+	if (IsApply(op)) op = OP_APPLY;
+	if (HelperFor(op) == NULL && !IsInline(op)) return 0;
+    }
+    return 1;
+}
+
+static void JitCompile(Handle fn) {
+    Handle bytecode = DATA_AREA(FUNCTION, fn)->bytecode;
+    if (!Compilable(bytecode) || !InitCodeArea()) return;
+    if (!ProtectCodeArea(PROT_READ|PROT_WRITE)) return;
+
+    int length = BytevectorLength(bytecode);
+    int *offsets = malloc((length + 1) * sizeof(int));
+    size_t *fixupAt = malloc((length + 1) * sizeof(size_t));
+    int *fixupTarget = malloc((length + 1) * sizeof(int));
+    if (!offsets || !fixupAt || !fixupTarget) panic("out of memory in JIT");
+    int nFixups = 0;
+    for (int i = 0; i <= length; i++) offsets[i] = -1;
+
+    EMITTER e;
+    e.code = codeArea + codeUsed;
+    e.pos = 0;
+    e.limit = CODE_AREA_SIZE - codeUsed;
+
+    // entry: rdi = frame, rsi = where to start
+    Byte(&e, 0x53);                                    // push rbx
+    Byte(&e, 0x48); Byte(&e, 0x89); Byte(&e, 0xfb);    // mov rbx, rdi
+    Byte(&e, 0xff); Byte(&e, 0xe6);                    // jmp rsi
+
+    for (int pc = 0; pc < length;) {
+	uint8_t op; int arg;
+	int next = DecodeInstruction(bytecode, pc, &op, &arg);
+	// the interpreter may have quickened the code; JitApply covers every
+	// kind of call
+	if (IsApply(op)) op = OP_APPLY;
+	offsets[pc] = e.pos;
+	switch (op) {
+	case OP_NOP:
+	    break;
+	case OP_JUMP: case OP_JUMP_BACK:
+	    fixupAt[nFixups] = EmitJump(&e, 0);
+	    fixupTarget[nFixups++] = (op == OP_JUMP) ? next + arg : next - arg;
+	    break;
+	case OP_JUMP_FALSE: case OP_JUMP_TRUE:
+	    EmitHelperCall(&e, HelperFor(op), arg, next);
+	    fixupAt[nFixups] = EmitJump(&e, 1);
+	    fixupTarget[nFixups++] = next + arg;
+	    break;
+	case OP_CASE:
+	    // the jumps that follow are five bytes each
+	    EmitHelperCall(&e, HelperFor(op), arg, next);
+	    Byte(&e, 0x89); Byte(&e, 0xc0);                  // mov eax, eax
+	    Byte(&e, 0x48); Byte(&e, 0x8d); Byte(&e, 0x04); Byte(&e, 0x80); // lea rax, [rax+rax*4]
+	    Byte(&e, 0x48); Byte(&e, 0x8d); Byte(&e, 0x0d); Dword(&e, 5);   // lea rcx, [rip+5]
+	    Byte(&e, 0x48); Byte(&e, 0x01); Byte(&e, 0xc8);  // add rax, rcx
+	    Byte(&e, 0xff); Byte(&e, 0xe0);                  // jmp rax
+	    break;
+	case OP_RETURN:
+	    EmitHelperCall(&e, HelperFor(op), arg, next);
+	    EmitExit(&e, JIT_RETURN);
+	    break;
+	case OP_APPLY: case OP_CALL_KNOWN: case OP_CALL_SELF: case OP_UNCHECKED:
+	    {
+		EmitHelperCall(&e, HelperFor(op), arg, next);
+		Byte(&e, 0x85); Byte(&e, 0xc0);        // test eax, eax
+		Byte(&e, 0x74); Byte(&e, 7);           // jz past the exit
+		EmitExit(&e, JIT_CALL);                // 7 bytes
+	    }
+	    break;
+	default:
+	    EmitHelperCall(&e, HelperFor(op), arg, next);
+	    break;
+	}
+	pc = next;
+    }
+    offsets[length] = e.pos;
+    for (int i = 0; i < nFixups; i++) {
+	size_t at = fixupAt[i];
+	int target = offsets[fixupTarget[i]];
+	assert(target != -1);
+	PatchDword(&e, at, (uint32_t)(target - (int)(at + 4)));
+    }
+    free(fixupAt);
+    free(fixupTarget);
+    if (!ProtectCodeArea(PROT_READ|PROT_EXEC)) panic("can't make machine code executable");
+
+    if (e.pos > e.limit) {
+	// out of room; leave this one and everything after it interpreted
+	free(offsets);
+	codeUsed = CODE_AREA_SIZE;
+	return;
+    }
+
+    JITCODE *jc = malloc(sizeof(JITCODE));
+    if (jc == NULL) panic("out of memory in JIT");
+    jc->header.run = JitRun;
+    jc->entry = (NATIVEPTR)(void*)e.code;
+    jc->length = length;
+    jc->offsets = offsets;
+    jc->next = allCode;
+    allCode = jc;
+    WritePerfMap(fn, e.code, e.pos);
+    codeUsed += (e.pos + 15) & ~(size_t)15;
+    DATA_AREA(FUNCTION, fn)->native = &jc->header;
+}
+
+void NoteCall(Handle fn) {
+    FUNCTION *f = DATA_AREA(FUNCTION, fn);
+    if (f->native != NULL) return;
+    if (++f->calls == jitThreshold) {
+	JitCompile(fn);
+    }
+}
+
+#else
+
+// no code generator for this machine; everything is interpreted
+
+void NoteCall(Handle fn) {}
+
+#endif
@@ -6,25 +6,66 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <assert.h>
+#include <signal.h>
+
+// How much the runtime checks for itself, chosen when it's built, as in
+// `make SAFETY=1`:
+//
+//   2  debug: every handle is checked as it's dereferenced
+//   1  checked: handles are trusted, but types and vector bounds are still
+//      checked, so a bad program panics rather than crashing
+//   0  fast: none of those are checked
+//
+// Everything has to be built at the same level, so `make clean` first.
+#ifndef SAFETY
+#define SAFETY 2
+#endif
 
 /* memory manager */
 
-// Type dispatches can be found in the MM, the display code, the compiler, some
-// of the primitives, and `util.c`.
+// Every type, in the order of their numbers, which code caches depend on.
+// The columns are the type; the size of its data; its flags; the name
+// type-of gives it; what it displays as, if it has no printed form of its
+// own; where the handles one holds are; and how to display one. A type
+// whose objects hold no handles is POINTER_FREE, and the collector never
+// looks inside them. A new type is one more line here.
+#define LISP_TYPES(X)                                                            \
+    X(TYPE_NIL,        0,                  POINTER_FREE,                         \
+      "nil",                 NULL,           NULL,               DisplayNil)     \
+    X(TYPE_INT,        sizeof(int),        POINTER_FREE | SELF_EVALUATING,       \
+      "integer",             NULL,           NULL,               DisplayInteger) \
+    X(TYPE_FLOAT,      sizeof(double),     POINTER_FREE | SELF_EVALUATING,       \
+      "float",               NULL,           NULL,               DisplayFloat)   \
+    X(TYPE_CONS,       sizeof(CONS),       0,                                    \
+      "pair",                NULL,           ConsReferences,     DisplayCons)    \
+    X(TYPE_SYMBOL,     0,                  POINTER_FREE,                         \
+      "symbol",              NULL,           NULL,               DisplaySymbol)  \
+    X(TYPE_VECTOR,     sizeof(VECTOR),     SELF_EVALUATING,                      \
+      "vector",              NULL,           VectorReferences,   DisplayVector)  \
+    X(TYPE_BYTEVECTOR, sizeof(BYTEVECTOR), POINTER_FREE | SELF_EVALUATING,       \
+      "bytevector",          "bytevector",   NULL,               DisplayOpaque)  \
+    X(TYPE_FUNCTION,   sizeof(FUNCTION),   0,                                    \
+      "procedure",           "function",     FunctionReferences, DisplayOpaque)  \
+    X(TYPE_PRIMITIVE,  sizeof(PRIMITIVE),  POINTER_FREE,                         \
+      "primitive-procedure", "primitive",    NULL,               DisplayOpaque)  \
+    X(TYPE_CONTEXT,    sizeof(CONTEXT),    0,                                    \
+      "continuation",        "continuation", ContextReferences,  DisplayOpaque)  \
+    X(TYPE_BOX,        sizeof(BOX),        0,                                    \
+      "box",                 "box",          BoxReferences,      DisplayOpaque)
 
 typedef enum LispTypes {
-    TYPE_NIL,
-    TYPE_INT,
-    TYPE_FLOAT,
-    TYPE_CONS,
-    TYPE_SYMBOL,
-    TYPE_VECTOR,
-    TYPE_BYTEVECTOR,
-    TYPE_FUNCTION,
-    TYPE_PRIMITIVE,
-    TYPE_CONTEXT,
+#define X(TYPE, SIZE, FLAGS, NAME, LABEL, REFERENCES, DISPLAY) TYPE,
+    LISP_TYPES(X)
+#undef X
+    TYPE_COUNT
 } OBJTYPE;
 
+// sets of types, for the compiler's type inference
+#define TYPE_BIT(t) (1 << (t))
+#define TYPES_ANY (TYPE_BIT(TYPE_COUNT) - 1)
+#define TYPES_BOOLEAN (TYPE_BIT(TYPE_SYMBOL) | TYPE_BIT(TYPE_NIL))
+#define TYPES_NUMERIC (TYPE_BIT(TYPE_INT) | TYPE_BIT(TYPE_FLOAT))
+
 // other types:
 // TYPE_STRING
 // TYPE_BOOLEAN
@@ -34,6 +75,7 @@ typedef enum LispTypes {
 
 
 typedef uint16_t Handle;
+#define MAX_HANDLES 0xffff   // entries in the object table, so handles are below this
 typedef struct LispObject {
     OBJTYPE type;
     size_t size; // includes the type and size fields
@@ -44,12 +86,29 @@ extern OBJ **objectTable;
 
 OBJ *Dereference(Handle);
 
-//#define DEREF(HND) (objectTable[(HND)])
+#if SAFETY >= 2
 #define DEREF(HND) Dereference((HND))
+#else
+#define DEREF(HND) (objectTable[(HND)])
+#endif
 #define DATA_AREA(TYPE,hnd) ((TYPE*)&(DEREF((hnd))->data))
 #define DATA_DEREF(TYPE,hnd) *DATA_AREA(TYPE,(hnd))
 #define TYPEOF(hnd) DEREF((hnd))->type
 
+// what the runtime knows about each type, from LISP_TYPES
+#define POINTER_FREE 1         // holds no handles
+#define SELF_EVALUATING 2      // a constant when it's compiled
+typedef struct TypeInfo {
+    const char *name;          // "TYPE_CONS", for debugging
+    size_t size;               // of an object with no extra data
+    int flags;
+    const char *typeOf;
+    const char *label;         // or NULL
+    Handle *(*references)(void *data, int *count); // the handles in `data`
+    void (*display)(Handle, FILE*);
+} TYPEINFO;
+extern const TYPEINFO typeInfo[];
+
 
 extern void *heap;
 
@@ -64,6 +123,7 @@ void* AllocRawMem(size_t);
 Handle CreateObject(OBJTYPE,size_t);
 void GarbageCollect();
 void ExtendObject(Handle, size_t);
+extern int depthFirstCollection; // 0 to copy in plain breadth-first order
 
 // Regarding Retain: the system might throw an error in the middle of
 // native-code object construction. Some way to unretain such objects after
@@ -71,12 +131,26 @@ void ExtendObject(Handle, size_t);
 // during such construction, and unretain everything after a catch
 void Retain(Handle);
 void Unretain(Handle);
+int RootMark();
+Handle PushRoot(Handle);
+void PopRoots(int);
 // void UnretainEverything();
 void EnableGC();
 void DisableGC();
+void MakeRoom();
 
 void InspectAllObjects();
 
+typedef struct MemStats {
+    unsigned long allocations;
+    unsigned long bytesAllocated;
+    unsigned long collections;
+    unsigned long bytesCopied;
+} MEMSTATS;
+extern MEMSTATS memStats;
+void SetGCFrequency(int);
+void WriteHeapSnapshot(FILE*);
+
 /* Types */
 
 Handle CreateInteger(int);
@@ -101,12 +175,23 @@ void SetCar(Handle, Handle);
 void SetCdr(Handle, Handle);
 
 int ListLength(Handle);
+int ListIndex(Handle, Handle);
+Handle ListAdjoin(Handle, Handle);
 Handle AlistGet(Handle, Handle);
 Handle AlistSet(Handle, Handle, Handle);
 
+typedef struct LispBox {
+    Handle value;
+} BOX;
+Handle CreateBox(Handle);
+Handle Unbox(Handle);
+void SetBox(Handle, Handle);
+
 Handle CreateSymbol(const char*);
+Handle CreateUninternedSymbol(const char*);
 Handle FindSymbolNamed(const char*);
 char *NameOfSymbol(Handle);
+unsigned SymbolHash(Handle);
 #define SYM(s) (CreateSymbol(#s))
 
 #define LISP_FALSE nil
@@ -121,7 +206,11 @@ Handle CreateVector(int);
 int VectorLength(Handle);
 Handle VectorRef(Handle, int);
 void VectorSet(Handle, int, Handle);
+#if SAFETY > 0
 void VectorBoundsCheck(Handle, int);
+#else
+#define VectorBoundsCheck(HND, IDX) ((void)(HND))
+#endif
 //Handle VectorFill(Handle, Handle);
 Handle VectorFromList(Handle);
 void ResizeVector(Handle, int);
@@ -148,17 +237,41 @@ typedef struct LispFunction {
     int arguments;
     Handle bytecode;
     Handle literals;
-    Handle closure;
+    Handle closure;    // vector of captured values, or nil
+    Handle regcode;    // register engine translation, or nil until needed;
+                       // empty if it runs on the stack interpreter
+    int calls;         // counted toward JIT compilation
+    struct NativeCode *native; // compiled machine code, or NULL
+    struct FunctionProfile *profile; // profiler's counts, or NULL
+    int verified;      // passed VerifyFunction, so runs without bounds checks
+    Handle name;       // the global it was first bound to, or nil; symbols
+                       // live for good, so the collector doesn't trace it
 } FUNCTION;
-//Handle CreateFunction(int,int,Handle,Handle);
+Handle CreateFunctionFrom(int, int, int, Handle, Handle);
+Handle CreateClosure(Handle, Handle);
 
 
 /* I/O */
 void DisplayObject(Handle, FILE*); // for machine-readable output
 void DumpObject(Handle, FILE*);    // for debugging
+void DisplayNil(Handle, FILE*);
+void DisplayInteger(Handle, FILE*);
+void DisplayFloat(Handle, FILE*);
+void DisplaySymbol(Handle, FILE*);
+void DisplayCons(Handle, FILE*);
+void DisplayVector(Handle, FILE*);
+void DisplayOpaque(Handle, FILE*);  // <label #handle>
 Handle ReadObject(FILE*);
 
 /* Compiler */
+
+// An instruction is an opcode, followed by a one-byte argument if the
+// opcode is above OPCODE_ARGUMENTS. An argument too big for a byte is
+// written as OPCODE_BIG_ARG, the opcode, and the argument in two bytes,
+// low byte first.
+#define MAX_SHORT_ARG 0xff
+#define MAX_ARG 0xffff
+
 enum bytecodes {
     OP_END = 0,        // end of bytecode stream;
     OP_NOP,            // do nothing
@@ -166,9 +279,8 @@ enum bytecodes {
     OP_DUP,            // copy the top of the stack
     OP_NIL,            // push nil
     OP_RETURN,         // leave this function
-    OP_BIND_CLOSURE,   // set the closure of top-of-stack function to here
 
-    OPCODE_BIG_ARG,    // indicates that this instruction's argument is two bytes
+    OPCODE_BIG_ARG,    // prefix: the next instruction's argument is two bytes
     OPCODE_ARGUMENTS,  // not an opcode, just a delimiter to mark what ops take
                        // an argument
 
@@ -177,14 +289,36 @@ enum bytecodes {
     OP_SET_GLOBAL,     // alter a global
     OP_LOCAL,          // push the value of a local: argument name or define'd
     OP_SET_LOCAL,      // alter a local
-    OP_CLOSURE,        // closure variable: in an outer function scope
-    OP_SET_CLOSURE,    // alter a closure variable
+    OP_LOCAL_BOX,      // push the contents of a boxed local
+    OP_SET_LOCAL_BOX,  // alter the contents of a boxed local
+    OP_BOX_LOCAL,      // replace a local with a box holding its value
+    OP_CLOSURE,        // closure variable: captured from an outer function
+    OP_CLOSURE_BOX,    // push the contents of a boxed closure variable
+    OP_SET_CLOSURE_BOX,// alter the contents of a boxed closure variable
+    OP_MAKE_CLOSURE,   // pop a function and N captured values; push a closure
     OP_APPLY,          // apply a function to arguments on the stack
     OP_TAIL_APPLY,     // apply a function, discarding the current call frame
     OP_JUMP_TRUE,      // jump forward N bytes if top-of-stack is true
     OP_JUMP_FALSE,     // jump forward N bytes if top-of-stack is false
     OP_JUMP,           // jump forward N bytes
     OP_JUMP_BACK,      // jump backwards N bytes
+    OP_CALL_KNOWN,     // like apply, but the compiler knows it's a function
+    OP_CALL_SELF,      // call the running function with N arguments
+    OP_UNCHECKED,      // call unchecked primitive N, the arguments' types proven
+    OP_CASE,           // pop a key; skip the big jumps that case table N says to
+
+    // Quickened instructions. The compiler never emits these; the stack
+    // engine writes them over an instruction once it has seen what the
+    // instruction works on, and writes back a general one if that changes.
+    OP_GLOBAL_CELL,    // push the value in a literal that's a cell of `globals`
+    OP_APPLY_FUNCTION, // apply, where the last thing applied was a function
+    OP_APPLY_PRIMITIVE,// apply, where the last thing applied was a primitive
+    OP_ADD_INT,        // apply `+` to two integers
+    OP_SUB_INT,        // apply `-` to two integers
+    OP_MUL_INT,        // apply `*` to two integers
+    OP_EQUAL_INT,      // apply `=` to two integers
+    OP_LESS_INT,       // apply `<` to two integers
+    OP_GREATER_INT,    // apply `>` to two integers
 
     OP_INVALID = 0xff  // all opcodes must be less than OP_INVALID
 };
@@ -196,7 +330,65 @@ typedef enum LispCompilerModes {
 } COMPILER_MODE;
 
 Handle Compile(Handle, COMPILER_MODE);
+Handle CompileFile(FILE*);
+Handle CompileSealedFile(FILE*);
 void Disassemble(Handle);
+int DisassembleInstruction(Handle, int, FILE*);
+const char *OpcodeName(uint8_t);
+int DecodeInstruction(Handle, int, uint8_t*, int*);
+
+extern int optimizeBytecode;   // 0 to compile without the optimizer
+extern int sealPrograms;       // 1 to compile files as sealed programs
+extern Handle sealedGlobals;
+extern Handle replacedPrimitives; // primitives the code being compiled assigns
+extern int lazyCompile;        // 1 to compile lambda bodies when first called
+extern int compilerSafety;     // 0 to compile as if under (safety 0)
+Handle CompileLazyFunction(Handle);
+int OptimizeBytecode(Handle, Handle);
+void RelaxBytecode(Handle, Handle);
+int VerifyFunction(Handle);
+int *StackDepths(Handle);      // per byte of code, -1 if unreached; NULL if it fails
+
+/* Register engine code */
+
+// Register code is a sequence of 16-bit words stored little-endian in a
+// bytevector. Each instruction is an opcode word followed by its operands.
+// Registers 0..nLocals-1 are the function's locals; stack slot N of the
+// stack bytecode becomes register nLocals+N.
+enum regcodes {
+    ROP_END = 0,
+    ROP_MOVE,          // d s       r[d] = s
+    ROP_SET_GLOBAL,    // k s       global literals[k] = s
+    ROP_UNBOX,         // d s       r[d] = contents of box s
+    ROP_SET_BOX,       // b s       contents of box b = s
+    ROP_BOX,           // d         r[d] = box holding r[d]
+    ROP_MAKE_CLOSURE,  // d t n v1..vn
+    ROP_CALL,          // d p n a1..an   r[d] = (p a1 ... an)
+    ROP_RETURN,        // s
+    ROP_JUMP,          // target
+    ROP_JUMP_FALSE,    // s target
+    ROP_JUMP_TRUE,     // s target
+    ROP_CASE,          // s k t0..tn   jump to the target case table k picks for s
+};
+
+// Source operands carry their addressing mode in the top three bits, so a
+// literal or a global can be used directly without first moving it into a
+// register. Destinations are always plain register numbers.
+enum operandkinds {
+    OPERAND_REG,
+    OPERAND_LITERAL,
+    OPERAND_GLOBAL,    // index of the global's symbol in the literals
+    OPERAND_NIL,
+    OPERAND_CLOSURE,   // captured value, unboxed
+    OPERAND_SELF,      // the running function
+};
+#define OPERAND(KIND,IDX) ((KIND) << 13 | (IDX))
+#define OPERAND_KIND(OPND) ((OPND) >> 13)
+#define MAX_OPERAND_INDEX 0x1fff
+#define OPERAND_INDEX(OPND) ((OPND) & MAX_OPERAND_INDEX)
+
+Handle CompileRegisterCode(Handle);
+void DisassembleRegisterCode(Handle);
 
 /* Virtual machine */
 
@@ -212,23 +404,148 @@ typedef struct LispContext {
 extern Handle currentContext;
 extern Handle globals;
 
+typedef enum LispEngines {
+    ENGINE_STACK,
+    ENGINE_REGISTER
+} ENGINE;
+extern ENGINE vmEngine;
+
+void EnsureRegisterCode(Handle);
+void EnsureCompiled(Handle);
+Handle LookupGlobal(Handle);
+void SetGlobal(Handle, Handle);
+extern int primitivesReplaced; // set once a primitive's global changes
+Handle GlobalNameOf(Handle);
+int IsApply(uint8_t);
+Handle CreateCaseTable(Handle);
+int CaseClauses(Handle);
+int CaseIndex(Handle, Handle);
+
+/* JIT compiler */
+
+// Machine code runs on a copy of the interpreter's registers and hands
+// control back to Interpret() to call and return from functions.
+typedef struct JitFrame {
+    Handle function;
+    Handle stack;
+    Handle locals;
+    Handle literals;
+    Handle closure;
+    int sp;
+    // set when the code exits
+    int ip;            // where to resume after a call
+    Handle callee;
+    int nargs;
+    Handle result;
+} JITFRAME;
+
+enum jitexits {
+    JIT_RETURN = 1,
+    JIT_CALL
+};
+
+// Native code for a function, from the JIT or the ahead-of-time compiler.
+// `run` executes it starting at a bytecode position and returns one of the
+// exits above.
+typedef struct NativeCode {
+    int (*run)(struct NativeCode*, JITFRAME*, int);
+} NATIVECODE;
+
+extern int jitThreshold;       // calls before compiling; 0 disables the JIT
+void NoteCall(Handle);
+int RunNativeCode(Handle, JITFRAME*, int);
+
+/* Ahead-of-time compiler */
+void CompileProgramToC(Handle, FILE*);
+
+/* Code cache */
+uint32_t HashSource(FILE*);
+void WriteCodeCache(Handle, uint32_t, FILE*);
+Handle ReadCodeCache(FILE*, uint32_t);
+
 Handle StartInterpreter(Handle, Handle);
 
+/* Profiler */
+
+// With `vmProfiling` set, StartInterpreter uses a build of the interpreter
+// loop that reports each instruction, call and global lookup here.
+extern int vmProfiling;
+void ProfileStep(Handle, int);
+void ProfileNative(Handle);
+void ProfileCall(Handle);
+void ProfileReturn(Handle);
+void ProfileGlobal(Handle);
+void ProfileStop();
+void PrintProfile(FILE*);
+
+/* Event tracing */
+
+typedef enum TraceEventKinds {
+    TRACE_GC,
+    TRACE_CALL,
+    TRACE_PRIMITIVE,
+    TRACE_COMPILE,
+    TRACE_READ
+} TRACEKIND;
+
+// Events are cheap to skip: the hooks check the flag before calling out.
+extern int traceEnabled;
+#define TRACE(KIND, PHASE, LABEL, VALUE) \
+    do { if (traceEnabled) TraceEvent((KIND), (PHASE), (LABEL), (VALUE)); } while (0)
+#define TRACE_FUNCTION(PHASE, FN) \
+    do { if (traceEnabled) TraceFunction((PHASE), (FN)); } while (0)
+void StartTracing(size_t);
+void TraceEvent(TRACEKIND, char, const char*, long);
+void TraceFunction(char, Handle);
+void WriteTrace(FILE*);
+
+/* Sampling profiler */
+
+// Set from a signal handler; the interpreters poll it at safe points.
+extern volatile sig_atomic_t samplePending;
+#define SAMPLE_POINT() do { if (samplePending) TakeSample(); } while (0)
+void StartSampling(int);
+void TakeSample();
+void WriteSamples(FILE*);
+
 /* Primitives */
 
 typedef Handle (*PRIMPTR)(Handle);
 typedef struct LispPrimitive {
+    const char *name;
     int arguments;
     PRIMPTR procedure;
+    uint8_t quickened; // what a call with two integers becomes, or OP_END
 } PRIMITIVE;
 
 Handle CallPrimitive(Handle, Handle);
 void ConstructPrimitives();
 
+// What the compiler knows about some of the primitives. `call` does the
+// primitive's work on `arity` arguments without checking their types, and
+// the compiler uses it when every argument's type is in `accepts`. A
+// checked call that returns had arguments with types in `checks`. Either
+// way, the result's type is in `returns`.
+typedef struct UncheckedPrimitive {
+    const char *name;
+    int arity;
+    int checks;
+    int accepts;
+    int returns;
+    Handle (*call)(Handle, Handle);
+} UNCHECKED;
+extern const UNCHECKED uncheckedPrimitives[];
+int UncheckedPrimitiveNamed(const char*);
+
 /* Utility -- sort these */
 void panic(char*) __attribute__ ((noreturn));
 const char *NameOfType(OBJTYPE);
+#if SAFETY > 0
 void Typecheck(Handle, OBJTYPE);
 void TypecheckNumeric(Handle);
+#else
+#define Typecheck(HND, TYPE) ((void)(HND))
+#define TypecheckNumeric(HND) ((void)(HND))
+#endif
 int Equivalent(Handle, Handle);
 //int RecursivelyEqual(Handle, Handle);
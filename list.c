@@ -41,3 +41,30 @@ Handle AlistSet(Handle alist, Handle key, Handle value) {
 	return head;
     }
 }
+
+// position of `x` in `list` by identity, or -1 if it isn't there (cf. `memq`)
+int ListIndex(Handle list, Handle x) {
+    int idx = 0;
+    while (list != nil) {
+	if (Car(list) == x) return idx;
+	list = Cdr(list);
+	idx++;
+    }
+    return -1;
+}
+
+// adds `x` to the end of `list` unless it's already present
+// returns the list, which is a fresh cell if `list` was empty
+Handle ListAdjoin(Handle list, Handle x) {
+    if (list == nil) {
+	return CreateCons(x, nil);
+    }
+    Handle tail = list;
+    while (1) {
+	if (Car(tail) == x) return list;
+	if (Cdr(tail) == nil) break;
+	tail = Cdr(tail);
+    }
+    SetCdr(tail, CreateCons(x, nil));
+    return list;
+}
@@ -6,9 +6,17 @@
 #include <assert.h>
 #include "lilscheme.h"
 
-#define HEAP_SIZE (1*1024*1024)
-#define MAX_HANDLES 0xffff
+// the source of a procedure of a few thousand forms, and its expansion, have
+// to fit at once
+#define HEAP_SIZE (4*1024*1024)
 #define FOR_EACH_HANDLE(_VAR_) for (int _VAR_ = 0; _VAR_ < MAX_HANDLES; _VAR_++)
+#define GC_STACK_DEPTH 64
+
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
 
 // XXX: Lots of code here involves pointer arithmetic with void*.
 // GCC thinks sizeof(void) == 1 for purposes of pointer arithmetic
@@ -17,7 +25,6 @@
 
 OBJ **objectTable;
 
-size_t SizeOfType(OBJTYPE);
 int IsAtBottomOfHeap(Handle);
 void MoveToBottomOfHeap(Handle);
 
@@ -28,6 +35,53 @@ Handle nil;
 Handle internedSymbols;
 Handle retainedObjects[MAX_HANDLES];
 size_t retainedObjectsSize = 0;
+static Handle *roots = NULL;   // see PushRoot
+static int rootCount = 0, rootCapacity = 0;
+static int handlesInUse = 0;   // as of the last collection, and given out since
+
+// Types
+
+// The handles an object holds are always side by side, so a type says where
+// they start and how many there are.
+
+static Handle *ConsReferences(void *data, int *count) {
+    *count = 2;
+    return &((CONS *)data)->car;
+}
+
+static Handle *VectorReferences(void *data, int *count) {
+    *count = ((VECTOR *)data)->length;
+    return ((VECTOR *)data)->elements;
+}
+
+static Handle *FunctionReferences(void *data, int *count) {
+    *count = 4;
+    return &((FUNCTION *)data)->bytecode;
+}
+
+static Handle *ContextReferences(void *data, int *count) {
+    *count = 4;
+    return &((CONTEXT *)data)->function;
+}
+
+static Handle *BoxReferences(void *data, int *count) {
+    *count = 1;
+    return &((BOX *)data)->value;
+}
+
+_Static_assert(offsetof(CONS, cdr) == offsetof(CONS, car) + sizeof(Handle),
+	       "a pair's handles aren't together");
+_Static_assert(offsetof(FUNCTION, regcode) == offsetof(FUNCTION, bytecode) + 3 * sizeof(Handle),
+	       "a function's handles aren't together");
+_Static_assert(offsetof(CONTEXT, prior) == offsetof(CONTEXT, function) + 3 * sizeof(Handle),
+	       "a context's handles aren't together");
+
+const TYPEINFO typeInfo[] = {
+#define X(TYPE, SIZE, FLAGS, NAME, LABEL, REFERENCES, DISPLAY) \
+    [TYPE] = {#TYPE, sizeof(OBJ) + (SIZE), (FLAGS), (NAME), (LABEL), (REFERENCES), DISPLAY},
+    LISP_TYPES(X)
+#undef X
+};
 
 void InitMem() {
     void *h = malloc(HEAP_SIZE);
@@ -43,12 +97,15 @@ void InitMem() {
     FOR_EACH_HANDLE(i) {
 	objectTable[i] = 0;
     }
+    handlesInUse = 0;
 
     nil = CreateObject(TYPE_NIL,0);
     assert(nil == 0);
+    rootCount = 0;
     internedSymbols = nil;
     currentContext = nil;
     globals = nil;
+    primitivesReplaced = 0;
 }
 
 void *HeapBottom() {
@@ -76,13 +133,23 @@ OBJ *Dereference(Handle handle) {
 
 // TODO: alignment?
 
+MEMSTATS memStats;
+
+// By default we collect every second allocation, which shakes out missing
+// Retains quickly. 0 means only collect when the heap or handles run out.
 static int gcFrequency = 2;
 static int allocsSinceCollection = 1;
+
+void SetGCFrequency(int allocs) {
+    gcFrequency = allocs;
+}
+
 void *AllocRawMem(size_t size) {
     void *newMark = freeMark + size;
-    // TODO: we currently have this hardwired to GC every second alloc
-    // we should have a setting to GC every Nth alloc
-    if (newMark > HeapBottom() || allocsSinceCollection > gcFrequency) {
+    memStats.allocations++;
+    memStats.bytesAllocated += size;
+    if (newMark > HeapBottom() ||
+	(gcFrequency > 0 && allocsSinceCollection > gcFrequency)) {
 	GarbageCollect();
 	allocsSinceCollection = 0;
 	newMark = freeMark + size;
@@ -122,6 +189,30 @@ void Unretain(Handle hnd) {
     panic("Unretain without Retain");
 }
 
+// Code that walks a structure, keeping what it has built so far in C
+// variables while it allocates more, pushes those handles here. Unlike
+// Retain, a handle can be pushed more than once, and nothing is searched:
+// PopRoots drops everything pushed since RootMark gave `mark`. PushRoot
+// gives back its argument, so a result can be rooted where it's made.
+int RootMark() {
+    return rootCount;
+}
+
+Handle PushRoot(Handle hnd) {
+    if (rootCount == rootCapacity) {
+	rootCapacity = rootCapacity ? 2 * rootCapacity : 256;
+	roots = realloc(roots, rootCapacity * sizeof(Handle));
+	if (roots == NULL) panic("out of memory for roots");
+    }
+    roots[rootCount++] = hnd;
+    return hnd;
+}
+
+void PopRoots(int mark) {
+    assert(mark <= rootCount);
+    rootCount = mark;
+}
+
 size_t MoveObjectFromHeap(Handle hnd, void *to) {
     if (!ValidHandle(hnd)) return 0;
     OBJ *from = objectTable[hnd];
@@ -171,6 +262,72 @@ static int gcEnabled = 1;
 void EnableGC() {gcEnabled = 1;}
 void DisableGC() {gcEnabled = 0;}
 
+// Collect now if less than half the heap, or half the handles, is free.
+// Code that's about to keep the collector away while it builds something
+// calls this first, at a point where everything it holds is retained.
+void MakeRoom() {
+    if (AvailableSpace() < HEAP_SIZE / 2 || handlesInUse > MAX_HANDLES / 2) {
+	GarbageCollect();
+    }
+}
+
+
+// Cheney's algorithm alone copies breadth first, so the cells of a list of
+// lists end up spread across the new heap with everything else at the same
+// depth between them. Instead, each object the scan reaches is the root of a
+// depth-first copy, with a small stack: an object's children are copied
+// right after it, then the first child's children, and so on, so a list or
+// a subtree comes out mostly in one piece. Whatever doesn't fit on the
+// stack is left where it was copied, for the scan to reach later. The scan
+// skips objects the stack has already been through, which `scanned` marks
+// by where they start.
+
+int depthFirstCollection = 1;
+
+static uint8_t scanned[HEAP_SIZE / 8];
+
+#define SCANNED_BIT(offset) (1 << ((offset) % 8))
+
+static void MarkScanned(void *newHeap, OBJ *obj) {
+    size_t offset = (void*)obj - newHeap;
+    scanned[offset / 8] |= SCANNED_BIT(offset);
+}
+
+static int IsScanned(void *newHeap, OBJ *obj) {
+    size_t offset = (void*)obj - newHeap;
+    return scanned[offset / 8] & SCANNED_BIT(offset);
+}
+
+// copy the children of `obj` to `newMark`, and push the ones that hold
+// handles themselves, if there's room; returns the new mark
+static void *ScanObject(OBJ *obj, void *newMark, OBJ **stack, int *depth) {
+    const TYPEINFO *type = &typeInfo[obj->type];
+    if (type->flags & POINTER_FREE) return newMark;
+    int count;
+    Handle *references = type->references(obj->data, &count);
+    // start fetching the children before they're needed
+    for (int i = 0; i < count; i++) {
+	if (ValidHandle(references[i])) PREFETCH(objectTable[references[i]]);
+    }
+    // they're pushed last first, so the first is copied from first
+    int pushed = *depth;
+    for (int i = 0; i < count; i++) {
+	OBJ *child = newMark;
+	size_t size = MoveObjectFromHeap(references[i], newMark);
+	if (size == 0) continue;
+	newMark += size;
+	if (depthFirstCollection && *depth < GC_STACK_DEPTH &&
+	    !(typeInfo[child->type].flags & POINTER_FREE)) {
+	    stack[(*depth)++] = child;
+	}
+    }
+    for (int i = pushed, j = *depth - 1; i < j; i++, j--) {
+	OBJ *swap = stack[i];
+	stack[i] = stack[j];
+	stack[j] = swap;
+    }
+    return newMark;
+}
 
 void GarbageCollect() {
     /* This is a stop-and-copy collector using Cheney's algorithm. */
@@ -178,6 +335,8 @@ void GarbageCollect() {
     // It may be wise to relocate declarations to the top of the function
 
     if (!gcEnabled) return;
+    TRACE(TRACE_GC, 'B', "gc", 0);
+    memStats.collections++;
     
     void *newHeap = malloc(HEAP_SIZE);
     if (newHeap == 0) {
@@ -192,6 +351,9 @@ void GarbageCollect() {
 	Handle hnd = retainedObjects[i];
 	newMark += MoveObjectFromHeap(hnd, newMark);
     }
+    for (int i = 0; i < rootCount; i++) {
+	newMark += MoveObjectFromHeap(roots[i], newMark);
+    }
     // move interned symbol list head
     newMark += MoveObjectFromHeap(internedSymbols, newMark);
     // move current context
@@ -200,50 +362,31 @@ void GarbageCollect() {
     newMark += MoveObjectFromHeap(globals, newMark);
     
     // move children of moved objects
+    OBJ *stack[GC_STACK_DEPTH];
     void *remaining = newHeap;
     while (remaining < newMark) {
 	OBJ *obj = (OBJ *)remaining;
-	switch(obj->type) {
-	case TYPE_NIL: case TYPE_INT: case TYPE_FLOAT: case TYPE_SYMBOL:
-	case TYPE_BYTEVECTOR: case TYPE_PRIMITIVE:
-	    break;
-	case TYPE_CONS: {
-	    CONS *cons = (CONS *)(obj->data);
-	    newMark += MoveObjectFromHeap(cons->car, newMark);
-	    newMark += MoveObjectFromHeap(cons->cdr, newMark);
-	    break;
-	}
-	case TYPE_VECTOR: {
-	    VECTOR *vec = (VECTOR *)(obj->data);
-	    for (int i = 0; i < vec->length; i++) {
-		newMark += MoveObjectFromHeap(vec->elements[i], newMark);
+	if (!IsScanned(newHeap, obj)) {
+	    int depth = 0;
+	    stack[depth++] = obj;
+	    while (depth > 0) {
+		OBJ *next = stack[--depth];
+		MarkScanned(newHeap, next);
+		newMark = ScanObject(next, newMark, stack, &depth);
 	    }
-	    break;
-	}
-	case TYPE_FUNCTION: {
-	    FUNCTION *func = (FUNCTION *)(obj->data);
-	    newMark += MoveObjectFromHeap(func->bytecode, newMark);
-	    newMark += MoveObjectFromHeap(func->literals, newMark);
-	    break;
-	}
-	case TYPE_CONTEXT: {
-	    CONTEXT *ctx = (CONTEXT *)(obj->data);
-	    newMark += MoveObjectFromHeap(ctx->function, newMark);
-	    newMark += MoveObjectFromHeap(ctx->locals, newMark);
-	    newMark += MoveObjectFromHeap(ctx->stack, newMark);
-	    newMark += MoveObjectFromHeap(ctx->prior, newMark);
-	    break;
-	}
-	default:
-	    panic("there's a type I don't know how to collect");
 	}
 	remaining += obj->size;
     }
+    memset(scanned, 0, (newMark - newHeap + 7) / 8);
     // free handles that aren't used anymore
+    handlesInUse = 0;
     FOR_EACH_HANDLE(i) {
 	if (ContainedInHeap(objectTable[i])) {
 	    objectTable[i] = NULL;
 	}
+	else if (objectTable[i] != NULL) {
+	    handlesInUse++;
+	}
     }
     // replace the heap
     void *oldHeap = heap;
@@ -251,56 +394,50 @@ void GarbageCollect() {
     freeMark = newMark;
     free(oldHeap);
     allocsSinceCollection = 0;
+    memStats.bytesCopied += newMark - newHeap;
+    TRACE(TRACE_GC, 'E', "gc", (long)(newMark - newHeap));
+}
+
+// The search for a free handle starts after the last one handed out, so
+// it doesn't rescan the live handles at the bottom of the table each time.
+static int nextHandle = 0;
+
+static int FindUnusedHandle() {
+    for (int n = 0; n < MAX_HANDLES; n++) {
+	int i = (nextHandle + n) % MAX_HANDLES;
+	if (objectTable[i] == NULL) {
+	    nextHandle = (i + 1) % MAX_HANDLES;
+	    return i;
+	}
+    }
+    return -1;
 }
 
 Handle UnusedHandle() {
-    // This could be optimized if we cache the last handle allocated.
-    FOR_EACH_HANDLE(i) {
-	if (objectTable[i] == NULL) return i;
+    int hnd = FindUnusedHandle();
+    if (hnd == -1) {
+	// garbage might be holding handles
+	GarbageCollect();
+	hnd = FindUnusedHandle();
+	if (hnd == -1) panic("out of handles");
     }
-    panic("out of handles");
-    return 0; // we don't ever return this way; this just suppresses warnings
+    handlesInUse++;
+    return hnd;
 }
 
 Handle CreateObject(OBJTYPE type, size_t extra) {
-    size_t size = SizeOfType(type) + extra;
+    assert(type < TYPE_COUNT);
+    size_t size = typeInfo[type].size + extra;
+    // the handle comes first, since getting one can collect garbage
+    Handle hnd = UnusedHandle();
     OBJ *optr = AllocRawMem(size);
     optr->type = type;
     optr->size = size;
-    Handle hnd = UnusedHandle();
     objectTable[hnd] = optr;
     assert((void*)optr + size == freeMark);
     return hnd;
 }
 
-size_t SizeOfType(OBJTYPE type) {
-    switch (type){
-    case TYPE_NIL:
-	return sizeof(OBJ);
-    case TYPE_INT:
-	return sizeof(OBJ) + sizeof(int);
-    case TYPE_FLOAT:
-	return sizeof(OBJ) + sizeof(double);
-    case TYPE_CONS:
-	return sizeof(OBJ) + sizeof(CONS);
-    case TYPE_SYMBOL:
-	return sizeof(OBJ); // there is no SYMBOL struct
-    case TYPE_VECTOR:
-	return sizeof(OBJ) + sizeof(VECTOR);
-    case TYPE_BYTEVECTOR:
-	return sizeof(OBJ) + sizeof(BYTEVECTOR);
-    case TYPE_FUNCTION:
-	return sizeof(OBJ) + sizeof(FUNCTION);
-    case TYPE_CONTEXT:
-	return sizeof(OBJ) + sizeof(CONTEXT);
-    case TYPE_PRIMITIVE:
-	return sizeof(OBJ) + sizeof(PRIMITIVE);
-    default:
-	panic("there's a type I don't know the size of");
-	return sizeof(OBJ);
-    }
-}
-
 // Debug routines
 
 
@@ -321,3 +458,51 @@ void InspectAllObjects() {
     }
     puts("=== Object Report End ===");
 }
+
+// Heap snapshots
+
+// A snapshot is a text file describing every live object and the references
+// between them, for the heapstat tool. Each line is one record:
+//
+//   lilscheme-heap 1
+//   root KIND HANDLE                      (KIND: nil retained symbols context globals)
+//   object HANDLE TYPE SIZE N EDGE1..EDGEN
+//   name HANDLE SYMBOL-NAME               (after each symbol)
+//   value HANDLE INTEGER                  (after each integer)
+
+static void WriteSnapshotObject(Handle hnd, FILE *out) {
+    OBJ *obj = DEREF(hnd);
+    fprintf(out, "object %d %s %zu", hnd, NameOfType(obj->type), obj->size);
+    const TYPEINFO *type = &typeInfo[obj->type];
+    int count = 0;
+    Handle *references = NULL;
+    if (!(type->flags & POINTER_FREE)) references = type->references(obj->data, &count);
+    fprintf(out, " %d", count);
+    for (int i = 0; i < count; i++) fprintf(out, " %d", references[i]);
+    fputc('\n', out);
+    if (obj->type == TYPE_SYMBOL) {
+	fprintf(out, "name %d %s\n", hnd, NameOfSymbol(hnd));
+    }
+    else if (obj->type == TYPE_INT) {
+	fprintf(out, "value %d %d\n", hnd, UnboxInteger(hnd));
+    }
+}
+
+// Collect first, so that only live objects are written
+void WriteHeapSnapshot(FILE *out) {
+    GarbageCollect();
+    fprintf(out, "lilscheme-heap 1\n");
+    fprintf(out, "root nil %d\n", nil);
+    for (size_t i = 0; i < retainedObjectsSize; i++) {
+	fprintf(out, "root retained %d\n", retainedObjects[i]);
+    }
+    for (int i = 0; i < rootCount; i++) {
+	fprintf(out, "root retained %d\n", roots[i]);
+    }
+    fprintf(out, "root symbols %d\n", internedSymbols);
+    fprintf(out, "root context %d\n", currentContext);
+    fprintf(out, "root globals %d\n", globals);
+    FOR_EACH_HANDLE(i) {
+	if (objectTable[i] != NULL) WriteSnapshotObject(i, out);
+    }
+}
@@ -0,0 +1,593 @@
+/* optimize.c - bytecode optimizer */
+
+// The code generator translates each form on its own, so its output has
+// seams: values pushed only to be dropped, jumps to jumps, and code after a
+// return. This pass cleans them up after a function's code is generated and
+// before the function is created.
+//
+// The bytecode is decoded into an array of instructions with jumps resolved
+// to instruction indexes, rewritten until nothing more changes, then encoded
+// back into the same bytevector. A rewrite that spans several instructions
+// only applies if no jump lands in the middle of them. Encoding gives each
+// jump the short form if its distance fits in a byte, and the big-argument
+// form if not. The jumps after an OP_CASE are its table's targets, so they
+// stay where they are and stay big, whatever else happens to them.
+//
+// Calls to pure primitives on constant arguments are folded, on the usual
+// assumption that the standard primitives aren't redefined. A primitive is
+// only folded if its global has that primitive's value when the code is
+// compiled, nothing in the code being compiled assigns it, and the
+// arguments are ones it can't fail on.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lilscheme.h"
+
+int optimizeBytecode = 1;
+
+typedef struct insn {
+    uint8_t op;
+    int arg;
+    int target;    // the instruction a jump goes to, or -1
+    int labels;    // how many jumps go to this instruction
+    int dead;
+    int big;       // a jump that's encoded with a two-byte distance
+    int pinned;    // one of the jumps after an OP_CASE
+} INSN;
+
+typedef struct optimizer {
+    INSN *code;
+    int length;
+    Handle literals;
+    int changed;
+} OPTIMIZER;
+
+static int IsJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_BACK ||
+	op == OP_JUMP_FALSE || op == OP_JUMP_TRUE;
+}
+
+static int IsConditional(uint8_t op) {
+    return op == OP_JUMP_FALSE || op == OP_JUMP_TRUE;
+}
+
+// pushes a constant
+static int IsConstant(INSN *insn) {
+    return insn->op == OP_LITERAL || insn->op == OP_NIL;
+}
+
+static Handle ConstantValue(OPTIMIZER *opt, INSN *insn) {
+    return insn->op == OP_NIL ? nil : VectorRef(opt->literals, insn->arg);
+}
+
+/* Bookkeeping */
+
+static void Kill(OPTIMIZER *opt, int i) {
+    INSN *insn = &opt->code[i];
+    if (insn->target != -1) opt->code[insn->target].labels--;
+    insn->target = -1;
+    insn->dead = 1;
+    opt->changed = 1;
+}
+
+static void Retarget(OPTIMIZER *opt, int i, int target) {
+    INSN *insn = &opt->code[i];
+    if (insn->target != -1) opt->code[insn->target].labels--;
+    insn->target = target;
+    if (target != -1) opt->code[target].labels++;
+    opt->changed = 1;
+}
+
+// nothing jumps into the instructions after `first`, up to `last`
+static int Straight(OPTIMIZER *opt, int first, int last) {
+    for (int i = first + 1; i <= last; i++) {
+	if (opt->code[i].labels > 0) return 0;
+    }
+    return 1;
+}
+
+// drop dead instructions; a jump to one goes to the next live one
+static void Compact(OPTIMIZER *opt) {
+    int n = opt->length;
+    int *renumbered = malloc((n + 1) * sizeof(int));
+    if (renumbered == NULL) panic("out of memory for the optimizer");
+    int live = 0;
+    for (int i = 0; i < n; i++) {
+	renumbered[i] = opt->code[i].dead ? -1 : live++;
+    }
+    for (int i = n - 1, next = -1; i >= 0; i--) {
+	if (renumbered[i] == -1) renumbered[i] = next;
+	else next = renumbered[i];
+    }
+    live = 0;
+    for (int i = 0; i < n; i++) {
+	INSN insn = opt->code[i];
+	if (insn.dead) continue;
+	if (insn.target != -1) {
+	    insn.target = renumbered[insn.target];
+	    assert(insn.target != -1);
+	}
+	insn.labels = 0;
+	opt->code[live++] = insn;
+    }
+    opt->length = live;
+    for (int i = 0; i < live; i++) {
+	if (opt->code[i].target != -1) opt->code[opt->code[i].target].labels++;
+    }
+    free(renumbered);
+}
+
+// the instructions that can run right after instruction `i`, in `next`;
+// returns how many there are
+static int Successors(OPTIMIZER *opt, int i, int *next) {
+    INSN *insn = &opt->code[i];
+    int n = 0;
+    switch (insn->op) {
+    case OP_RETURN: case OP_END: case OP_TAIL_APPLY:
+	return 0;
+    case OP_JUMP: case OP_JUMP_BACK:
+	next[n++] = insn->target;
+	return n;
+    case OP_CASE:
+	for (int j = i + 1; j < opt->length && opt->code[j].pinned; j++) next[n++] = j;
+	return n;
+    }
+    if (IsConditional(insn->op)) next[n++] = insn->target;
+    if (i + 1 < opt->length) next[n++] = i + 1;
+    return n;
+}
+
+static int InstructionSize(INSN *insn) {
+    if (insn->op < OPCODE_ARGUMENTS) return 1;
+    int big = insn->target != -1 ? insn->big : insn->arg > MAX_SHORT_ARG;
+    return big ? 4 : 2;
+}
+
+// the position of each instruction once it's encoded
+static int *Positions(OPTIMIZER *opt) {
+    int *pos = malloc((opt->length + 1) * sizeof(int));
+    if (pos == NULL) panic("out of memory for the optimizer");
+    pos[0] = 0;
+    for (int i = 0; i < opt->length; i++) {
+	pos[i + 1] = pos[i] + InstructionSize(&opt->code[i]);
+    }
+    return pos;
+}
+
+/* Rewrites */
+
+// Primitives whose result depends only on their arguments, and the
+// arguments they're known to accept
+enum foldable {FOLD_ANY, FOLD_NUMBERS, FOLD_INTEGERS};
+static const struct {
+    const char *name;
+    enum foldable accepts;
+} foldable[] = {
+    {"+", FOLD_INTEGERS},
+    {"-", FOLD_INTEGERS},
+    {"*", FOLD_INTEGERS},
+    {"=", FOLD_NUMBERS},
+    {"<", FOLD_NUMBERS},
+    {">", FOLD_NUMBERS},
+    {"eq?", FOLD_ANY},
+    {"eqv?", FOLD_ANY},
+    {"not", FOLD_ANY},
+    {"null?", FOLD_ANY},
+    {"pair?", FOLD_ANY},
+};
+
+// the primitive `symbol` names, if it can be folded with `argc` arguments
+static Handle FoldablePrimitive(Handle symbol, int argc, enum foldable *accepts) {
+    if (ListIndex(replacedPrimitives, symbol) != -1) return nil;
+    Handle cell = AlistGet(globals, symbol);
+    if (cell == nil) return nil;
+    Handle prim = Cdr(cell);
+    if (TYPEOF(prim) != TYPE_PRIMITIVE) return nil;
+    PRIMITIVE *pr = DATA_AREA(PRIMITIVE, prim);
+    if (strcmp(pr->name, NameOfSymbol(symbol)) != 0) return nil;
+    if (argc < 1 || (pr->arguments >= 0 && argc != pr->arguments)) return nil;
+    for (size_t i = 0; i < sizeof(foldable) / sizeof(foldable[0]); i++) {
+	if (strcmp(foldable[i].name, pr->name) == 0) {
+	    *accepts = foldable[i].accepts;
+	    return prim;
+	}
+    }
+    return nil;
+}
+
+static int Accepts(enum foldable accepts, Handle x) {
+    switch (accepts) {
+    case FOLD_INTEGERS: return TYPEOF(x) == TYPE_INT;
+    case FOLD_NUMBERS: return IsNumeric(x);
+    default: return 1;
+    }
+}
+
+// constant... global apply  =>  constant
+static void FoldConstants(OPTIMIZER *opt) {
+    for (int i = 0; i < opt->length; i++) {
+	INSN *apply = &opt->code[i];
+	if (apply->op != OP_APPLY && apply->op != OP_UNCHECKED) continue;
+	int argc = apply->op == OP_UNCHECKED ?
+	    uncheckedPrimitives[apply->arg].arity : apply->arg;
+	int first = i - 1 - argc;
+	if (first < 0) continue;
+	if (opt->code[i - 1].op != OP_GLOBAL || !Straight(opt, first, i)) continue;
+	// an earlier fold in this pass may have left dead code in the way
+	int constant = 1;
+	for (int j = first; j < i; j++) constant &= !opt->code[j].dead;
+	for (int j = first; j < i - 1; j++) constant &= IsConstant(&opt->code[j]);
+	if (!constant) continue;
+
+	Handle symbol = VectorRef(opt->literals, opt->code[i - 1].arg);
+	enum foldable accepts;
+	Handle prim = FoldablePrimitive(symbol, argc, &accepts);
+	if (prim == nil) continue;
+	// arguments are pushed last first
+	Handle argv = CreateVector(argc);
+	Retain(argv);
+	int ok = 1;
+	for (int k = 0; k < argc; k++) {
+	    Handle x = ConstantValue(opt, &opt->code[i - 2 - k]);
+	    ok &= Accepts(accepts, x);
+	    VectorSet(argv, k, x);
+	}
+	if (!ok || VectorLength(opt->literals) >= MAX_ARG) {
+	    Unretain(argv);
+	    continue;
+	}
+	Handle result = CallPrimitive(prim, argv);
+	Unretain(argv);
+
+	INSN *folded = &opt->code[first];
+	if (result == nil) {
+	    folded->op = OP_NIL;
+	    folded->arg = 0;
+	}
+	else {
+	    Retain(result);
+	    folded->op = OP_LITERAL;
+	    folded->arg = AddToVector(opt->literals, result);
+	    Unretain(result);
+	}
+	for (int j = first + 1; j <= i; j++) Kill(opt, j);
+	opt->changed = 1;
+    }
+    Compact(opt);
+}
+
+static int IsPurePush(uint8_t op) {
+    return op == OP_LITERAL || op == OP_NIL || op == OP_LOCAL ||
+	op == OP_CLOSURE || op == OP_DUP;
+}
+
+static int IsStore(uint8_t op) {
+    return op == OP_SET_LOCAL || op == OP_SET_LOCAL_BOX ||
+	op == OP_SET_CLOSURE_BOX || op == OP_SET_GLOBAL;
+}
+
+// push drop  =>  nothing;  dup store drop  =>  store;  nop  =>  nothing
+static void RemoveDeadPushes(OPTIMIZER *opt) {
+    for (int i = 0; i < opt->length; i++) {
+	INSN *code = opt->code;
+	if (code[i].dead) continue;
+	if (code[i].op == OP_NOP) {
+	    Kill(opt, i);
+	}
+	else if (i + 1 < opt->length && IsPurePush(code[i].op) &&
+		 code[i + 1].op == OP_DROP && Straight(opt, i, i + 1)) {
+	    Kill(opt, i);
+	    Kill(opt, i + 1);
+	}
+	else if (i + 2 < opt->length && code[i].op == OP_DUP &&
+		 IsStore(code[i + 1].op) && code[i + 2].op == OP_DROP &&
+		 Straight(opt, i, i + 2)) {
+	    Kill(opt, i);
+	    Kill(opt, i + 2);
+	}
+    }
+    Compact(opt);
+}
+
+// Branches on constants become jumps or nothing, jumps to the next
+// instruction go, and a jump to a return is a return.
+static void SimplifyBranches(OPTIMIZER *opt) {
+    for (int i = 0; i < opt->length; i++) {
+	INSN *code = opt->code;
+	if (code[i].dead) continue;
+	if (IsConstant(&code[i]) && i + 1 < opt->length &&
+	    IsConditional(code[i + 1].op) && Straight(opt, i, i + 1)) {
+	    int isTrue = ConstantValue(opt, &code[i]) != nil;
+	    Kill(opt, i);
+	    if (isTrue == (code[i + 1].op == OP_JUMP_TRUE)) {
+		code[i + 1].op = OP_JUMP;
+	    }
+	    else {
+		Kill(opt, i + 1);
+	    }
+	    continue;
+	}
+	if (!IsJump(code[i].op) || code[i].pinned) continue;
+	int target = code[i].target;
+	if (target == i + 1) {
+	    if (IsConditional(code[i].op)) {
+		// the condition still has to come off the stack
+		Retarget(opt, i, -1);
+		code[i].op = OP_DROP;
+		code[i].arg = 0;
+	    }
+	    else {
+		Kill(opt, i);
+	    }
+	}
+	else if (code[target].op == OP_RETURN && !IsConditional(code[i].op)) {
+	    Retarget(opt, i, -1);
+	    code[i].op = OP_RETURN;
+	    code[i].arg = 0;
+	}
+    }
+    Compact(opt);
+}
+
+// a jump to a jump goes straight to the second one's target, as long as
+// a conditional jump still goes forward
+static void ThreadJumps(OPTIMIZER *opt) {
+    int *pos = Positions(opt);
+    for (int i = 0; i < opt->length; i++) {
+	INSN *insn = &opt->code[i];
+	if (!IsJump(insn->op)) continue;
+	INSN *next = &opt->code[insn->target];
+	if (next->op != OP_JUMP && next->op != OP_JUMP_BACK) continue;
+	int target = next->target;
+	if (target == insn->target) continue;
+	int from = pos[i + 1];
+	int distance = pos[target] - from;
+	if (IsConditional(insn->op) && distance < 0) continue;
+	Retarget(opt, i, target);
+    }
+    free(pos);
+}
+
+// Only what can be reached from the first instruction, through jumps and
+// falling through, is kept. A loop that nothing outside it reaches is
+// labelled by its own jump back, so it takes following the jumps to see
+// that it's dead.
+static void RemoveUnreachable(OPTIMIZER *opt) {
+    int n = opt->length;
+    char *reached = calloc(n + 1, 1);
+    int *pending = malloc((n + 1) * sizeof(int));
+    int *next = malloc((n + 1) * sizeof(int));
+    if (reached == NULL || pending == NULL || next == NULL) {
+	panic("out of memory for the optimizer");
+    }
+    int nPending = 0;
+    if (n > 0) {
+	reached[0] = 1;
+	pending[nPending++] = 0;
+    }
+    while (nPending > 0) {
+	int i = pending[--nPending];
+	int count = Successors(opt, i, next);
+	for (int k = 0; k < count; k++) {
+	    if (reached[next[k]]) continue;
+	    reached[next[k]] = 1;
+	    pending[nPending++] = next[k];
+	}
+    }
+    for (int i = 0; i < n; i++) {
+	if (!reached[i] && opt->code[i].op != OP_END) Kill(opt, i);
+    }
+    free(reached);
+    free(pending);
+    free(next);
+    Compact(opt);
+}
+
+/* Decoding and encoding */
+
+static void Decode(OPTIMIZER *opt, Handle bytecode) {
+    int codeLength = BytevectorLength(bytecode);
+    int *indexAt = malloc((codeLength + 1) * sizeof(int));
+    opt->code = malloc(codeLength * sizeof(INSN));
+    if (indexAt == NULL || opt->code == NULL) {
+	panic("out of memory for the optimizer");
+    }
+    opt->length = 0;
+    for (int pc = 0; pc < codeLength;) {
+	INSN *insn = &opt->code[opt->length];
+	indexAt[pc] = opt->length++;
+	int next = DecodeInstruction(bytecode, pc, &insn->op, &insn->arg);
+	// keep the target's position until every index is known
+	if (insn->op == OP_JUMP_BACK) insn->target = next - insn->arg;
+	else if (IsJump(insn->op)) insn->target = next + insn->arg;
+	else insn->target = -1;
+	insn->labels = 0;
+	insn->dead = 0;
+	insn->big = 0;
+	insn->pinned = 0;
+	pc = next;
+    }
+    for (int i = 0; i < opt->length; i++) {
+	INSN *insn = &opt->code[i];
+	if (insn->target != -1) {
+	    insn->target = indexAt[insn->target];
+	    opt->code[insn->target].labels++;
+	}
+	if (insn->op == OP_CASE) {
+	    int jumps = CaseClauses(VectorRef(opt->literals, insn->arg)) + 1;
+	    for (int j = 1; j <= jumps; j++) opt->code[i + j].pinned = 1;
+	}
+    }
+    free(indexAt);
+}
+
+// Every jump but a case's starts short, and the ones whose distance doesn't
+// fit are made big until none are left. Making a jump bigger only moves others further
+// apart, so this stops. Returns the position of each instruction.
+static int *Layout(OPTIMIZER *opt) {
+    for (int i = 0; i < opt->length; i++) opt->code[i].big = opt->code[i].pinned;
+    for (;;) {
+	int *pos = Positions(opt);
+	int grew = 0;
+	for (int i = 0; i < opt->length; i++) {
+	    INSN *insn = &opt->code[i];
+	    if (insn->target == -1 || insn->big) continue;
+	    int distance = abs(pos[insn->target] - pos[i + 1]);
+	    if (distance > MAX_SHORT_ARG) {
+		insn->big = 1;
+		grew = 1;
+	    }
+	}
+	if (!grew) return pos;
+	free(pos);
+    }
+}
+
+static void Encode(OPTIMIZER *opt, Handle bytecode) {
+    int *pos = Layout(opt);
+    ResizeBytevector(bytecode, pos[opt->length]);
+    uint8_t *bytes = BVEC_CONTENTS(bytecode);
+    for (int i = 0; i < opt->length; i++) {
+	INSN *insn = &opt->code[i];
+	int arg = insn->arg;
+	if (insn->target != -1) {
+	    arg = pos[insn->target] - pos[i + 1];
+	    if (insn->op == OP_JUMP || insn->op == OP_JUMP_BACK) {
+		insn->op = arg < 0 ? OP_JUMP_BACK : OP_JUMP;
+	    }
+	    if (arg < 0) arg = -arg;
+	}
+	if (arg > MAX_ARG) panic("optimized jump too far");
+	uint8_t *at = &bytes[pos[i]];
+	if (InstructionSize(insn) == 4) {
+	    *at++ = OPCODE_BIG_ARG;
+	    *at++ = insn->op;
+	    *at++ = arg & 0xff;
+	    *at = arg >> 8;
+	}
+	else {
+	    *at++ = insn->op;
+	    if (insn->op > OPCODE_ARGUMENTS) *at = arg;
+	}
+    }
+    free(pos);
+}
+
+// remove literals nothing refers to any more
+static void CompactLiterals(OPTIMIZER *opt) {
+    int count = VectorLength(opt->literals);
+    int *renumbered = malloc((count + 1) * sizeof(int));
+    if (renumbered == NULL) panic("out of memory for the optimizer");
+    for (int k = 0; k < count; k++) renumbered[k] = -1;
+    for (int i = 0; i < opt->length; i++) {
+	uint8_t op = opt->code[i].op;
+	if (op == OP_LITERAL || op == OP_GLOBAL || op == OP_SET_GLOBAL || op == OP_CASE) {
+	    renumbered[opt->code[i].arg] = 0;
+	}
+    }
+    int used = 0;
+    for (int k = 0; k < count; k++) {
+	if (renumbered[k] == -1) continue;
+	renumbered[k] = used;
+	VectorSet(opt->literals, used++, VectorRef(opt->literals, k));
+    }
+    if (used < count) {
+	ResizeVector(opt->literals, used);
+	for (int i = 0; i < opt->length; i++) {
+	    uint8_t op = opt->code[i].op;
+	    if (op == OP_LITERAL || op == OP_GLOBAL || op == OP_SET_GLOBAL ||
+		op == OP_CASE) {
+		opt->code[i].arg = renumbered[opt->code[i].arg];
+	    }
+	}
+    }
+    free(renumbered);
+}
+
+static int StackEffectOf(INSN *insn) {
+    switch (insn->op) {
+    case OP_DUP: case OP_NIL: case OP_LITERAL: case OP_GLOBAL: case OP_GLOBAL_CELL:
+    case OP_LOCAL: case OP_LOCAL_BOX: case OP_CLOSURE: case OP_CLOSURE_BOX:
+	return 1;
+    case OP_DROP: case OP_RETURN: case OP_SET_GLOBAL: case OP_SET_LOCAL:
+    case OP_SET_LOCAL_BOX: case OP_SET_CLOSURE_BOX:
+    case OP_JUMP_TRUE: case OP_JUMP_FALSE: case OP_CASE:
+	return -1;
+    case OP_MAKE_CLOSURE: case OP_TAIL_APPLY: case OP_CALL_KNOWN:
+	return -insn->arg;
+    case OP_CALL_SELF:
+	return 1 - insn->arg;
+    case OP_UNCHECKED:
+	return -uncheckedPrimitives[insn->arg].arity;
+    default:
+	return IsApply(insn->op) ? -insn->arg : 0;
+    }
+}
+
+// the deepest the stack gets, following the jumps; every instruction
+// that's jumped to has to be reached with the same depth each way
+static int MaxStack(OPTIMIZER *opt) {
+    int n = opt->length;
+    int *depthAt = malloc((n + 1) * sizeof(int));
+    int *pending = malloc((n + 1) * sizeof(int));
+    int *next = malloc((n + 1) * sizeof(int));
+    if (depthAt == NULL || pending == NULL || next == NULL) {
+	panic("out of memory for the optimizer");
+    }
+    for (int i = 0; i < n; i++) depthAt[i] = -1;
+    int nPending = 0, max = 0;
+    if (n > 0) {
+	depthAt[0] = 0;
+	pending[nPending++] = 0;
+    }
+    while (nPending > 0) {
+	int i = pending[--nPending];
+	int depth = depthAt[i] + StackEffectOf(&opt->code[i]);
+	assert(depth >= 0);
+	if (depth > max) max = depth;
+	int count = Successors(opt, i, next);
+	for (int k = 0; k < count; k++) {
+	    if (depthAt[next[k]] == -1) {
+		depthAt[next[k]] = depth;
+		pending[nPending++] = next[k];
+	    }
+	    assert(depthAt[next[k]] == depth);
+	}
+    }
+    for (int i = 0; i < n; i++) assert(opt->code[i].labels == 0 || depthAt[i] != -1);
+    free(depthAt);
+    free(pending);
+    free(next);
+    return max;
+}
+
+// Optimize a function's code in place. Returns the stack size it needs now.
+int OptimizeBytecode(Handle bytecode, Handle literals) {
+    OPTIMIZER opt;
+    opt.literals = literals;
+    Decode(&opt, bytecode);
+    do {
+	opt.changed = 0;
+	FoldConstants(&opt);
+	RemoveDeadPushes(&opt);
+	SimplifyBranches(&opt);
+	ThreadJumps(&opt);
+	RemoveUnreachable(&opt);
+    } while (opt.changed);
+    CompactLiterals(&opt);
+    Encode(&opt, bytecode);
+    int stacksize = MaxStack(&opt);
+    free(opt.code);
+    return stacksize;
+}
+
+// Encode a function's code again without optimizing it, so that the
+// compiler's forward jumps are short wherever they can be.
+void RelaxBytecode(Handle bytecode, Handle literals) {
+    OPTIMIZER opt;
+    opt.literals = literals;
+    Decode(&opt, bytecode);
+    Encode(&opt, bytecode);
+    free(opt.code);
+}
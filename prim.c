@@ -1,18 +1,25 @@
 #include <stdio.h>
+#include <string.h>
 #include "lilscheme.h"
 
 Handle CallPrimitive(Handle prim, Handle argv) {
     // TODO: check arity
     PRIMITIVE *pr = DATA_AREA(PRIMITIVE, prim);
     PRIMPTR proc = pr->procedure;
-    return (*proc)(argv);
+    const char *name = pr->name;
+    TRACE(TRACE_PRIMITIVE, 'B', name, 0);
+    Handle result = (*proc)(argv);
+    TRACE(TRACE_PRIMITIVE, 'E', name, 0);
+    return result;
 }
 
-Handle CreatePrimitive(PRIMPTR proc, int arity) {
+Handle CreatePrimitive(const char *name, PRIMPTR proc, int arity, uint8_t quickened) {
     Handle prim = CreateObject(TYPE_PRIMITIVE, 0);
     PRIMITIVE *pr = DATA_AREA(PRIMITIVE, prim);
+    pr->name = name;
     pr->procedure = proc;
     pr->arguments = arity;
+    pr->quickened = quickened;
     return prim;
 }
 
@@ -68,6 +75,30 @@ Handle prim_EQUAL(Handle argv) {
     
 }
 
+// true iff each argument is less than the next
+Handle prim_LESS(Handle argv) {
+    int len = VectorLength(argv);
+    for (int i = 0; i < len; i++) TypecheckNumeric(VectorRef(argv, i));
+    for (int i = 1; i < len; i++) {
+	if (CompareNumbers(VectorRef(argv, i-1), VectorRef(argv, i)) >= 0) {
+	    return LISP_FALSE;
+	}
+    }
+    return LISP_TRUE;
+}
+
+// true iff each argument is greater than the next
+Handle prim_GREATER(Handle argv) {
+    int len = VectorLength(argv);
+    for (int i = 0; i < len; i++) TypecheckNumeric(VectorRef(argv, i));
+    for (int i = 1; i < len; i++) {
+	if (CompareNumbers(VectorRef(argv, i-1), VectorRef(argv, i)) <= 0) {
+	    return LISP_FALSE;
+	}
+    }
+    return LISP_TRUE;
+}
+
 Handle prim_cons(Handle argv) {
     Handle a = VectorRef(argv, 0);
     Handle b = VectorRef(argv, 1);
@@ -84,6 +115,19 @@ Handle prim_cdr(Handle argv) {
     return Cdr(pair);
 }
 
+Handle prim_nullp(Handle argv) {
+    return LISP_BOOLEAN(VectorRef(argv, 0) == nil);
+}
+
+Handle prim_pairp(Handle argv) {
+    return LISP_BOOLEAN(TYPEOF(VectorRef(argv, 0)) == TYPE_CONS);
+}
+
+// nil is the only false value
+Handle prim_not(Handle argv) {
+    return LISP_BOOLEAN(VectorRef(argv, 0) == LISP_FALSE);
+}
+
 Handle prim_set_car(Handle argv) {
     Handle pair = VectorRef(argv, 0);
     Handle obj = VectorRef(argv, 1);
@@ -128,48 +172,117 @@ Handle prim_display(Handle argv) {
 
 Handle prim_type_of(Handle argv) {
     Handle o = VectorRef(argv, 0);
-    switch (TYPEOF(o)) {
-    case TYPE_NIL:
-	return SYM(nil);
-    case TYPE_INT:
-	return SYM(integer);
-    case TYPE_FLOAT:
-	return SYM(float);
-    case TYPE_CONS:
-	return SYM(pair);
-    case TYPE_VECTOR:
-	return SYM(vector);
-    case TYPE_BYTEVECTOR:
-	return SYM(bytevector);
-    case TYPE_FUNCTION:
-	return SYM(procedure);
-    case TYPE_PRIMITIVE:
-	return SYM(primitive-procedure);
-    case TYPE_CONTEXT:
-	return SYM(continuation);
-	
-    default:
-	panic("forgot a type in the type-of primitive");
-	return SYM(UNKNOWN-TYPE);
+    return CreateSymbol(typeInfo[TYPEOF(o)].typeOf);
+}
+
+/* Unchecked primitives */
+
+// These do the same as the primitives above, given arguments the compiler
+// has already proven are the right types.
+
+static Handle unchecked_PLUS(Handle a, Handle b) {
+    return CreateInteger(DATA_DEREF(int, a) + DATA_DEREF(int, b));
+}
+
+static Handle unchecked_MINUS(Handle a, Handle b) {
+    return CreateInteger(DATA_DEREF(int, a) - DATA_DEREF(int, b));
+}
+
+static Handle unchecked_TIMES(Handle a, Handle b) {
+    return CreateInteger(DATA_DEREF(int, a) * DATA_DEREF(int, b));
+}
+
+static Handle unchecked_EQUAL(Handle a, Handle b) {
+    return LISP_BOOLEAN(DATA_DEREF(int, a) == DATA_DEREF(int, b));
+}
+
+static Handle unchecked_LESS(Handle a, Handle b) {
+    return LISP_BOOLEAN(DATA_DEREF(int, a) < DATA_DEREF(int, b));
+}
+
+static Handle unchecked_GREATER(Handle a, Handle b) {
+    return LISP_BOOLEAN(DATA_DEREF(int, a) > DATA_DEREF(int, b));
+}
+
+static Handle unchecked_car(Handle pair, Handle unused) {
+    return DATA_AREA(CONS, pair)->car;
+}
+
+static Handle unchecked_cdr(Handle pair, Handle unused) {
+    return DATA_AREA(CONS, pair)->cdr;
+}
+
+static Handle unchecked_cons(Handle a, Handle b) {
+    return CreateCons(a, b);
+}
+
+static Handle unchecked_eqp(Handle a, Handle b) {
+    return LISP_BOOLEAN(a == b);
+}
+
+static Handle unchecked_nullp(Handle x, Handle unused) {
+    return LISP_BOOLEAN(x == nil);
+}
+
+static Handle unchecked_pairp(Handle x, Handle unused) {
+    return LISP_BOOLEAN(TYPEOF(x) == TYPE_CONS);
+}
+
+static Handle unchecked_not(Handle x, Handle unused) {
+    return LISP_BOOLEAN(x == LISP_FALSE);
+}
+
+#define INT TYPE_BIT(TYPE_INT)
+#define PAIR TYPE_BIT(TYPE_CONS)
+const UNCHECKED uncheckedPrimitives[] = {
+    {"+", 2, INT, INT, INT, unchecked_PLUS},
+    {"-", 2, INT, INT, INT, unchecked_MINUS},
+    {"*", 2, INT, INT, INT, unchecked_TIMES},
+    {"=", 2, TYPES_NUMERIC, INT, TYPES_BOOLEAN, unchecked_EQUAL},
+    {"<", 2, TYPES_NUMERIC, INT, TYPES_BOOLEAN, unchecked_LESS},
+    {">", 2, TYPES_NUMERIC, INT, TYPES_BOOLEAN, unchecked_GREATER},
+    {"car", 1, PAIR, PAIR, TYPES_ANY, unchecked_car},
+    {"cdr", 1, PAIR, PAIR, TYPES_ANY, unchecked_cdr},
+    {"cons", 2, TYPES_ANY, TYPES_ANY, PAIR, unchecked_cons},
+    {"eq?", 2, TYPES_ANY, TYPES_ANY, TYPES_BOOLEAN, unchecked_eqp},
+    {"null?", 1, TYPES_ANY, TYPES_ANY, TYPES_BOOLEAN, unchecked_nullp},
+    {"pair?", 1, TYPES_ANY, TYPES_ANY, TYPES_BOOLEAN, unchecked_pairp},
+    {"not", 1, TYPES_ANY, TYPES_ANY, TYPES_BOOLEAN, unchecked_not},
+    {NULL, 0, 0, 0, 0, NULL}
+};
+#undef INT
+#undef PAIR
+
+// the index of the unchecked primitive called `name`, or -1
+int UncheckedPrimitiveNamed(const char *name) {
+    for (int i = 0; uncheckedPrimitives[i].name != NULL; i++) {
+	if (strcmp(uncheckedPrimitives[i].name, name) == 0) return i;
     }
+    return -1;
 }
 
 struct PrimTableEntry {
     char *name;
     PRIMPTR proc;
     int arity;
+    uint8_t quickened;  // see PRIMITIVE
 };
 
 static struct PrimTableEntry primTable[] = {
-    {"+", prim_PLUS,  -1},
-    {"-", prim_MINUS, -1},
-    {"*", prim_TIMES, -2},
-    {"=", prim_EQUAL, -2},
+    {"+", prim_PLUS,  -1, OP_ADD_INT},
+    {"-", prim_MINUS, -1, OP_SUB_INT},
+    {"*", prim_TIMES, -2, OP_MUL_INT},
+    {"=", prim_EQUAL, -2, OP_EQUAL_INT},
+    {"<", prim_LESS, -2, OP_LESS_INT},
+    {">", prim_GREATER, -2, OP_GREATER_INT},
     {"eq?", prim_eqp, 2},
     {"eqv?", prim_eqvp, 2},
     {"cons", prim_cons, 2},
     {"car", prim_car, 1},
-    {"cdr", prim_car, 1},
+    {"cdr", prim_cdr, 1},
+    {"null?", prim_nullp, 1},
+    {"pair?", prim_pairp, 1},
+    {"not", prim_not, 1},
     {"set-car!", prim_set_car, 2},
     {"set-cdr!", prim_set_cdr, 2},
     {"display", prim_display, 1},
@@ -181,7 +294,8 @@ void ConstructPrimitives() {
     int idx = 0;
     while (primTable[idx].name != NULL) {
 	Handle key = CreateSymbol(primTable[idx].name);
-	Handle prim = CreatePrimitive(primTable[idx].proc, primTable[idx].arity);
+	Handle prim = CreatePrimitive(primTable[idx].name, primTable[idx].proc,
+				      primTable[idx].arity, primTable[idx].quickened);
 	globals = AlistSet(globals, key, prim);
 	idx++;
     }
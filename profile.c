@@ -0,0 +1,255 @@
+/* profile.c - instrumenting profiler for the stack engine */
+
+// The profiled build of the interpreter loop calls ProfileStep() before each
+// instruction. The time since the previous step is charged to the previous
+// instruction, its opcode and its function. Time spent in native code is
+// charged to the function only. Time spent in the profiler itself is left
+// out as far as possible.
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lilscheme.h"
+
+#define HOT_FUNCTIONS 3     // functions whose instructions are listed
+
+int vmProfiling = 0;
+
+// one per compiled function; closures made from the same template share one
+typedef struct FunctionProfile {
+    Handle function;    // the first instance seen, kept alive for the report
+    uint64_t calls, returns, instructions, cycles;
+    int length;         // of the bytecode
+    uint64_t *counts;   // per bytecode position
+    uint64_t *ipCycles;
+    struct FunctionProfile *next;
+} FUNCPROFILE;
+
+static FUNCPROFILE *profiles = NULL;
+static int nProfiles = 0;
+static Handle profiled;      // vector rooting every profiled function
+
+static uint64_t opcodeCounts[256];
+static uint64_t opcodeCycles[256];
+static FUNCPROFILE **byBytecode = NULL;
+static uint64_t *globalLookups = NULL;  // by symbol handle
+static uint64_t nativeCycles = 0;
+
+// what the running interval will be charged to
+static FUNCPROFILE *current = NULL;
+static int currentIp = -1;      // -1 for native code
+static uint8_t currentOp;       // as it was before the engine quickened it
+static uint64_t intervalStart;
+
+static uint64_t ReadCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+// the opcode at `ip`, past any big-argument prefix
+static uint8_t OpcodeAt(Handle fn, int ip) {
+    uint8_t op; int arg;
+    DecodeInstruction(DATA_AREA(FUNCTION, fn)->bytecode, ip, &op, &arg);
+    return op;
+}
+
+static void Charge(uint64_t now) {
+    if (current == NULL) return;
+    uint64_t elapsed = now - intervalStart;
+    current->cycles += elapsed;
+    if (currentIp == -1) {
+	nativeCycles += elapsed;
+    }
+    else {
+	current->ipCycles[currentIp] += elapsed;
+	opcodeCycles[currentOp] += elapsed;
+    }
+}
+
+static FUNCPROFILE *ProfileOf(Handle fn) {
+    FUNCPROFILE *p = DATA_AREA(FUNCTION, fn)->profile;
+    if (p != NULL) return p;
+
+    if (globalLookups == NULL) {
+	profiled = CreateVector(0);
+	Retain(profiled);
+	globalLookups = calloc(MAX_HANDLES, sizeof(uint64_t));
+	byBytecode = calloc(MAX_HANDLES, sizeof(FUNCPROFILE*));
+	if (globalLookups == NULL || byBytecode == NULL) {
+	    panic("out of memory in profiler");
+	}
+    }
+    // the bytecode stays alive through the first function seen with it, so
+    // its handle can't be reused
+    Handle bytecode = DATA_AREA(FUNCTION, fn)->bytecode;
+    p = byBytecode[bytecode];
+    if (p != NULL) {
+	DATA_AREA(FUNCTION, fn)->profile = p;
+	return p;
+    }
+    p = calloc(1, sizeof(FUNCPROFILE));
+    if (p == NULL) panic("out of memory in profiler");
+    p->function = fn;
+    p->length = BytevectorLength(bytecode);
+    p->counts = calloc(p->length, sizeof(uint64_t));
+    p->ipCycles = calloc(p->length, sizeof(uint64_t));
+    if (p->counts == NULL || p->ipCycles == NULL) {
+	panic("out of memory in profiler");
+    }
+    p->next = profiles;
+    profiles = p;
+    nProfiles++;
+    byBytecode[bytecode] = p;
+    DATA_AREA(FUNCTION, fn)->profile = p;
+    VectorAppend(profiled, fn);
+    return p;
+}
+
+void ProfileStep(Handle fn, int ip) {
+    Charge(ReadCycleCounter());
+    FUNCPROFILE *p = ProfileOf(fn);
+    p->instructions++;
+    p->counts[ip]++;
+    currentOp = OpcodeAt(fn, ip);
+    opcodeCounts[currentOp]++;
+    current = p;
+    currentIp = ip;
+    intervalStart = ReadCycleCounter();
+}
+
+void ProfileNative(Handle fn) {
+    Charge(ReadCycleCounter());
+    current = ProfileOf(fn);
+    currentIp = -1;
+    intervalStart = ReadCycleCounter();
+}
+
+void ProfileCall(Handle fn) {
+    if (TYPEOF(fn) == TYPE_FUNCTION) ProfileOf(fn)->calls++;
+}
+
+void ProfileReturn(Handle fn) {
+    ProfileOf(fn)->returns++;
+}
+
+void ProfileGlobal(Handle sym) {
+    if (globalLookups != NULL) globalLookups[sym]++;
+}
+
+void ProfileStop() {
+    Charge(ReadCycleCounter());
+    current = NULL;
+}
+
+
+/* Report */
+
+static int CompareByCycles(const void *a, const void *b) {
+    uint64_t x = (*(FUNCPROFILE**)a)->cycles, y = (*(FUNCPROFILE**)b)->cycles;
+    return (x < y) - (x > y);
+}
+
+static int CompareOpcodes(const void *a, const void *b) {
+    uint64_t x = opcodeCycles[*(int*)a], y = opcodeCycles[*(int*)b];
+    return (x < y) - (x > y);
+}
+
+static int CompareLookups(const void *a, const void *b) {
+    uint64_t x = globalLookups[*(int*)a], y = globalLookups[*(int*)b];
+    return (x < y) - (x > y);
+}
+
+static double Percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+static void PrintFunctionName(FUNCPROFILE *p, FILE *out) {
+    Handle name = GlobalNameOf(p->function);
+    if (name != nil) fprintf(out, "%-20s", NameOfSymbol(name));
+    else fprintf(out, "<lambda %04x>       ", p->function);
+}
+
+void PrintProfile(FILE *out) {
+    uint64_t total = 0, instructions = 0;
+    FUNCPROFILE **sorted = malloc((nProfiles + 1) * sizeof(FUNCPROFILE*));
+    if (sorted == NULL) panic("out of memory in profiler");
+    int n = 0;
+    for (FUNCPROFILE *p = profiles; p != NULL; p = p->next) {
+	sorted[n++] = p;
+	total += p->cycles;
+	instructions += p->instructions;
+    }
+    qsort(sorted, n, sizeof(FUNCPROFILE*), CompareByCycles);
+
+    fprintf(out, "\n=== profile: %llu instructions, %llu cycles ===\n",
+	    (unsigned long long)instructions, (unsigned long long)total);
+
+    fprintf(out, "\nopcode                   count       cycles  cycles/op      %%\n");
+    int ops[256], nOps = 0;
+    for (int op = 0; op < 256; op++) {
+	if (opcodeCounts[op] > 0) ops[nOps++] = op;
+    }
+    qsort(ops, nOps, sizeof(int), CompareOpcodes);
+    for (int i = 0; i < nOps; i++) {
+	int op = ops[i];
+	fprintf(out, "%-16s %12llu %12llu %10.1f %6.2f\n", OpcodeName(op),
+		(unsigned long long)opcodeCounts[op],
+		(unsigned long long)opcodeCycles[op],
+		(double)opcodeCycles[op] / opcodeCounts[op],
+		Percent(opcodeCycles[op], total));
+    }
+    if (nativeCycles > 0) {
+	fprintf(out, "%-16s %12s %12llu %10s %6.2f\n", "(native code)", "",
+		(unsigned long long)nativeCycles, "",
+		Percent(nativeCycles, total));
+    }
+
+    fprintf(out, "\nfunction                calls    returns instructions       cycles      %%\n");
+    for (int i = 0; i < n; i++) {
+	FUNCPROFILE *p = sorted[i];
+	PrintFunctionName(p, out);
+	fprintf(out, " %8llu %10llu %12llu %12llu %6.2f\n",
+		(unsigned long long)p->calls, (unsigned long long)p->returns,
+		(unsigned long long)p->instructions, (unsigned long long)p->cycles,
+		Percent(p->cycles, total));
+    }
+
+    if (globalLookups != NULL) {
+	int *syms = malloc(MAX_HANDLES * sizeof(int));
+	if (syms == NULL) panic("out of memory in profiler");
+	int nSyms = 0;
+	for (int i = 0; i < MAX_HANDLES; i++) {
+	    if (globalLookups[i] > 0) syms[nSyms++] = i;
+	}
+	qsort(syms, nSyms, sizeof(int), CompareLookups);
+	fprintf(out, "\nglobal lookups\n");
+	for (int i = 0; i < nSyms; i++) {
+	    fprintf(out, "%-20s %12llu\n", NameOfSymbol(syms[i]),
+		    (unsigned long long)globalLookups[syms[i]]);
+	}
+	free(syms);
+    }
+
+    // annotated listings of the hottest functions
+    for (int i = 0; i < n && i < HOT_FUNCTIONS; i++) {
+	FUNCPROFILE *p = sorted[i];
+	fprintf(out, "\n");
+	PrintFunctionName(p, out);
+	fprintf(out, "\n       count       cycles      %%\n");
+	for (int ip = 0; ip < p->length;) {
+	    fprintf(out, "%12llu %12llu %6.2f  %4d  ",
+		    (unsigned long long)p->counts[ip],
+		    (unsigned long long)p->ipCycles[ip],
+		    Percent(p->ipCycles[ip], p->cycles), ip);
+	    ip = DisassembleInstruction(p->function, ip, out);
+	    fputc('\n', out);
+	}
+    }
+    free(sorted);
+}
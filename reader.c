@@ -22,9 +22,12 @@ Handle ReadVector(FILE*);
 // TODO: handle EOFs properly
 //       disable garbage collection while reading
 Handle ReadObject(FILE *input) {
+    TRACE(TRACE_READ, 'B', "read", ftell(input));
+    MakeRoom();
     DisableGC();
     Handle o = ReadNextObject(input);
     EnableGC();
+    TRACE(TRACE_READ, 'E', "read", ftell(input));
     return o;
 }
 
@@ -131,12 +134,16 @@ Handle ReadQuoted(FILE *input) {
 				 nil));		 
 }
 
+// skips comments too, which run from a semicolon to the end of the line
 int ReadNextNonSpace(FILE *input) {
     int c;
-    do {
+    for (;;) {
 	c = fgetc(input);
-    } while (isspace(c));
-    return c;
+	if (c == ';') {
+	    while (c != '\n' && c != EOF) c = fgetc(input);
+	}
+	if (!isspace(c)) return c;
+    }
 }
 
 
@@ -1,8 +1,191 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "lilscheme.h"
 
+#define DEFAULT_JIT_THRESHOLD 100
+#define DEFAULT_SAMPLE_RATE 1000
+#define TRACE_EVENTS (1 << 16)  // kept in the trace buffer
+
+char *programFile = NULL;
+int useCodeCache = 1;
+char *sampleFile = NULL;
+char *traceFile = NULL;
+char *snapshotFile = NULL;
+int sampleRate = DEFAULT_SAMPLE_RATE;
+
+void Usage(char *progname) {
+    fprintf(stderr, "usage: %s [--engine=stack|register] [--jit[=CALLS]] "
+	    "[--no-cache] [--no-optimize] [--sealed] [--lazy] [--safety=N] [--profile] "
+	    "[--sample=OUT [--sample-rate=HZ]] [--trace=OUT] [--heap-snapshot=OUT] [FILE]\n",
+	    progname);
+}
+
+int ParseOptions(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "--engine=stack") == 0) {
+	    vmEngine = ENGINE_STACK;
+	}
+	else if (strcmp(argv[i], "--engine=register") == 0) {
+	    vmEngine = ENGINE_REGISTER;
+	}
+	else if (strcmp(argv[i], "--jit") == 0) {
+	    jitThreshold = DEFAULT_JIT_THRESHOLD;
+	}
+	else if (strncmp(argv[i], "--jit=", 6) == 0) {
+	    jitThreshold = atoi(argv[i] + 6);
+	}
+	else if (strcmp(argv[i], "--profile") == 0) {
+	    vmProfiling = 1;
+	}
+	else if (strncmp(argv[i], "--sample=", 9) == 0) {
+	    sampleFile = argv[i] + 9;
+	}
+	else if (strncmp(argv[i], "--trace=", 8) == 0) {
+	    traceFile = argv[i] + 8;
+	}
+	else if (strncmp(argv[i], "--heap-snapshot=", 16) == 0) {
+	    snapshotFile = argv[i] + 16;
+	}
+	else if (strncmp(argv[i], "--sample-rate=", 14) == 0) {
+	    sampleRate = atoi(argv[i] + 14);
+	    if (sampleRate <= 0 || sampleRate > 1000000) {
+		Usage(argv[0]);
+		return 0;
+	    }
+	}
+	else if (strcmp(argv[i], "--no-cache") == 0) {
+	    useCodeCache = 0;
+	}
+	else if (strcmp(argv[i], "--no-optimize") == 0) {
+	    optimizeBytecode = 0;
+	}
+	else if (strcmp(argv[i], "--sealed") == 0) {
+	    sealPrograms = 1;
+	}
+	else if (strcmp(argv[i], "--lazy") == 0) {
+	    // stubs hold source, which the cache can't
+	    lazyCompile = 1;
+	    useCodeCache = 0;
+	}
+	else if (strncmp(argv[i], "--safety=", 9) == 0) {
+	    // as if the program started with a safety declaration
+	    compilerSafety = atoi(argv[i] + 9);
+	    if (argv[i][9] < '0' || argv[i][9] > '2' || argv[i][10] != '\0') {
+		Usage(argv[0]);
+		return 0;
+	    }
+	}
+	else if (argv[i][0] != '-' && programFile == NULL) {
+	    programFile = argv[i];
+	}
+	else {
+	    Usage(argv[0]);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+// write the folded stacks collected by the sampling profiler
+void FinishSampling() {
+    FILE *out = fopen(sampleFile, "w");
+    if (out == NULL) {
+	perror(sampleFile);
+	return;
+    }
+    WriteSamples(out);
+    fclose(out);
+}
+
+// write the event trace as Chrome trace JSON
+void FinishTracing() {
+    FILE *out = fopen(traceFile, "w");
+    if (out == NULL) {
+	perror(traceFile);
+	return;
+    }
+    WriteTrace(out);
+    fclose(out);
+}
+
+// write a heap snapshot for heapstat
+void FinishSnapshot() {
+    FILE *out = fopen(snapshotFile, "w");
+    if (out == NULL) {
+	perror(snapshotFile);
+	return;
+    }
+    WriteHeapSnapshot(out);
+    fclose(out);
+}
+
+// Load the compiled program for `path` from its cache file, or compile it
+// and write the cache. The cache is only written if it can be replaced
+// whole, so an interrupted run can't leave half a file behind.
+Handle LoadProgram(char *path, FILE *source) {
+    uint32_t hash = HashSource(source);
+    rewind(source);
+    char *cachePath = malloc(strlen(path) + 5);
+    char *tempPath = malloc(strlen(path) + 9);
+    if (cachePath == NULL || tempPath == NULL) panic("out of memory");
+    sprintf(cachePath, "%s.lsc", path);
+    sprintf(tempPath, "%s.lsc.tmp", path);
+
+    Handle program = nil;
+    FILE *cache = fopen(cachePath, "rb");
+    if (cache != NULL) {
+	program = ReadCodeCache(cache, hash);
+	fclose(cache);
+    }
+    if (program == nil) {
+	program = CompileFile(source);
+	cache = fopen(tempPath, "wb");
+	if (cache != NULL) {
+	    WriteCodeCache(program, hash, cache);
+	    if (fclose(cache) == 0) rename(tempPath, cachePath);
+	    else remove(tempPath);
+	}
+    }
+    free(cachePath);
+    free(tempPath);
+    return program;
+}
+
+// Run the forms of a program file in order, without printing results
+int RunFile(char *path) {
+    FILE *source = fopen(path, "r");
+    if (source == NULL) {
+	perror(path);
+	return 1;
+    }
+    InitMem();
+    ConstructPrimitives();
+    Handle program = useCodeCache ? LoadProgram(path, source) : CompileFile(source);
+    Retain(program);
+    fclose(source);
+    FOR_IN_VECTOR(i, program) {
+	StartInterpreter(VectorRef(program, i), nil);
+    }
+    Unretain(program);
+    if (vmProfiling) PrintProfile(stderr);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     Handle code, fn;
+
+    if (!ParseOptions(argc, argv)) return 1;
+    if (sampleFile != NULL) {
+	StartSampling(sampleRate);
+	atexit(FinishSampling);
+    }
+    if (traceFile != NULL) {
+	StartTracing(TRACE_EVENTS);
+	atexit(FinishTracing);
+    }
+    if (snapshotFile != NULL) atexit(FinishSnapshot);
+    if (programFile != NULL) return RunFile(programFile);
     
     puts("lilscheme repl");    
     InitMem();
@@ -31,5 +214,6 @@ int main(int argc, char **argv) {
 	}
     }
 
+    if (vmProfiling) PrintProfile(stderr);
     return 0;
 }
@@ -0,0 +1,122 @@
+/* sample.c - sampling profiler */
+
+// A profiling timer raises SIGPROF at a fixed rate of CPU time. The handler
+// only sets a flag. The interpreters check it whenever they enter or resume
+// a function, and at loop back-edges, where the context chain is consistent.
+// There the Scheme call stack is recorded by walking currentContext and
+// its prior contexts. Samples are kept as folded stacks, root first and
+// separated by semicolons, with a count for each distinct stack. That's the
+// input format of flamegraph.pl.
+
+#define _DEFAULT_SOURCE // for setitimer
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "lilscheme.h"
+
+#define MAX_SAMPLE_DEPTH 128
+#define SAMPLE_BUCKETS 1024
+#define FRAME_NAME_SIZE 32
+
+volatile sig_atomic_t samplePending = 0;
+
+typedef struct StackSample {
+    char *stack;
+    unsigned long count;
+    struct StackSample *next;
+} STACKSAMPLE;
+
+static STACKSAMPLE *buckets[SAMPLE_BUCKETS];
+
+static void OnProfilingTimer(int signal) {
+    (void)signal;
+    samplePending = 1;
+}
+
+void StartSampling(int hz) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnProfilingTimer;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) panic("can't handle SIGPROF");
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+	panic("can't start the profiling timer");
+    }
+}
+
+static void FrameName(Handle fn, char *buf) {
+    Handle name = DATA_AREA(FUNCTION, fn)->name;
+    if (name != nil) {
+	snprintf(buf, FRAME_NAME_SIZE, "%s", NameOfSymbol(name));
+    }
+    else {
+	// closures made from the same template share their bytecode
+	snprintf(buf, FRAME_NAME_SIZE, "lambda-%04x",
+		 DATA_AREA(FUNCTION, fn)->bytecode);
+    }
+}
+
+static unsigned long HashString(const char *s) {
+    unsigned long hash = 5381;
+    while (*s) hash = hash * 33 + (unsigned char)*s++;
+    return hash;
+}
+
+// called by the interpreters when samplePending is set; allocates nothing
+void TakeSample() {
+    samplePending = 0;
+    static char names[MAX_SAMPLE_DEPTH][FRAME_NAME_SIZE];
+    static char stack[MAX_SAMPLE_DEPTH * (FRAME_NAME_SIZE + 1)];
+
+    int depth = 0;
+    for (Handle cxt = currentContext; cxt != nil && depth < MAX_SAMPLE_DEPTH;
+	 cxt = DATA_AREA(CONTEXT, cxt)->prior) {
+	FrameName(DATA_AREA(CONTEXT, cxt)->function, names[depth++]);
+    }
+    if (depth == 0) return;
+
+    char *end = stack;
+    for (int i = depth - 1; i >= 0; i--) {
+	size_t len = strlen(names[i]);
+	memcpy(end, names[i], len);
+	end += len;
+	*end++ = i ? ';' : '\0';
+    }
+
+    unsigned long bucket = HashString(stack) % SAMPLE_BUCKETS;
+    for (STACKSAMPLE *s = buckets[bucket]; s != NULL; s = s->next) {
+	if (strcmp(s->stack, stack) == 0) {
+	    s->count++;
+	    return;
+	}
+    }
+    STACKSAMPLE *s = malloc(sizeof(STACKSAMPLE));
+    if (s == NULL || (s->stack = strdup(stack)) == NULL) {
+	panic("out of memory in sampler");
+    }
+    s->count = 1;
+    s->next = buckets[bucket];
+    buckets[bucket] = s;
+}
+
+// stop the timer and write one line per distinct stack
+void WriteSamples(FILE *out) {
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, NULL);
+    samplePending = 0;
+
+    for (int i = 0; i < SAMPLE_BUCKETS; i++) {
+	for (STACKSAMPLE *s = buckets[i]; s != NULL; s = s->next) {
+	    fprintf(out, "%s %lu\n", s->stack, s->count);
+	}
+    }
+}
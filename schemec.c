@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <string.h>
+#include "lilscheme.h"
+
+// Compile a Scheme program to C. The output links against the runtime
+// objects and runs the program's top-level forms in order.
+int main(int argc, char **argv) {
+    int file = 1;
+    for (; file < argc && argv[file][0] == '-'; file++) {
+	if (strcmp(argv[file], "--no-optimize") == 0) optimizeBytecode = 0;
+	else if (strcmp(argv[file], "--sealed") == 0) sealPrograms = 1;
+	else if (strncmp(argv[file], "--safety=", 9) == 0 && argv[file][9] >= '0' &&
+		 argv[file][9] <= '2' && argv[file][10] == '\0') {
+	    compilerSafety = argv[file][9] - '0';
+	}
+	else break;
+    }
+    if (argc != file + 1) {
+	fprintf(stderr, "usage: %s [--no-optimize] [--sealed] [--safety=N] "
+		"program.scm > program.c\n", argv[0]);
+	return 1;
+    }
+    FILE *source = fopen(argv[file], "r");
+    if (source == NULL) {
+	perror(argv[file]);
+	return 1;
+    }
+
+    InitMem();
+    ConstructPrimitives();
+    Handle program = CompileFile(source);
+    Retain(program);
+    fclose(source);
+
+    CompileProgramToC(program, stdout);
+    Unretain(program);
+    return 0;
+}
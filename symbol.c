@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include "lilscheme.h"
 
@@ -7,6 +8,46 @@
 
 
 // Symbols
+
+// The interned symbols list is what keeps them alive; this hash table, from
+// names to symbols, is how they're found. It's emptied when the list is,
+// which only happens in InitMem.
+static Handle *symbolTable;
+static int symbolTableSize;  // a power of two, or 0
+static int symbolCount;
+
+static unsigned HashName(const char *name) {
+    unsigned hash = 2166136261u;
+    for (; *name; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+// the slot for `name`: the symbol with that name, or an empty one
+static Handle *SymbolSlot(const char *name) {
+    unsigned mask = symbolTableSize - 1;
+    unsigned i = HashName(name) & mask;
+    while (symbolTable[i] != nil && strcmp(NameOfSymbol(symbolTable[i]), name) != 0) {
+	i = (i + 1) & mask;
+    }
+    return &symbolTable[i];
+}
+
+static void AddToSymbolTable(Handle sym) {
+    if (2 * (symbolCount + 1) > symbolTableSize) {
+	Handle *old = symbolTable;
+	int oldSize = symbolTableSize;
+	symbolTableSize = oldSize == 0 ? 256 : 2 * oldSize;
+	symbolTable = calloc(symbolTableSize, sizeof(Handle));
+	if (symbolTable == NULL) panic("out of memory for the symbol table");
+	for (int i = 0; i < oldSize; i++) {
+	    if (old[i] != nil) *SymbolSlot(NameOfSymbol(old[i])) = old[i];
+	}
+	free(old);
+    }
+    *SymbolSlot(NameOfSymbol(sym)) = sym;
+    symbolCount++;
+}
+
 // todo: reconsider the policy on case-sensitivity
 Handle CreateSymbol(const char *name) {
     // Despite the name of this procedure, this will only create a new symbol
@@ -19,20 +60,27 @@ Handle CreateSymbol(const char *name) {
 	strcpy(DATA_AREA(char, sym), name);
 	internedSymbols = CreateCons(sym, internedSymbols);
 	Unretain(sym);
+	AddToSymbolTable(sym);
     }
     return sym;
 }
 
+// A symbol that's never eq? to one that's read, whatever its name. The
+// compiler uses these to rename variables.
+Handle CreateUninternedSymbol(const char *name) {
+    Handle sym = CreateObject(TYPE_SYMBOL, strlen(name)+1);
+    strcpy(DATA_AREA(char, sym), name);
+    return sym;
+}
+
 Handle FindSymbolNamed(const char *desiredName) {
-    Handle here = internedSymbols;
-    while (here != nil) {
-	Handle sym = Car(here);
-	if (strcmp(NameOfSymbol(sym), desiredName) == 0) {
-	    return sym;
-	}
-	here = Cdr(here);
+    if (internedSymbols == nil && symbolCount > 0) {
+	// InitMem has started over
+	memset(symbolTable, 0, symbolTableSize * sizeof(Handle));
+	symbolCount = 0;
     }
-    return nil;
+    if (symbolTableSize == 0) return nil;
+    return *SymbolSlot(desiredName);
 }
 
 char *NameOfSymbol(Handle sym) {
@@ -42,3 +90,8 @@ char *NameOfSymbol(Handle sym) {
     return DATA_AREA(char, sym);
 }
 
+// a hash of the symbol's name, which stays the same from one run to the next
+unsigned SymbolHash(Handle sym) {
+    return HashName(NameOfSymbol(sym));
+}
+
@@ -0,0 +1,120 @@
+/* trace.c - event tracing */
+
+// Events go into a ring buffer of fixed size, so a long-running process
+// keeps only its most recent history. Writers claim a slot with an atomic
+// increment and never wait for one another. Nothing is formatted until the
+// buffer is written out, as Chrome's Trace Event JSON, which chrome://tracing
+// and Perfetto can display.
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lilscheme.h"
+
+typedef struct TraceEvent {
+    uint64_t time;      // nanoseconds
+    TRACEKIND kind;
+    char phase;         // 'B'egin or 'E'nd
+    Handle symbol;      // names the event if not nil
+    const char *label;  // otherwise, this does
+    long value;
+} TRACEEVENT;
+
+int traceEnabled = 0;
+
+static TRACEEVENT *ring = NULL;
+static size_t ringSize;         // a power of two
+static atomic_size_t head = 0;  // events ever written
+
+static const char *categories[] = {
+    [TRACE_GC] = "gc",
+    [TRACE_CALL] = "vm",
+    [TRACE_PRIMITIVE] = "primitive",
+    [TRACE_COMPILE] = "compiler",
+    [TRACE_READ] = "reader",
+};
+
+// keep the last `events` events, rounded up to a power of two
+void StartTracing(size_t events) {
+    ringSize = 1;
+    while (ringSize < events) ringSize *= 2;
+    ring = calloc(ringSize, sizeof(TRACEEVENT));
+    if (ring == NULL) panic("out of memory for the trace buffer");
+    traceEnabled = 1;
+}
+
+static void Record(TRACEKIND kind, char phase, Handle symbol,
+		   const char *label, long value) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    size_t slot = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    TRACEEVENT *e = &ring[slot & (ringSize - 1)];
+    e->time = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+    e->kind = kind;
+    e->phase = phase;
+    e->symbol = symbol;
+    e->label = label;
+    e->value = value;
+}
+
+void TraceEvent(TRACEKIND kind, char phase, const char *label, long value) {
+    Record(kind, phase, nil, label, value);
+}
+
+// Symbols live as long as the process, so a function's global name can be
+// kept by handle. SetGlobal notes the name on the function, so a call costs
+// no search. Lambdas are told apart by their bytecode's handle.
+void TraceFunction(char phase, Handle fn) {
+    Handle name = DATA_AREA(FUNCTION, fn)->name;
+    Record(TRACE_CALL, phase, name, "lambda", DATA_AREA(FUNCTION, fn)->bytecode);
+}
+
+static void WriteString(const char *s, FILE *out) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+	if (*s == '"' || *s == '\\') fputc('\\', out);
+	fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// stop tracing and write out what's in the buffer, oldest first
+void WriteTrace(FILE *out) {
+    traceEnabled = 0;
+    size_t end = atomic_load(&head);
+    size_t start = end > ringSize ? end - ringSize : 0;
+    uint64_t epoch = start < end ? ring[start & (ringSize - 1)].time : 0;
+
+    fputs("{\"traceEvents\":[", out);
+    for (size_t i = start; i < end; i++) {
+	TRACEEVENT *e = &ring[i & (ringSize - 1)];
+	fputs(i == start ? "\n" : ",\n", out);
+	fputs("{\"name\":", out);
+	WriteString(e->symbol != nil ? NameOfSymbol(e->symbol) : e->label, out);
+	fprintf(out, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1",
+		categories[e->kind], e->phase, (e->time - epoch) / 1000.0);
+	switch (e->kind) {
+	case TRACE_GC:
+	    if (e->phase == 'E') {
+		fprintf(out, ",\"args\":{\"bytes copied\":%ld}", e->value);
+	    }
+	    break;
+	case TRACE_CALL:
+	    if (e->symbol == nil) {
+		fprintf(out, ",\"args\":{\"bytecode\":%ld}", e->value);
+	    }
+	    break;
+	case TRACE_READ:
+	    if (e->value >= 0) {
+		fprintf(out, ",\"args\":{\"offset\":%ld}", e->value);
+	    }
+	    break;
+	default:
+	    break;
+	}
+	fputc('}', out);
+    }
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", out);
+}
@@ -11,21 +11,10 @@ void panic(char *mesg) {
 
 
 const char *NameOfType(OBJTYPE type) {
-    switch (type){
-    case TYPE_NIL:        return "TYPE_NIL";
-    case TYPE_INT:        return "TYPE_INT";
-    case TYPE_FLOAT:      return "TYPE_FLOAT";
-    case TYPE_CONS:       return "TYPE_CONS";
-    case TYPE_SYMBOL:     return "TYPE_SYMBOL";
-    case TYPE_VECTOR:     return "TYPE_VECTOR";
-    case TYPE_BYTEVECTOR: return "TYPE_BYTEVECTOR";
-    case TYPE_FUNCTION:   return "TYPE_FUNCTION";
-    case TYPE_CONTEXT:    return "TYPE_CONTEXT";
-    case TYPE_PRIMITIVE:  return "TYPE_PRIMITIVE";
-    default: return "???";
-    }
+    return type < TYPE_COUNT ? typeInfo[type].name : "???";
 }
 
+#if SAFETY > 0
 void Typecheck(Handle o, OBJTYPE type) {
     if (TYPEOF(o) != type) {
 	panic("incorrect type");
@@ -37,6 +26,7 @@ void TypecheckNumeric(Handle o) {
 	panic("non-numeric object");
     }
 }
+#endif
 
 // equivalence is what eqv? test for
 int Equivalent(Handle x, Handle y) {
@@ -26,11 +26,13 @@ void VectorSet(Handle v, int idx, Handle value) {
     DATA_AREA(VECTOR,v)->elements[idx] = value;
 }
 
+#if SAFETY > 0
 void VectorBoundsCheck(Handle v, int idx) {
     if (idx >= VectorLength(v)) {
 	panic("vector index out of bounds");
     }
 }
+#endif
 
 Handle VectorFromList(Handle list) {
     int length = ListLength(list);
@@ -0,0 +1,254 @@
+/* verify.c - bytecode verifier */
+
+// Every function is checked once, when it's created, and the stack engine
+// runs the ones that pass in a build of its loop that doesn't check bounds
+// (see interpret.h). The compiler's output always passes; what this guards
+// against is a damaged cache file or a mistake in code generation, which
+// would otherwise scribble past the end of a vector.
+//
+// A function passes if
+//
+//  - its code is whole instructions with known opcodes, and every jump
+//    lands on the start of one;
+//  - however an instruction is reached, the stack has the same depth there,
+//    and no instruction takes the stack below empty or above `stacksize`;
+//  - every local, literal and unchecked primitive it names exists;
+//  - each case table is well formed and only picks the jumps that follow
+//    its OP_CASE; and
+//  - no path runs off the end of the code.
+//
+// Closure variables can't be checked here, since the closure is made by
+// another function, so those are still checked as they're used.
+
+#include <stdlib.h>
+#include "lilscheme.h"
+
+typedef struct Verifier {
+    const uint8_t *code;
+    int length;
+    int nLocals;
+    int nLiterals;
+    int stacksize;
+    Handle literals;
+    char *starts;      // 1 where an instruction starts
+    int *depth;        // the stack depth on reaching each byte, or -1
+    int *pending;      // instructions still to look at
+    int nPending;
+} VERIFIER;
+
+static int IsKnownOpcode(uint8_t op) {
+    return op != OPCODE_BIG_ARG && op != OPCODE_ARGUMENTS && op <= OP_GREATER_INT;
+}
+
+// the instruction at `pos`; returns where the next one starts, or -1 if it's cut off
+static int Decode(VERIFIER *v, int pos, uint8_t *op, int *arg) {
+    *op = v->code[pos];
+    *arg = 0;
+    if (*op == OPCODE_BIG_ARG) {
+	if (pos + 3 >= v->length) return -1;
+	*op = v->code[pos + 1];
+	*arg = v->code[pos + 2] | v->code[pos + 3] << 8;
+	return *op > OPCODE_ARGUMENTS ? pos + 4 : -1;
+    }
+    if (*op > OPCODE_ARGUMENTS) {
+	if (pos + 1 >= v->length) return -1;
+	*arg = v->code[pos + 1];
+	return pos + 2;
+    }
+    return pos + 1;
+}
+
+// mark where each instruction starts
+static int FindStarts(VERIFIER *v) {
+    int pos = 0;
+    while (pos < v->length) {
+	uint8_t op; int arg;
+	v->starts[pos] = 1;
+	pos = Decode(v, pos, &op, &arg);
+	if (pos == -1 || !IsKnownOpcode(op)) return 0;
+    }
+    return 1;
+}
+
+// Reach `target` with `depth` values on the stack. It has to be an
+// instruction, and if it's been reached before, with the same depth.
+static int Reach(VERIFIER *v, int target, int depth) {
+    if (target < 0 || target >= v->length || !v->starts[target]) return 0;
+    if (v->depth[target] != -1) return v->depth[target] == depth;
+    v->depth[target] = depth;
+    v->pending[v->nPending++] = target;
+    return 1;
+}
+
+static int LiteralOk(VERIFIER *v, int idx) {
+    return idx < v->nLiterals;
+}
+
+// A case table's jumps must be integers from 0 to its number of clauses,
+// and a hashed table needs an empty pair, or a missing key would never
+// stop being looked for.
+static int CaseTableOk(Handle table) {
+    if (TYPEOF(table) != TYPE_VECTOR || VectorLength(table) < 3) return 0;
+    Handle clauses = VectorRef(table, 0);
+    if (TYPEOF(clauses) != TYPE_INT || UnboxInteger(clauses) < 0) return 0;
+    int n = UnboxInteger(clauses), length = VectorLength(table);
+    int dense = VectorRef(table, 1) != nil;
+    if (dense && TYPEOF(VectorRef(table, 1)) != TYPE_INT) return 0;
+    int pairs = (length - 2) / 2, empty = 0;
+    if (!dense && (length % 2 != 0 || pairs < 2 || (pairs & (pairs - 1)) != 0)) {
+	return 0;
+    }
+    for (int i = dense ? 2 : 3; i < length; i += dense ? 1 : 2) {
+	Handle jump = VectorRef(table, i);
+	if (jump == nil) empty = 1;
+	else if (TYPEOF(jump) != TYPE_INT || UnboxInteger(jump) < 0 ||
+		 UnboxInteger(jump) > n) return 0;
+    }
+    return dense || empty;
+}
+
+// follow the jumps after the OP_CASE that ends at `next`
+static int CaseJumpsOk(VERIFIER *v, int next, int idx, int depth) {
+    Handle table = VectorRef(v->literals, idx);
+    if (!CaseTableOk(table)) return 0;
+    for (int i = 0; i <= CaseClauses(table); i++) {
+	int at = next + 4 * i;
+	if (at + 1 >= v->length || v->code[at] != OPCODE_BIG_ARG ||
+	    (v->code[at + 1] != OP_JUMP && v->code[at + 1] != OP_JUMP_BACK) ||
+	    !Reach(v, at, depth)) return 0;
+    }
+    return 1;
+}
+
+// check the instruction at `pos` and reach the ones that can run after it
+static int Step(VERIFIER *v, int pos) {
+    uint8_t op; int arg;
+    int next = Decode(v, pos, &op, &arg);
+    int depth = v->depth[pos];
+    int pops = 0, pushes = 0;
+    switch (op) {
+    case OP_END: case OP_TAIL_APPLY:
+	// these stop the program
+	return 1;
+    case OP_NOP: case OP_JUMP: case OP_JUMP_BACK:
+	break;
+    case OP_DROP: case OP_JUMP_TRUE: case OP_JUMP_FALSE: case OP_RETURN:
+	pops = 1;
+	break;
+    case OP_DUP:
+	pops = 1; pushes = 2;
+	break;
+    case OP_NIL:
+	pushes = 1;
+	break;
+    case OP_LITERAL: case OP_GLOBAL:
+	if (!LiteralOk(v, arg)) return 0;
+	pushes = 1;
+	break;
+    case OP_GLOBAL_CELL:
+	if (!LiteralOk(v, arg) || TYPEOF(VectorRef(v->literals, arg)) != TYPE_CONS) return 0;
+	pushes = 1;
+	break;
+    case OP_SET_GLOBAL:
+	if (!LiteralOk(v, arg)) return 0;
+	pops = 1;
+	break;
+    case OP_LOCAL: case OP_LOCAL_BOX:
+	if (arg >= v->nLocals) return 0;
+	pushes = 1;
+	break;
+    case OP_SET_LOCAL: case OP_SET_LOCAL_BOX:
+	if (arg >= v->nLocals) return 0;
+	pops = 1;
+	break;
+    case OP_BOX_LOCAL:
+	if (arg >= v->nLocals) return 0;
+	break;
+    case OP_CLOSURE: case OP_CLOSURE_BOX:
+	pushes = 1;
+	break;
+    case OP_SET_CLOSURE_BOX:
+	pops = 1;
+	break;
+    case OP_MAKE_CLOSURE: case OP_CALL_KNOWN:
+    case OP_APPLY: case OP_APPLY_FUNCTION: case OP_APPLY_PRIMITIVE:
+	pops = arg + 1; pushes = 1;
+	break;
+    case OP_ADD_INT: case OP_SUB_INT: case OP_MUL_INT:
+    case OP_EQUAL_INT: case OP_LESS_INT: case OP_GREATER_INT:
+	// these look at two arguments under the procedure before they check it
+	if (arg != 2) return 0;
+	pops = 3; pushes = 1;
+	break;
+    case OP_CALL_SELF:
+	pops = arg; pushes = 1;
+	break;
+    case OP_UNCHECKED:
+	for (int i = 0; i <= arg; i++) {
+	    if (uncheckedPrimitives[i].name == NULL) return 0;
+	}
+	pops = uncheckedPrimitives[arg].arity + 1; pushes = 1;
+	break;
+    case OP_CASE:
+	if (!LiteralOk(v, arg) || depth < 1) return 0;
+	return CaseJumpsOk(v, next, arg, depth - 1);
+    default:
+	return 0;
+    }
+    if (depth < pops || depth - pops + pushes > v->stacksize) return 0;
+    depth += pushes - pops;
+
+    switch (op) {
+    case OP_RETURN:
+	return 1;
+    case OP_JUMP:
+	return Reach(v, next + arg, depth);
+    case OP_JUMP_BACK:
+	return Reach(v, next - arg, depth);
+    case OP_JUMP_TRUE: case OP_JUMP_FALSE:
+	if (!Reach(v, next + arg, depth)) return 0;
+	break;
+    }
+    return Reach(v, next, depth);
+}
+
+// The stack depth on reaching each byte of `fn`'s code, or -1 where no
+// instruction starts or nothing reaches; NULL if `fn` doesn't pass. The
+// caller frees it.
+int *StackDepths(Handle fn) {
+    FUNCTION *f = DATA_AREA(FUNCTION, fn);
+    VERIFIER v;
+    v.code = BVEC_CONTENTS(f->bytecode);
+    v.length = BytevectorLength(f->bytecode);
+    v.nLocals = f->nLocals;
+    v.literals = f->literals;
+    v.nLiterals = VectorLength(f->literals);
+    v.stacksize = f->stacksize;
+    if (v.length == 0 || f->arguments > f->nLocals) return NULL;
+    v.starts = calloc(v.length, 1);
+    v.depth = malloc(v.length * sizeof(int));
+    v.pending = malloc(v.length * sizeof(int));
+    if (v.starts == NULL || v.depth == NULL || v.pending == NULL) {
+	panic("out of memory for the verifier");
+    }
+    for (int i = 0; i < v.length; i++) v.depth[i] = -1;
+    v.nPending = 0;
+
+    int ok = FindStarts(&v) && Reach(&v, 0, 0);
+    while (ok && v.nPending > 0) ok = Step(&v, v.pending[--v.nPending]);
+
+    free(v.starts);
+    free(v.pending);
+    if (!ok) {
+	free(v.depth);
+	return NULL;
+    }
+    return v.depth;
+}
+
+// whether the stack engine can run `fn` without bounds checks
+int VerifyFunction(Handle fn) {
+    int *depths = StackDepths(fn);
+    free(depths);
+    return depths != NULL;
+}
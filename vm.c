@@ -1,10 +1,15 @@
+#include <limits.h>
 #include <stdio.h>
 #include "lilscheme.h"
 
 Handle currentContext;
 Handle globals;
+ENGINE vmEngine = ENGINE_STACK;
 
 Handle Interpret(Handle);
+Handle InterpretChecked(Handle);
+Handle InterpretProfiled(Handle);
+Handle InterpretRegisters(Handle);
 
 Handle CreateContext(Handle fn, Handle prior) {
     int nLocals, stacksize;
@@ -16,10 +21,19 @@ Handle CreateContext(Handle fn, Handle prior) {
 	stacksize = f->stacksize;
     }
 
-    Handle locals = CreateVector(nLocals);
-    Retain(locals);
-    Handle stack = CreateVector(stacksize);
-    Retain(stack);
+    // the register engine keeps the stack slots in the locals vector
+    Handle locals, stack;
+    if (vmEngine == ENGINE_REGISTER) {
+	locals = CreateVector(nLocals + stacksize);
+	Retain(locals);
+	stack = nil;
+    }
+    else {
+	locals = CreateVector(nLocals);
+	Retain(locals);
+	stack = CreateVector(stacksize);
+	Retain(stack);
+    }
 
     Handle context = CreateObject(TYPE_CONTEXT, 0);
     
@@ -31,203 +45,525 @@ Handle CreateContext(Handle fn, Handle prior) {
     cxt->ip = 0;
     cxt->sp = 0;
 
-    Unretain(stack);
+    if (stack != nil) Unretain(stack);
     Unretain(locals);
     return context;
 }
 
-Handle ClosureGet(Handle fn, int idx) {
-    Handle enclosingContext = DATA_AREA(FUNCTION, fn)->closure;
-    while (enclosingContext != nil) {
-	Handle enclosingLocals = DATA_AREA(CONTEXT, enclosingContext)->locals;
-	int len = VectorLength(enclosingLocals);
-	if (idx < len) {
-	    return VectorRef(enclosingLocals, idx);
-	}
-	else {
-	    idx -= len;
-	    enclosingContext = DATA_AREA(CONTEXT, enclosingContext)->prior;
+// A closure is a copy of a compiled function's template with its own vector
+// of captured values. The bytecode and literals are shared.
+Handle CreateClosure(Handle template, Handle values) {
+    Typecheck(template, TYPE_FUNCTION);
+    Handle fn = CreateObject(TYPE_FUNCTION, 0);
+    FUNCTION *f = DATA_AREA(FUNCTION, fn);
+    *f = *DATA_AREA(FUNCTION, template);
+    f->closure = values;
+    return fn;
+}
+
+void LoadArgumentsFromList(Handle locals, Handle argList) {
+    int i = 0;
+    while (argList != nil) {
+	VectorSet(locals, i, Car(argList));
+	argList = Cdr(argList);
+	i++;
+    }
+}
+
+void EnsureRegisterCode(Handle fn) {
+    if (DATA_AREA(FUNCTION, fn)->regcode == nil) {
+	Handle regcode = CompileRegisterCode(fn);
+	DATA_AREA(FUNCTION, fn)->regcode = regcode;
+    }
+}
+
+// whether the register engine runs `fn` on the stack interpreter, because
+// it's too big to translate
+static int RunsOnStack(Handle fn) {
+    return BytevectorLength(DATA_AREA(FUNCTION, fn)->regcode) == 0;
+}
+
+// call such a function from register code, with the vector `args`, which
+// the caller keeps; it runs in a stack context of its own, as do the calls
+// it makes
+static Handle CallOnStack(Handle fn, Handle args) {
+    Handle caller = currentContext;
+    int mark = RootMark();
+    PushRoot(caller);
+    vmEngine = ENGINE_STACK;
+    Handle context = CreateContext(fn, nil);
+    Handle locals = DATA_AREA(CONTEXT, context)->locals;
+    FOR_IN_VECTOR(i, args) VectorSet(locals, i, VectorRef(args, i));
+    Handle result = Interpret(context);
+    vmEngine = ENGINE_REGISTER;
+    currentContext = caller;
+    PopRoots(mark);
+    return result;
+}
+
+// A stub from lazy compilation, or a closure made from one, becomes the
+// function the stub stands for the first time it's called.
+void EnsureCompiled(Handle fn) {
+    if (DATA_AREA(FUNCTION, fn)->stacksize != 0) return;
+    Retain(fn);
+    Handle compiled = CompileLazyFunction(fn);
+    // closures share the template's register code
+    if (vmEngine == ENGINE_REGISTER) EnsureRegisterCode(compiled);
+    FUNCTION *f = DATA_AREA(FUNCTION, fn);
+    Handle closure = f->closure, name = f->name;
+    *f = *DATA_AREA(FUNCTION, compiled);
+    f->closure = closure;
+    f->name = name;
+    Unretain(fn);
+}
+
+// the global a function (or a closure made from it) is bound to, or nil;
+// this searches the globals, so it's for reports, not for every call
+Handle GlobalNameOf(Handle fn) {
+    Handle bytecode = DATA_AREA(FUNCTION, fn)->bytecode;
+    for (Handle g = globals; g != nil; g = Cdr(g)) {
+	Handle value = Cdr(Car(g));
+	if (TYPEOF(value) == TYPE_FUNCTION &&
+	    DATA_AREA(FUNCTION, value)->bytecode == bytecode) {
+	    return Car(Car(g));
 	}
     }
-    panic("no such closure variable");
     return nil;
 }
 
-void ClosureSet(Handle fn, int idx, Handle val) {
-    Handle enclosingContext = DATA_AREA(FUNCTION, fn)->closure;
-    while (enclosingContext != nil) {
-	Handle enclosingLocals = DATA_AREA(CONTEXT, enclosingContext)->locals;
-	int len = VectorLength(enclosingLocals);
-	if (idx < len) {
-	    VectorSet(enclosingLocals, idx, val);
+int RunNativeCode(Handle fn, JITFRAME *frame, int ip) {
+    NATIVECODE *nc = DATA_AREA(FUNCTION, fn)->native;
+    return nc->run(nc, frame, ip);
+}
+
+Handle LookupGlobal(Handle symbol) {
+    Handle result = AlistGet(globals, symbol);
+    if (result == nil) panic("undefined global");
+    return Cdr(result);
+}
+
+// Code the compiler has proven things about relies on the primitives doing
+// what they do, so replacing one turns that code's shortcuts off for good.
+int primitivesReplaced = 0;
+
+void SetGlobal(Handle symbol, Handle value) {
+    Handle cell = AlistGet(globals, symbol);
+    if (cell != nil && TYPEOF(Cdr(cell)) == TYPE_PRIMITIVE && Cdr(cell) != value) {
+	primitivesReplaced = 1;
+    }
+    if (TYPEOF(value) == TYPE_FUNCTION && DATA_AREA(FUNCTION, value)->name == nil) {
+	DATA_AREA(FUNCTION, value)->name = symbol;
+    }
+    globals = AlistSet(globals, symbol, value);
+}
+
+/* Case dispatch */
+
+// A `case` compiles to OP_CASE, then a big jump to each clause in order,
+// then one to the default. OP_CASE's literal is a table saying which of
+// those jumps a key takes. It's a vector that starts with the number of
+// clauses. Integer keys that are close together are looked up by value:
+//
+//   #(clauses lowest jump-for-lowest jump-for-lowest+1 ...)
+//
+// with () for values that no clause has. Other keys go in a hash table of
+// key and jump pairs, which is never more than half full:
+//
+//   #(clauses () key jump key jump ...)
+//
+// Symbols hash by name rather than by handle, so a table still works once
+// it's been through the code cache or built into a C program.
+
+// the integer that `key` is eqv? to, if there is one
+static int CaseInteger(Handle key, int *value) {
+    if (TYPEOF(key) == TYPE_INT) {
+	*value = UnboxInteger(key);
+	return 1;
+    }
+    if (TYPEOF(key) == TYPE_FLOAT) {
+	double d = UnboxFloat(key);
+	if (d >= INT_MIN && d <= INT_MAX && d == (int)d) {
+	    *value = (int)d;
+	    return 1;
 	}
-	else {
-	    idx -= len;
-	    enclosingContext = DATA_AREA(CONTEXT, enclosingContext)->prior;
+    }
+    return 0;
+}
+
+static unsigned CaseHash(Handle key) {
+    int value;
+    if (CaseInteger(key, &value)) return (unsigned)value * 2654435761u;
+    return TYPEOF(key) == TYPE_SYMBOL ? SymbolHash(key) : 0;
+}
+
+// the pair in a hashed table that holds `key`, or the empty one it would go in
+static int CaseSlot(Handle table, Handle key) {
+    unsigned mask = (VectorLength(table) - 2) / 2 - 1;
+    unsigned i = CaseHash(key) & mask;
+    while (VectorRef(table, 3 + 2*i) != nil && !Equivalent(VectorRef(table, 2 + 2*i), key)) {
+	i = (i + 1) & mask;
+    }
+    return 2 + 2*i;
+}
+
+// The table for clauses whose keys are the lists in `datums`. A key that's
+// in an earlier clause as well belongs to the earlier one. This allocates,
+// so the caller has to keep the collector away.
+Handle CreateCaseTable(Handle datums) {
+    int clauses = 0, keys = 0, integers = 0, lowest = 0, highest = 0;
+    for (Handle d = datums; d != nil; d = Cdr(d), clauses++) {
+	for (Handle k = Car(d); k != nil; k = Cdr(k), keys++) {
+	    if (TYPEOF(Car(k)) != TYPE_INT) continue;
+	    int value = UnboxInteger(Car(k));
+	    if (integers++ == 0 || value < lowest) lowest = value;
+	    if (integers == 1 || value > highest) highest = value;
+	}
+    }
+    int dense = keys > 0 && integers == keys &&
+	(long)highest - lowest < 2L * keys + 8;
+    Handle table;
+    if (dense) {
+	table = CreateVector(highest - lowest + 3);
+	VectorSet(table, 1, CreateInteger(lowest));
+    }
+    else {
+	int size = 2;
+	while (size < 2 * keys) size *= 2;
+	table = CreateVector(2 * size + 2);
+    }
+    VectorSet(table, 0, CreateInteger(clauses));
+    int jump = 0;
+    for (Handle d = datums; d != nil; d = Cdr(d), jump++) {
+	for (Handle k = Car(d); k != nil; k = Cdr(k)) {
+	    int slot = dense ? UnboxInteger(Car(k)) - lowest + 2 : CaseSlot(table, Car(k));
+	    if (!dense && VectorRef(table, slot + 1) == nil) {
+		VectorSet(table, slot, Car(k));
+		VectorSet(table, slot + 1, CreateInteger(jump));
+	    }
+	    else if (dense && VectorRef(table, slot) == nil) {
+		VectorSet(table, slot, CreateInteger(jump));
+	    }
 	}
     }
-    panic("no such closure variable");
-    return;
+    return table;
 }
 
-void LoadArgumentsFromList(Handle locals, Handle argList) {
-    int i = 0;
-    while (argList != nil) {
-	VectorSet(locals, i, Car(argList));
-	argList = Cdr(argList);
-	i++;
+int CaseClauses(Handle table) {
+    return UnboxInteger(VectorRef(table, 0));
+}
+
+// which jump after OP_CASE `key` takes; the last one is the default
+int CaseIndex(Handle table, Handle key) {
+    Handle jump;
+    Handle lowest = VectorRef(table, 1);
+    if (lowest != nil) {
+	int value;
+	if (!CaseInteger(key, &value)) return CaseClauses(table);
+	long slot = (long)value - UnboxInteger(lowest) + 2;
+	if (slot < 2 || slot >= VectorLength(table)) return CaseClauses(table);
+	jump = VectorRef(table, slot);
+    }
+    else {
+	jump = VectorRef(table, CaseSlot(table, key) + 1);
+    }
+    return jump == nil ? CaseClauses(table) : UnboxInteger(jump);
+}
+
+/* Quickening */
+
+// The stack engine rewrites an instruction in place once it knows what the
+// instruction works on: a global's cell, or whether a call goes to a function,
+// a primitive, or an arithmetic primitive on two integers. Each quickened
+// instruction checks that this still holds and goes back to the general case
+// if it doesn't. The rewrite only changes the opcode and keeps the
+// instruction's length, so jumps and resume points stay put.
+
+// OP_APPLY or one of its quickened forms
+int IsApply(uint8_t op) {
+    return op == OP_APPLY || op == OP_APPLY_FUNCTION || op == OP_APPLY_PRIMITIVE ||
+	(op >= OP_ADD_INT && op <= OP_GREATER_INT);
+}
+
+// write `op` over the opcode of the instruction at `pc`
+static void Quicken(Handle bytecode, int pc, uint8_t op) {
+    uint8_t *bytes = BVEC_CONTENTS(bytecode);
+    if (bytes[pc] == OPCODE_BIG_ARG) pc++;
+    bytes[pc] = op;
+}
+
+// Make the global load at `pc` load from `cell` from now on. The cell
+// becomes a literal of its own, unless the instruction has no room for its
+// index. A global's cell stays the same for as long as the global exists.
+static void QuickenGlobal(Handle bytecode, int pc, Handle literals, Handle cell) {
+    int idx = -1;
+    FOR_IN_VECTOR(i, literals) {
+	if (VectorRef(literals, i) == cell) idx = i;
+    }
+    int big = BytevectorRef(bytecode, pc) == OPCODE_BIG_ARG;
+    if (idx == -1) {
+	if (VectorLength(literals) > (big ? MAX_ARG : MAX_SHORT_ARG)) return;
+	idx = AddToVector(literals, cell);
+    }
+    uint8_t *bytes = BVEC_CONTENTS(bytecode);
+    if (big) {
+	bytes[pc + 1] = OP_GLOBAL_CELL;
+	bytes[pc + 2] = idx & 0xff;
+	bytes[pc + 3] = idx >> 8;
+    }
+    else {
+	bytes[pc] = OP_GLOBAL_CELL;
+	bytes[pc + 1] = idx;
+    }
+}
+
+// what a call to the primitive `prim` with `argc` arguments on `stack` becomes
+static uint8_t QuickenedPrimitiveCall(Handle prim, Handle stack, int sp, int argc) {
+    uint8_t op = DATA_AREA(PRIMITIVE, prim)->quickened;
+    if (op != OP_END && argc == 2 && TYPEOF(VectorRef(stack, sp - 1)) == TYPE_INT &&
+	TYPEOF(VectorRef(stack, sp - 2)) == TYPE_INT) {
+	return op;
+    }
+    return OP_APPLY_PRIMITIVE;
+}
+
+// the quickened arithmetic instruction `op` applied to two integers
+static Handle IntegerOperation(uint8_t op, Handle a, Handle b) {
+    int x = UnboxInteger(a), y = UnboxInteger(b);
+    switch (op) {
+    case OP_ADD_INT: return CreateInteger(x + y);
+    case OP_SUB_INT: return CreateInteger(x - y);
+    case OP_MUL_INT: return CreateInteger(x * y);
+    case OP_EQUAL_INT: return LISP_BOOLEAN(x == y);
+    case OP_LESS_INT: return LISP_BOOLEAN(x < y);
+    case OP_GREATER_INT: return LISP_BOOLEAN(x > y);
+    default: panic("not an integer instruction");
     }
 }
 
 Handle StartInterpreter(Handle fn, Handle arglist) {
+    EnsureCompiled(fn);
+    if (vmEngine == ENGINE_REGISTER) {
+	EnsureRegisterCode(fn);
+	if (RunsOnStack(fn)) {
+	    vmEngine = ENGINE_STACK;
+	    Handle result = StartInterpreter(fn, arglist);
+	    vmEngine = ENGINE_REGISTER;
+	    return result;
+	}
+    }
+    else if (vmProfiling) ProfileCall(fn);
+    TRACE_FUNCTION('B', fn);
     Handle context = CreateContext(fn, nil);
     LoadArgumentsFromList(DATA_AREA(CONTEXT, context)->locals, arglist);
+    if (vmEngine == ENGINE_REGISTER) {
+	return InterpretRegisters(context);
+    }
+    if (vmProfiling) {
+	Handle result = InterpretProfiled(context);
+	ProfileStop();
+	return result;
+    }
     return Interpret(context);
 }
 
 
 /* WELCOME TO DIE */
-#define POP() (VectorRef(stack, --sp))
-#define PUSH(_H) (VectorSet(stack, sp, _H),sp++)
-#define TOS() (VectorRef(stack, sp-1))
+#define POP() (REF(stack, --sp))
+#define PUSH(_H) (SET(stack, sp, _H),sp++)
+#define TOS() (REF(stack, sp-1))
 
 int LoadArgumentsFromStack(Handle stack, int sp, Handle locals, int count) {
     for (int i = 0; i < count; i++) {
-	VectorSet(locals, i, POP());
+	VectorSet(locals, i, VectorRef(stack, --sp));
     }
     return sp;
 }
 
+// element access for code that VerifyFunction has passed
+static inline Handle UncheckedRef(Handle v, int i) {
+    return DATA_AREA(VECTOR, v)->elements[i];
+}
+
+static inline void UncheckedSet(Handle v, int i, Handle x) {
+    DATA_AREA(VECTOR, v)->elements[i] = x;
+}
+
+
+// The loop is compiled three times. Interpret runs verified functions, with
+// no bounds checks on the stack, locals or literals, and hands anything else
+// to InterpretChecked. InterpretProfiled is the checked loop with the
+// profiler's hooks, so that the profiler costs nothing when it's off.
+#define INTERPRET Interpret
+#define TRUSTED 1
+#define PROFILE_FETCH(FN, IP)
+#define PROFILE_NATIVE(FN)
+#define PROFILE_CALL(FN)
+#define PROFILE_RETURN(FN)
+#define PROFILE_GLOBAL(SYM)
+#include "interpret.h"
+#undef INTERPRET
+#undef TRUSTED
+
+#define INTERPRET InterpretChecked
+#define TRUSTED 0
+#include "interpret.h"
+#undef INTERPRET
+#undef PROFILE_FETCH
+#undef PROFILE_NATIVE
+#undef PROFILE_CALL
+#undef PROFILE_RETURN
+#undef PROFILE_GLOBAL
+
+#define INTERPRET InterpretProfiled
+#define PROFILE_FETCH(FN, IP) ProfileStep((FN), (IP))
+#define PROFILE_NATIVE(FN) ProfileNative(FN)
+#define PROFILE_CALL(FN) ProfileCall(FN)
+#define PROFILE_RETURN(FN) ProfileReturn(FN)
+#define PROFILE_GLOBAL(SYM) ProfileGlobal(SYM)
+#include "interpret.h"
+
+
+/* Register engine */
+
+#define WORD(N) (BytevectorRef(code, 2*(N)) | BytevectorRef(code, 2*(N)+1) << 8)
+#define OPND(N) (FetchOperand(WORD(N), function, regs, literals, closure))
 
-Handle Interpret(Handle context) {
-    Handle function, literals, locals, stack;
+Handle FetchOperand(int operand, Handle function, Handle regs, Handle literals,
+		    Handle closure) {
+    int idx = OPERAND_INDEX(operand);
+    switch (OPERAND_KIND(operand)) {
+    case OPERAND_REG: return VectorRef(regs, idx);
+    case OPERAND_LITERAL: return VectorRef(literals, idx);
+    case OPERAND_GLOBAL: return LookupGlobal(VectorRef(literals, idx));
+    case OPERAND_NIL: return nil;
+    case OPERAND_CLOSURE: return VectorRef(closure, idx);
+    case OPERAND_SELF: return function;
+    default:
+	panic("invalid operand");
+	return nil;
+    }
+}
+
+// In the register engine the context's `sp` is not a stack pointer; while a
+// call is in progress it holds the register that receives the result.
+Handle InterpretRegisters(Handle context) {
+    Handle function, literals, regs, closure;
     Handle priorContext;
-    Handle bytecode;
-    int ip, sp;
+    Handle code;
+    int pc;
 
-    uint8_t op; int arg;
+    int op;
     Handle returnValue = nil;
 
-    // unpack the context
  init:
     currentContext = context;
     if (context == nil) goto terminate;
     else
     {
+	SAMPLE_POINT();
 	CONTEXT *cxt = DATA_AREA(CONTEXT, context);
 	function = cxt->function;
 	FUNCTION *fn = DATA_AREA(FUNCTION, function);
 	literals = fn->literals;
-	locals = cxt->locals;
-	stack = cxt->stack;
-	bytecode = fn->bytecode;
-	ip = cxt->ip;
-	sp = cxt->sp;
+	closure = fn->closure;
+	code = fn->regcode;
+	regs = cxt->locals;
+	pc = cxt->ip;
 	priorContext = cxt->prior;
     }
 
-    // fetch the current instruction
-    
  fetch:
-    op = BytevectorRef(bytecode, ip);
-    ip++;
-    if (op > OPCODE_ARGUMENTS) {
-	arg = BytevectorRef(bytecode, ip);
-	ip++;
-    }
-
-    
-    // now dispatch
+    op = WORD(pc);
     switch (op) {
-    case OP_END:
-	// we put this here to catch off-by-one errors;
+    case ROP_END:
 	panic("end of code; did not return");
 	break;
-    case OP_NOP:
-	// nop
+    case ROP_MOVE:
+	VectorSet(regs, WORD(pc+1), OPND(pc+2));
+	pc += 3;
 	break;
-    case OP_DROP:
-	// remove top-of-stack
-	sp--;
+    case ROP_SET_GLOBAL:
+	SetGlobal(VectorRef(literals, WORD(pc+1)), OPND(pc+2));
+	pc += 3;
 	break;
-    case OP_DUP:
-	PUSH(TOS());
+    case ROP_UNBOX:
+	VectorSet(regs, WORD(pc+1), Unbox(OPND(pc+2)));
+	pc += 3;
 	break;
-    case OP_NIL:
-	PUSH(nil);
+    case ROP_SET_BOX:
+	SetBox(OPND(pc+1), OPND(pc+2));
+	pc += 3;
 	break;
-    case OP_BIND_CLOSURE:
+    case ROP_BOX:
 	{
-	    Handle fn = TOS();
-	    Typecheck(fn, TYPE_FUNCTION);
-	    FUNCTION *contents = DATA_AREA(FUNCTION, fn);
-	    contents->closure = currentContext;
-	}
-	break;
-    case OP_RETURN:
-	// return top-of-stack to the prior context
-	// if there is no context, leave the interpreter
-	returnValue = POP();
-	context = currentContext = priorContext;
-	if (context == nil) goto terminate;
-	else
-	{
-	    CONTEXT *cxt = DATA_AREA(CONTEXT, context);
-	    sp = cxt->sp;
-	    stack = cxt->stack;
-	    PUSH(returnValue);
-	    cxt->sp = sp;
-	    goto init;
+	    int reg = WORD(pc+1);
+	    VectorSet(regs, reg, CreateBox(VectorRef(regs, reg)));
+	    pc += 2;
 	}
 	break;
-
-    case OP_LITERAL:
-	PUSH(VectorRef(literals, arg));
-	break;
-    case OP_GLOBAL:
+    case ROP_MAKE_CLOSURE:
 	{
-	    Handle result = AlistGet(globals, VectorRef(literals, arg));
-	    if (result == nil) panic("undefined global");
-	    PUSH(Cdr(result));
-	    break;
+	    int dest = WORD(pc+1);
+	    int n = WORD(pc+3);
+	    // translate the template once, rather than each closure made from it
+	    Handle template = OPND(pc+2);
+	    EnsureRegisterCode(template);
+	    Handle values = CreateVector(n);
+	    Retain(values);
+	    for (int i = 0; i < n; i++) {
+		VectorSet(values, i, OPND(pc+4+i));
+	    }
+	    VectorSet(regs, dest, CreateClosure(template, values));
+	    Unretain(values);
+	    pc += 4 + n;
 	}
-    case OP_SET_GLOBAL:
-	globals = AlistSet(globals, VectorRef(literals, arg), POP());
-	break;
-    case OP_LOCAL:
-	PUSH(VectorRef(locals, arg));
 	break;
-    case OP_SET_LOCAL:
-	VectorSet(locals, arg, POP());
-	break;
-    case OP_CLOSURE:
-	PUSH(ClosureGet(function, arg));
-	break;
-    case OP_SET_CLOSURE:
-	ClosureSet(function, arg, POP());
-	break;
-    case OP_APPLY:
+    case ROP_CALL:
 	{
-	    Handle proc = POP();
-	    switch(TYPEOF(proc)) {
+	    int dest = WORD(pc+1);
+	    Handle proc = OPND(pc+2);
+	    int n = WORD(pc+3);
+	    int args = pc + 4;
+	    pc += 4 + n;
+	    switch (TYPEOF(proc)) {
 	    case TYPE_FUNCTION:
 		{
+		    TRACE_FUNCTION('B', proc);
+		    EnsureCompiled(proc);
+		    EnsureRegisterCode(proc);
+		    if (RunsOnStack(proc)) {
+			Handle argv = CreateVector(n);
+			Retain(argv);
+			for (int i = 0; i < n; i++) {
+			    VectorSet(argv, i, OPND(args+i));
+			}
+			Handle result = CallOnStack(proc, argv);
+			Unretain(argv);
+			VectorSet(regs, dest, result);
+			break;
+		    }
 		    Handle newContext = CreateContext(proc, currentContext);
-		    CONTEXT *cxt = DATA_AREA(CONTEXT, newContext);
-		    sp = LoadArgumentsFromStack(stack, sp, cxt->locals, arg);
-		    cxt = DATA_AREA(CONTEXT, currentContext);
-		    cxt->sp = sp;
-		    cxt->ip = ip;
+		    Handle newRegs = DATA_AREA(CONTEXT, newContext)->locals;
+		    for (int i = 0; i < n; i++) {
+			VectorSet(newRegs, i, OPND(args+i));
+		    }
+		    CONTEXT *cxt = DATA_AREA(CONTEXT, currentContext);
+		    cxt->ip = pc;
+		    cxt->sp = dest;
 		    context = newContext;
 		    goto init;
 		}
 		break;
 	    case TYPE_PRIMITIVE:
 		{
-		    Handle argv = CreateVector(arg);
-		    sp = LoadArgumentsFromStack(stack, sp, argv, arg);
+		    Handle argv = CreateVector(n);
+		    Retain(argv);
+		    for (int i = 0; i < n; i++) {
+			VectorSet(argv, i, OPND(args+i));
+		    }
 		    Handle result = CallPrimitive(proc, argv);
-		    PUSH(result);
+		    Unretain(argv);
+		    VectorSet(regs, dest, result);
 		}
 		break;
 	    default:
@@ -235,30 +571,37 @@ Handle Interpret(Handle context) {
 	    }
 	}
 	break;
-    case OP_TAIL_APPLY:
-	panic("tail-apply not implented");
+    case ROP_RETURN:
+	returnValue = OPND(pc+1);
+	TRACE_FUNCTION('E', function);
+	context = priorContext;
+	if (context == nil) goto terminate;
+	else
+	{
+	    CONTEXT *cxt = DATA_AREA(CONTEXT, context);
+	    VectorSet(cxt->locals, cxt->sp, returnValue);
+	    goto init;
+	}
 	break;
-    case OP_JUMP_TRUE:
-	if (POP() != nil) ip += arg;
+    case ROP_JUMP:
+	pc = WORD(pc+1);
 	break;
-    case OP_JUMP_FALSE:
-	if (POP() == nil) ip += arg;
+    case ROP_JUMP_FALSE:
+	if (OPND(pc+1) == nil) pc = WORD(pc+2);
+	else pc += 3;
 	break;
-    case OP_JUMP:
-	ip += arg;
+    case ROP_JUMP_TRUE:
+	if (OPND(pc+1) != nil) pc = WORD(pc+2);
+	else pc += 3;
 	break;
-    case OP_JUMP_BACK:
-	ip -= arg;
+    case ROP_CASE:
+	pc = WORD(pc + 3 + CaseIndex(VectorRef(literals, WORD(pc+2)), OPND(pc+1)));
 	break;
-	
-    case OP_INVALID:
-	panic("runaway fall-through in VM dispatch");
     default:
-	panic("invalid opcode");
+	panic("invalid register opcode");
     }
-    assert(sp >= 0);
     goto fetch;
-    
+
  terminate:
     return returnValue;
 }